@@ -90,7 +90,8 @@ XcClose(
 /*! \brief Open an unbound event channel
     \param Xc Xencontrol handle returned by XcOpen()
     \param RemoteDomain ID of a remote domain that will bind the channel
-    \param Event Handle to an event object that will receive event channel notifications
+    \param Event Handle to an event object that will receive event channel notifications,
+           or NULL to receive them through XcEvtchnWait()
     \param Mask Set to TRUE if the event channel should be initially masked
     \param LocalPort Port number that is assigned to the event channel
     \return Error code
@@ -105,11 +106,33 @@ XcEvtchnBindUnbound(
     OUT ULONG *LocalPort
     );
 
+/*! \brief Open a number of unbound event channels in one call
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param RemoteDomain ID of a remote domain that will bind the channels
+    \param Mask Set to TRUE if the channels should be masked
+    \param Count Number of channels to open (at most XENIFACE_EVTCHN_BIND_BATCH_MAX)
+    \param LocalPorts Array of \a Count entries that receives the local port numbers
+    \return Error code
+
+    The channels have no event object, wait for them with XcEvtchnWait() or
+    XcEvtchnMapPending(). Either all channels are opened or none are.
+*/
+XENCONTROL_API
+DWORD
+XcEvtchnBindUnboundBatch(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  USHORT RemoteDomain,
+    IN  BOOL Mask,
+    IN  ULONG Count,
+    OUT ULONG *LocalPorts
+    );
+
 /*! \brief Open an event channel that was already bound by a remote domain
     \param Xc Xencontrol handle returned by XcOpen()
     \param RemoteDomain ID of a remote domain that has already bound the channel
     \param RemotePort Port number that is assigned to the event channel in the \a RemoteDomain
-    \param Event Handle to an event that will receive event channel notifications
+    \param Event Handle to an event that will receive event channel notifications,
+           or NULL to receive them through XcEvtchnWait()
     \param Mask Set to TRUE if the event object channel should be initially masked
     \param LocalPort Port number that is assigned to the event channel
     \return Error code
@@ -149,6 +172,22 @@ XcEvtchnNotify(
     IN  ULONG LocalPort
     );
 
+/*! \brief Notify the remote ends of multiple event channels in one call
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param Count Number of entries in \a LocalPorts (at most XENIFACE_EVTCHN_NOTIFY_BATCH_MAX)
+    \param LocalPorts Port numbers that are assigned to the event channels
+    \param Results Optional array of \a Count entries that receives the error code for each port
+    \return Error code
+*/
+XENCONTROL_API
+DWORD
+XcEvtchnNotifyBatch(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  ULONG Count,
+    IN  PULONG LocalPorts,
+    OUT DWORD *Results OPTIONAL
+    );
+
 /*! \brief Unmask an event channel
     \param Xc Xencontrol handle returned by XcOpen()
     \param LocalPort Port number that is assigned to the event channel
@@ -161,6 +200,235 @@ XcEvtchnUnmask(
     IN  ULONG LocalPort
     );
 
+/*! \brief Wait for notifications on event channels that were bound without an event object
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param MaxPorts Number of entries in \a LocalPorts
+    \param LocalPorts Array that receives port numbers of the event channels that fired
+    \param NumberPorts Number of entries written to \a LocalPorts
+    \param Timeout Timeout in milliseconds, or INFINITE
+    \return Error code, ERROR_TIMEOUT if no channel fired within \a Timeout
+*/
+XENCONTROL_API
+DWORD
+XcEvtchnWait(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  ULONG MaxPorts,
+    OUT PULONG LocalPorts,
+    OUT PULONG NumberPorts,
+    IN  DWORD Timeout
+    );
+
+/*! \brief Get the next fired event channel, like xenevtchn_pending() on Linux
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param LocalPort Receives the port number of an event channel that fired
+    \param Timeout Timeout in milliseconds, or INFINITE
+    \return Error code, ERROR_TIMEOUT if no channel fired within \a Timeout
+
+    Only channels bound without an event object are reported. Other ports that
+    fired stay queued for the next call. For the Linux behaviour of keeping a
+    fired channel masked until it is handled, set XENIFACE_EVTCHN_MODERATION_ACK
+    with XcEvtchnSetModeration() and call XcEvtchnUnmask() after handling it.
+*/
+XENCONTROL_API
+DWORD
+XcEvtchnPending(
+    IN  PXENCONTROL_CONTEXT Xc,
+    OUT PULONG LocalPort,
+    IN  DWORD Timeout
+    );
+
+/*! \brief Queue an asynchronous wait for event channels that were bound without an event object
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param Output Buffer that receives port numbers of the event channels that fired.
+           It must stay valid until the request completes.
+    \param cbOutput Size of the \a Output buffer, in bytes
+    \param Overlapped Overlapped structure that is signaled or posted to the associated
+           completion port when the request completes
+    \return ERROR_IO_PENDING if the request was queued, ERROR_SUCCESS if it completed
+            immediately, or an error code
+*/
+XENCONTROL_API
+DWORD
+XcEvtchnWaitOverlapped(
+    IN  PXENCONTROL_CONTEXT Xc,
+    OUT PXENIFACE_EVTCHN_WAIT_OUT Output,
+    IN  DWORD cbOutput,
+    IN  LPOVERLAPPED Overlapped
+    );
+
+/*! \brief Map the event channel pending bits of this session into the process
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param Pending Receives the address of the pending bits, valid until XcClose()
+    \param NumberPorts Number of ports covered by the pending bits
+    \return Error code
+    \note Use XcEvtchnTestAndClearPending() to consume notifications from the mapped bits.
+          Fails with ERROR_ACCESS_DENIED in a process that inherited or duplicated the handle.
+*/
+XENCONTROL_API
+DWORD
+XcEvtchnMapPending(
+    IN  PXENCONTROL_CONTEXT Xc,
+    OUT volatile LONG **Pending,
+    OUT ULONG *NumberPorts
+    );
+
+/*! \brief Atomically test and clear the pending bit of an event channel
+    \param Pending Pending bits returned by XcEvtchnMapPending()
+    \param LocalPort Port number that is assigned to the event channel
+    \return TRUE if the event channel fired since the bit was last cleared
+*/
+static __inline
+BOOL
+XcEvtchnTestAndClearPending(
+    IN  volatile LONG *Pending,
+    IN  ULONG LocalPort
+    )
+{
+    return InterlockedBitTestAndReset(&Pending[LocalPort / 32], LocalPort % 32) != 0;
+}
+
+/*! \brief Set the spin budget of an event channel for XcEvtchnSpinWait()
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param LocalPort Port number that is assigned to the event channel
+    \param SpinMicroseconds Time to spin for, at most XENIFACE_EVTCHN_SPIN_MAX
+    \return Error code
+*/
+XENCONTROL_API
+DWORD
+XcEvtchnSetSpin(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  ULONG LocalPort,
+    IN  ULONG SpinMicroseconds
+    );
+
+/*! \brief Wait for a notification on an event channel, spinning before blocking
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param LocalPort Port number that is assigned to the event channel
+    \param Event Event object the channel was bound with. If NULL, ERROR_TIMEOUT is returned
+           when the spin budget runs out and the caller should fall back to XcEvtchnWait()
+    \param Timeout Timeout in milliseconds for the blocking wait, or INFINITE
+    \param SpinWakeups Total number of waits on the channel that were satisfied by spinning
+    \return Error code, ERROR_TIMEOUT if no notification arrived within \a Timeout
+*/
+XENCONTROL_API
+DWORD
+XcEvtchnSpinWait(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  ULONG LocalPort,
+    IN  HANDLE Event,
+    IN  DWORD Timeout,
+    OUT ULONG *SpinWakeups OPTIONAL
+    );
+
+/*! \brief Set notification moderation for an event channel
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param LocalPort Port number that is assigned to the event channel
+    \param Mode Moderation mode
+    \param IntervalMicroseconds Minimum time between deliveries for XENIFACE_EVTCHN_MODERATION_INTERVAL
+    \return Error code
+    \note With XENIFACE_EVTCHN_MODERATION_ACK, call XcEvtchnUnmask() after handling each notification.
+*/
+XENCONTROL_API
+DWORD
+XcEvtchnSetModeration(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  ULONG LocalPort,
+    IN  XENIFACE_EVTCHN_MODERATION Mode,
+    IN  ULONG IntervalMicroseconds
+    );
+
+/*! \brief Deliver notifications of an event channel on a specific processor
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param LocalPort Port number that is assigned to the event channel
+    \param Processor Target processor, usually the ideal processor of the consuming thread
+    \param BindStatus NTSTATUS of binding the event channel itself to the vCPU
+    \return Error code
+*/
+XENCONTROL_API
+DWORD
+XcEvtchnSetAffinity(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  ULONG LocalPort,
+    IN  PPROCESSOR_NUMBER Processor,
+    OUT LONG *BindStatus OPTIONAL
+    );
+
+/*! \brief Query where notifications of an event channel are handled
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param LocalPort Port number that is assigned to the event channel
+    \param Affinity Target and last upcall/delivery processors of the channel
+    \return Error code
+*/
+XENCONTROL_API
+DWORD
+XcEvtchnQueryAffinity(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  ULONG LocalPort,
+    OUT PXENIFACE_EVTCHN_QUERY_AFFINITY_OUT Affinity
+    );
+
+/*! \brief Query statistics of an event channel
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param LocalPort Port number that is assigned to the event channel
+    \param Stats Interrupt, DPC, delivery, send and unmask counts of the channel
+    \return Error code
+*/
+XENCONTROL_API
+DWORD
+XcEvtchnQueryStats(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  ULONG LocalPort,
+    OUT PXENIFACE_EVTCHN_QUERY_STATS_OUT Stats
+    );
+
+/*! \brief Report that a thread woke up for an event channel notification
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param LocalPort Port number that is assigned to the event channel
+    \param WakeTime QueryPerformanceCounter() value taken right after the wait returned
+    \return Error code
+
+    Completes the latency trace of the last notification, see XcEvtchnQueryLatency().
+*/
+XENCONTROL_API
+DWORD
+XcEvtchnReportWake(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  ULONG LocalPort,
+    IN  LONGLONG WakeTime
+    );
+
+/*! \brief Read the latency histograms of an event channel
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param LocalPort Port number that is assigned to the event channel
+    \param Reset Clear the histograms after reading them
+    \param Latency Log2 histograms of the notification path, in nanoseconds
+    \return Error code
+*/
+XENCONTROL_API
+DWORD
+XcEvtchnQueryLatency(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  ULONG LocalPort,
+    IN  BOOL Reset,
+    OUT PXENIFACE_EVTCHN_QUERY_LATENCY_OUT Latency
+    );
+
+/*! \brief Associate the Xen Interface device handle with an I/O completion port
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param CompletionPort Handle to an existing I/O completion port
+    \param CompletionKey Key included in every completion packet for this handle
+    \return Error code
+    \note Grant and map requests made through the same handle complete to the port as well,
+          so a dedicated XcOpen() session for event channel waits is recommended.
+*/
+XENCONTROL_API
+DWORD
+XcAssociateCompletionPort(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  HANDLE CompletionPort,
+    IN  ULONG_PTR CompletionKey
+    );
+
 /*! \brief Grant a \a RemoteDomain permission to access local memory pages
     \param Xc Xencontrol handle returned by XcOpen()
     \param RemoteDomain ID of a remote domain that is being granted access
@@ -185,6 +453,32 @@ XcGnttabPermitForeignAccess(
     OUT ULONG *References
     );
 
+/*! \brief Grant a \a RemoteDomain permission to access local memory pages with a given cache attribute
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param RemoteDomain ID of a remote domain that is being granted access
+    \param NumberPages Number of 4k pages to grant access to
+    \param NotifyOffset Offset of a byte in the granted region that will be set to 0 when the grant is revoked
+    \param NotifyPort Local port number of an open event channel that will be notified when the grant is revoked
+    \param Flags Grant options
+    \param CacheType Cache attribute of the granted pages
+    \param Address Local user mode address of the granted memory region
+    \param References An array of Xen grant numbers for every granted page
+    \return Error code
+*/
+XENCONTROL_API
+DWORD
+XcGnttabPermitForeignAccessEx(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  USHORT RemoteDomain,
+    IN  ULONG NumberPages,
+    IN  ULONG NotifyOffset,
+    IN  ULONG NotifyPort,
+    IN  XENIFACE_GNTTAB_PAGE_FLAGS Flags,
+    IN  XENIFACE_GNTTAB_CACHE_TYPE CacheType,
+    OUT PVOID *Address,
+    OUT ULONG *References
+    );
+
 /*! \brief Revoke a foreign domain access to previously granted memory region
     \param Xc Xencontrol handle returned by XcOpen()
     \param Address Local user mode address of the granted memory region
@@ -221,6 +515,32 @@ XcGnttabMapForeignPages(
     OUT PVOID *Address
     );
 
+/*! \brief Map a foreign memory region into the current address space with a given cache attribute
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param RemoteDomain ID of a remote domain that has granted access to the pages
+    \param NumberPages Number of 4k pages to map
+    \param References An array of Xen grant numbers for every granted page
+    \param NotifyOffset Offset of a byte in the mapped region that will be set to 0 when the region is unmapped
+    \param NotifyPort Local port number of an open event channel that will be notified when the region is unmapped
+    \param Flags Map options
+    \param CacheType Cache attribute of the mapping
+    \param Address Local user mode address of the mapped memory region
+    \return Error code
+*/
+XENCONTROL_API
+DWORD
+XcGnttabMapForeignPagesEx(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  USHORT RemoteDomain,
+    IN  ULONG NumberPages,
+    IN  PULONG References,
+    IN  ULONG NotifyOffset,
+    IN  ULONG NotifyPort,
+    IN  XENIFACE_GNTTAB_PAGE_FLAGS Flags,
+    IN  XENIFACE_GNTTAB_CACHE_TYPE CacheType,
+    OUT PVOID *Address
+    );
+
 /*! \brief Unmap a foreign memory region from the current address space
     \param Xc Xencontrol handle returned by XcOpen()
     \param Address Local user mode address of the mapped memory region
@@ -233,6 +553,50 @@ XcGnttabUnmapForeignPages(
     IN  PVOID Address
     );
 
+/*! \brief Copy data between local buffers and pages granted by foreign domains
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param Count Number of entries in \a Segments (at most XENIFACE_GNTTAB_COPY_MAX)
+    \param Segments Segments to copy, each within a single foreign page
+    \param Results Optional array of \a Count entries that receives the error code for each segment
+    \return Error code
+    \note Nothing is mapped into the calling process, which makes this cheaper than
+          XcGnttabMapForeignPages() for one-shot transfers.
+*/
+XENCONTROL_API
+DWORD
+XcGnttabCopy(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  ULONG Count,
+    IN  PXENIFACE_GNTTAB_COPY_SEGMENT Segments,
+    OUT DWORD *Results OPTIONAL
+    );
+
+/*! \brief Set the size of the foreign mapping cache of this handle
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param Budget Maximum number of bytes kept mapped, 0 disables the cache
+    \return Error code
+    \note Only mappings created with XENIFACE_GNTTAB_CACHE_MAPPING on this handle are cached.
+          Lowering the budget evicts the least recently used mappings.
+*/
+XENCONTROL_API
+DWORD
+XcGnttabSetMapCacheBudget(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  ULONG64 Budget
+    );
+
+/*! \brief Query size, hit and eviction counts of the foreign mapping cache of this handle
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param Stats Cache state
+    \return Error code
+*/
+XENCONTROL_API
+DWORD
+XcGnttabQueryMapCache(
+    IN  PXENCONTROL_CONTEXT Xc,
+    OUT PXENIFACE_GNTTAB_MAP_CACHE_STATS Stats
+    );
+
 /*! \brief Read a XenStore key
     \param Xc Xencontrol handle returned by XcOpen()
     \param Path Path to the key
@@ -335,6 +699,18 @@ XcStoreRemoveWatch(
     IN  PVOID Handle
     );
 
+/*! \brief Query hit and miss counts of the driver's context lookaside lists
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param Stats Number of lists and the name and counters of each
+    \return Error code
+*/
+XENCONTROL_API
+DWORD
+XcQueryCacheStats(
+    IN  PXENCONTROL_CONTEXT Xc,
+    OUT PXENIFACE_CACHE_STATS_OUT Stats
+    );
+
 #ifdef __cplusplus
 }
 #endif
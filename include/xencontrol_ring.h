@@ -0,0 +1,303 @@
+#ifndef _XENCONTROL_RING_H_
+#define _XENCONTROL_RING_H_
+
+/*! \file xencontrol_ring.h
+    \brief Single-producer, single-consumer message ring in shared memory
+
+    One end of a ring only produces, the other only consumes. Producers
+    reserve space for a record, fill it in place and commit it; consumers
+    peek at the next record in place and release it. Nothing is copied by
+    the library.
+
+    Each end publishes its index in its own cache line. Notifications use
+    event indices: an end only asks to be notified when it is about to
+    block, so a busy ring passes most records without any notification.
+
+    The ring itself is plain shared memory. How the memory is shared and
+    how an end notifies the other is up to an XC_RING_TRANSPORT.
+    XcRingCreate() and XcRingAttach() use grants and an event channel.
+    XcRingLoopbackCreate() keeps both ends in one process, which doesn't
+    need Xen and builds on any host with pthreads.
+*/
+
+#ifdef _WIN32
+#include "xencontrol.h"
+#else
+#include <stdint.h>
+
+typedef uint8_t UCHAR, *PUCHAR;
+typedef uint16_t USHORT;
+typedef uint32_t ULONG, *PULONG;
+typedef uint32_t DWORD;
+typedef uint64_t ULONG64;
+typedef int BOOL;
+typedef void *PVOID;
+
+#define VOID void
+#define IN
+#define OUT
+#define OPTIONAL
+#define TRUE  1
+#define FALSE 0
+#define INFINITE 0xFFFFFFFF
+
+#define ERROR_SUCCESS 0
+#define ERROR_INVALID_FUNCTION 1
+#define ERROR_NOT_ENOUGH_MEMORY 8
+#define ERROR_INVALID_DATA 13
+#define ERROR_INVALID_PARAMETER 87
+#define ERROR_NO_DATA 232
+#define ERROR_TIMEOUT 1460
+#define ERROR_RETRY 1237
+
+#define XENCONTROL_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define XC_RING_PAGE_SIZE   4096
+#define XC_RING_CACHE_LINE  64
+#define XC_RING_MAGIC       0x676E6952 /* "Ring" */
+
+/*! \brief Largest ring order, 1MB of data */
+#define XC_RING_ORDER_MAX   8
+
+/*! \brief Number of shared pages of a ring: a header page and 2^Order data pages */
+#define XC_RING_PAGES(Order) (1 + (1UL << (Order)))
+
+/*! \brief Shared header of a ring, in its first page
+
+    Indices are free-running byte counts into the data pages, which follow
+    the header page. Records start 8-byte aligned with an XC_RING_RECORD.
+*/
+typedef struct _XC_RING_SHARED {
+    /* written by the producer */
+    volatile ULONG Prod;      /*!< Bytes published */
+    volatile ULONG ConsEvent; /*!< The producer wants a notification once Cons reaches this */
+    UCHAR          ProdPad[XC_RING_CACHE_LINE - 2 * sizeof(ULONG)];
+    /* written by the consumer */
+    volatile ULONG Cons;      /*!< Bytes released */
+    volatile ULONG ProdEvent; /*!< The consumer wants a notification once Prod reaches this */
+    UCHAR          ConsPad[XC_RING_CACHE_LINE - 2 * sizeof(ULONG)];
+    /* written once by the end that creates the ring */
+    ULONG          Magic;     /*!< XC_RING_MAGIC */
+    ULONG          Order;     /*!< log2 of the number of data pages */
+} XC_RING_SHARED, *PXC_RING_SHARED;
+
+/*! \brief Header of a record in the data pages */
+typedef struct _XC_RING_RECORD {
+    ULONG Length;   /*!< Payload bytes, or XC_RING_PADDING and the length of a gap before the end of the data */
+    ULONG Reserved;
+} XC_RING_RECORD, *PXC_RING_RECORD;
+
+#define XC_RING_PADDING 0x80000000
+
+/*! \brief How the ends of a ring notify each other */
+typedef struct _XC_RING_TRANSPORT {
+    PVOID Context;
+    DWORD (*Notify)(PVOID Context);              /*!< Notify the other end */
+    DWORD (*Wait)(PVOID Context, DWORD Timeout); /*!< Wait for a notification from the other end, ERROR_TIMEOUT on timeout */
+    VOID (*Close)(PVOID Context);                /*!< Release the shared memory and the channel, may be NULL */
+} XC_RING_TRANSPORT, *PXC_RING_TRANSPORT;
+
+/*! \brief Counters of one end of a ring */
+typedef struct _XC_RING_STATS {
+    ULONG64 Committed; /*!< Records committed by this end */
+    ULONG64 Released;  /*!< Records released by this end */
+    ULONG64 Notifies;  /*!< Notifications sent to the other end */
+    ULONG64 Waits;     /*!< Times this end waited for a notification */
+} XC_RING_STATS, *PXC_RING_STATS;
+
+struct _XC_RING;
+typedef struct _XC_RING *PXC_RING;
+
+/*! \brief Open one end of a ring in memory shared by other means
+    \param Shared Page-aligned memory of XC_RING_PAGES(\a Order) pages
+    \param Order log2 of the number of data pages, at most XC_RING_ORDER_MAX
+    \param Initialize TRUE for the first end, which writes the header; the other end checks it
+    \param Transport Notification channel, copied; its Close callback runs in XcRingClose()
+    \param Ring Ring handle
+    \return Error code
+*/
+XENCONTROL_API
+DWORD
+XcRingOpen(
+    IN  PVOID Shared,
+    IN  ULONG Order,
+    IN  BOOL Initialize,
+    IN  const XC_RING_TRANSPORT *Transport,
+    OUT PXC_RING *Ring
+    );
+
+/*! \brief Create both ends of a ring in this process
+    \param Order log2 of the number of data pages, at most XC_RING_ORDER_MAX
+    \param Producer Producing end
+    \param Consumer Consuming end
+    \return Error code
+    \note Both ends must be closed with XcRingClose().
+*/
+XENCONTROL_API
+DWORD
+XcRingLoopbackCreate(
+    IN  ULONG Order,
+    OUT PXC_RING *Producer,
+    OUT PXC_RING *Consumer
+    );
+
+#ifdef _WIN32
+/*! \brief Create a ring shared with a remote domain
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param RemoteDomain Domain that attaches to the ring
+    \param Order log2 of the number of data pages, at most XC_RING_ORDER_MAX
+    \param Ring Ring handle
+    \param References Array of XC_RING_PAGES(\a Order) entries that receives the grant references to pass to the remote domain
+    \param LocalPort Receives the unbound event channel port to pass to the remote domain
+    \return Error code
+*/
+XENCONTROL_API
+DWORD
+XcRingCreate(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  USHORT RemoteDomain,
+    IN  ULONG Order,
+    OUT PXC_RING *Ring,
+    OUT ULONG *References,
+    OUT ULONG *LocalPort
+    );
+
+/*! \brief Attach to a ring created by a remote domain
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param RemoteDomain Domain that created the ring
+    \param Order log2 of the number of data pages
+    \param References Grant references of the XC_RING_PAGES(\a Order) ring pages
+    \param RemotePort Unbound event channel port of the remote domain
+    \param Ring Ring handle
+    \return Error code
+*/
+XENCONTROL_API
+DWORD
+XcRingAttach(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  USHORT RemoteDomain,
+    IN  ULONG Order,
+    IN  PULONG References,
+    IN  ULONG RemotePort,
+    OUT PXC_RING *Ring
+    );
+#endif
+
+/*! \brief Close one end of a ring
+    \param Ring Ring handle
+*/
+XENCONTROL_API
+VOID
+XcRingClose(
+    IN  PXC_RING Ring
+    );
+
+/*! \brief Largest record a ring can carry
+    \param Ring Ring handle
+    \return Payload bytes, half of the data size minus the record header
+*/
+XENCONTROL_API
+ULONG
+XcRingMaxLength(
+    IN  PXC_RING Ring
+    );
+
+/*! \brief Reserve space for a record (producer)
+    \param Ring Ring handle
+    \param Length Payload bytes, at most XcRingMaxLength()
+    \param Buffer Receives the 8-byte aligned payload, to be filled in place
+    \return ERROR_SUCCESS, ERROR_RETRY if the ring is full, or an error code
+    \note Records reserved since the last XcRingCommit() are invisible to the consumer.
+*/
+XENCONTROL_API
+DWORD
+XcRingReserve(
+    IN  PXC_RING Ring,
+    IN  ULONG Length,
+    OUT PVOID *Buffer
+    );
+
+/*! \brief Publish reserved records (producer)
+    \param Ring Ring handle
+    \return Error code
+    \note The consumer is only notified if it is waiting for data.
+*/
+XENCONTROL_API
+DWORD
+XcRingCommit(
+    IN  PXC_RING Ring
+    );
+
+/*! \brief Get the next record (consumer)
+    \param Ring Ring handle
+    \param Buffer Receives the payload, valid until XcRingRelease()
+    \param Length Receives the payload bytes
+    \return ERROR_SUCCESS, ERROR_NO_DATA if the ring is empty, or an error code
+    \note Peeking again without a release returns the same record.
+*/
+XENCONTROL_API
+DWORD
+XcRingPeek(
+    IN  PXC_RING Ring,
+    OUT PVOID *Buffer,
+    OUT ULONG *Length
+    );
+
+/*! \brief Give the record returned by XcRingPeek() back to the producer (consumer)
+    \param Ring Ring handle
+    \return Error code
+    \note The producer is only notified if it is waiting for space.
+*/
+XENCONTROL_API
+DWORD
+XcRingRelease(
+    IN  PXC_RING Ring
+    );
+
+/*! \brief Wait until the ring has data (consumer)
+    \param Ring Ring handle
+    \param Timeout Milliseconds to wait for each notification, or INFINITE
+    \return ERROR_SUCCESS, ERROR_TIMEOUT, or an error code
+*/
+XENCONTROL_API
+DWORD
+XcRingWaitReadable(
+    IN  PXC_RING Ring,
+    IN  DWORD Timeout
+    );
+
+/*! \brief Commit reserved records, then wait until a record of \a Length bytes fits (producer)
+    \param Ring Ring handle
+    \param Length Payload bytes, at most XcRingMaxLength()
+    \param Timeout Milliseconds to wait for each notification, or INFINITE
+    \return ERROR_SUCCESS, ERROR_TIMEOUT, or an error code
+*/
+XENCONTROL_API
+DWORD
+XcRingWaitWritable(
+    IN  PXC_RING Ring,
+    IN  ULONG Length,
+    IN  DWORD Timeout
+    );
+
+/*! \brief Get the counters of one end of a ring
+    \param Ring Ring handle
+    \param Stats Counters
+*/
+XENCONTROL_API
+VOID
+XcRingQueryStats(
+    IN  PXC_RING Ring,
+    OUT PXC_RING_STATS Stats
+    );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _XENCONTROL_RING_H_
@@ -0,0 +1,283 @@
+#ifndef _XENCONTROL_VCHAN_H_
+#define _XENCONTROL_VCHAN_H_
+
+/*! \file xencontrol_vchan.h
+    \brief Byte-stream channel compatible with libxenvchan
+
+    A vchan is a pair of byte rings between a server and a client domain,
+    laid out as libxenvchan does, so either end can talk to a libxenvchan
+    peer. The server grants a control page and the ring pages, binds an
+    unbound event channel and publishes "ring-ref" and "event-channel" under
+    a XenStore path readable by the client. The client maps them and binds
+    to the port.
+
+    The server reads from the left ring and writes to the right ring. Rings
+    of 1KB and 2KB live in the control page; larger rings are granted
+    separately, up to XC_VCHAN_ORDER_MAX.
+
+    Like XC_RING, the protocol is plain shared memory and notifications go
+    through an XC_RING_TRANSPORT. XcVchanLoopbackCreate() keeps both ends
+    in one process, which doesn't need Xen and builds on any host with
+    pthreads.
+*/
+
+#include "xencontrol_ring.h"
+
+#ifndef _WIN32
+#define ERROR_BROKEN_PIPE 109
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define XC_VCHAN_NOTIFY_WRITE   0x1 /*!< Notify when the ring has new data */
+#define XC_VCHAN_NOTIFY_READ    0x2 /*!< Notify when the ring has new space */
+
+#define XC_VCHAN_PAGE_SHIFT     12
+#define XC_VCHAN_SMALL_ORDER    10  /*!< 1KB ring at offset 1024 of the control page */
+#define XC_VCHAN_LARGE_ORDER    11  /*!< 2KB ring at offset 2048 of the control page */
+
+/*! \brief Largest ring order, 1MB; libxenvchan peers refuse larger rings */
+#define XC_VCHAN_ORDER_MAX      20
+
+/*! \brief Pages granted for a ring of 2^Order bytes, 0 if it lives in the control page */
+#define XC_VCHAN_PAGES(Order) \
+    ((Order) >= XC_VCHAN_PAGE_SHIFT ? 1UL << ((Order) - XC_VCHAN_PAGE_SHIFT) : 0)
+
+/*! \brief Indices of one ring, free-running byte counts */
+typedef struct _XC_VCHAN_RING_SHARED {
+    volatile ULONG Cons;
+    volatile ULONG Prod;
+} XC_VCHAN_RING_SHARED, *PXC_VCHAN_RING_SHARED;
+
+/*! \brief Control page, struct vchan_interface of libxenvchan */
+typedef struct _XC_VCHAN_INTERFACE {
+    XC_VCHAN_RING_SHARED Left;  /*!< Client to server */
+    XC_VCHAN_RING_SHARED Right; /*!< Server to client */
+    USHORT LeftOrder;
+    USHORT RightOrder;
+    volatile UCHAR ClientLive;   /*!< 0 closed, 1 connected, 2 not connected yet */
+    volatile UCHAR ServerLive;   /*!< 0 closed, 1 connected */
+    volatile UCHAR ClientNotify; /*!< XC_VCHAN_NOTIFY_* events the client wants */
+    volatile UCHAR ServerNotify; /*!< XC_VCHAN_NOTIFY_* events the server wants */
+    ULONG Grants[1];             /*!< References of the left ring pages, then of the right ring pages */
+} XC_VCHAN_INTERFACE, *PXC_VCHAN_INTERFACE;
+
+struct _XC_VCHAN;
+typedef struct _XC_VCHAN *PXC_VCHAN;
+
+/*! \brief Open one end of a vchan in memory shared by other means
+    \param Interface Control page
+    \param Server TRUE for the server, which initializes the control page; the client checks it and connects
+    \param LeftOrder log2 of the size of the left ring
+    \param RightOrder log2 of the size of the right ring
+    \param LeftBuffer Left ring, NULL if it lives in the control page
+    \param RightBuffer Right ring, NULL if it lives in the control page
+    \param Transport Notification channel, copied; its Close callback runs in XcVchanClose()
+    \param Vchan Vchan handle
+    \return Error code
+*/
+XENCONTROL_API
+DWORD
+XcVchanOpen(
+    IN  PXC_VCHAN_INTERFACE Interface,
+    IN  BOOL Server,
+    IN  ULONG LeftOrder,
+    IN  ULONG RightOrder,
+    IN  PVOID LeftBuffer OPTIONAL,
+    IN  PVOID RightBuffer OPTIONAL,
+    IN  const XC_RING_TRANSPORT *Transport,
+    OUT PXC_VCHAN *Vchan
+    );
+
+/*! \brief Create a connected server and client in this process
+    \param LeftOrder log2 of the size of the client to server ring
+    \param RightOrder log2 of the size of the server to client ring
+    \param Server Server end
+    \param Client Client end
+    \return Error code
+    \note Both ends must be closed with XcVchanClose().
+*/
+XENCONTROL_API
+DWORD
+XcVchanLoopbackCreate(
+    IN  ULONG LeftOrder,
+    IN  ULONG RightOrder,
+    OUT PXC_VCHAN *Server,
+    OUT PXC_VCHAN *Client
+    );
+
+#ifdef _WIN32
+/*! \brief Create the server end of a vchan, libxenvchan_server_init()
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param RemoteDomain Client domain
+    \param Path XenStore path that receives "ring-ref" and "event-channel", readable by the client only
+    \param ReadMin Smallest size of the ring read by the server, in bytes
+    \param WriteMin Smallest size of the ring written by the server, in bytes
+    \param Vchan Vchan handle
+    \return Error code
+    \note The rings are rounded up to a power of two. XcVchanClose() removes \a Path.
+*/
+XENCONTROL_API
+DWORD
+XcVchanServerInit(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  USHORT RemoteDomain,
+    IN  PCHAR Path,
+    IN  ULONG ReadMin,
+    IN  ULONG WriteMin,
+    OUT PXC_VCHAN *Vchan
+    );
+
+/*! \brief Connect to the server end of a vchan, libxenvchan_client_init()
+    \param Xc Xencontrol handle returned by XcOpen()
+    \param RemoteDomain Server domain
+    \param Path XenStore path the server published the vchan under
+    \param Vchan Vchan handle
+    \return Error code
+*/
+XENCONTROL_API
+DWORD
+XcVchanClientInit(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  USHORT RemoteDomain,
+    IN  PCHAR Path,
+    OUT PXC_VCHAN *Vchan
+    );
+#endif
+
+/*! \brief Close one end of a vchan and tell the other end
+    \param Vchan Vchan handle
+*/
+XENCONTROL_API
+VOID
+XcVchanClose(
+    IN  PXC_VCHAN Vchan
+    );
+
+/*! \brief Select blocking or non-blocking reads and writes
+    \param Vchan Vchan handle
+    \param Blocking TRUE to wait in XcVchanRead(), XcVchanWrite(), XcVchanRecv() and XcVchanSend(), the default
+*/
+XENCONTROL_API
+VOID
+XcVchanSetBlocking(
+    IN  PXC_VCHAN Vchan,
+    IN  BOOL Blocking
+    );
+
+/*! \brief Check whether the other end is still there
+    \param Vchan Vchan handle
+    \return 0 if closed, 1 if connected, 2 for a server whose client hasn't connected yet
+*/
+XENCONTROL_API
+ULONG
+XcVchanIsOpen(
+    IN  PXC_VCHAN Vchan
+    );
+
+/*! \brief Bytes that can be read without waiting
+    \param Vchan Vchan handle
+    \return Number of bytes
+    \note Also asks the other end to notify when more data arrives.
+*/
+XENCONTROL_API
+ULONG
+XcVchanDataReady(
+    IN  PXC_VCHAN Vchan
+    );
+
+/*! \brief Bytes that can be written without waiting
+    \param Vchan Vchan handle
+    \return Number of bytes
+    \note Also asks the other end to notify when more space frees up.
+*/
+XENCONTROL_API
+ULONG
+XcVchanBufferSpace(
+    IN  PXC_VCHAN Vchan
+    );
+
+/*! \brief Wait for a notification from the other end
+    \param Vchan Vchan handle
+    \param Timeout Milliseconds to wait, or INFINITE
+    \return ERROR_SUCCESS, ERROR_TIMEOUT, or an error code
+    \note Call XcVchanDataReady() or XcVchanBufferSpace() first to ask for the notification.
+*/
+XENCONTROL_API
+DWORD
+XcVchanWait(
+    IN  PXC_VCHAN Vchan,
+    IN  DWORD Timeout
+    );
+
+/*! \brief Read up to \a Size bytes of the stream
+    \param Vchan Vchan handle
+    \param Buffer Buffer that receives the data
+    \param Size Size of \a Buffer, in bytes
+    \param Read Receives the number of bytes read: at least 1 if blocking, possibly 0 if not
+    \return ERROR_SUCCESS, ERROR_BROKEN_PIPE if the other end closed and nothing is left to read, or an error code
+*/
+XENCONTROL_API
+DWORD
+XcVchanRead(
+    IN  PXC_VCHAN Vchan,
+    OUT PVOID Buffer,
+    IN  ULONG Size,
+    OUT ULONG *Read
+    );
+
+/*! \brief Write up to \a Size bytes of the stream
+    \param Vchan Vchan handle
+    \param Buffer Data to write
+    \param Size Size of \a Buffer, in bytes
+    \param Written Receives the number of bytes written: all of them if blocking, possibly fewer if not
+    \return ERROR_SUCCESS, ERROR_BROKEN_PIPE if the other end closed, or an error code
+*/
+XENCONTROL_API
+DWORD
+XcVchanWrite(
+    IN  PXC_VCHAN Vchan,
+    IN  const VOID *Buffer,
+    IN  ULONG Size,
+    OUT ULONG *Written
+    );
+
+/*! \brief Read exactly \a Size bytes, or nothing
+    \param Vchan Vchan handle
+    \param Buffer Buffer that receives the data
+    \param Size Number of bytes, at most the size of the ring
+    \param Read Receives \a Size, or 0 if not blocking and fewer bytes are ready
+    \return ERROR_SUCCESS, ERROR_BROKEN_PIPE, ERROR_INVALID_PARAMETER if \a Size can never fit, or an error code
+*/
+XENCONTROL_API
+DWORD
+XcVchanRecv(
+    IN  PXC_VCHAN Vchan,
+    OUT PVOID Buffer,
+    IN  ULONG Size,
+    OUT ULONG *Read
+    );
+
+/*! \brief Write exactly \a Size bytes, or nothing
+    \param Vchan Vchan handle
+    \param Buffer Data to write
+    \param Size Number of bytes, at most the size of the ring
+    \param Written Receives \a Size, or 0 if not blocking and there is less space
+    \return ERROR_SUCCESS, ERROR_BROKEN_PIPE, ERROR_INVALID_PARAMETER if \a Size can never fit, or an error code
+*/
+XENCONTROL_API
+DWORD
+XcVchanSend(
+    IN  PXC_VCHAN Vchan,
+    IN  const VOID *Buffer,
+    IN  ULONG Size,
+    OUT ULONG *Written
+    );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _XENCONTROL_VCHAN_H_
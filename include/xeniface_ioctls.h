@@ -163,7 +163,8 @@ typedef struct _XENIFACE_EVTCHN_BIND_INTERDOMAIN_IN {
     USHORT  RemoteDomain; /*!< Remote domain that has already bound the channel */
     ULONG   RemotePort;   /*!< Port number that is assigned to the event channel in the RemoteDomain */
     BOOLEAN Mask;         /*!< Set to TRUE if the event channel should be initially masked */
-    HANDLE  Event;        /*!< Handle to an event object that will receive event channel notifications */
+    HANDLE  Event;        /*!< Handle to an event object that will receive event channel notifications,
+                               or NULL to receive them through IOCTL_XENIFACE_EVTCHN_WAIT */
 } XENIFACE_EVTCHN_BIND_INTERDOMAIN_IN, *PXENIFACE_EVTCHN_BIND_INTERDOMAIN_IN;
 
 /*! \brief Output for IOCTL_XENIFACE_EVTCHN_BIND_INTERDOMAIN */
@@ -184,7 +185,8 @@ typedef struct _XENIFACE_EVTCHN_BIND_INTERDOMAIN_OUT {
 typedef struct _XENIFACE_EVTCHN_BIND_UNBOUND_IN {
     USHORT  RemoteDomain; /*!< Remote domain that will bind the channel */
     BOOLEAN Mask;         /*!< Set to TRUE if the event channel should be initially masked */
-    HANDLE  Event;        /*!< Handle to an event object that will receive event channel notifications */
+    HANDLE  Event;        /*!< Handle to an event object that will receive event channel notifications,
+                               or NULL to receive them through IOCTL_XENIFACE_EVTCHN_WAIT */
 } XENIFACE_EVTCHN_BIND_UNBOUND_IN, *PXENIFACE_EVTCHN_BIND_UNBOUND_IN;
 
 /*! \brief Output for IOCTL_XENIFACE_EVTCHN_BIND_UNBOUND */
@@ -234,13 +236,364 @@ typedef struct _XENIFACE_EVTCHN_UNMASK_IN {
     ULONG LocalPort; /*!< Local port number that is assigned to the event channel */
 } XENIFACE_EVTCHN_UNMASK_IN, *PXENIFACE_EVTCHN_UNMASK_IN;
 
+/*! \brief Notify the remote ends of multiple event channels
+
+    All ports are notified under a single lock acquisition. A port that is
+    not open for the calling file object does not stop the remaining ports
+    from being notified; its entry in the output Status array is set instead.
+
+    Input: XENIFACE_EVTCHN_NOTIFY_BATCH_IN
+
+    Output: XENIFACE_EVTCHN_NOTIFY_BATCH_OUT
+*/
+#define IOCTL_XENIFACE_EVTCHN_NOTIFY_BATCH \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x815, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*! \brief Maximum number of ports for IOCTL_XENIFACE_EVTCHN_NOTIFY_BATCH */
+#define XENIFACE_EVTCHN_NOTIFY_BATCH_MAX 1024
+
+/*! \brief Input for IOCTL_XENIFACE_EVTCHN_NOTIFY_BATCH */
+typedef struct _XENIFACE_EVTCHN_NOTIFY_BATCH_IN {
+    ULONG NumberPorts;                /*!< Number of entries in LocalPorts */
+    ULONG LocalPorts[ANYSIZE_ARRAY];  /*!< Local port numbers of the event channels to notify */
+} XENIFACE_EVTCHN_NOTIFY_BATCH_IN, *PXENIFACE_EVTCHN_NOTIFY_BATCH_IN;
+
+/*! \brief Output for IOCTL_XENIFACE_EVTCHN_NOTIFY_BATCH */
+typedef struct _XENIFACE_EVTCHN_NOTIFY_BATCH_OUT {
+    ULONG NumberPorts;                /*!< Number of entries in Status */
+    LONG  Status[ANYSIZE_ARRAY];      /*!< NTSTATUS of the notification for each port, in input order */
+} XENIFACE_EVTCHN_NOTIFY_BATCH_OUT, *PXENIFACE_EVTCHN_NOTIFY_BATCH_OUT;
+
+/*! \brief Wait for notifications on event channels that were bound without an event object
+    \note This IOCTL should be asynchronous. The driver completes the request as soon
+          as at least one such channel opened by the calling file object has fired,
+          so a single I/O completion port can service any number of channels.
+          Each port is reported once per batch of notifications, and the request may
+          occasionally complete with NumberPorts set to zero.
+
+          ReadFile on the device handle works the same way, like reading the Linux
+          evtchn device. The read buffer receives a bare array of ULONG local ports
+          and the number of bytes read is four times the number of ports. Ports
+          that did not fit stay queued for the next read or wait.
+
+    Input: None
+
+    Output: XENIFACE_EVTCHN_WAIT_OUT
+*/
+#define IOCTL_XENIFACE_EVTCHN_WAIT \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x816, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*! \brief Output for IOCTL_XENIFACE_EVTCHN_WAIT */
+typedef struct _XENIFACE_EVTCHN_WAIT_OUT {
+    ULONG NumberPorts;                /*!< Number of valid entries in LocalPorts */
+    ULONG LocalPorts[ANYSIZE_ARRAY];  /*!< Local port numbers of the event channels that fired */
+} XENIFACE_EVTCHN_WAIT_OUT, *PXENIFACE_EVTCHN_WAIT_OUT;
+
+/*! \brief Map a page of event channel pending bits into the caller's address space
+    \note Bit N of the page (bit N % 32 of the N / 32-th LONG) is set by the driver
+          whenever the event channel with local port N, opened by the calling file
+          object, fires. This happens before the channel's event object is signaled.
+          Together with channels bound without an event object, this lets a polling
+          loop test and clear bits with interlocked operations without entering
+          the kernel or waking an event object.
+          Ports at or above XENIFACE_EVTCHN_PENDING_PORTS are never reported in the page.
+          Channels are unmasked by the driver after each notification; IOCTL_XENIFACE_EVTCHN_UNMASK
+          is only needed for channels bound with Mask set to TRUE.
+          The mapping stays valid until the handle is closed or the process exits and can only be
+          created once per handle, by the process that opened it.
+
+    Input: None
+
+    Output: XENIFACE_EVTCHN_MAP_PENDING_OUT
+*/
+#define IOCTL_XENIFACE_EVTCHN_MAP_PENDING \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x817, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*! \brief Number of ports covered by the page mapped by IOCTL_XENIFACE_EVTCHN_MAP_PENDING */
+#define XENIFACE_EVTCHN_PENDING_PORTS (4096 * 8)
+
+/*! \brief Output for IOCTL_XENIFACE_EVTCHN_MAP_PENDING */
+typedef struct _XENIFACE_EVTCHN_MAP_PENDING_OUT {
+    PVOID Address;     /*!< User mode address of the pending bits */
+    ULONG NumberPorts; /*!< Number of ports covered by the pending bits */
+} XENIFACE_EVTCHN_MAP_PENDING_OUT, *PXENIFACE_EVTCHN_MAP_PENDING_OUT;
+
+/*! \brief Set the spin budget of an event channel for IOCTL_XENIFACE_EVTCHN_SPIN_WAIT
+
+    Input: XENIFACE_EVTCHN_SET_SPIN_IN
+
+    Output: None
+*/
+#define IOCTL_XENIFACE_EVTCHN_SET_SPIN \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x818, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*! \brief Maximum spin budget in microseconds */
+#define XENIFACE_EVTCHN_SPIN_MAX 1000
+
+/*! \brief Input for IOCTL_XENIFACE_EVTCHN_SET_SPIN */
+typedef struct _XENIFACE_EVTCHN_SET_SPIN_IN {
+    ULONG LocalPort;        /*!< Local port number that is assigned to the event channel */
+    ULONG SpinMicroseconds; /*!< Time to spin for, at most XENIFACE_EVTCHN_SPIN_MAX */
+} XENIFACE_EVTCHN_SET_SPIN_IN, *PXENIFACE_EVTCHN_SET_SPIN_IN;
+
+/*! \brief Busy-wait for a notification on an event channel
+    \note The calling thread spins in the driver for the channel's spin budget, watching
+          for notifications as soon as the interrupt arrives. A notification consumed by
+          spinning does not signal the channel's event object, set its pending bit or
+          complete IOCTL_XENIFACE_EVTCHN_WAIT, but it is a delivery for the channel's
+          moderation mode: with XENIFACE_EVTCHN_MODERATION_ACK the channel stays masked until
+          IOCTL_XENIFACE_EVTCHN_UNMASK. If Fired is FALSE in the output the caller should fall
+          back to its usual blocking wait.
+
+    Input: XENIFACE_EVTCHN_SPIN_WAIT_IN
+
+    Output: XENIFACE_EVTCHN_SPIN_WAIT_OUT
+*/
+#define IOCTL_XENIFACE_EVTCHN_SPIN_WAIT \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x819, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*! \brief Input for IOCTL_XENIFACE_EVTCHN_SPIN_WAIT */
+typedef struct _XENIFACE_EVTCHN_SPIN_WAIT_IN {
+    ULONG LocalPort; /*!< Local port number that is assigned to the event channel */
+} XENIFACE_EVTCHN_SPIN_WAIT_IN, *PXENIFACE_EVTCHN_SPIN_WAIT_IN;
+
+/*! \brief Output for IOCTL_XENIFACE_EVTCHN_SPIN_WAIT */
+typedef struct _XENIFACE_EVTCHN_SPIN_WAIT_OUT {
+    BOOLEAN Fired;       /*!< TRUE if a notification arrived within the spin budget */
+    ULONG   SpinWakeups; /*!< Total number of spin waits on the channel satisfied by spinning */
+    ULONG   SpinMisses;  /*!< Total number of spin waits on the channel that ran out of budget */
+} XENIFACE_EVTCHN_SPIN_WAIT_OUT, *PXENIFACE_EVTCHN_SPIN_WAIT_OUT;
+
+/*! \brief Notification moderation modes of an event channel */
+typedef enum _XENIFACE_EVTCHN_MODERATION {
+    XENIFACE_EVTCHN_MODERATION_NONE = 0, /*!< Every notification is delivered and the channel is unmasked right away */
+    XENIFACE_EVTCHN_MODERATION_INTERVAL, /*!< At most one delivery per IntervalMicroseconds, later notifications are coalesced */
+    XENIFACE_EVTCHN_MODERATION_ACK,      /*!< The channel stays masked after a delivery until IOCTL_XENIFACE_EVTCHN_UNMASK */
+} XENIFACE_EVTCHN_MODERATION;
+
+/*! \brief Set notification moderation for an event channel
+    \note With XENIFACE_EVTCHN_MODERATION_INTERVAL a notification arriving less than
+          IntervalMicroseconds after the previous delivery keeps the channel masked
+          and is delivered, together with anything coalesced into it, when the
+          interval expires. This bounds the added latency to IntervalMicroseconds.
+
+    Input: XENIFACE_EVTCHN_SET_MODERATION_IN
+
+    Output: None
+*/
+#define IOCTL_XENIFACE_EVTCHN_SET_MODERATION \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x81A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*! \brief Maximum moderation interval in microseconds */
+#define XENIFACE_EVTCHN_MODERATION_INTERVAL_MAX 1000000
+
+/*! \brief Input for IOCTL_XENIFACE_EVTCHN_SET_MODERATION */
+typedef struct _XENIFACE_EVTCHN_SET_MODERATION_IN {
+    ULONG                      LocalPort;            /*!< Local port number that is assigned to the event channel */
+    XENIFACE_EVTCHN_MODERATION Mode;                 /*!< Moderation mode */
+    ULONG                      IntervalMicroseconds; /*!< Minimum time between deliveries for XENIFACE_EVTCHN_MODERATION_INTERVAL,
+                                                          at most XENIFACE_EVTCHN_MODERATION_INTERVAL_MAX */
+} XENIFACE_EVTCHN_SET_MODERATION_IN, *PXENIFACE_EVTCHN_SET_MODERATION_IN;
+
+/*! \brief Deliver notifications of an event channel on a specific processor
+    \note The driver asks Xen to raise the channel's upcall on the given vCPU and
+          targets the channel's DPCs at it, so the whole delivery chain can stay on
+          the processor of the consuming thread. If Xen refuses the vCPU binding the
+          DPCs are still targeted and BindStatus reports the error.
+
+    Input: XENIFACE_EVTCHN_SET_AFFINITY_IN
+
+    Output: XENIFACE_EVTCHN_SET_AFFINITY_OUT
+*/
+#define IOCTL_XENIFACE_EVTCHN_SET_AFFINITY \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x81B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*! \brief Input for IOCTL_XENIFACE_EVTCHN_SET_AFFINITY */
+typedef struct _XENIFACE_EVTCHN_SET_AFFINITY_IN {
+    ULONG  LocalPort; /*!< Local port number that is assigned to the event channel */
+    USHORT Group;     /*!< Processor group of the target processor */
+    UCHAR  Number;    /*!< Number of the target processor within its group */
+} XENIFACE_EVTCHN_SET_AFFINITY_IN, *PXENIFACE_EVTCHN_SET_AFFINITY_IN;
+
+/*! \brief Output for IOCTL_XENIFACE_EVTCHN_SET_AFFINITY */
+typedef struct _XENIFACE_EVTCHN_SET_AFFINITY_OUT {
+    LONG BindStatus; /*!< NTSTATUS of binding the event channel to the vCPU */
+} XENIFACE_EVTCHN_SET_AFFINITY_OUT, *PXENIFACE_EVTCHN_SET_AFFINITY_OUT;
+
+/*! \brief Query where notifications of an event channel are handled
+
+    Input: XENIFACE_EVTCHN_QUERY_AFFINITY_IN
+
+    Output: XENIFACE_EVTCHN_QUERY_AFFINITY_OUT
+*/
+#define IOCTL_XENIFACE_EVTCHN_QUERY_AFFINITY \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x81C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*! \brief Input for IOCTL_XENIFACE_EVTCHN_QUERY_AFFINITY */
+typedef struct _XENIFACE_EVTCHN_QUERY_AFFINITY_IN {
+    ULONG LocalPort; /*!< Local port number that is assigned to the event channel */
+} XENIFACE_EVTCHN_QUERY_AFFINITY_IN, *PXENIFACE_EVTCHN_QUERY_AFFINITY_IN;
+
+/*! \brief Output for IOCTL_XENIFACE_EVTCHN_QUERY_AFFINITY */
+typedef struct _XENIFACE_EVTCHN_QUERY_AFFINITY_OUT {
+    BOOLEAN          Targeted;         /*!< TRUE if IOCTL_XENIFACE_EVTCHN_SET_AFFINITY was used */
+    PROCESSOR_NUMBER Target;           /*!< Processor set by IOCTL_XENIFACE_EVTCHN_SET_AFFINITY */
+    PROCESSOR_NUMBER LastInterrupt;    /*!< Processor that took the last upcall for the channel */
+    PROCESSOR_NUMBER LastDelivery;     /*!< Processor that delivered the last notification to user mode */
+    ULONG64          Deliveries;       /*!< Number of notifications delivered to user mode */
+    ULONG64          RemoteDeliveries; /*!< Number of deliveries on a different processor than their upcall */
+} XENIFACE_EVTCHN_QUERY_AFFINITY_OUT, *PXENIFACE_EVTCHN_QUERY_AFFINITY_OUT;
+
+/*! \brief Query statistics of an event channel
+
+    Times are system interrupt times in 100ns units, 0 if the event has not happened yet.
+    The same counters, summed over all channels, are available as WMI data of
+    XenStoreBase.
+
+    Input: XENIFACE_EVTCHN_QUERY_STATS_IN
+
+    Output: XENIFACE_EVTCHN_QUERY_STATS_OUT
+*/
+#define IOCTL_XENIFACE_EVTCHN_QUERY_STATS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x81D, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*! \brief Input for IOCTL_XENIFACE_EVTCHN_QUERY_STATS */
+typedef struct _XENIFACE_EVTCHN_QUERY_STATS_IN {
+    ULONG LocalPort; /*!< Local port number that is assigned to the event channel */
+} XENIFACE_EVTCHN_QUERY_STATS_IN, *PXENIFACE_EVTCHN_QUERY_STATS_IN;
+
+/*! \brief Output for IOCTL_XENIFACE_EVTCHN_QUERY_STATS */
+typedef struct _XENIFACE_EVTCHN_QUERY_STATS_OUT {
+    ULONG64 Interrupts;        /*!< Number of upcalls for the channel */
+    ULONG64 Dpcs;              /*!< Number of notification DPCs run */
+    ULONG64 Coalesced;         /*!< Number of upcalls folded into an earlier notification */
+    ULONG64 Deliveries;        /*!< Number of notifications delivered to user mode */
+    ULONG64 Sends;             /*!< Number of notifications sent to the remote end */
+    ULONG64 Unmasks;           /*!< Number of times the channel was unmasked */
+    ULONG64 LastInterruptTime; /*!< Time of the last upcall */
+    ULONG64 LastDeliveryTime;  /*!< Time of the last delivery to user mode */
+    ULONG64 CurrentTime;       /*!< Time when the statistics were taken */
+} XENIFACE_EVTCHN_QUERY_STATS_OUT, *PXENIFACE_EVTCHN_QUERY_STATS_OUT;
+
+/*! \brief Stages of event channel latency tracing */
+typedef enum _XENIFACE_EVTCHN_LATENCY_STAGE {
+    XENIFACE_EVTCHN_LATENCY_INTERRUPT_TO_DPC = 0, /*!< Upcall to the start of the notification DPC */
+    XENIFACE_EVTCHN_LATENCY_DPC_TO_SIGNAL,        /*!< DPC start to signalling user mode */
+    XENIFACE_EVTCHN_LATENCY_SIGNAL_TO_WAKE,       /*!< Signalling user mode to the reported wake */
+    XENIFACE_EVTCHN_LATENCY_INTERRUPT_TO_WAKE,    /*!< Upcall to the reported wake */
+    XENIFACE_EVTCHN_LATENCY_STAGES
+} XENIFACE_EVTCHN_LATENCY_STAGE;
+
+/*! \brief Number of buckets of an event channel latency histogram
+
+    Bucket N counts latencies of 2^N to 2^(N+1)-1 nanoseconds. The first bucket also
+    counts latencies below 1ns and the last bucket everything above its range.
+*/
+#define XENIFACE_EVTCHN_LATENCY_BUCKETS 32
+
+/*! \brief Report when a user thread woke up for an event channel notification
+
+    Completes the latency trace of the last notification of the channel. WakeTime
+    is the QueryPerformanceCounter() value taken right after the wait returned.
+    Reports without an outstanding notification are ignored.
+
+    Input: XENIFACE_EVTCHN_REPORT_WAKE_IN
+
+    Output: None
+*/
+#define IOCTL_XENIFACE_EVTCHN_REPORT_WAKE \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x81E, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*! \brief Input for IOCTL_XENIFACE_EVTCHN_REPORT_WAKE */
+typedef struct _XENIFACE_EVTCHN_REPORT_WAKE_IN {
+    ULONG    LocalPort; /*!< Local port number that is assigned to the event channel */
+    LONGLONG WakeTime;  /*!< Performance counter value at wake up */
+} XENIFACE_EVTCHN_REPORT_WAKE_IN, *PXENIFACE_EVTCHN_REPORT_WAKE_IN;
+
+/*! \brief Read the latency histograms of an event channel
+
+    Input: XENIFACE_EVTCHN_QUERY_LATENCY_IN
+
+    Output: XENIFACE_EVTCHN_QUERY_LATENCY_OUT
+*/
+#define IOCTL_XENIFACE_EVTCHN_QUERY_LATENCY \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x81F, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*! \brief Input for IOCTL_XENIFACE_EVTCHN_QUERY_LATENCY */
+typedef struct _XENIFACE_EVTCHN_QUERY_LATENCY_IN {
+    ULONG   LocalPort; /*!< Local port number that is assigned to the event channel */
+    BOOLEAN Reset;     /*!< Clear the histograms after reading them */
+} XENIFACE_EVTCHN_QUERY_LATENCY_IN, *PXENIFACE_EVTCHN_QUERY_LATENCY_IN;
+
+/*! \brief Output for IOCTL_XENIFACE_EVTCHN_QUERY_LATENCY */
+typedef struct _XENIFACE_EVTCHN_QUERY_LATENCY_OUT {
+    /*! Sample counts, indexed by XENIFACE_EVTCHN_LATENCY_STAGE and bucket */
+    ULONG Histogram[XENIFACE_EVTCHN_LATENCY_STAGES][XENIFACE_EVTCHN_LATENCY_BUCKETS];
+} XENIFACE_EVTCHN_QUERY_LATENCY_OUT, *PXENIFACE_EVTCHN_QUERY_LATENCY_OUT;
+
+/*! \brief Open a number of unbound event channels in one call
+    \note The channels have no event object, notifications are delivered through
+          IOCTL_XENIFACE_EVTCHN_WAIT and the page mapped by IOCTL_XENIFACE_EVTCHN_MAP_PENDING.
+          Either all channels are opened or none are.
+
+    Input: XENIFACE_EVTCHN_BIND_UNBOUND_BATCH_IN
+
+    Output: XENIFACE_EVTCHN_BIND_UNBOUND_BATCH_OUT
+*/
+#define IOCTL_XENIFACE_EVTCHN_BIND_UNBOUND_BATCH \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x850, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*! \brief Maximum number of channels for IOCTL_XENIFACE_EVTCHN_BIND_UNBOUND_BATCH */
+#define XENIFACE_EVTCHN_BIND_BATCH_MAX 1024
+
+/*! \brief Input for IOCTL_XENIFACE_EVTCHN_BIND_UNBOUND_BATCH */
+typedef struct _XENIFACE_EVTCHN_BIND_UNBOUND_BATCH_IN {
+    USHORT  RemoteDomain;   /*!< Remote domain that will bind the channels */
+    BOOLEAN Mask;           /*!< Set to TRUE if the channels should be masked */
+    ULONG   NumberChannels; /*!< Number of channels to open */
+} XENIFACE_EVTCHN_BIND_UNBOUND_BATCH_IN, *PXENIFACE_EVTCHN_BIND_UNBOUND_BATCH_IN;
+
+/*! \brief Output for IOCTL_XENIFACE_EVTCHN_BIND_UNBOUND_BATCH */
+typedef struct _XENIFACE_EVTCHN_BIND_UNBOUND_BATCH_OUT {
+    ULONG NumberChannels;            /*!< Number of entries in LocalPorts */
+    ULONG LocalPorts[ANYSIZE_ARRAY]; /*!< Local port numbers of the opened channels */
+} XENIFACE_EVTCHN_BIND_UNBOUND_BATCH_OUT, *PXENIFACE_EVTCHN_BIND_UNBOUND_BATCH_OUT;
+
 /*! \brief Bitmask of XenStore key permissions */
 typedef enum _XENIFACE_GNTTAB_PAGE_FLAGS {
     XENIFACE_GNTTAB_READONLY          = 1 << 0, /*!< If set, the granted/mapped pages are read-only */
     XENIFACE_GNTTAB_USE_NOTIFY_OFFSET = 1 << 1, /*!< If set, the NotifyOffset member of the grant/map IOCTL input is used */
     XENIFACE_GNTTAB_USE_NOTIFY_PORT   = 1 << 2, /*!< If set, the NotifyPort member of the grant/map IOCTL input is used */
+    XENIFACE_GNTTAB_PERSISTENT        = 1 << 3, /*!< Grant only: on revoke the pages are zeroed and kept granted to the remote domain
+                                                     for reuse by a later grant of the same size on the same handle */
+    XENIFACE_GNTTAB_NO_SCRUB          = 1 << 4, /*!< Grant only: don't zero the pages on revoke. New grants always start with
+                                                     pages zeroed by the memory manager, pooled ones with what this handle left there */
+    XENIFACE_GNTTAB_DEFER_SCRUB       = 1 << 5, /*!< Grant only: zero the pages on a background worker after revoke instead of
+                                                     in the revoking thread. Ignored with XENIFACE_GNTTAB_NO_SCRUB */
+    XENIFACE_GNTTAB_CACHE_MAPPING     = 1 << 6, /*!< Map only: on unmap the pages stay mapped in the driver, and a later map of the
+                                                     same references by the same handle reuses that mapping. The remote domain
+                                                     cannot end access to cached pages until they are evicted, and the unmap
+                                                     notification of the last map is only sent then */
+    XENIFACE_GNTTAB_USE_HANDLE        = 1 << 7, /*!< The request completes right away instead of staying pending. The pages belong
+                                                     to the handle the request was made on until the revoke/unmap IOCTL for RequestId
+                                                     on that handle, until the handle is closed or until the process exits. Only the
+                                                     process that opened the handle may use this flag */
 } XENIFACE_GNTTAB_PAGE_FLAGS;
 
+/*! \brief Cache attribute of granted/mapped pages
+
+    The driver maps the pages into system space and into the caller with the
+    same attribute, as the memory manager doesn't allow conflicting mappings
+    of a page.
+*/
+typedef enum _XENIFACE_GNTTAB_CACHE_TYPE {
+    XENIFACE_GNTTAB_CACHED = 0,     /*!< Normal write-back memory */
+    XENIFACE_GNTTAB_WRITE_COMBINED, /*!< Writes are buffered and combined, reads are uncached. Suited to streaming
+                                         writes such as frame buffers */
+    XENIFACE_GNTTAB_UNCACHED,       /*!< Every access goes to memory, for device-style registers */
+    XENIFACE_GNTTAB_CACHE_TYPES
+} XENIFACE_GNTTAB_CACHE_TYPE;
+
 /*! \brief Grant permission to access local memory pages to a foreign domain
     \note This IOCTL must be asynchronous. The driver doesn't complete the request
           until the grant is explicitly revoked or the calling thread terminates.
@@ -260,6 +613,7 @@ typedef struct _XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS_IN {
     XENIFACE_GNTTAB_PAGE_FLAGS Flags;        /*!< Additional flags */
     ULONG                      NotifyOffset; /*!< Offset of a byte in the granted region that will be set to 0 when the grant is revoked */
     ULONG                      NotifyPort;   /*!< Local port number of an open event channel that will be notified when the grant is revoked */
+    XENIFACE_GNTTAB_CACHE_TYPE CacheType;    /*!< Cache attribute of the granted pages */
 } XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS_IN, *PXENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS_IN;
 
 /*! \brief Output for IOCTL_XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS */
@@ -301,6 +655,7 @@ typedef struct _XENIFACE_GNTTAB_MAP_FOREIGN_PAGES_IN {
     XENIFACE_GNTTAB_PAGE_FLAGS Flags;                     /*!< Additional flags */
     ULONG                      NotifyOffset;              /*!< Offset of a byte in the mapped region that will be set to 0 when the region is unmapped */
     ULONG                      NotifyPort;                /*!< Local port number of an open event channel that will be notified when the region is unmapped */
+    XENIFACE_GNTTAB_CACHE_TYPE CacheType;                 /*!< Cache attribute of the mapping */
     ULONG                      References[ANYSIZE_ARRAY]; /*!< An array of Xen-assigned references for each granted page */
 } XENIFACE_GNTTAB_MAP_FOREIGN_PAGES_IN, *PXENIFACE_GNTTAB_MAP_FOREIGN_PAGES_IN;
 
@@ -323,6 +678,91 @@ typedef struct _XENIFACE_GNTTAB_UNMAP_FOREIGN_PAGES_IN {
     ULONG RequestId; /*! Request ID used in the corresponding IOCTL_XENIFACE_GNTTAB_MAP_FOREIGN_PAGES call */
 } XENIFACE_GNTTAB_UNMAP_FOREIGN_PAGES_IN, *PXENIFACE_GNTTAB_UNMAP_FOREIGN_PAGES_IN;
 
+/*! \brief Copy data between local buffers and pages granted by foreign domains
+
+    Each segment is copied between a local user-mode buffer and a part of one
+    granted foreign page, without mapping anything into the caller. The driver
+    locks all local buffers once for the batch and maps runs of consecutive
+    segments that share a domain and direction with a single grant operation.
+    A failed segment does not stop the remaining ones; its entry in the output
+    Status array is set instead.
+
+    Input: XENIFACE_GNTTAB_COPY_IN
+
+    Output: XENIFACE_GNTTAB_COPY_OUT
+*/
+#define IOCTL_XENIFACE_GNTTAB_COPY \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x824, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*! \brief Maximum number of segments for IOCTL_XENIFACE_GNTTAB_COPY */
+#define XENIFACE_GNTTAB_COPY_MAX 1024
+
+/*! \brief Direction of a IOCTL_XENIFACE_GNTTAB_COPY segment */
+typedef enum _XENIFACE_GNTTAB_COPY_DIRECTION {
+    XENIFACE_GNTTAB_COPY_TO_REMOTE = 0, /*!< Copy from the local buffer to the foreign page */
+    XENIFACE_GNTTAB_COPY_FROM_REMOTE    /*!< Copy from the foreign page to the local buffer */
+} XENIFACE_GNTTAB_COPY_DIRECTION;
+
+/*! \brief One segment of IOCTL_XENIFACE_GNTTAB_COPY */
+typedef struct _XENIFACE_GNTTAB_COPY_SEGMENT {
+    PVOID                          Buffer;       /*!< Local user-mode buffer */
+    USHORT                         RemoteDomain; /*!< Domain that granted the foreign page */
+    ULONG                          Reference;    /*!< Grant reference of the foreign page */
+    ULONG                          Offset;       /*!< Offset in the foreign page */
+    ULONG                          Length;       /*!< Number of bytes to copy, Offset + Length must not exceed a page */
+    XENIFACE_GNTTAB_COPY_DIRECTION Direction;    /*!< Copy direction */
+} XENIFACE_GNTTAB_COPY_SEGMENT, *PXENIFACE_GNTTAB_COPY_SEGMENT;
+
+/*! \brief Input for IOCTL_XENIFACE_GNTTAB_COPY */
+typedef struct _XENIFACE_GNTTAB_COPY_IN {
+    ULONG                        NumberSegments;           /*!< Number of entries in Segments */
+    XENIFACE_GNTTAB_COPY_SEGMENT Segments[ANYSIZE_ARRAY];  /*!< Segments to copy */
+} XENIFACE_GNTTAB_COPY_IN, *PXENIFACE_GNTTAB_COPY_IN;
+
+/*! \brief Output for IOCTL_XENIFACE_GNTTAB_COPY */
+typedef struct _XENIFACE_GNTTAB_COPY_OUT {
+    ULONG NumberSegments;             /*!< Number of entries in Status */
+    LONG  Status[ANYSIZE_ARRAY];      /*!< NTSTATUS of each segment, in input order */
+} XENIFACE_GNTTAB_COPY_OUT, *PXENIFACE_GNTTAB_COPY_OUT;
+
+/*! \brief Set the size of the foreign mapping cache of this handle
+
+    Mappings kept for XENIFACE_GNTTAB_CACHE_MAPPING requests made on this
+    handle are evicted, least recently used first, while their total size
+    exceeds the budget. A budget of 0 disables the cache. Each handle starts
+    with a budget of 64MB.
+
+    Input: XENIFACE_GNTTAB_SET_MAP_CACHE_BUDGET_IN
+
+    Output: None
+*/
+#define IOCTL_XENIFACE_GNTTAB_SET_MAP_CACHE_BUDGET \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x825, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*! \brief Input for IOCTL_XENIFACE_GNTTAB_SET_MAP_CACHE_BUDGET */
+typedef struct _XENIFACE_GNTTAB_SET_MAP_CACHE_BUDGET_IN {
+    ULONG64 Budget; /*!< Maximum number of bytes kept mapped */
+} XENIFACE_GNTTAB_SET_MAP_CACHE_BUDGET_IN, *PXENIFACE_GNTTAB_SET_MAP_CACHE_BUDGET_IN;
+
+/*! \brief Query the state of the foreign mapping cache of this handle
+
+    Input: None
+
+    Output: XENIFACE_GNTTAB_MAP_CACHE_STATS
+*/
+#define IOCTL_XENIFACE_GNTTAB_QUERY_MAP_CACHE \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x826, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*! \brief Output for IOCTL_XENIFACE_GNTTAB_QUERY_MAP_CACHE */
+typedef struct _XENIFACE_GNTTAB_MAP_CACHE_STATS {
+    ULONG64 Budget;    /*!< Maximum number of bytes kept mapped */
+    ULONG64 Bytes;     /*!< Number of bytes currently cached */
+    ULONG64 Entries;   /*!< Number of mappings currently cached */
+    ULONG64 Hits;      /*!< Number of XENIFACE_GNTTAB_CACHE_MAPPING maps that reused a cached mapping */
+    ULONG64 Misses;    /*!< Number of XENIFACE_GNTTAB_CACHE_MAPPING maps that had to map the pages */
+    ULONG64 Evictions; /*!< Number of mappings dropped to stay within the budget */
+} XENIFACE_GNTTAB_MAP_CACHE_STATS, *PXENIFACE_GNTTAB_MAP_CACHE_STATS;
+
 /*! \brief Gets the current suspend count.
 
     Input: None
@@ -384,4 +824,31 @@ typedef struct _XENIFACE_SUSPEND_REGISTER_OUT {
 */
 #define XENIFACE_LOG_MAX_LENGTH         256
 
+/*! \brief Maximum number of lists reported by IOCTL_XENIFACE_QUERY_CACHE_STATS */
+#define XENIFACE_CACHE_STATS_MAX 8
+
+/*! \brief Counters of one context lookaside list */
+typedef struct _XENIFACE_CACHE_STATS {
+    CHAR    Name[16];    /*!< NUL-terminated name of the list */
+    ULONG64 Allocations; /*!< Number of contexts handed out */
+    ULONG64 Misses;      /*!< Number of allocations that were not satisfied from the list */
+    ULONG64 Frees;       /*!< Number of contexts given back */
+    ULONG   Depth;       /*!< Current maximum number of contexts kept in the list */
+} XENIFACE_CACHE_STATS, *PXENIFACE_CACHE_STATS;
+
+/*! \brief Query hit and miss counts of the driver's context lookaside lists
+
+    Input: None
+
+    Output: XENIFACE_CACHE_STATS_OUT
+*/
+#define IOCTL_XENIFACE_QUERY_CACHE_STATS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x84E, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*! \brief Output for IOCTL_XENIFACE_QUERY_CACHE_STATS */
+typedef struct _XENIFACE_CACHE_STATS_OUT {
+    ULONG                NumberCaches;                     /*!< Number of valid entries in Caches */
+    XENIFACE_CACHE_STATS Caches[XENIFACE_CACHE_STATS_MAX]; /*!< Counters of each list */
+} XENIFACE_CACHE_STATS_OUT, *PXENIFACE_CACHE_STATS_OUT;
+
 #endif // _XENIFACE_IOCTLS_H_
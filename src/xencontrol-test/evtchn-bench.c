@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "evtchn-bench.h"
+
+// notifications answered before sampling starts
+#define BENCH_WARMUP(iterations) ((iterations) / 10 + 1)
+// a round trip that takes longer than this is treated as a lost event
+#define BENCH_TIMEOUT_MS 5000
+
+// Loopback stand-in: channel i uses ports 2i+1 (ping) and 2i+2 (pong).
+typedef struct _BENCH_LOOPBACK {
+    BENCH_ENDPOINT *Endpoints[2 * BENCH_CONCURRENCY_MAX + 1];
+} BENCH_LOOPBACK;
+
+static BENCH_LOOPBACK BenchLoopback;
+
+static DWORD LoopbackConnect(BENCH_BACKEND *backend, ULONG index, BENCH_CHANNEL *channel)
+{
+    BENCH_LOOPBACK *loopback = backend->Context;
+    DWORD status;
+
+    if (index >= BENCH_CONCURRENCY_MAX)
+        return ERROR_INVALID_PARAMETER;
+
+    status = PortableEventInitialize(&channel->Ping.Event);
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    status = PortableEventInitialize(&channel->Pong.Event);
+    if (status != ERROR_SUCCESS) {
+        PortableEventTeardown(&channel->Ping.Event);
+        return status;
+    }
+
+    channel->Ping.Port = 2 * index + 1;
+    channel->Pong.Port = 2 * index + 2;
+    channel->Local = TRUE;
+    loopback->Endpoints[channel->Ping.Port] = &channel->Ping;
+    loopback->Endpoints[channel->Pong.Port] = &channel->Pong;
+    return ERROR_SUCCESS;
+}
+
+static DWORD LoopbackNotify(BENCH_BACKEND *backend, BENCH_ENDPOINT *endpoint)
+{
+    BENCH_LOOPBACK *loopback = backend->Context;
+    ULONG peer = (endpoint->Port & 1) ? endpoint->Port + 1 : endpoint->Port - 1;
+
+    PortableEventSet(&loopback->Endpoints[peer]->Event);
+    return ERROR_SUCCESS;
+}
+
+static void LoopbackDisconnect(BENCH_BACKEND *backend, BENCH_CHANNEL *channel)
+{
+    BENCH_LOOPBACK *loopback = backend->Context;
+
+    loopback->Endpoints[channel->Ping.Port] = NULL;
+    loopback->Endpoints[channel->Pong.Port] = NULL;
+    PortableEventTeardown(&channel->Pong.Event);
+    PortableEventTeardown(&channel->Ping.Event);
+}
+
+void BenchLoopbackBackend(BENCH_BACKEND *backend)
+{
+    backend->Name = L"loopback";
+    backend->Context = &BenchLoopback;
+    backend->Connect = LoopbackConnect;
+    backend->Notify = LoopbackNotify;
+    backend->Disconnect = LoopbackDisconnect;
+}
+
+typedef struct _BENCH_WORKER {
+    BENCH_BACKEND *Backend;
+    BENCH_ENDPOINT *Endpoint;
+    ULONG Iterations;
+    ULONG64 *Samples; // ping side only, in ns
+    ULONG64 Start;
+    ULONG64 End;
+    volatile BOOL *Stop; // echo side only
+    DWORD Status;
+} BENCH_WORKER;
+
+static PORTABLE_THREAD_PROC PingThreadProc(PVOID context)
+{
+    BENCH_WORKER *worker = context;
+    ULONG warmup = BENCH_WARMUP(worker->Iterations);
+    ULONG i;
+    ULONG64 t0;
+
+    for (i = 0; i < warmup + worker->Iterations; i++) {
+        if (i == warmup)
+            worker->Start = PortableNow();
+
+        t0 = PortableNow();
+        worker->Status = worker->Backend->Notify(worker->Backend, worker->Endpoint);
+        if (worker->Status != ERROR_SUCCESS)
+            break;
+
+        worker->Status = PortableEventWait(&worker->Endpoint->Event, BENCH_TIMEOUT_MS);
+        if (worker->Status != ERROR_SUCCESS)
+            break;
+
+        if (i >= warmup)
+            worker->Samples[i - warmup] = PortableNow() - t0;
+    }
+    worker->End = PortableNow();
+    return 0;
+}
+
+static PORTABLE_THREAD_PROC PongThreadProc(PVOID context)
+{
+    BENCH_WORKER *worker = context;
+    ULONG i;
+
+    for (i = 0; i < BENCH_WARMUP(worker->Iterations) + worker->Iterations; i++) {
+        worker->Status = PortableEventWait(&worker->Endpoint->Event, BENCH_TIMEOUT_MS);
+        if (worker->Status != ERROR_SUCCESS)
+            break;
+
+        worker->Status = worker->Backend->Notify(worker->Backend, worker->Endpoint);
+        if (worker->Status != ERROR_SUCCESS)
+            break;
+    }
+    return 0;
+}
+
+static PORTABLE_THREAD_PROC EchoThreadProc(PVOID context)
+{
+    BENCH_WORKER *worker = context;
+
+    while (!*worker->Stop) {
+        // poll the stop flag every so often
+        worker->Status = PortableEventWait(&worker->Endpoint->Event, 100);
+        if (worker->Status == ERROR_TIMEOUT)
+            continue;
+        if (worker->Status != ERROR_SUCCESS)
+            break;
+
+        worker->Status = worker->Backend->Notify(worker->Backend, worker->Endpoint);
+        if (worker->Status != ERROR_SUCCESS)
+            break;
+    }
+    return 0;
+}
+
+static int CompareSamples(const void *a, const void *b)
+{
+    ULONG64 x = *(const ULONG64 *)a;
+    ULONG64 y = *(const ULONG64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// nearest-rank percentile of sorted samples, in microseconds
+static double Percentile(const ULONG64 *samples, ULONG64 count, double p)
+{
+    ULONG64 rank = (ULONG64)(p * count + 0.999999);
+
+    if (rank == 0)
+        rank = 1;
+    return samples[rank - 1] / 1000.0;
+}
+
+static DWORD BenchLevel(BENCH_BACKEND *backend, ULONG concurrency, ULONG iterations, ULONG64 *samples)
+{
+    BENCH_CHANNEL channels[BENCH_CONCURRENCY_MAX];
+    BENCH_WORKER ping[BENCH_CONCURRENCY_MAX], pong[BENCH_CONCURRENCY_MAX];
+    PORTABLE_THREAD pingThreads[BENCH_CONCURRENCY_MAX], pongThreads[BENCH_CONCURRENCY_MAX];
+    ULONG connected, pingStarted, pongStarted, i;
+    ULONG64 start, end, count;
+    DWORD status;
+
+    memset(channels, 0, sizeof(channels));
+    memset(ping, 0, sizeof(ping));
+    memset(pong, 0, sizeof(pong));
+    connected = pingStarted = pongStarted = 0;
+
+    for (i = 0; i < concurrency; i++) {
+        status = backend->Connect(backend, i, &channels[i]);
+        if (status != ERROR_SUCCESS) {
+            wprintf(L"[!] %ls: connecting channel %u failed: 0x%x\n", backend->Name, (unsigned)i, (unsigned)status);
+            goto out;
+        }
+        connected++;
+    }
+
+    for (i = 0; i < concurrency; i++) {
+        if (!channels[i].Local)
+            continue;
+
+        pong[i].Backend = backend;
+        pong[i].Endpoint = &channels[i].Pong;
+        pong[i].Iterations = iterations;
+        status = PortableThreadStart(&pongThreads[i], PongThreadProc, &pong[i]);
+        if (status != ERROR_SUCCESS)
+            goto out;
+        pongStarted = i + 1;
+    }
+
+    for (i = 0; i < concurrency; i++) {
+        ping[i].Backend = backend;
+        ping[i].Endpoint = &channels[i].Ping;
+        ping[i].Iterations = iterations;
+        ping[i].Samples = samples + (ULONG64)i * iterations;
+        status = PortableThreadStart(&pingThreads[i], PingThreadProc, &ping[i]);
+        if (status != ERROR_SUCCESS)
+            goto out;
+        pingStarted = i + 1;
+    }
+
+out:
+    for (i = 0; i < pingStarted; i++)
+        PortableThreadJoin(pingThreads[i]);
+
+    for (i = 0; i < pongStarted; i++) {
+        if (channels[i].Local)
+            PortableThreadJoin(pongThreads[i]);
+    }
+
+    for (i = 0; i < connected; i++)
+        backend->Disconnect(backend, &channels[i]);
+
+    if (pingStarted < concurrency) {
+        if (connected == concurrency)
+            wprintf(L"[!] %ls: starting worker threads failed: 0x%x\n", backend->Name, (unsigned)status);
+        return status;
+    }
+
+    start = ping[0].Start;
+    end = ping[0].End;
+    for (i = 0; i < concurrency; i++) {
+        if (ping[i].Status != ERROR_SUCCESS) {
+            wprintf(L"[!] %ls: channel %u failed: 0x%x\n", backend->Name, (unsigned)i, (unsigned)ping[i].Status);
+            return ping[i].Status;
+        }
+        if (ping[i].Start < start)
+            start = ping[i].Start;
+        if (ping[i].End > end)
+            end = ping[i].End;
+    }
+
+    count = (ULONG64)concurrency * iterations;
+    qsort(samples, (size_t)count, sizeof(samples[0]), CompareSamples);
+
+    // every round trip is two notifications
+    wprintf(L"[*] %4u %10.2f %10.2f %10.2f %10.2f %10.2f %12.0f\n",
+            (unsigned)concurrency,
+            samples[0] / 1000.0,
+            Percentile(samples, count, 0.50),
+            Percentile(samples, count, 0.99),
+            Percentile(samples, count, 0.999),
+            samples[count - 1] / 1000.0,
+            2.0 * count * 1000000000.0 / (double)(end - start));
+
+    return ERROR_SUCCESS;
+}
+
+DWORD BenchRun(BENCH_BACKEND *backend, ULONG maxConcurrency, ULONG iterations)
+{
+    ULONG64 *samples;
+    ULONG concurrency;
+    DWORD status = ERROR_SUCCESS;
+
+    if (maxConcurrency == 0 || maxConcurrency > BENCH_CONCURRENCY_MAX || iterations == 0)
+        return ERROR_INVALID_PARAMETER;
+
+    samples = malloc(sizeof(ULONG64) * maxConcurrency * iterations);
+    if (!samples)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    wprintf(L"[*] %ls: %u round trips per channel, latency in us\n", backend->Name, (unsigned)iterations);
+    wprintf(L"[*] %4ls %10ls %10ls %10ls %10ls %10ls %12ls\n",
+            L"chan", L"min", L"p50", L"p99", L"p99.9", L"max", L"events/s");
+
+    for (concurrency = 1; concurrency <= maxConcurrency; concurrency *= 2) {
+        status = BenchLevel(backend, concurrency, iterations, samples);
+        if (status != ERROR_SUCCESS)
+            break;
+    }
+
+    free(samples);
+    return status;
+}
+
+DWORD BenchEcho(BENCH_BACKEND *backend, ULONG count, BENCH_ENDPOINT *endpoints, volatile BOOL *stop)
+{
+    BENCH_WORKER echo[BENCH_CONCURRENCY_MAX];
+    PORTABLE_THREAD threads[BENCH_CONCURRENCY_MAX];
+    ULONG started, i;
+    DWORD status = ERROR_SUCCESS;
+
+    if (count > BENCH_CONCURRENCY_MAX)
+        return ERROR_INVALID_PARAMETER;
+
+    memset(echo, 0, sizeof(echo));
+    for (started = 0; started < count; started++) {
+        echo[started].Backend = backend;
+        echo[started].Endpoint = &endpoints[started];
+        echo[started].Stop = stop;
+        status = PortableThreadStart(&threads[started], EchoThreadProc, &echo[started]);
+        if (status != ERROR_SUCCESS) {
+            *stop = TRUE;
+            break;
+        }
+    }
+
+    for (i = 0; i < started; i++) {
+        PortableThreadJoin(threads[i]);
+        if (status == ERROR_SUCCESS && echo[i].Status != ERROR_SUCCESS && echo[i].Status != ERROR_TIMEOUT)
+            status = echo[i].Status;
+    }
+
+    return status;
+}
+
+#ifndef _WIN32
+// Host build: only the loopback stand-in is available.
+int main(int argc, char *argv[])
+{
+    BENCH_BACKEND backend;
+    ULONG channels = argc < 2 ? 8 : (ULONG)atoi(argv[1]);
+    ULONG iterations = argc < 3 ? 100000 : (ULONG)atoi(argv[2]);
+
+    BenchLoopbackBackend(&backend);
+    return BenchRun(&backend, channels, iterations) == ERROR_SUCCESS ? 0 : 1;
+}
+#endif
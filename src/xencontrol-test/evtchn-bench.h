@@ -0,0 +1,53 @@
+#pragma once
+#include <wchar.h>
+
+// Event channel ping-pong latency benchmark.
+//
+// The harness only talks to event channels through BENCH_BACKEND, so the same
+// measurement code runs against xeniface (Windows) and against an in-process
+// loopback stand-in that builds on any host with pthreads:
+//
+//     cc -O2 -pthread -I../../include -o evtchn-bench evtchn-bench.c
+
+#include "../xencontrol/xencontrol_portable.h"
+
+#define BENCH_CONCURRENCY_MAX 64
+
+typedef struct _BENCH_ENDPOINT {
+    ULONG Port;
+    PORTABLE_EVENT Event; // signaled by the backend when the port fires
+} BENCH_ENDPOINT;
+
+// One channel under test. Pong is only used when both ends live in this
+// process; against a remote peer the other domain runs the echo loop.
+typedef struct _BENCH_CHANNEL {
+    BENCH_ENDPOINT Ping;
+    BENCH_ENDPOINT Pong;
+    BOOL Local;
+} BENCH_CHANNEL;
+
+typedef struct _BENCH_BACKEND BENCH_BACKEND;
+
+struct _BENCH_BACKEND {
+    const wchar_t *Name;
+    PVOID Context;
+    // Set up channel Index (ports and events).
+    DWORD (*Connect)(BENCH_BACKEND *Backend, ULONG Index, BENCH_CHANNEL *Channel);
+    DWORD (*Notify)(BENCH_BACKEND *Backend, BENCH_ENDPOINT *Endpoint);
+    void (*Disconnect)(BENCH_BACKEND *Backend, BENCH_CHANNEL *Channel);
+};
+
+// In-process stand-in for the evtchn interface: a notify on one end of a
+// channel signals the event of the other end.
+void
+BenchLoopbackBackend(BENCH_BACKEND *backend);
+
+// Run the benchmark at concurrency levels 1, 2, 4 ... maxConcurrency with
+// the given number of round trips per channel and print latency percentiles
+// and event rates for each level.
+DWORD
+BenchRun(BENCH_BACKEND *backend, ULONG maxConcurrency, ULONG iterations);
+
+// Answer every notification on the given endpoints until *stop is set.
+DWORD
+BenchEcho(BENCH_BACKEND *backend, ULONG count, BENCH_ENDPOINT *endpoints, volatile BOOL *stop);
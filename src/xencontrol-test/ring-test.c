@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "ring-test.h"
+#include "../xencontrol/xencontrol_portable.h"
+
+// a wait that takes longer than this is treated as a lost notification
+#define RING_TEST_TIMEOUT_MS 5000
+
+typedef struct _RING_TEST_WORKER {
+    PXC_RING Ring;
+    ULONG Messages;
+    ULONG MaxLength;
+    ULONG64 Bytes;
+    DWORD Status;
+} RING_TEST_WORKER;
+
+// Length of message seq: at least the sequence number, spread up to maxLength.
+static ULONG RingTestLength(ULONG64 seq, ULONG maxLength)
+{
+    return sizeof(ULONG64) + (ULONG)((seq * 2654435761u) % (maxLength - sizeof(ULONG64) + 1));
+}
+
+static PORTABLE_THREAD_PROC ProducerThreadProc(PVOID context)
+{
+    RING_TEST_WORKER *worker = context;
+    ULONG64 seq;
+    ULONG length;
+    PVOID buffer;
+
+    for (seq = 0; seq < worker->Messages; seq++) {
+        length = RingTestLength(seq, worker->MaxLength);
+
+        worker->Status = XcRingReserve(worker->Ring, length, &buffer);
+        if (worker->Status == ERROR_RETRY) {
+            worker->Status = XcRingWaitWritable(worker->Ring, length, RING_TEST_TIMEOUT_MS);
+            if (worker->Status != ERROR_SUCCESS)
+                break;
+
+            worker->Status = XcRingReserve(worker->Ring, length, &buffer);
+        }
+        if (worker->Status != ERROR_SUCCESS)
+            break;
+
+        memcpy(buffer, &seq, sizeof(seq));
+        memset((char *)buffer + sizeof(seq), (int)(seq & 0xff), length - sizeof(seq));
+        worker->Bytes += length;
+
+        worker->Status = XcRingCommit(worker->Ring);
+        if (worker->Status != ERROR_SUCCESS)
+            break;
+    }
+    return 0;
+}
+
+static PORTABLE_THREAD_PROC ConsumerThreadProc(PVOID context)
+{
+    RING_TEST_WORKER *worker = context;
+    ULONG64 seq, got;
+    ULONG length, i;
+    PVOID buffer;
+    const unsigned char *data;
+
+    for (seq = 0; seq < worker->Messages; seq++) {
+        worker->Status = XcRingPeek(worker->Ring, &buffer, &length);
+        while (worker->Status == ERROR_NO_DATA) {
+            worker->Status = XcRingWaitReadable(worker->Ring, RING_TEST_TIMEOUT_MS);
+            if (worker->Status != ERROR_SUCCESS)
+                break;
+
+            worker->Status = XcRingPeek(worker->Ring, &buffer, &length);
+        }
+        if (worker->Status != ERROR_SUCCESS)
+            break;
+
+        memcpy(&got, buffer, sizeof(got));
+        data = (const unsigned char *)buffer + sizeof(got);
+        worker->Status = ERROR_INVALID_DATA;
+        if (got != seq || length != RingTestLength(seq, worker->MaxLength)) {
+            wprintf(L"[!] message %llu: got %llu, %lu bytes\n",
+                    (unsigned long long)seq, (unsigned long long)got, (unsigned long)length);
+            break;
+        }
+        for (i = 0; i < length - sizeof(got); i++) {
+            if (data[i] != (unsigned char)(seq & 0xff))
+                break;
+        }
+        if (i != length - sizeof(got)) {
+            wprintf(L"[!] message %llu: corrupt at byte %lu\n", (unsigned long long)seq, (unsigned long)i);
+            break;
+        }
+        worker->Bytes += length;
+
+        worker->Status = XcRingRelease(worker->Ring);
+        if (worker->Status != ERROR_SUCCESS)
+            break;
+    }
+    return 0;
+}
+
+DWORD RingTestRun(const wchar_t *name, PXC_RING producer, PXC_RING consumer, ULONG messages, ULONG maxLength)
+{
+    RING_TEST_WORKER prod, cons;
+    PORTABLE_THREAD prodThread, consThread;
+    XC_RING_STATS prodStats, consStats;
+    ULONG64 start, end;
+    double seconds;
+    DWORD status;
+
+    if (messages == 0 || maxLength < sizeof(ULONG64) || maxLength > XcRingMaxLength(producer))
+        return ERROR_INVALID_PARAMETER;
+
+    memset(&prod, 0, sizeof(prod));
+    memset(&cons, 0, sizeof(cons));
+    prod.Ring = producer;
+    cons.Ring = consumer;
+    prod.Messages = cons.Messages = messages;
+    prod.MaxLength = cons.MaxLength = maxLength;
+
+    start = PortableNow();
+
+    status = PortableThreadStart(&consThread, ConsumerThreadProc, &cons);
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    status = PortableThreadStart(&prodThread, ProducerThreadProc, &prod);
+    if (status != ERROR_SUCCESS) {
+        // the consumer gives up after a timeout
+        PortableThreadJoin(consThread);
+        return status;
+    }
+
+    PortableThreadJoin(prodThread);
+    PortableThreadJoin(consThread);
+    end = PortableNow();
+
+    if (prod.Status != ERROR_SUCCESS) {
+        wprintf(L"[!] %ls: producer failed: 0x%x\n", name, (unsigned)prod.Status);
+        return prod.Status;
+    }
+    if (cons.Status != ERROR_SUCCESS) {
+        wprintf(L"[!] %ls: consumer failed: 0x%x\n", name, (unsigned)cons.Status);
+        return cons.Status;
+    }
+
+    XcRingQueryStats(producer, &prodStats);
+    XcRingQueryStats(consumer, &consStats);
+    seconds = (double)(end - start) / 1000000000.0;
+
+    wprintf(L"[*] %ls: %lu messages of up to %lu bytes, %.1f MB/s, %.0f messages/s\n",
+            name, (unsigned long)messages, (unsigned long)maxLength,
+            (double)cons.Bytes / seconds / (1024 * 1024), messages / seconds);
+    wprintf(L"[*] %ls: producer %llu notifies %llu waits, consumer %llu notifies %llu waits, %.4f notifies per message\n",
+            name,
+            (unsigned long long)prodStats.Notifies, (unsigned long long)prodStats.Waits,
+            (unsigned long long)consStats.Notifies, (unsigned long long)consStats.Waits,
+            (double)(prodStats.Notifies + consStats.Notifies) / messages);
+
+    return ERROR_SUCCESS;
+}
+
+static DWORD RingTestNoNotify(PVOID context)
+{
+    (void)context;
+    return ERROR_SUCCESS;
+}
+
+static DWORD RingTestNoWait(PVOID context, DWORD timeout)
+{
+    (void)context;
+    (void)timeout;
+    return ERROR_TIMEOUT;
+}
+
+// Play a hostile producer: lay out the header with cons at offset and prod
+// at offset + avail, put a record of the given length at offset and check
+// what the consumer's peek makes of it.
+static DWORD RingTestPeekForged(const wchar_t *name, ULONG offset, ULONG avail, ULONG length, DWORD expected)
+{
+    // order 0: a header page and one data page
+    static ULONG64 shared[XC_RING_PAGES(0) * XC_RING_PAGE_SIZE / sizeof(ULONG64)];
+    XC_RING_TRANSPORT transport = { NULL, RingTestNoNotify, RingTestNoWait, NULL };
+    PXC_RING_SHARED header = (PXC_RING_SHARED)shared;
+    PUCHAR data = (PUCHAR)shared + XC_RING_PAGE_SIZE;
+    PXC_RING_RECORD record = (PXC_RING_RECORD)(data + offset);
+    PXC_RING consumer;
+    PVOID buffer;
+    ULONG got;
+    DWORD status;
+
+    memset(shared, 0, sizeof(shared));
+    header->Magic = XC_RING_MAGIC;
+    header->Order = 0;
+    header->Cons = offset;
+    header->Prod = offset + avail;
+    record->Length = length;
+
+    status = XcRingOpen(shared, 0, FALSE, &transport, &consumer);
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"[!] hostile %ls: XcRingOpen failed: 0x%x\n", name, (unsigned)status);
+        return status;
+    }
+
+    status = XcRingPeek(consumer, &buffer, &got);
+    XcRingClose(consumer);
+
+    if (status != expected) {
+        wprintf(L"[!] hostile %ls: peek returned 0x%x, expected 0x%x\n", name, (unsigned)status, (unsigned)expected);
+        return ERROR_INVALID_DATA;
+    }
+    if (status == ERROR_SUCCESS &&
+        (PUCHAR)buffer + got > data + XC_RING_PAGE_SIZE) {
+        wprintf(L"[!] hostile %ls: record reaches past the data page\n", name);
+        return ERROR_INVALID_DATA;
+    }
+    return ERROR_SUCCESS;
+}
+
+DWORD RingTestHostile(void)
+{
+    const ULONG size = XC_RING_PAGE_SIZE;
+    const ULONG tail = size - 16;   // room for a header and 8 bytes before the end
+    DWORD status = ERROR_SUCCESS;
+
+    // sanity: well-formed records are accepted
+    status |= RingTestPeekForged(L"valid", 0, 64, 56, ERROR_SUCCESS);
+    status |= RingTestPeekForged(L"valid tail", tail, 16, 8, ERROR_SUCCESS);
+    status |= RingTestPeekForged(L"padding", tail, 16 + 64, XC_RING_PADDING | 16, ERROR_SUCCESS);
+    // prod more than a ring ahead of cons
+    status |= RingTestPeekForged(L"prod overrun", 0, size + 8, 56, ERROR_INVALID_DATA);
+    status |= RingTestPeekForged(L"prod behind", 64, (ULONG)-8, 56, ERROR_INVALID_DATA);
+    // record longer than what was published
+    status |= RingTestPeekForged(L"length past prod", 0, 64, 128, ERROR_INVALID_DATA);
+    // record running past the end of the data page, with prod covering it
+    status |= RingTestPeekForged(L"length past end", tail, 256, 128, ERROR_INVALID_DATA);
+    status |= RingTestPeekForged(L"length too large", 0, size, 0x7fffffff, ERROR_INVALID_DATA);
+    // padding that doesn't end exactly at the end of the data page
+    status |= RingTestPeekForged(L"short padding", tail, 256, XC_RING_PADDING | 8, ERROR_INVALID_DATA);
+    status |= RingTestPeekForged(L"padding past prod", tail, 8, XC_RING_PADDING | 16, ERROR_INVALID_DATA);
+
+    if (status == ERROR_SUCCESS)
+        wprintf(L"[*] hostile producer: all forged records handled\n");
+    return status == ERROR_SUCCESS ? ERROR_SUCCESS : ERROR_INVALID_DATA;
+}
+
+#ifndef _WIN32
+// Host build: only the in-process loopback is available.
+int main(int argc, char *argv[])
+{
+    PXC_RING producer, consumer;
+    ULONG order = argc < 2 ? 4 : (ULONG)atoi(argv[1]);
+    ULONG messages = argc < 3 ? 1000000 : (ULONG)atoi(argv[2]);
+    ULONG maxLength = argc < 4 ? 256 : (ULONG)atoi(argv[3]);
+    DWORD status;
+
+    status = RingTestHostile();
+    if (status != ERROR_SUCCESS)
+        return 1;
+
+    status = XcRingLoopbackCreate(order, &producer, &consumer);
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"[!] XcRingLoopbackCreate(%lu) failed: 0x%x\n", (unsigned long)order, (unsigned)status);
+        return 1;
+    }
+
+    status = RingTestRun(L"loopback", producer, consumer, messages, maxLength);
+
+    XcRingClose(consumer);
+    XcRingClose(producer);
+    return status == ERROR_SUCCESS ? 0 : 1;
+}
+#endif
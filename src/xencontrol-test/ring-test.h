@@ -0,0 +1,22 @@
+#pragma once
+
+// Two-thread exercise of the message ring in xencontrol_ring.h.
+//
+// One thread produces records of varying length, the other checks them in
+// order. The ring and its transport are set up by the caller, so the same
+// code runs against grants and an event channel (Windows) and against the
+// in-process loopback that builds on any host with pthreads:
+//
+//     cc -O2 -pthread -I../../include -o ring-test ring-test.c ../xencontrol/xencontrol_ring.c ../xencontrol/xencontrol_loopback.c
+
+#include "xencontrol_ring.h"
+
+// Send messages records of up to maxLength bytes from producer to consumer,
+// then print throughput and how many notifications and waits it took.
+DWORD
+RingTestRun(const wchar_t *name, PXC_RING producer, PXC_RING consumer, ULONG messages, ULONG maxLength);
+
+// Feed the consumer forged headers and records the way a hostile producer
+// could, and check that none of them gets past XcRingPeek.
+DWORD
+RingTestHostile(void);
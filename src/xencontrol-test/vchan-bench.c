@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "vchan-bench.h"
+#include "../xencontrol/xencontrol_portable.h"
+
+// The stream repeats a pattern whose period isn't a power of two, so it
+// never lines up with the ring and a misplaced byte can't go unnoticed.
+#define VCHAN_BENCH_PERIOD 65521
+
+typedef struct _VCHAN_BENCH_WORKER {
+    PXC_VCHAN Vchan;
+    const UCHAR *Pattern; // VCHAN_BENCH_PERIOD + Chunk bytes
+    UCHAR *Buffer;        // reader only, Chunk bytes
+    ULONG64 Bytes;
+    ULONG Chunk;
+    DWORD Status;
+} VCHAN_BENCH_WORKER;
+
+static PORTABLE_THREAD_PROC WriterThreadProc(PVOID context)
+{
+    VCHAN_BENCH_WORKER *worker = context;
+    ULONG64 offset = 0;
+    ULONG size, written;
+
+    while (offset < worker->Bytes) {
+        size = worker->Chunk;
+        if (size > worker->Bytes - offset)
+            size = (ULONG)(worker->Bytes - offset);
+
+        worker->Status = XcVchanWrite(worker->Vchan, worker->Pattern + offset % VCHAN_BENCH_PERIOD, size, &written);
+        if (worker->Status != ERROR_SUCCESS)
+            break;
+
+        offset += written;
+    }
+    return 0;
+}
+
+static PORTABLE_THREAD_PROC ReaderThreadProc(PVOID context)
+{
+    VCHAN_BENCH_WORKER *worker = context;
+    ULONG64 offset = 0;
+    ULONG read;
+
+    while (offset < worker->Bytes) {
+        worker->Status = XcVchanRead(worker->Vchan, worker->Buffer, worker->Chunk, &read);
+        if (worker->Status != ERROR_SUCCESS)
+            break;
+
+        if (memcmp(worker->Buffer, worker->Pattern + offset % VCHAN_BENCH_PERIOD, read) != 0) {
+            wprintf(L"[!] stream corrupt between offsets %llu and %llu\n",
+                    (unsigned long long)offset, (unsigned long long)(offset + read));
+            worker->Status = ERROR_INVALID_DATA;
+            break;
+        }
+
+        offset += read;
+    }
+    return 0;
+}
+
+DWORD VchanBenchRun(const wchar_t *name, PXC_VCHAN writer, PXC_VCHAN reader, ULONG megabytes, ULONG chunk)
+{
+    VCHAN_BENCH_WORKER w, r;
+    PORTABLE_THREAD writerThread, readerThread;
+    UCHAR *pattern;
+    ULONG64 start, end;
+    ULONG i;
+    DWORD status;
+
+    if (megabytes == 0 || chunk == 0)
+        return ERROR_INVALID_PARAMETER;
+
+    pattern = malloc(VCHAN_BENCH_PERIOD + chunk);
+    if (!pattern)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    for (i = 0; i < VCHAN_BENCH_PERIOD + chunk; i++)
+        pattern[i] = (UCHAR)((i % VCHAN_BENCH_PERIOD) * 2654435761u >> 24);
+
+    memset(&w, 0, sizeof(w));
+    memset(&r, 0, sizeof(r));
+    w.Vchan = writer;
+    r.Vchan = reader;
+    w.Pattern = r.Pattern = pattern;
+    w.Bytes = r.Bytes = (ULONG64)megabytes * 1024 * 1024;
+    w.Chunk = r.Chunk = chunk;
+
+    status = ERROR_NOT_ENOUGH_MEMORY;
+    r.Buffer = malloc(chunk);
+    if (!r.Buffer)
+        goto out;
+
+    start = PortableNow();
+
+    status = PortableThreadStart(&readerThread, ReaderThreadProc, &r);
+    if (status != ERROR_SUCCESS)
+        goto out;
+
+    status = PortableThreadStart(&writerThread, WriterThreadProc, &w);
+    if (status != ERROR_SUCCESS) {
+        // closing the writer end lets the reader see a broken pipe
+        XcVchanClose(writer);
+        PortableThreadJoin(readerThread);
+        goto out;
+    }
+
+    PortableThreadJoin(writerThread);
+    PortableThreadJoin(readerThread);
+    end = PortableNow();
+
+    status = w.Status != ERROR_SUCCESS ? w.Status : r.Status;
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"[!] %ls: %ls failed: 0x%x\n", name, w.Status != ERROR_SUCCESS ? L"writer" : L"reader", (unsigned)status);
+        goto out;
+    }
+
+    wprintf(L"[*] %ls: %lu MB in writes of %lu bytes, %.1f MB/s\n",
+            name, (unsigned long)megabytes, (unsigned long)chunk,
+            (double)megabytes * 1000000000.0 / (double)(end - start));
+
+out:
+    free(r.Buffer);
+    free(pattern);
+    return status;
+}
+
+#ifndef _WIN32
+// Host build: only the in-process loopback is available. Without an order,
+// sweep ring sizes from 1KB to the largest one.
+int main(int argc, char *argv[])
+{
+    static const ULONG orders[] = { 10, 11, 12, 14, 16, 18, XC_VCHAN_ORDER_MAX };
+    PXC_VCHAN server, client;
+    ULONG first = argc < 2 ? 0 : (ULONG)(sizeof(orders) / sizeof(orders[0]) - 1);
+    ULONG megabytes = argc < 3 ? 1024 : (ULONG)atoi(argv[2]);
+    ULONG chunk = argc < 4 ? 65536 : (ULONG)atoi(argv[3]);
+    ULONG i, order;
+    wchar_t name[32];
+    DWORD status = ERROR_SUCCESS;
+
+    for (i = first; i < sizeof(orders) / sizeof(orders[0]); i++) {
+        order = argc < 2 ? orders[i] : (ULONG)atoi(argv[1]);
+
+        // the client writes the left ring; the right one is unused here
+        status = XcVchanLoopbackCreate(order, order == XC_VCHAN_LARGE_ORDER ? XC_VCHAN_SMALL_ORDER : XC_VCHAN_LARGE_ORDER,
+                                       &server, &client);
+        if (status != ERROR_SUCCESS) {
+            wprintf(L"[!] XcVchanLoopbackCreate(%lu) failed: 0x%x\n", (unsigned long)order, (unsigned)status);
+            return 1;
+        }
+
+        swprintf(name, sizeof(name) / sizeof(name[0]), L"loopback %luKB", (unsigned long)(1UL << order) / 1024);
+        status = VchanBenchRun(name, client, server, megabytes, chunk);
+
+        XcVchanClose(client);
+        XcVchanClose(server);
+        if (status != ERROR_SUCCESS)
+            break;
+    }
+
+    return status == ERROR_SUCCESS ? 0 : 1;
+}
+#endif
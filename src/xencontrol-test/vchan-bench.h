@@ -0,0 +1,17 @@
+#pragma once
+
+// Vchan stream throughput benchmark.
+//
+// A writer thread streams a pattern through one end of a vchan and a reader
+// thread checks it on the other. The vchan is set up by the caller, so the
+// same code runs against grants and an event channel (Windows) and against
+// the in-process loopback that builds on any host with pthreads:
+//
+//     cc -O2 -pthread -I../../include -o vchan-bench vchan-bench.c ../xencontrol/xencontrol_vchan.c ../xencontrol/xencontrol_loopback.c
+
+#include "xencontrol_vchan.h"
+
+// Stream megabytes MB from writer to reader in writes of up to chunk bytes
+// and print the throughput.
+DWORD
+VchanBenchRun(const wchar_t *name, PXC_VCHAN writer, PXC_VCHAN reader, ULONG megabytes, ULONG chunk);
@@ -5,6 +5,9 @@
 
 #include "xencontrol.h"
 #include "crc64.h"
+#include "evtchn-bench.h"
+#include "ring-test.h"
+#include "vchan-bench.h"
 
 #define PAGES_MIN 1
 #define PAGES_MAX 64
@@ -195,6 +198,555 @@ void Usage(WCHAR *exe)
     wprintf(L"Usage:\n");
     wprintf(L"server: %s server <remote domain id> [number of loops]\n", exe);
     wprintf(L"client: %s <remote domain id> <shared page ref> [number of loops]\n", exe);
+    wprintf(L"cleanup timing: %s cleanup <remote domain id> [max number of channels]\n", exe);
+    wprintf(L"evtchn latency: %s bench <local|loopback|remote domain id> [max number of channels] [round trips]\n", exe);
+    wprintf(L"evtchn latency peer: %s echo <remote domain id> [number of channels]\n", exe);
+    wprintf(L"grant write bandwidth: %s write <local|remote domain id> [number of pages] [rounds]\n", exe);
+    wprintf(L"message ring: %s ring <local|loopback> [order] [number of messages]\n", exe);
+    wprintf(L"vchan throughput: %s vchan <local|loopback> [order] [megabytes]\n", exe);
+}
+
+// Measure how long closing a handle takes against the number of event channels open on it.
+DWORD CleanupTest(IN USHORT remoteDomain, IN ULONG maxChannels)
+{
+    PXENCONTROL_CONTEXT xc;
+    ULONG channels, i, localPort;
+    LARGE_INTEGER freq, start, end;
+    DWORD status;
+
+    QueryPerformanceFrequency(&freq);
+
+    wprintf(L"[*] %8s %12s %14s\n", L"channels", L"cleanup us", L"us/channel");
+    for (channels = 1; channels <= maxChannels; channels *= 2) {
+        status = XcOpen(XcLogger, &xc);
+        if (status != ERROR_SUCCESS) {
+            wprintf(L"[!] Error opening xen interface device: 0x%x\n", status);
+            return status;
+        }
+
+        XcSetLogLevel(xc, XLL_ERROR);
+
+        for (i = 0; i < channels; i++) {
+            status = XcEvtchnBindUnbound(xc, remoteDomain, NULL, TRUE, &localPort);
+            if (status != ERROR_SUCCESS) {
+                wprintf(L"[!] XcEvtchnBindUnbound(%u) failed after %lu channels: 0x%x\n",
+                        remoteDomain, i, status);
+                XcClose(xc);
+                return status;
+            }
+        }
+
+        // closing the handle tears down all channels in the driver
+        QueryPerformanceCounter(&start);
+        XcClose(xc);
+        QueryPerformanceCounter(&end);
+
+        end.QuadPart = (end.QuadPart - start.QuadPart) * 1000000 / freq.QuadPart;
+        wprintf(L"[*] %8lu %12llu %14.2f\n", channels, end.QuadPart, (double)end.QuadPart / channels);
+    }
+
+    return ERROR_SUCCESS;
+}
+
+#define BENCH_STORE_KEY "data/xifbench"
+
+// xeniface backend for the event channel benchmark
+typedef struct _XC_BENCH {
+    PXENCONTROL_CONTEXT Xc;
+    USHORT LocalDomain;
+    USHORT RemoteDomain;
+    ULONG NumberPorts; // ports published by the echo peer, 0 for local loopback channels
+    ULONG RemotePorts[BENCH_CONCURRENCY_MAX];
+} XC_BENCH;
+
+static DWORD XcBenchConnect(BENCH_BACKEND *backend, ULONG index, BENCH_CHANNEL *channel)
+{
+    XC_BENCH *bench = backend->Context;
+    DWORD status;
+
+    if (bench->NumberPorts != 0 && index >= bench->NumberPorts)
+        return ERROR_INVALID_PARAMETER;
+
+    status = PortableEventInitialize(&channel->Ping.Event);
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    if (bench->NumberPorts != 0) {
+        // the other end belongs to the echo peer
+        channel->Local = FALSE;
+        status = XcEvtchnBindInterdomain(bench->Xc, bench->RemoteDomain, bench->RemotePorts[index],
+                                         channel->Ping.Event.Handle, FALSE, &channel->Ping.Port);
+        if (status != ERROR_SUCCESS)
+            PortableEventTeardown(&channel->Ping.Event);
+
+        return status;
+    }
+
+    // both ends in this domain
+    channel->Local = TRUE;
+    status = PortableEventInitialize(&channel->Pong.Event);
+    if (status != ERROR_SUCCESS)
+        goto fail1;
+
+    status = XcEvtchnBindUnbound(bench->Xc, bench->LocalDomain, channel->Pong.Event.Handle, FALSE, &channel->Pong.Port);
+    if (status != ERROR_SUCCESS)
+        goto fail2;
+
+    status = XcEvtchnBindInterdomain(bench->Xc, bench->LocalDomain, channel->Pong.Port,
+                                     channel->Ping.Event.Handle, FALSE, &channel->Ping.Port);
+    if (status != ERROR_SUCCESS)
+        goto fail3;
+
+    return ERROR_SUCCESS;
+
+fail3:
+    XcEvtchnClose(bench->Xc, channel->Pong.Port);
+fail2:
+    PortableEventTeardown(&channel->Pong.Event);
+fail1:
+    PortableEventTeardown(&channel->Ping.Event);
+    return status;
+}
+
+static DWORD XcBenchNotify(BENCH_BACKEND *backend, BENCH_ENDPOINT *endpoint)
+{
+    XC_BENCH *bench = backend->Context;
+
+    return XcEvtchnNotify(bench->Xc, endpoint->Port);
+}
+
+static void XcBenchDisconnect(BENCH_BACKEND *backend, BENCH_CHANNEL *channel)
+{
+    XC_BENCH *bench = backend->Context;
+
+    XcEvtchnClose(bench->Xc, channel->Ping.Port);
+    PortableEventTeardown(&channel->Ping.Event);
+
+    if (channel->Local) {
+        XcEvtchnClose(bench->Xc, channel->Pong.Port);
+        PortableEventTeardown(&channel->Pong.Event);
+    }
+}
+
+static DWORD XcBenchOpen(XC_BENCH *bench, BENCH_BACKEND *backend)
+{
+    CHAR value[16];
+    DWORD status;
+
+    status = XcOpen(XcLogger, &bench->Xc);
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"[!] Error opening xen interface device: 0x%x\n", status);
+        return status;
+    }
+
+    XcSetLogLevel(bench->Xc, XLL_ERROR);
+
+    status = XcStoreRead(bench->Xc, "domid", sizeof(value), value);
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"[!] XcStoreRead(domid) failed: 0x%x\n", status);
+        XcClose(bench->Xc);
+        return status;
+    }
+    bench->LocalDomain = (USHORT)atoi(value);
+
+    backend->Name = L"xeniface";
+    backend->Context = bench;
+    backend->Connect = XcBenchConnect;
+    backend->Notify = XcBenchNotify;
+    backend->Disconnect = XcBenchDisconnect;
+    return ERROR_SUCCESS;
+}
+
+// Round-trip notify latency, either between two local ports bound to this domain,
+// against the in-process stand-in, or against an echo peer in the remote domain.
+DWORD EvtchnBenchTest(IN const WCHAR *target, IN ULONG maxChannels, IN ULONG iterations)
+{
+    BENCH_BACKEND backend;
+    XC_BENCH bench = { 0 };
+    CHAR path[256], value[1024];
+    PCHAR next;
+    DWORD status;
+
+    if (_wcsicmp(target, L"loopback") == 0) {
+        BenchLoopbackBackend(&backend);
+        return BenchRun(&backend, maxChannels, iterations);
+    }
+
+    status = XcBenchOpen(&bench, &backend);
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    if (_wcsicmp(target, L"local") == 0) {
+        bench.RemoteDomain = bench.LocalDomain;
+    } else {
+        bench.RemoteDomain = (USHORT)_wtoi(target);
+
+        // the echo peer publishes its unbound ports
+        StringCbPrintfA(path, sizeof(path), "/local/domain/%d/" BENCH_STORE_KEY, bench.RemoteDomain);
+        status = XcStoreRead(bench.Xc, path, sizeof(value), value);
+        if (status != ERROR_SUCCESS) {
+            wprintf(L"[!] XcStoreRead(%S) failed: 0x%x (is the echo peer running?)\n", path, status);
+            goto out;
+        }
+
+        next = value;
+        while (bench.NumberPorts < BENCH_CONCURRENCY_MAX && *next != '\0') {
+            bench.RemotePorts[bench.NumberPorts++] = strtoul(next, &next, 10);
+            while (*next == ' ')
+                next++;
+        }
+
+        if (maxChannels > bench.NumberPorts)
+            maxChannels = bench.NumberPorts;
+    }
+
+    status = BenchRun(&backend, maxChannels, iterations);
+
+out:
+    XcClose(bench.Xc);
+    return status;
+}
+
+typedef struct _ECHO_CTX {
+    BENCH_BACKEND *Backend;
+    ULONG Count;
+    BENCH_ENDPOINT *Endpoints;
+    volatile BOOL Stop;
+    DWORD Status;
+} ECHO_CTX;
+
+DWORD WINAPI BenchEchoThreadProc(PVOID context)
+{
+    ECHO_CTX *ctx = (ECHO_CTX *)context;
+
+    ctx->Status = BenchEcho(ctx->Backend, ctx->Count, ctx->Endpoints, &ctx->Stop);
+    return 0;
+}
+
+// Peer side of the remote benchmark: answer notifications on unbound ports
+// offered to the remote domain.
+DWORD EvtchnEchoTest(IN USHORT remoteDomain, IN ULONG channels)
+{
+    BENCH_BACKEND backend;
+    XC_BENCH bench = { 0 };
+    BENCH_ENDPOINT endpoints[BENCH_CONCURRENCY_MAX];
+    XENIFACE_STORE_PERMISSION perms[2];
+    ECHO_CTX ctx;
+    CHAR value[1024];
+    size_t length;
+    HANDLE thread;
+    ULONG i, bound;
+    DWORD status;
+
+    if (channels == 0 || channels > BENCH_CONCURRENCY_MAX)
+        return ERROR_INVALID_PARAMETER;
+
+    status = XcBenchOpen(&bench, &backend);
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    value[0] = '\0';
+    for (bound = 0; bound < channels; bound++) {
+        status = PortableEventInitialize(&endpoints[bound].Event);
+        if (status != ERROR_SUCCESS)
+            goto out;
+
+        status = XcEvtchnBindUnbound(bench.Xc, remoteDomain, endpoints[bound].Event.Handle, FALSE, &endpoints[bound].Port);
+        if (status != ERROR_SUCCESS) {
+            wprintf(L"[!] XcEvtchnBindUnbound(%u) failed: 0x%x\n", remoteDomain, status);
+            PortableEventTeardown(&endpoints[bound].Event);
+            goto out;
+        }
+
+        StringCbLengthA(value, sizeof(value), &length);
+        StringCbPrintfA(value + length, sizeof(value) - length, "%s%lu", bound ? " " : "", endpoints[bound].Port);
+    }
+
+    perms[0].Domain = bench.LocalDomain; // our domain
+    perms[0].Mask = XENIFACE_STORE_PERM_NONE; // no permissions to others
+    perms[1].Domain = remoteDomain; // peer
+    perms[1].Mask = XENIFACE_STORE_PERM_READ;
+
+    status = XcStoreWrite(bench.Xc, BENCH_STORE_KEY, value);
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"[!] XcStoreWrite(%S, %S) failed: 0x%x\n", BENCH_STORE_KEY, value, status);
+        goto out;
+    }
+
+    status = XcStoreSetPermissions(bench.Xc, BENCH_STORE_KEY, 2, perms);
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"[!] XcStoreSetPermissions(%S) failed: 0x%x\n", BENCH_STORE_KEY, status);
+        goto remove;
+    }
+
+    ctx.Backend = &backend;
+    ctx.Count = channels;
+    ctx.Endpoints = endpoints;
+    ctx.Stop = FALSE;
+    ctx.Status = ERROR_SUCCESS;
+
+    thread = CreateThread(NULL, 0, BenchEchoThreadProc, &ctx, 0, NULL);
+    if (!thread) {
+        status = GetLastError();
+        wprintf(L"[!] CreateThread failed: 0x%x\n", status);
+        goto remove;
+    }
+
+    wprintf(L"[*] echoing on ports %S for domain %u\npress any key to exit\n", value, remoteDomain);
+    (void)getc(stdin);
+
+    ctx.Stop = TRUE;
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    status = ctx.Status;
+
+remove:
+    XcStoreRemove(bench.Xc, BENCH_STORE_KEY);
+out:
+    for (i = 0; i < bound; i++) {
+        XcEvtchnClose(bench.Xc, endpoints[i].Port);
+        PortableEventTeardown(&endpoints[i].Event);
+    }
+    XcClose(bench.Xc);
+    return status;
+}
+
+static const WCHAR *CacheTypeNames[XENIFACE_GNTTAB_CACHE_TYPES] = {
+    L"cached",
+    L"write-combined",
+    L"uncached",
+};
+
+// Sequential store bandwidth of a region in MB/s.
+static double WriteBandwidth(PVOID va, SIZE_T size, ULONG rounds)
+{
+    LARGE_INTEGER freq, start, end;
+    ULONG round;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    for (round = 0; round < rounds; round++)
+        memset(va, (int)round, size);
+    QueryPerformanceCounter(&end);
+
+    if (end.QuadPart == start.QuadPart)
+        return 0.0;
+
+    return (double)size * rounds * freq.QuadPart / (end.QuadPart - start.QuadPart) / (1024 * 1024);
+}
+
+// Compare streaming write bandwidth of granted pages, and of the same pages
+// mapped back into this domain, for each cache attribute.
+DWORD GnttabBandwidthTest(IN const WCHAR *target, IN ULONG numPages, IN ULONG rounds)
+{
+    PXENCONTROL_CONTEXT xc;
+    USHORT localDomain, remoteDomain;
+    ULONG cacheType;
+    PULONG refs;
+    PVOID granted, mapped;
+    CHAR value[16];
+    SIZE_T size = (SIZE_T)numPages * PAGE_SIZE;
+    double grantRate, mapRate;
+    BOOL local;
+    DWORD status;
+
+    if (numPages == 0 || rounds == 0)
+        return ERROR_INVALID_PARAMETER;
+
+    refs = malloc(numPages * sizeof(ULONG));
+    if (!refs)
+        return ERROR_OUTOFMEMORY;
+
+    status = XcOpen(XcLogger, &xc);
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"[!] Error opening xen interface device: 0x%x\n", status);
+        free(refs);
+        return status;
+    }
+
+    XcSetLogLevel(xc, XLL_ERROR);
+
+    status = XcStoreRead(xc, "domid", sizeof(value), value);
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"[!] XcStoreRead(domid) failed: 0x%x\n", status);
+        goto out;
+    }
+    localDomain = (USHORT)atoi(value);
+
+    // Pages granted to ourselves can also be mapped back, which measures the
+    // map path too. A remote domain only receives the grant.
+    local = _wcsicmp(target, L"local") == 0;
+    remoteDomain = local ? localDomain : (USHORT)_wtoi(target);
+
+    wprintf(L"[*] %lu pages granted to domain %u, %lu rounds\n", numPages, remoteDomain, rounds);
+    wprintf(L"[*] %-16s %12s %12s\n", L"cache type", L"grant MB/s", L"map MB/s");
+    for (cacheType = XENIFACE_GNTTAB_CACHED; cacheType < XENIFACE_GNTTAB_CACHE_TYPES; cacheType++) {
+        status = XcGnttabPermitForeignAccessEx(xc, remoteDomain, numPages, 0, 0, 0,
+                                               (XENIFACE_GNTTAB_CACHE_TYPE)cacheType, &granted, refs);
+        if (status != ERROR_SUCCESS) {
+            wprintf(L"[!] XcGnttabPermitForeignAccessEx(%s) failed: 0x%x\n", CacheTypeNames[cacheType], status);
+            goto out;
+        }
+
+        grantRate = WriteBandwidth(granted, size, rounds);
+
+        mapRate = 0.0;
+        if (local) {
+            status = XcGnttabMapForeignPagesEx(xc, localDomain, numPages, refs, 0, 0, 0,
+                                               (XENIFACE_GNTTAB_CACHE_TYPE)cacheType, &mapped);
+            if (status == ERROR_SUCCESS) {
+                mapRate = WriteBandwidth(mapped, size, rounds);
+                XcGnttabUnmapForeignPages(xc, mapped);
+            } else {
+                wprintf(L"[!] XcGnttabMapForeignPagesEx(%s) failed: 0x%x\n", CacheTypeNames[cacheType], status);
+            }
+        }
+
+        XcGnttabRevokeForeignAccess(xc, granted);
+        wprintf(L"[*] %-16s %12.1f %12.1f\n", CacheTypeNames[cacheType], grantRate, mapRate);
+    }
+
+    status = ERROR_SUCCESS;
+
+out:
+    XcClose(xc);
+    free(refs);
+    return status;
+}
+
+// Pass messages between two threads over a ring, either granted to and
+// mapped back into this domain, or in plain memory of this process.
+DWORD RingTest(IN const WCHAR *target, IN ULONG order, IN ULONG messages)
+{
+    PXENCONTROL_CONTEXT xc;
+    PXC_RING producer, consumer;
+    USHORT localDomain;
+    ULONG refs[XC_RING_PAGES(XC_RING_ORDER_MAX)];
+    ULONG port;
+    CHAR value[16];
+    DWORD status;
+
+    if (order > XC_RING_ORDER_MAX)
+        return ERROR_INVALID_PARAMETER;
+
+    status = RingTestHostile();
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    if (_wcsicmp(target, L"loopback") == 0) {
+        status = XcRingLoopbackCreate(order, &producer, &consumer);
+        if (status != ERROR_SUCCESS) {
+            wprintf(L"[!] XcRingLoopbackCreate failed: 0x%x\n", status);
+            return status;
+        }
+
+        status = RingTestRun(L"loopback", producer, consumer, messages, 256);
+        XcRingClose(consumer);
+        XcRingClose(producer);
+        return status;
+    }
+
+    status = XcOpen(XcLogger, &xc);
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"[!] Error opening xen interface device: 0x%x\n", status);
+        return status;
+    }
+
+    XcSetLogLevel(xc, XLL_ERROR);
+
+    status = XcStoreRead(xc, "domid", sizeof(value), value);
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"[!] XcStoreRead(domid) failed: 0x%x\n", status);
+        goto out;
+    }
+    localDomain = (USHORT)atoi(value);
+
+    status = XcRingCreate(xc, localDomain, order, &producer, refs, &port);
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"[!] XcRingCreate failed: 0x%x\n", status);
+        goto out;
+    }
+
+    status = XcRingAttach(xc, localDomain, order, refs, port, &consumer);
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"[!] XcRingAttach failed: 0x%x\n", status);
+        XcRingClose(producer);
+        goto out;
+    }
+
+    status = RingTestRun(L"local", producer, consumer, messages, 256);
+
+    XcRingClose(consumer);
+    XcRingClose(producer);
+
+out:
+    XcClose(xc);
+    return status;
+}
+
+// Stream data from a vchan client to its server, either over grants and an
+// event channel of this domain, or in plain memory of this process.
+DWORD VchanBenchTest(IN const WCHAR *target, IN ULONG order, IN ULONG megabytes)
+{
+    PXENCONTROL_CONTEXT xc;
+    PXC_VCHAN server, client;
+    USHORT localDomain;
+    CHAR path[256], value[16];
+    DWORD status;
+
+    if (_wcsicmp(target, L"loopback") == 0) {
+        // the client writes the left ring; the right one is unused here
+        status = XcVchanLoopbackCreate(order, order == XC_VCHAN_LARGE_ORDER ? XC_VCHAN_SMALL_ORDER : XC_VCHAN_LARGE_ORDER,
+                                       &server, &client);
+        if (status != ERROR_SUCCESS) {
+            wprintf(L"[!] XcVchanLoopbackCreate failed: 0x%x\n", status);
+            return status;
+        }
+
+        status = VchanBenchRun(L"loopback", client, server, megabytes, 65536);
+        XcVchanClose(client);
+        XcVchanClose(server);
+        return status;
+    }
+
+    status = XcOpen(XcLogger, &xc);
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"[!] Error opening xen interface device: 0x%x\n", status);
+        return status;
+    }
+
+    XcSetLogLevel(xc, XLL_ERROR);
+
+    status = XcStoreRead(xc, "domid", sizeof(value), value);
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"[!] XcStoreRead(domid) failed: 0x%x\n", status);
+        goto out;
+    }
+    localDomain = (USHORT)atoi(value);
+
+    StringCbPrintfA(path, sizeof(path), "/local/domain/%d/data/vchan-bench/%lu", localDomain, GetCurrentProcessId());
+
+    status = XcVchanServerInit(xc, localDomain, path, 1UL << order, 1024, &server);
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"[!] XcVchanServerInit failed: 0x%x\n", status);
+        goto out;
+    }
+
+    status = XcVchanClientInit(xc, localDomain, path, &client);
+    if (status != ERROR_SUCCESS) {
+        wprintf(L"[!] XcVchanClientInit failed: 0x%x\n", status);
+        XcVchanClose(server);
+        goto out;
+    }
+
+    status = VchanBenchRun(L"local", client, server, megabytes, 65536);
+
+    XcVchanClose(client);
+    XcVchanClose(server);
+
+out:
+    XcClose(xc);
+    return status;
 }
 
 int __cdecl wmain(int argc, WCHAR *argv[])
@@ -217,6 +769,36 @@ int __cdecl wmain(int argc, WCHAR *argv[])
         return 1;
     }
 
+    if (argv[1][0] == L'c') {
+        status = CleanupTest((USHORT)_wtoi(argv[2]), argc < 4 ? 2048 : _wtoi(argv[3]));
+        return status == ERROR_SUCCESS ? 0 : 1;
+    }
+
+    if (argv[1][0] == L'b') {
+        status = EvtchnBenchTest(argv[2], argc < 4 ? 8 : _wtoi(argv[3]), argc < 5 ? 100000 : _wtoi(argv[4]));
+        return status == ERROR_SUCCESS ? 0 : 1;
+    }
+
+    if (argv[1][0] == L'e') {
+        status = EvtchnEchoTest((USHORT)_wtoi(argv[2]), argc < 4 ? 8 : _wtoi(argv[3]));
+        return status == ERROR_SUCCESS ? 0 : 1;
+    }
+
+    if (argv[1][0] == L'w') {
+        status = GnttabBandwidthTest(argv[2], argc < 4 ? 256 : _wtoi(argv[3]), argc < 5 ? 64 : _wtoi(argv[4]));
+        return status == ERROR_SUCCESS ? 0 : 1;
+    }
+
+    if (argv[1][0] == L'r') {
+        status = RingTest(argv[2], argc < 4 ? 4 : _wtoi(argv[3]), argc < 5 ? 1000000 : _wtoi(argv[4]));
+        return status == ERROR_SUCCESS ? 0 : 1;
+    }
+
+    if (argv[1][0] == L'v') {
+        status = VchanBenchTest(argv[2], argc < 4 ? 16 : _wtoi(argv[3]), argc < 5 ? 1024 : _wtoi(argv[4]));
+        return status == ERROR_SUCCESS ? 0 : 1;
+    }
+
     status = XcOpen(XcLogger, &xc);
     if (status != ERROR_SUCCESS) {
         wprintf(L"[!] Error opening xen interface device: 0x%x\n", status);
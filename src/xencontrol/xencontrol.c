@@ -97,7 +97,6 @@ XcOpen(
 
     Context->Logger = Logger;
     Context->LogLevel = XLL_INFO;
-    Context->RequestId = 1;
     InitializeListHead(&Context->RequestList);
     InitializeCriticalSection(&Context->RequestListLock);
 
@@ -218,6 +217,62 @@ fail:
     return GetLastError();
 }
 
+DWORD
+XcEvtchnBindUnboundBatch(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  USHORT RemoteDomain,
+    IN  BOOL Mask,
+    IN  ULONG Count,
+    OUT ULONG *LocalPorts
+    )
+{
+    XENIFACE_EVTCHN_BIND_UNBOUND_BATCH_IN In;
+    XENIFACE_EVTCHN_BIND_UNBOUND_BATCH_OUT *Out = NULL;
+    DWORD Returned, Size;
+    BOOL Success;
+
+    Log(XLL_DEBUG, L"RemoteDomain: %d, Mask: %d, Count: %lu", RemoteDomain, Mask, Count);
+
+    if (Count == 0 || Count > XENIFACE_EVTCHN_BIND_BATCH_MAX) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        goto fail;
+    }
+
+    Size = (ULONG)FIELD_OFFSET(XENIFACE_EVTCHN_BIND_UNBOUND_BATCH_OUT, LocalPorts[Count]);
+    Out = malloc(Size);
+    if (!Out) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        goto fail;
+    }
+
+    In.RemoteDomain = RemoteDomain;
+    In.Mask = !!Mask;
+    In.NumberChannels = Count;
+
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_EVTCHN_BIND_UNBOUND_BATCH,
+                              &In, sizeof(In),
+                              Out, Size,
+                              &Returned,
+                              NULL);
+
+    if (!Success) {
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_EVTCHN_BIND_UNBOUND_BATCH failed");
+        goto fail;
+    }
+
+    memcpy(LocalPorts, Out->LocalPorts, Count * sizeof(ULONG));
+    Log(XLL_DEBUG, L"LocalPorts: %lu..%lu", LocalPorts[0], LocalPorts[Count - 1]);
+
+    free(Out);
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
+    free(Out);
+    return GetLastError();
+}
+
 DWORD
 XcEvtchnBindInterdomain(
     IN  PXENCONTROL_CONTEXT Xc,
@@ -326,6 +381,67 @@ fail:
     return GetLastError();
 }
 
+DWORD
+XcEvtchnNotifyBatch(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  ULONG Count,
+    IN  PULONG LocalPorts,
+    OUT DWORD *Results OPTIONAL
+    )
+{
+    XENIFACE_EVTCHN_NOTIFY_BATCH_IN *In = NULL;
+    XENIFACE_EVTCHN_NOTIFY_BATCH_OUT *Out;
+    DWORD Returned, Size;
+    BOOL Success;
+
+    Log(XLL_DEBUG, L"Count: %lu", Count);
+
+    if (Count == 0 || Count > XENIFACE_EVTCHN_NOTIFY_BATCH_MAX) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        goto fail;
+    }
+
+    // Input and output have the same size, so one buffer serves both.
+    Size = (ULONG)FIELD_OFFSET(XENIFACE_EVTCHN_NOTIFY_BATCH_IN, LocalPorts[Count]);
+    In = malloc(Size);
+    if (!In) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        goto fail;
+    }
+
+    In->NumberPorts = Count;
+    memcpy(&In->LocalPorts, LocalPorts, Count * sizeof(ULONG));
+
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_EVTCHN_NOTIFY_BATCH,
+                              In, Size,
+                              In, Size,
+                              &Returned,
+                              NULL);
+
+    if (!Success) {
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_EVTCHN_NOTIFY_BATCH failed");
+        goto fail;
+    }
+
+    Out = (XENIFACE_EVTCHN_NOTIFY_BATCH_OUT *)In;
+    for (ULONG i = 0; i < Count; i++) {
+        if (Out->Status[i] < 0)
+            Log(XLL_WARNING, L"LocalPort %lu: status 0x%x", LocalPorts[i], Out->Status[i]);
+
+        if (Results)
+            Results[i] = (Out->Status[i] < 0) ? ERROR_NOT_FOUND : ERROR_SUCCESS;
+    }
+
+    free(In);
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
+    free(In);
+    return GetLastError();
+}
+
 DWORD
 XcEvtchnUnmask(
     IN  PXENCONTROL_CONTEXT Xc,
@@ -358,335 +474,321 @@ fail:
     return GetLastError();
 }
 
-static PXENCONTROL_GNTTAB_REQUEST
-FindRequest(
+DWORD
+XcEvtchnPending(
     IN  PXENCONTROL_CONTEXT Xc,
-    IN  PVOID Address
+    OUT PULONG LocalPort,
+    IN  DWORD Timeout
     )
 {
-    PLIST_ENTRY Entry;
-    PXENCONTROL_GNTTAB_REQUEST ReturnRequest = NULL;
+    OVERLAPPED Overlapped;
+    DWORD Returned;
+    DWORD Status;
 
-    EnterCriticalSection(&Xc->RequestListLock);
-    Entry = Xc->RequestList.Flink;
-    while (Entry != &Xc->RequestList) {
-        PXENCONTROL_GNTTAB_REQUEST Request = CONTAINING_RECORD(Entry, XENCONTROL_GNTTAB_REQUEST, ListEntry);
+    ZeroMemory(&Overlapped, sizeof(Overlapped));
 
-        if (Request->Address == Address) {
-            ReturnRequest = Request;
-            break;
-        }
+    Overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!Overlapped.hEvent) {
+        Status = GetLastError();
+        goto fail;
+    }
 
-        Entry = Entry->Flink;
+    // Reading the device returns fired ports, one per ULONG.
+    if (ReadFile(Xc->XenIface, LocalPort, sizeof(ULONG), &Returned, &Overlapped)) {
+        Status = ERROR_SUCCESS;
+    } else {
+        Status = GetLastError();
+        if (Status == ERROR_IO_PENDING) {
+            if (WaitForSingleObject(Overlapped.hEvent, Timeout) != WAIT_OBJECT_0)
+                CancelIoEx(Xc->XenIface, &Overlapped);
+
+            // The read may have completed after all, don't lose the port.
+            if (GetOverlappedResult(Xc->XenIface, &Overlapped, &Returned, TRUE))
+                Status = ERROR_SUCCESS;
+            else
+                Status = GetLastError();
+
+            if (Status == ERROR_OPERATION_ABORTED)
+                Status = ERROR_TIMEOUT;
+        }
     }
-    LeaveCriticalSection(&Xc->RequestListLock);
 
-    return ReturnRequest;
+    if (Status != ERROR_SUCCESS)
+        goto fail;
+
+    Log(XLL_DEBUG, L"LocalPort: %lu", *LocalPort);
+
+    CloseHandle(Overlapped.hEvent);
+    return ERROR_SUCCESS;
+
+fail:
+    if (Status != ERROR_TIMEOUT)
+        Log(XLL_ERROR, L"Error: 0x%x", Status);
+    if (Overlapped.hEvent)
+        CloseHandle(Overlapped.hEvent);
+    return Status;
 }
 
 DWORD
-XcGnttabPermitForeignAccess(
+XcEvtchnWaitOverlapped(
     IN  PXENCONTROL_CONTEXT Xc,
-    IN  USHORT RemoteDomain,
-    IN  ULONG NumberPages,
-    IN  ULONG NotifyOffset,
-    IN  ULONG NotifyPort,
-    IN  XENIFACE_GNTTAB_PAGE_FLAGS Flags,
-    OUT PVOID *Address,
-    OUT ULONG *References
+    OUT PXENIFACE_EVTCHN_WAIT_OUT Output,
+    IN  DWORD cbOutput,
+    IN  LPOVERLAPPED Overlapped
     )
 {
-    XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS_IN In;
-    XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS_OUT *Out;
-    PXENCONTROL_GNTTAB_REQUEST Request;
-    DWORD Returned, Size;
+    DWORD Returned;
     BOOL Success;
     DWORD Status;
 
-    // lock the whole operation to not generate duplicate IDs
-    EnterCriticalSection(&Xc->RequestListLock);
+    Log(XLL_DEBUG, L"Output: %p, cbOutput: %lu, Overlapped: %p", Output, cbOutput, Overlapped);
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_EVTCHN_WAIT,
+                              NULL, 0,
+                              Output, cbOutput,
+                              &Returned,
+                              Overlapped);
 
-    In.RequestId = Xc->RequestId;
-    In.RemoteDomain = RemoteDomain;
-    In.NumberPages = NumberPages;
-    In.NotifyOffset = NotifyOffset;
-    In.NotifyPort = NotifyPort;
-    In.Flags = Flags;
+    if (Success)
+        return ERROR_SUCCESS;
 
-    Size = (ULONG)FIELD_OFFSET(XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS_OUT, References[NumberPages]);
-    Out = malloc(Size);
-    Request = malloc(sizeof(*Request));
+    Status = GetLastError();
+    if (Status != ERROR_IO_PENDING) {
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_EVTCHN_WAIT failed");
+        Log(XLL_ERROR, L"Error: 0x%x", Status);
+    }
+
+    return Status;
+}
+
+DWORD
+XcEvtchnWait(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  ULONG MaxPorts,
+    OUT PULONG LocalPorts,
+    OUT PULONG NumberPorts,
+    IN  DWORD Timeout
+    )
+{
+    XENIFACE_EVTCHN_WAIT_OUT *Out = NULL;
+    OVERLAPPED Overlapped;
+    DWORD Returned, Size;
+    DWORD Status;
+
+    ZeroMemory(&Overlapped, sizeof(Overlapped));
+
+    Status = ERROR_INVALID_PARAMETER;
+    if (MaxPorts == 0)
+        goto fail;
 
     Status = ERROR_OUTOFMEMORY;
-    if (!Request || !Out)
+    Size = (ULONG)FIELD_OFFSET(XENIFACE_EVTCHN_WAIT_OUT, LocalPorts[MaxPorts]);
+    Out = malloc(Size);
+    if (!Out)
         goto fail;
 
-    ZeroMemory(Request, sizeof(*Request));
-    Request->Id = In.RequestId;
+    Overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!Overlapped.hEvent) {
+        Status = GetLastError();
+        goto fail;
+    }
 
-    Log(XLL_DEBUG, L"Id %lu, RemoteDomain: %d, NumberPages: %lu, NotifyOffset: 0x%x, NotifyPort: %lu, Flags: 0x%x",
-        In.RequestId, RemoteDomain, NumberPages, NotifyOffset, NotifyPort, Flags);
+    Status = XcEvtchnWaitOverlapped(Xc, Out, Size, &Overlapped);
+    if (Status == ERROR_IO_PENDING) {
+        if (WaitForSingleObject(Overlapped.hEvent, Timeout) != WAIT_OBJECT_0)
+            CancelIoEx(Xc->XenIface, &Overlapped);
 
-    Success = DeviceIoControl(Xc->XenIface,
-                              IOCTL_XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS,
-                              &In, sizeof(In),
-                              Out, Size,
-                              &Returned,
-                              &Request->Overlapped);
+        // The request may have completed after all, don't lose the ports.
+        if (GetOverlappedResult(Xc->XenIface, &Overlapped, &Returned, TRUE))
+            Status = ERROR_SUCCESS;
+        else
+            Status = GetLastError();
 
-    Status = GetLastError();
-    // this IOCTL is expected to be pending on success
-    if (!Success) {
-        if (Status != ERROR_IO_PENDING) {
-            Log(XLL_ERROR, L"IOCTL_XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS failed");
-            goto fail;
-        }
-    } else {
-        Log(XLL_ERROR, L"IOCTL_XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS not pending");
-        Status = ERROR_UNIDENTIFIED_ERROR;
-        goto fail;
+        if (Status == ERROR_OPERATION_ABORTED)
+            Status = ERROR_TIMEOUT;
     }
 
-    Request->Address = Out->Address;
+    if (Status != ERROR_SUCCESS)
+        goto fail;
 
-    InsertTailList(&Xc->RequestList, &Request->ListEntry);
-    Xc->RequestId++;
-    LeaveCriticalSection(&Xc->RequestListLock);
+    memcpy(LocalPorts, Out->LocalPorts, Out->NumberPorts * sizeof(ULONG));
+    *NumberPorts = Out->NumberPorts;
 
-    *Address = Out->Address;
-    memcpy(References, &Out->References, NumberPages * sizeof(ULONG));
-    Log(XLL_DEBUG, L"Address: %p", *Address);
-    for (ULONG i = 0; i < NumberPages; i++)
-        Log(XLL_DEBUG, L"Grant ref[%lu]: %lu", i, Out->References[i]);
+    Log(XLL_DEBUG, L"NumberPorts: %lu", *NumberPorts);
 
+    CloseHandle(Overlapped.hEvent);
     free(Out);
     return ERROR_SUCCESS;
 
 fail:
-    LeaveCriticalSection(&Xc->RequestListLock);
-    Log(XLL_ERROR, L"Error: 0x%x", Status);
+    if (Status != ERROR_TIMEOUT)
+        Log(XLL_ERROR, L"Error: 0x%x", Status);
+
+    if (Overlapped.hEvent)
+        CloseHandle(Overlapped.hEvent);
     free(Out);
-    free(Request);
     return Status;
 }
 
 DWORD
-XcGnttabRevokeForeignAccess(
+XcEvtchnSetSpin(
     IN  PXENCONTROL_CONTEXT Xc,
-    IN  PVOID Address
+    IN  ULONG LocalPort,
+    IN  ULONG SpinMicroseconds
     )
 {
-    XENIFACE_GNTTAB_REVOKE_FOREIGN_ACCESS_IN In;
-    PXENCONTROL_GNTTAB_REQUEST Request;
+    XENIFACE_EVTCHN_SET_SPIN_IN In;
     DWORD Returned;
     BOOL Success;
-    DWORD Status;
-
-    Log(XLL_DEBUG, L"Address: %p", Address);
-
-    Status = ERROR_NOT_FOUND;
-    Request = FindRequest(Xc, Address);
-    if (!Request) {
-        Log(XLL_ERROR, L"Address %p not granted", Address);
-        goto fail;
-    }
 
-    In.RequestId = Request->Id;
+    In.LocalPort = LocalPort;
+    In.SpinMicroseconds = SpinMicroseconds;
 
+    Log(XLL_DEBUG, L"LocalPort: %lu, SpinMicroseconds: %lu", LocalPort, SpinMicroseconds);
     Success = DeviceIoControl(Xc->XenIface,
-                              IOCTL_XENIFACE_GNTTAB_REVOKE_FOREIGN_ACCESS,
+                              IOCTL_XENIFACE_EVTCHN_SET_SPIN,
                               &In, sizeof(In),
                               NULL, 0,
                               &Returned,
                               NULL);
 
     if (!Success) {
-        Status = GetLastError();
-        Log(XLL_ERROR, L"IOCTL_XENIFACE_GNTTAB_REVOKE_FOREIGN_ACCESS failed");
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_EVTCHN_SET_SPIN failed");
         goto fail;
-    } else {
-        /*
-         * [pcfist@gmail.com]
-         * Don't check GetLastError() on success because DeviceIoControl()
-         * does not change it when succeeds so we might end up returning stale
-         * error code value to client when the call is really successful.
-         */
-        Status = ERROR_SUCCESS;
     }
 
-    EnterCriticalSection(&Xc->RequestListLock);
-    RemoveEntryList(&Request->ListEntry);
-    LeaveCriticalSection(&Xc->RequestListLock);
-    free(Request);
-
-    return Status;
+    return ERROR_SUCCESS;
 
 fail:
-    Log(XLL_ERROR, L"Error: %d 0x%x", Status, Status);
-    return Status;
+    Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
+    return GetLastError();
 }
 
 DWORD
-XcGnttabMapForeignPages(
+XcEvtchnSpinWait(
     IN  PXENCONTROL_CONTEXT Xc,
-    IN  USHORT RemoteDomain,
-    IN  ULONG NumberPages,
-    IN  PULONG References,
-    IN  ULONG NotifyOffset,
-    IN  ULONG NotifyPort,
-    IN  XENIFACE_GNTTAB_PAGE_FLAGS Flags,
-    OUT PVOID *Address
+    IN  ULONG LocalPort,
+    IN  HANDLE Event,
+    IN  DWORD Timeout,
+    OUT ULONG *SpinWakeups OPTIONAL
     )
 {
-    XENIFACE_GNTTAB_MAP_FOREIGN_PAGES_IN *In;
-    XENIFACE_GNTTAB_MAP_FOREIGN_PAGES_OUT Out;
-    PXENCONTROL_GNTTAB_REQUEST Request;
-    DWORD Returned, Size;
+    XENIFACE_EVTCHN_SPIN_WAIT_IN In;
+    XENIFACE_EVTCHN_SPIN_WAIT_OUT Out;
+    DWORD Returned;
     BOOL Success;
-    DWORD Status;
 
-    // lock the whole operation to not generate duplicate IDs
-    EnterCriticalSection(&Xc->RequestListLock);
-
-    Status = ERROR_OUTOFMEMORY;
-    Size = (ULONG)FIELD_OFFSET(XENIFACE_GNTTAB_MAP_FOREIGN_PAGES_IN, References[NumberPages]);
-    In = malloc(Size);
-    Request = malloc(sizeof(*Request));
-    if (!In || !Request)
-        goto fail;
-
-    In->RequestId = Xc->RequestId;
-    In->RemoteDomain = RemoteDomain;
-    In->NumberPages = NumberPages;
-    In->NotifyOffset = NotifyOffset;
-    In->NotifyPort = NotifyPort;
-    In->Flags = Flags;
-    memcpy(&In->References, References, NumberPages * sizeof(ULONG));
-
-    ZeroMemory(Request, sizeof(*Request));
-    Request->Id = In->RequestId;
-
-    Log(XLL_DEBUG, L"Id %lu, RemoteDomain: %d, NumberPages: %lu, NotifyOffset: 0x%x, NotifyPort: %lu, Flags: 0x%x",
-        In->RequestId, RemoteDomain, NumberPages, NotifyOffset, NotifyPort, Flags);
-
-    for (ULONG i = 0; i < NumberPages; i++)
-        Log(XLL_DEBUG, L"Grant ref[%lu]: %lu", i, References[i]);
+    In.LocalPort = LocalPort;
 
+    Log(XLL_TRACE, L"LocalPort: %lu, Event: %p, Timeout: %lu", LocalPort, Event, Timeout);
     Success = DeviceIoControl(Xc->XenIface,
-                              IOCTL_XENIFACE_GNTTAB_MAP_FOREIGN_PAGES,
-                              In, Size,
+                              IOCTL_XENIFACE_EVTCHN_SPIN_WAIT,
+                              &In, sizeof(In),
                               &Out, sizeof(Out),
                               &Returned,
-                              &Request->Overlapped);
+                              NULL);
 
-    Status = GetLastError();
-    // this IOCTL is expected to be pending on success
     if (!Success) {
-        if (Status != ERROR_IO_PENDING) {
-            Log(XLL_ERROR, L"IOCTL_XENIFACE_GNTTAB_MAP_FOREIGN_PAGES failed");
-            goto fail;
-        }
-    } else {
-        Log(XLL_ERROR, L"IOCTL_XENIFACE_GNTTAB_MAP_FOREIGN_PAGES not pending");
-        Status = ERROR_UNIDENTIFIED_ERROR;
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_EVTCHN_SPIN_WAIT failed");
         goto fail;
     }
 
-    Request->Address = Out.Address;
-    InsertTailList(&Xc->RequestList, &Request->ListEntry);
-    Xc->RequestId++;
-    LeaveCriticalSection(&Xc->RequestListLock);
+    if (SpinWakeups)
+        *SpinWakeups = Out.SpinWakeups;
 
-    *Address = Out.Address;
+    if (Out.Fired)
+        return ERROR_SUCCESS;
 
-    Log(XLL_DEBUG, L"Address: %p", *Address);
+    if (Event == NULL)
+        return ERROR_TIMEOUT;
 
-    free(In);
-    return ERROR_SUCCESS;
+    switch (WaitForSingleObject(Event, Timeout)) {
+    case WAIT_OBJECT_0:
+        return ERROR_SUCCESS;
+
+    case WAIT_TIMEOUT:
+        return ERROR_TIMEOUT;
+
+    default:
+        Log(XLL_ERROR, L"WaitForSingleObject failed");
+        goto fail;
+    }
 
 fail:
-    LeaveCriticalSection(&Xc->RequestListLock);
-    Log(XLL_ERROR, L"Error: 0x%x", Status);
-    free(In);
-    free(Request);
-    return Status;
+    Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
+    return GetLastError();
 }
 
 DWORD
-XcGnttabUnmapForeignPages(
+XcEvtchnSetModeration(
     IN  PXENCONTROL_CONTEXT Xc,
-    IN  PVOID Address
+    IN  ULONG LocalPort,
+    IN  XENIFACE_EVTCHN_MODERATION Mode,
+    IN  ULONG IntervalMicroseconds
     )
 {
-    XENIFACE_GNTTAB_UNMAP_FOREIGN_PAGES_IN In;
-    PXENCONTROL_GNTTAB_REQUEST Request;
+    XENIFACE_EVTCHN_SET_MODERATION_IN In;
     DWORD Returned;
     BOOL Success;
-    DWORD Status;
-
-    Log(XLL_DEBUG, L"Address: %p", Address);
-
-    Status = ERROR_NOT_FOUND;
-    Request = FindRequest(Xc, Address);
-    if (!Request) {
-        Log(XLL_ERROR, L"Address %p not mapped", Address);
-        goto fail;
-    }
 
-    In.RequestId = Request->Id;
+    In.LocalPort = LocalPort;
+    In.Mode = Mode;
+    In.IntervalMicroseconds = IntervalMicroseconds;
 
+    Log(XLL_DEBUG, L"LocalPort: %lu, Mode: %d, IntervalMicroseconds: %lu",
+        LocalPort, Mode, IntervalMicroseconds);
     Success = DeviceIoControl(Xc->XenIface,
-                              IOCTL_XENIFACE_GNTTAB_UNMAP_FOREIGN_PAGES,
+                              IOCTL_XENIFACE_EVTCHN_SET_MODERATION,
                               &In, sizeof(In),
                               NULL, 0,
                               &Returned,
                               NULL);
 
     if (!Success) {
-        Status = GetLastError();
-        Log(XLL_ERROR, L"IOCTL_XENIFACE_GNTTAB_UNMAP_FOREIGN_PAGES failed");
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_EVTCHN_SET_MODERATION failed");
         goto fail;
-    } else {
-        Status = ERROR_SUCCESS;
     }
 
-    EnterCriticalSection(&Xc->RequestListLock);
-    RemoveEntryList(&Request->ListEntry);
-    LeaveCriticalSection(&Xc->RequestListLock);
-    free(Request);
-
-    return Status;
+    return ERROR_SUCCESS;
 
 fail:
-    Log(XLL_ERROR, L"Error: 0x%x", Status);
-    return Status;
+    Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
+    return GetLastError();
 }
 
 DWORD
-XcStoreRead(
+XcEvtchnSetAffinity(
     IN  PXENCONTROL_CONTEXT Xc,
-    IN  PSTR Path,
-    IN  DWORD cbValue,
-    OUT CHAR *Value
+    IN  ULONG LocalPort,
+    IN  PPROCESSOR_NUMBER Processor,
+    OUT LONG *BindStatus OPTIONAL
     )
 {
+    XENIFACE_EVTCHN_SET_AFFINITY_IN In;
+    XENIFACE_EVTCHN_SET_AFFINITY_OUT Out;
     DWORD Returned;
     BOOL Success;
 
-    Log(XLL_DEBUG, L"Path: '%S'", Path);
+    In.LocalPort = LocalPort;
+    In.Group = Processor->Group;
+    In.Number = Processor->Number;
+
+    Log(XLL_DEBUG, L"LocalPort: %lu, Group: %u, Number: %u", LocalPort, In.Group, In.Number);
     Success = DeviceIoControl(Xc->XenIface,
-                              IOCTL_XENIFACE_STORE_READ,
-                              Path, (DWORD)strlen(Path) + 1,
-                              Value, cbValue,
+                              IOCTL_XENIFACE_EVTCHN_SET_AFFINITY,
+                              &In, sizeof(In),
+                              &Out, sizeof(Out),
                               &Returned,
                               NULL);
 
     if (!Success) {
-        Log(XLL_ERROR, L"IOCTL_XENIFACE_STORE_READ failed");
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_EVTCHN_SET_AFFINITY failed");
         goto fail;
     }
 
-    Log(XLL_DEBUG, L"Value: '%S'", Value);
+    Log(XLL_DEBUG, L"BindStatus: 0x%x", Out.BindStatus);
+    if (BindStatus)
+        *BindStatus = Out.BindStatus;
 
     return ERROR_SUCCESS;
 
@@ -696,76 +798,64 @@ fail:
 }
 
 DWORD
-XcStoreWrite(
+XcEvtchnQueryAffinity(
     IN  PXENCONTROL_CONTEXT Xc,
-    IN  PCHAR Path,
-    IN  PCHAR Value
+    IN  ULONG LocalPort,
+    OUT PXENIFACE_EVTCHN_QUERY_AFFINITY_OUT Affinity
     )
 {
-    PCHAR Buffer;
-    DWORD cbBuffer;
+    XENIFACE_EVTCHN_QUERY_AFFINITY_IN In;
     DWORD Returned;
     BOOL Success;
 
-    cbBuffer = (DWORD)(strlen(Path) + 1 + strlen(Value) + 1 + 1);
-    Buffer = malloc(cbBuffer);
-    if (!Buffer) {
-        SetLastError(ERROR_OUTOFMEMORY);
-        goto fail;
-    }
-
-    ZeroMemory(Buffer, cbBuffer);
-    memcpy(Buffer, Path, strlen(Path));
-    memcpy(Buffer + strlen(Path) + 1, Value, strlen(Value));
+    In.LocalPort = LocalPort;
 
-    Log(XLL_DEBUG, L"Path: '%S', Value: '%S'", Path, Value);
+    Log(XLL_DEBUG, L"LocalPort: %lu", LocalPort);
     Success = DeviceIoControl(Xc->XenIface,
-                              IOCTL_XENIFACE_STORE_WRITE,
-                              Buffer, cbBuffer,
-                              NULL, 0,
+                              IOCTL_XENIFACE_EVTCHN_QUERY_AFFINITY,
+                              &In, sizeof(In),
+                              Affinity, sizeof(*Affinity),
                               &Returned,
                               NULL);
 
     if (!Success) {
-        Log(XLL_ERROR, L"IOCTL_XENIFACE_STORE_WRITE failed");
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_EVTCHN_QUERY_AFFINITY failed");
         goto fail;
     }
 
-    free(Buffer);
     return ERROR_SUCCESS;
 
 fail:
     Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
-    free(Buffer);
     return GetLastError();
 }
 
 DWORD
-XcStoreDirectory(
+XcEvtchnQueryStats(
     IN  PXENCONTROL_CONTEXT Xc,
-    IN  PCHAR Path,
-    IN  DWORD cbOutput,
-    OUT CHAR *Output
+    IN  ULONG LocalPort,
+    OUT PXENIFACE_EVTCHN_QUERY_STATS_OUT Stats
     )
 {
+    XENIFACE_EVTCHN_QUERY_STATS_IN In;
     DWORD Returned;
     BOOL Success;
 
-    Log(XLL_DEBUG, L"Path: '%S'", Path);
+    In.LocalPort = LocalPort;
+
+    Log(XLL_DEBUG, L"LocalPort: %lu", LocalPort);
     Success = DeviceIoControl(Xc->XenIface,
-                              IOCTL_XENIFACE_STORE_DIRECTORY,
-                              Path, (DWORD)strlen(Path) + 1,
-                              Output, cbOutput,
+                              IOCTL_XENIFACE_EVTCHN_QUERY_STATS,
+                              &In, sizeof(In),
+                              Stats, sizeof(*Stats),
                               &Returned,
                               NULL);
 
     if (!Success) {
-        Log(XLL_ERROR, L"IOCTL_XENIFACE_STORE_DIRECTORY failed");
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_EVTCHN_QUERY_STATS failed");
         goto fail;
     }
 
-    _LogMultiSz(Xc, __FUNCTION__, XLL_DEBUG, Output);
-
     return ERROR_SUCCESS;
 
 fail:
@@ -774,24 +864,28 @@ fail:
 }
 
 DWORD
-XcStoreRemove(
+XcEvtchnReportWake(
     IN  PXENCONTROL_CONTEXT Xc,
-    IN  PCHAR Path
+    IN  ULONG LocalPort,
+    IN  LONGLONG WakeTime
     )
 {
+    XENIFACE_EVTCHN_REPORT_WAKE_IN In;
     DWORD Returned;
     BOOL Success;
 
-    Log(XLL_DEBUG, L"Path: '%S'", Path);
+    In.LocalPort = LocalPort;
+    In.WakeTime = WakeTime;
+
     Success = DeviceIoControl(Xc->XenIface,
-                              IOCTL_XENIFACE_STORE_REMOVE,
-                              Path, (DWORD)strlen(Path) + 1,
+                              IOCTL_XENIFACE_EVTCHN_REPORT_WAKE,
+                              &In, sizeof(In),
                               NULL, 0,
                               &Returned,
                               NULL);
 
     if (!Success) {
-        Log(XLL_ERROR, L"IOCTL_XENIFACE_STORE_REMOVE failed");
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_EVTCHN_REPORT_WAKE failed");
         goto fail;
     }
 
@@ -803,87 +897,66 @@ fail:
 }
 
 DWORD
-XcStoreSetPermissions(
+XcEvtchnQueryLatency(
     IN  PXENCONTROL_CONTEXT Xc,
-    IN  PCHAR Path,
-    IN  ULONG Count,
-    IN  PXENIFACE_STORE_PERMISSION Permissions
+    IN  ULONG LocalPort,
+    IN  BOOL Reset,
+    OUT PXENIFACE_EVTCHN_QUERY_LATENCY_OUT Latency
     )
 {
-    DWORD Returned, Size;
+    XENIFACE_EVTCHN_QUERY_LATENCY_IN In;
+    DWORD Returned;
     BOOL Success;
-    XENIFACE_STORE_SET_PERMISSIONS_IN *In = NULL;
-
-    Log(XLL_DEBUG, L"Path: '%S', Count: %lu", Path, Count);
-    for (ULONG i = 0; i < Count; i++)
-        Log(XLL_DEBUG, L"Domain: %d, Mask: 0x%x", Permissions[i].Domain, Permissions[i].Mask);
 
-    Size = (ULONG)FIELD_OFFSET(XENIFACE_STORE_SET_PERMISSIONS_IN, Permissions[Count]);
-    In = malloc(Size);
-    if (!In) {
-        SetLastError(ERROR_OUTOFMEMORY);
-        goto fail;
-    }
-
-    In->Path = Path;
-    In->PathLength = (DWORD)strlen(In->Path) + 1;
-    In->NumberPermissions = Count;
-    memcpy(&In->Permissions, Permissions, Count * sizeof(XENIFACE_STORE_PERMISSION));
+    In.LocalPort = LocalPort;
+    In.Reset = !!Reset;
 
+    Log(XLL_DEBUG, L"LocalPort: %lu, Reset: %d", LocalPort, Reset);
     Success = DeviceIoControl(Xc->XenIface,
-                              IOCTL_XENIFACE_STORE_SET_PERMISSIONS,
-                              In, Size,
-                              NULL, 0,
+                              IOCTL_XENIFACE_EVTCHN_QUERY_LATENCY,
+                              &In, sizeof(In),
+                              Latency, sizeof(*Latency),
                               &Returned,
                               NULL);
 
     if (!Success) {
-        Log(XLL_ERROR, L"IOCTL_XENIFACE_STORE_SET_PERMISSIONS failed");
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_EVTCHN_QUERY_LATENCY failed");
         goto fail;
     }
 
-    free(In);
     return ERROR_SUCCESS;
 
 fail:
     Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
-    free(In);
     return GetLastError();
 }
 
 DWORD
-XcStoreAddWatch(
+XcEvtchnMapPending(
     IN  PXENCONTROL_CONTEXT Xc,
-    IN  PCHAR Path,
-    IN  HANDLE Event,
-    OUT PVOID *Handle
+    OUT volatile LONG **Pending,
+    OUT ULONG *NumberPorts
     )
 {
+    XENIFACE_EVTCHN_MAP_PENDING_OUT Out;
     DWORD Returned;
     BOOL Success;
-    XENIFACE_STORE_ADD_WATCH_IN In;
-    XENIFACE_STORE_ADD_WATCH_OUT Out;
-
-    Log(XLL_DEBUG, L"Path: '%S', Event: %p", Path, Event);
 
-    In.Path = Path;
-    In.PathLength = (DWORD)strlen(Path) + 1;
-    In.Event = Event;
     Success = DeviceIoControl(Xc->XenIface,
-                              IOCTL_XENIFACE_STORE_ADD_WATCH,
-                              &In, sizeof(In),
+                              IOCTL_XENIFACE_EVTCHN_MAP_PENDING,
+                              NULL, 0,
                               &Out, sizeof(Out),
                               &Returned,
                               NULL);
 
     if (!Success) {
-        Log(XLL_ERROR, L"IOCTL_XENIFACE_STORE_ADD_WATCH failed");
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_EVTCHN_MAP_PENDING failed");
         goto fail;
     }
 
-    *Handle = Out.Context;
-
-    Log(XLL_DEBUG, L"Handle: %p", *Handle);
+    *Pending = Out.Address;
+    *NumberPorts = Out.NumberPorts;
+    Log(XLL_DEBUG, L"Pending: %p, NumberPorts: %lu", Out.Address, Out.NumberPorts);
 
     return ERROR_SUCCESS;
 
@@ -893,33 +966,1398 @@ fail:
 }
 
 DWORD
-XcStoreRemoveWatch(
+XcAssociateCompletionPort(
     IN  PXENCONTROL_CONTEXT Xc,
-    IN  PVOID Handle
+    IN  HANDLE CompletionPort,
+    IN  ULONG_PTR CompletionKey
     )
 {
-    DWORD Returned;
-    BOOL Success;
-    XENIFACE_STORE_REMOVE_WATCH_IN In;
+    Log(XLL_DEBUG, L"CompletionPort: %p, CompletionKey: %p", CompletionPort, (PVOID)CompletionKey);
 
-    Log(XLL_DEBUG, L"Handle: %p", Handle);
+    if (!CreateIoCompletionPort(Xc->XenIface, CompletionPort, CompletionKey, 0)) {
+        Log(XLL_ERROR, L"CreateIoCompletionPort failed");
+        Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
+        return GetLastError();
+    }
 
-    In.Context = Handle;
-    Success = DeviceIoControl(Xc->XenIface,
-                              IOCTL_XENIFACE_STORE_REMOVE_WATCH,
-                              &In, sizeof(In),
-                              NULL, 0,
-                              &Returned,
-                              NULL);
+    return ERROR_SUCCESS;
+}
 
-    if (!Success) {
-        Log(XLL_ERROR, L"IOCTL_XENIFACE_STORE_REMOVE_WATCH failed");
-        goto fail;
+// The driver wants request IDs unique for the process, across all handles
+// and whether the request stays pending or is owned by the handle.
+static ULONG
+XcNextRequestId(
+    VOID
+    )
+{
+    static volatile LONG RequestId;
+
+    return (ULONG)InterlockedIncrement(&RequestId);
+}
+
+static PXENCONTROL_GNTTAB_REQUEST
+FindRequest(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  PVOID Address
+    )
+{
+    PLIST_ENTRY Entry;
+    PXENCONTROL_GNTTAB_REQUEST ReturnRequest = NULL;
+
+    EnterCriticalSection(&Xc->RequestListLock);
+    Entry = Xc->RequestList.Flink;
+    while (Entry != &Xc->RequestList) {
+        PXENCONTROL_GNTTAB_REQUEST Request = CONTAINING_RECORD(Entry, XENCONTROL_GNTTAB_REQUEST, ListEntry);
+
+        if (Request->Address == Address) {
+            ReturnRequest = Request;
+            break;
+        }
+
+        Entry = Entry->Flink;
     }
+    LeaveCriticalSection(&Xc->RequestListLock);
 
-    return ERROR_SUCCESS;
+    return ReturnRequest;
+}
 
-fail:
-    Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
-    return GetLastError();
+DWORD
+XcGnttabPermitForeignAccess(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  USHORT RemoteDomain,
+    IN  ULONG NumberPages,
+    IN  ULONG NotifyOffset,
+    IN  ULONG NotifyPort,
+    IN  XENIFACE_GNTTAB_PAGE_FLAGS Flags,
+    OUT PVOID *Address,
+    OUT ULONG *References
+    )
+{
+    return XcGnttabPermitForeignAccessEx(Xc, RemoteDomain, NumberPages, NotifyOffset, NotifyPort,
+                                         Flags, XENIFACE_GNTTAB_CACHED, Address, References);
+}
+
+DWORD
+XcGnttabPermitForeignAccessEx(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  USHORT RemoteDomain,
+    IN  ULONG NumberPages,
+    IN  ULONG NotifyOffset,
+    IN  ULONG NotifyPort,
+    IN  XENIFACE_GNTTAB_PAGE_FLAGS Flags,
+    IN  XENIFACE_GNTTAB_CACHE_TYPE CacheType,
+    OUT PVOID *Address,
+    OUT ULONG *References
+    )
+{
+    XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS_IN In;
+    XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS_OUT *Out;
+    PXENCONTROL_GNTTAB_REQUEST Request;
+    DWORD Returned, Size;
+    BOOL Success;
+    DWORD Status;
+
+    // the request is listed before another thread can look up its address
+    EnterCriticalSection(&Xc->RequestListLock);
+
+    In.RequestId = XcNextRequestId();
+    In.RemoteDomain = RemoteDomain;
+    In.NumberPages = NumberPages;
+    In.NotifyOffset = NotifyOffset;
+    In.NotifyPort = NotifyPort;
+    In.Flags = Flags;
+    In.CacheType = CacheType;
+
+    Size = (ULONG)FIELD_OFFSET(XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS_OUT, References[NumberPages]);
+    Out = malloc(Size);
+    Request = malloc(sizeof(*Request));
+
+    Status = ERROR_OUTOFMEMORY;
+    if (!Request || !Out)
+        goto fail;
+
+    ZeroMemory(Request, sizeof(*Request));
+    Request->Id = In.RequestId;
+
+    Log(XLL_DEBUG, L"Id %lu, RemoteDomain: %d, NumberPages: %lu, NotifyOffset: 0x%x, NotifyPort: %lu, Flags: 0x%x, CacheType: %d",
+        In.RequestId, RemoteDomain, NumberPages, NotifyOffset, NotifyPort, Flags, CacheType);
+
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS,
+                              &In, sizeof(In),
+                              Out, Size,
+                              &Returned,
+                              &Request->Overlapped);
+
+    Status = GetLastError();
+    if (Flags & XENIFACE_GNTTAB_USE_HANDLE) {
+        // completes right away, the driver keeps the pages with our handle
+        if (!Success) {
+            Log(XLL_ERROR, L"IOCTL_XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS failed");
+            goto fail;
+        }
+    } else if (!Success) {
+        // this IOCTL is expected to be pending on success
+        if (Status != ERROR_IO_PENDING) {
+            Log(XLL_ERROR, L"IOCTL_XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS failed");
+            goto fail;
+        }
+    } else {
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS not pending");
+        Status = ERROR_UNIDENTIFIED_ERROR;
+        goto fail;
+    }
+
+    Request->Address = Out->Address;
+
+    InsertTailList(&Xc->RequestList, &Request->ListEntry);
+    LeaveCriticalSection(&Xc->RequestListLock);
+
+    *Address = Out->Address;
+    memcpy(References, &Out->References, NumberPages * sizeof(ULONG));
+    Log(XLL_DEBUG, L"Address: %p", *Address);
+    for (ULONG i = 0; i < NumberPages; i++)
+        Log(XLL_DEBUG, L"Grant ref[%lu]: %lu", i, Out->References[i]);
+
+    free(Out);
+    return ERROR_SUCCESS;
+
+fail:
+    LeaveCriticalSection(&Xc->RequestListLock);
+    Log(XLL_ERROR, L"Error: 0x%x", Status);
+    free(Out);
+    free(Request);
+    return Status;
+}
+
+DWORD
+XcGnttabRevokeForeignAccess(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  PVOID Address
+    )
+{
+    XENIFACE_GNTTAB_REVOKE_FOREIGN_ACCESS_IN In;
+    PXENCONTROL_GNTTAB_REQUEST Request;
+    DWORD Returned;
+    BOOL Success;
+    DWORD Status;
+
+    Log(XLL_DEBUG, L"Address: %p", Address);
+
+    Status = ERROR_NOT_FOUND;
+    Request = FindRequest(Xc, Address);
+    if (!Request) {
+        Log(XLL_ERROR, L"Address %p not granted", Address);
+        goto fail;
+    }
+
+    In.RequestId = Request->Id;
+
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_GNTTAB_REVOKE_FOREIGN_ACCESS,
+                              &In, sizeof(In),
+                              NULL, 0,
+                              &Returned,
+                              NULL);
+
+    if (!Success) {
+        Status = GetLastError();
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_GNTTAB_REVOKE_FOREIGN_ACCESS failed");
+        goto fail;
+    } else {
+        /*
+         * [pcfist@gmail.com]
+         * Don't check GetLastError() on success because DeviceIoControl()
+         * does not change it when succeeds so we might end up returning stale
+         * error code value to client when the call is really successful.
+         */
+        Status = ERROR_SUCCESS;
+    }
+
+    EnterCriticalSection(&Xc->RequestListLock);
+    RemoveEntryList(&Request->ListEntry);
+    LeaveCriticalSection(&Xc->RequestListLock);
+    free(Request);
+
+    return Status;
+
+fail:
+    Log(XLL_ERROR, L"Error: %d 0x%x", Status, Status);
+    return Status;
+}
+
+DWORD
+XcGnttabMapForeignPages(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  USHORT RemoteDomain,
+    IN  ULONG NumberPages,
+    IN  PULONG References,
+    IN  ULONG NotifyOffset,
+    IN  ULONG NotifyPort,
+    IN  XENIFACE_GNTTAB_PAGE_FLAGS Flags,
+    OUT PVOID *Address
+    )
+{
+    return XcGnttabMapForeignPagesEx(Xc, RemoteDomain, NumberPages, References, NotifyOffset, NotifyPort,
+                                     Flags, XENIFACE_GNTTAB_CACHED, Address);
+}
+
+DWORD
+XcGnttabMapForeignPagesEx(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  USHORT RemoteDomain,
+    IN  ULONG NumberPages,
+    IN  PULONG References,
+    IN  ULONG NotifyOffset,
+    IN  ULONG NotifyPort,
+    IN  XENIFACE_GNTTAB_PAGE_FLAGS Flags,
+    IN  XENIFACE_GNTTAB_CACHE_TYPE CacheType,
+    OUT PVOID *Address
+    )
+{
+    XENIFACE_GNTTAB_MAP_FOREIGN_PAGES_IN *In;
+    XENIFACE_GNTTAB_MAP_FOREIGN_PAGES_OUT Out;
+    PXENCONTROL_GNTTAB_REQUEST Request;
+    DWORD Returned, Size;
+    BOOL Success;
+    DWORD Status;
+
+    // the request is listed before another thread can look up its address
+    EnterCriticalSection(&Xc->RequestListLock);
+
+    Status = ERROR_OUTOFMEMORY;
+    Size = (ULONG)FIELD_OFFSET(XENIFACE_GNTTAB_MAP_FOREIGN_PAGES_IN, References[NumberPages]);
+    In = malloc(Size);
+    Request = malloc(sizeof(*Request));
+    if (!In || !Request)
+        goto fail;
+
+    In->RequestId = XcNextRequestId();
+    In->RemoteDomain = RemoteDomain;
+    In->NumberPages = NumberPages;
+    In->NotifyOffset = NotifyOffset;
+    In->NotifyPort = NotifyPort;
+    In->Flags = Flags;
+    In->CacheType = CacheType;
+    memcpy(&In->References, References, NumberPages * sizeof(ULONG));
+
+    ZeroMemory(Request, sizeof(*Request));
+    Request->Id = In->RequestId;
+
+    Log(XLL_DEBUG, L"Id %lu, RemoteDomain: %d, NumberPages: %lu, NotifyOffset: 0x%x, NotifyPort: %lu, Flags: 0x%x, CacheType: %d",
+        In->RequestId, RemoteDomain, NumberPages, NotifyOffset, NotifyPort, Flags, CacheType);
+
+    for (ULONG i = 0; i < NumberPages; i++)
+        Log(XLL_DEBUG, L"Grant ref[%lu]: %lu", i, References[i]);
+
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_GNTTAB_MAP_FOREIGN_PAGES,
+                              In, Size,
+                              &Out, sizeof(Out),
+                              &Returned,
+                              &Request->Overlapped);
+
+    Status = GetLastError();
+    if (Flags & XENIFACE_GNTTAB_USE_HANDLE) {
+        // completes right away, the driver keeps the pages with our handle
+        if (!Success) {
+            Log(XLL_ERROR, L"IOCTL_XENIFACE_GNTTAB_MAP_FOREIGN_PAGES failed");
+            goto fail;
+        }
+    } else if (!Success) {
+        // this IOCTL is expected to be pending on success
+        if (Status != ERROR_IO_PENDING) {
+            Log(XLL_ERROR, L"IOCTL_XENIFACE_GNTTAB_MAP_FOREIGN_PAGES failed");
+            goto fail;
+        }
+    } else {
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_GNTTAB_MAP_FOREIGN_PAGES not pending");
+        Status = ERROR_UNIDENTIFIED_ERROR;
+        goto fail;
+    }
+
+    Request->Address = Out.Address;
+    InsertTailList(&Xc->RequestList, &Request->ListEntry);
+    LeaveCriticalSection(&Xc->RequestListLock);
+
+    *Address = Out.Address;
+
+    Log(XLL_DEBUG, L"Address: %p", *Address);
+
+    free(In);
+    return ERROR_SUCCESS;
+
+fail:
+    LeaveCriticalSection(&Xc->RequestListLock);
+    Log(XLL_ERROR, L"Error: 0x%x", Status);
+    free(In);
+    free(Request);
+    return Status;
+}
+
+DWORD
+XcGnttabUnmapForeignPages(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  PVOID Address
+    )
+{
+    XENIFACE_GNTTAB_UNMAP_FOREIGN_PAGES_IN In;
+    PXENCONTROL_GNTTAB_REQUEST Request;
+    DWORD Returned;
+    BOOL Success;
+    DWORD Status;
+
+    Log(XLL_DEBUG, L"Address: %p", Address);
+
+    Status = ERROR_NOT_FOUND;
+    Request = FindRequest(Xc, Address);
+    if (!Request) {
+        Log(XLL_ERROR, L"Address %p not mapped", Address);
+        goto fail;
+    }
+
+    In.RequestId = Request->Id;
+
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_GNTTAB_UNMAP_FOREIGN_PAGES,
+                              &In, sizeof(In),
+                              NULL, 0,
+                              &Returned,
+                              NULL);
+
+    if (!Success) {
+        Status = GetLastError();
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_GNTTAB_UNMAP_FOREIGN_PAGES failed");
+        goto fail;
+    } else {
+        Status = ERROR_SUCCESS;
+    }
+
+    EnterCriticalSection(&Xc->RequestListLock);
+    RemoveEntryList(&Request->ListEntry);
+    LeaveCriticalSection(&Xc->RequestListLock);
+    free(Request);
+
+    return Status;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", Status);
+    return Status;
+}
+
+DWORD
+XcGnttabCopy(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  ULONG Count,
+    IN  PXENIFACE_GNTTAB_COPY_SEGMENT Segments,
+    OUT DWORD *Results OPTIONAL
+    )
+{
+    XENIFACE_GNTTAB_COPY_IN *In = NULL;
+    XENIFACE_GNTTAB_COPY_OUT *Out;
+    DWORD Returned, InSize, OutSize;
+    BOOL Success;
+
+    Log(XLL_DEBUG, L"Count: %lu", Count);
+
+    if (Count == 0 || Count > XENIFACE_GNTTAB_COPY_MAX) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        goto fail;
+    }
+
+    // The output is smaller than the input, so one buffer serves both.
+    InSize = (ULONG)FIELD_OFFSET(XENIFACE_GNTTAB_COPY_IN, Segments[Count]);
+    OutSize = (ULONG)FIELD_OFFSET(XENIFACE_GNTTAB_COPY_OUT, Status[Count]);
+    In = malloc(InSize);
+    if (!In) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        goto fail;
+    }
+
+    In->NumberSegments = Count;
+    memcpy(&In->Segments, Segments, Count * sizeof(XENIFACE_GNTTAB_COPY_SEGMENT));
+
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_GNTTAB_COPY,
+                              In, InSize,
+                              In, OutSize,
+                              &Returned,
+                              NULL);
+
+    if (!Success) {
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_GNTTAB_COPY failed");
+        goto fail;
+    }
+
+    Out = (XENIFACE_GNTTAB_COPY_OUT *)In;
+    for (ULONG i = 0; i < Count; i++) {
+        if (Out->Status[i] < 0)
+            Log(XLL_WARNING, L"Segment %lu (domain %u, ref %lu): status 0x%x",
+                i, Segments[i].RemoteDomain, Segments[i].Reference, Out->Status[i]);
+
+        if (Results) {
+            if (Out->Status[i] >= 0)
+                Results[i] = ERROR_SUCCESS;
+            else if (Out->Status[i] == STATUS_ACCESS_VIOLATION)
+                Results[i] = ERROR_NOACCESS;
+            else if (Out->Status[i] == STATUS_INVALID_PARAMETER)
+                Results[i] = ERROR_INVALID_PARAMETER;
+            else
+                Results[i] = ERROR_GEN_FAILURE;
+        }
+    }
+
+    free(In);
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
+    free(In);
+    return GetLastError();
+}
+
+DWORD
+XcGnttabSetMapCacheBudget(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  ULONG64 Budget
+    )
+{
+    XENIFACE_GNTTAB_SET_MAP_CACHE_BUDGET_IN In;
+    DWORD Returned;
+    BOOL Success;
+
+    In.Budget = Budget;
+    Log(XLL_DEBUG, L"Budget: %llu", Budget);
+
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_GNTTAB_SET_MAP_CACHE_BUDGET,
+                              &In, sizeof(In),
+                              NULL, 0,
+                              &Returned,
+                              NULL);
+
+    if (!Success) {
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_GNTTAB_SET_MAP_CACHE_BUDGET failed");
+        goto fail;
+    }
+
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
+    return GetLastError();
+}
+
+DWORD
+XcGnttabQueryMapCache(
+    IN  PXENCONTROL_CONTEXT Xc,
+    OUT PXENIFACE_GNTTAB_MAP_CACHE_STATS Stats
+    )
+{
+    DWORD Returned;
+    BOOL Success;
+
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_GNTTAB_QUERY_MAP_CACHE,
+                              NULL, 0,
+                              Stats, sizeof(*Stats),
+                              &Returned,
+                              NULL);
+
+    if (!Success) {
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_GNTTAB_QUERY_MAP_CACHE failed");
+        goto fail;
+    }
+
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
+    return GetLastError();
+}
+
+DWORD
+XcStoreRead(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  PSTR Path,
+    IN  DWORD cbValue,
+    OUT CHAR *Value
+    )
+{
+    DWORD Returned;
+    BOOL Success;
+
+    Log(XLL_DEBUG, L"Path: '%S'", Path);
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_STORE_READ,
+                              Path, (DWORD)strlen(Path) + 1,
+                              Value, cbValue,
+                              &Returned,
+                              NULL);
+
+    if (!Success) {
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_STORE_READ failed");
+        goto fail;
+    }
+
+    Log(XLL_DEBUG, L"Value: '%S'", Value);
+
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
+    return GetLastError();
+}
+
+DWORD
+XcStoreWrite(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  PCHAR Path,
+    IN  PCHAR Value
+    )
+{
+    PCHAR Buffer;
+    DWORD cbBuffer;
+    DWORD Returned;
+    BOOL Success;
+
+    cbBuffer = (DWORD)(strlen(Path) + 1 + strlen(Value) + 1 + 1);
+    Buffer = malloc(cbBuffer);
+    if (!Buffer) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        goto fail;
+    }
+
+    ZeroMemory(Buffer, cbBuffer);
+    memcpy(Buffer, Path, strlen(Path));
+    memcpy(Buffer + strlen(Path) + 1, Value, strlen(Value));
+
+    Log(XLL_DEBUG, L"Path: '%S', Value: '%S'", Path, Value);
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_STORE_WRITE,
+                              Buffer, cbBuffer,
+                              NULL, 0,
+                              &Returned,
+                              NULL);
+
+    if (!Success) {
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_STORE_WRITE failed");
+        goto fail;
+    }
+
+    free(Buffer);
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
+    free(Buffer);
+    return GetLastError();
+}
+
+DWORD
+XcStoreDirectory(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  PCHAR Path,
+    IN  DWORD cbOutput,
+    OUT CHAR *Output
+    )
+{
+    DWORD Returned;
+    BOOL Success;
+
+    Log(XLL_DEBUG, L"Path: '%S'", Path);
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_STORE_DIRECTORY,
+                              Path, (DWORD)strlen(Path) + 1,
+                              Output, cbOutput,
+                              &Returned,
+                              NULL);
+
+    if (!Success) {
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_STORE_DIRECTORY failed");
+        goto fail;
+    }
+
+    _LogMultiSz(Xc, __FUNCTION__, XLL_DEBUG, Output);
+
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
+    return GetLastError();
+}
+
+DWORD
+XcStoreRemove(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  PCHAR Path
+    )
+{
+    DWORD Returned;
+    BOOL Success;
+
+    Log(XLL_DEBUG, L"Path: '%S'", Path);
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_STORE_REMOVE,
+                              Path, (DWORD)strlen(Path) + 1,
+                              NULL, 0,
+                              &Returned,
+                              NULL);
+
+    if (!Success) {
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_STORE_REMOVE failed");
+        goto fail;
+    }
+
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
+    return GetLastError();
+}
+
+DWORD
+XcStoreSetPermissions(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  PCHAR Path,
+    IN  ULONG Count,
+    IN  PXENIFACE_STORE_PERMISSION Permissions
+    )
+{
+    DWORD Returned, Size;
+    BOOL Success;
+    XENIFACE_STORE_SET_PERMISSIONS_IN *In = NULL;
+
+    Log(XLL_DEBUG, L"Path: '%S', Count: %lu", Path, Count);
+    for (ULONG i = 0; i < Count; i++)
+        Log(XLL_DEBUG, L"Domain: %d, Mask: 0x%x", Permissions[i].Domain, Permissions[i].Mask);
+
+    Size = (ULONG)FIELD_OFFSET(XENIFACE_STORE_SET_PERMISSIONS_IN, Permissions[Count]);
+    In = malloc(Size);
+    if (!In) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        goto fail;
+    }
+
+    In->Path = Path;
+    In->PathLength = (DWORD)strlen(In->Path) + 1;
+    In->NumberPermissions = Count;
+    memcpy(&In->Permissions, Permissions, Count * sizeof(XENIFACE_STORE_PERMISSION));
+
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_STORE_SET_PERMISSIONS,
+                              In, Size,
+                              NULL, 0,
+                              &Returned,
+                              NULL);
+
+    if (!Success) {
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_STORE_SET_PERMISSIONS failed");
+        goto fail;
+    }
+
+    free(In);
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
+    free(In);
+    return GetLastError();
+}
+
+DWORD
+XcStoreAddWatch(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  PCHAR Path,
+    IN  HANDLE Event,
+    OUT PVOID *Handle
+    )
+{
+    DWORD Returned;
+    BOOL Success;
+    XENIFACE_STORE_ADD_WATCH_IN In;
+    XENIFACE_STORE_ADD_WATCH_OUT Out;
+
+    Log(XLL_DEBUG, L"Path: '%S', Event: %p", Path, Event);
+
+    In.Path = Path;
+    In.PathLength = (DWORD)strlen(Path) + 1;
+    In.Event = Event;
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_STORE_ADD_WATCH,
+                              &In, sizeof(In),
+                              &Out, sizeof(Out),
+                              &Returned,
+                              NULL);
+
+    if (!Success) {
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_STORE_ADD_WATCH failed");
+        goto fail;
+    }
+
+    *Handle = Out.Context;
+
+    Log(XLL_DEBUG, L"Handle: %p", *Handle);
+
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
+    return GetLastError();
+}
+
+DWORD
+XcStoreRemoveWatch(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  PVOID Handle
+    )
+{
+    DWORD Returned;
+    BOOL Success;
+    XENIFACE_STORE_REMOVE_WATCH_IN In;
+
+    Log(XLL_DEBUG, L"Handle: %p", Handle);
+
+    In.Context = Handle;
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_STORE_REMOVE_WATCH,
+                              &In, sizeof(In),
+                              NULL, 0,
+                              &Returned,
+                              NULL);
+
+    if (!Success) {
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_STORE_REMOVE_WATCH failed");
+        goto fail;
+    }
+
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
+    return GetLastError();
+}
+
+DWORD
+XcQueryCacheStats(
+    IN  PXENCONTROL_CONTEXT Xc,
+    OUT PXENIFACE_CACHE_STATS_OUT Stats
+    )
+{
+    DWORD Returned;
+    BOOL Success;
+
+    Success = DeviceIoControl(Xc->XenIface,
+                              IOCTL_XENIFACE_QUERY_CACHE_STATS,
+                              NULL, 0,
+                              Stats, sizeof(*Stats),
+                              &Returned,
+                              NULL);
+
+    if (!Success) {
+        Log(XLL_ERROR, L"IOCTL_XENIFACE_QUERY_CACHE_STATS failed");
+        goto fail;
+    }
+
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", GetLastError());
+    return GetLastError();
+}
+
+static DWORD
+RingChannelNotify(
+    IN  PVOID Context
+    )
+{
+    PXENCONTROL_RING_CHANNEL Channel = Context;
+
+    return XcEvtchnNotify(Channel->Xc, Channel->LocalPort);
+}
+
+static DWORD
+RingChannelWait(
+    IN  PVOID Context,
+    IN  DWORD Timeout
+    )
+{
+    PXENCONTROL_RING_CHANNEL Channel = Context;
+
+    switch (WaitForSingleObject(Channel->Event, Timeout)) {
+    case WAIT_OBJECT_0:
+        return ERROR_SUCCESS;
+    case WAIT_TIMEOUT:
+        return ERROR_TIMEOUT;
+    default:
+        return GetLastError();
+    }
+}
+
+// Also undoes a partially set up channel: port 0 is never bound.
+static VOID
+RingChannelClose(
+    IN  PVOID Context
+    )
+{
+    PXENCONTROL_RING_CHANNEL Channel = Context;
+
+    if (Channel->LocalPort != 0)
+        XcEvtchnClose(Channel->Xc, Channel->LocalPort);
+
+    if (Channel->Address != NULL) {
+        if (Channel->Granted)
+            XcGnttabRevokeForeignAccess(Channel->Xc, Channel->Address);
+        else
+            XcGnttabUnmapForeignPages(Channel->Xc, Channel->Address);
+    }
+
+    if (Channel->Event != NULL)
+        CloseHandle(Channel->Event);
+
+    free(Channel);
+}
+
+static DWORD
+RingChannelOpen(
+    IN  PXENCONTROL_RING_CHANNEL Channel,
+    IN  ULONG Order,
+    OUT PXC_RING *Ring
+    )
+{
+    XC_RING_TRANSPORT Transport;
+
+    Transport.Context = Channel;
+    Transport.Notify = RingChannelNotify;
+    Transport.Wait = RingChannelWait;
+    Transport.Close = RingChannelClose;
+
+    return XcRingOpen(Channel->Address, Order, Channel->Granted, &Transport, Ring);
+}
+
+DWORD
+XcRingCreate(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  USHORT RemoteDomain,
+    IN  ULONG Order,
+    OUT PXC_RING *Ring,
+    OUT ULONG *References,
+    OUT ULONG *LocalPort
+    )
+{
+    PXENCONTROL_RING_CHANNEL Channel;
+    DWORD Status;
+
+    Log(XLL_DEBUG, L"RemoteDomain: %d, Order: %lu", RemoteDomain, Order);
+
+    if (Order > XC_RING_ORDER_MAX)
+        return ERROR_INVALID_PARAMETER;
+
+    Channel = malloc(sizeof(*Channel));
+    if (Channel == NULL)
+        return ERROR_OUTOFMEMORY;
+
+    ZeroMemory(Channel, sizeof(*Channel));
+    Channel->Xc = Xc;
+    Channel->Granted = TRUE;
+
+    Channel->Event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (Channel->Event == NULL) {
+        Status = GetLastError();
+        goto fail;
+    }
+
+    // the pages belong to our handle rather than to a pending request
+    Status = XcGnttabPermitForeignAccess(Xc, RemoteDomain, XC_RING_PAGES(Order), 0, 0,
+                                         XENIFACE_GNTTAB_USE_HANDLE,
+                                         &Channel->Address, References);
+    if (Status != ERROR_SUCCESS)
+        goto fail;
+
+    Status = XcEvtchnBindUnbound(Xc, RemoteDomain, Channel->Event, FALSE, &Channel->LocalPort);
+    if (Status != ERROR_SUCCESS)
+        goto fail;
+
+    Status = RingChannelOpen(Channel, Order, Ring);
+    if (Status != ERROR_SUCCESS)
+        goto fail;
+
+    *LocalPort = Channel->LocalPort;
+    Log(XLL_DEBUG, L"Ring: %p, LocalPort: %lu", *Ring, *LocalPort);
+
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", Status);
+    RingChannelClose(Channel);
+    return Status;
+}
+
+DWORD
+XcRingAttach(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  USHORT RemoteDomain,
+    IN  ULONG Order,
+    IN  PULONG References,
+    IN  ULONG RemotePort,
+    OUT PXC_RING *Ring
+    )
+{
+    PXENCONTROL_RING_CHANNEL Channel;
+    DWORD Status;
+
+    Log(XLL_DEBUG, L"RemoteDomain: %d, Order: %lu, RemotePort: %lu", RemoteDomain, Order, RemotePort);
+
+    if (Order > XC_RING_ORDER_MAX)
+        return ERROR_INVALID_PARAMETER;
+
+    Channel = malloc(sizeof(*Channel));
+    if (Channel == NULL)
+        return ERROR_OUTOFMEMORY;
+
+    ZeroMemory(Channel, sizeof(*Channel));
+    Channel->Xc = Xc;
+    Channel->Granted = FALSE;
+
+    Channel->Event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (Channel->Event == NULL) {
+        Status = GetLastError();
+        goto fail;
+    }
+
+    Status = XcGnttabMapForeignPages(Xc, RemoteDomain, XC_RING_PAGES(Order), References, 0, 0,
+                                     XENIFACE_GNTTAB_USE_HANDLE,
+                                     &Channel->Address);
+    if (Status != ERROR_SUCCESS)
+        goto fail;
+
+    Status = XcEvtchnBindInterdomain(Xc, RemoteDomain, RemotePort, Channel->Event, FALSE, &Channel->LocalPort);
+    if (Status != ERROR_SUCCESS)
+        goto fail;
+
+    Status = RingChannelOpen(Channel, Order, Ring);
+    if (Status != ERROR_SUCCESS)
+        goto fail;
+
+    Log(XLL_DEBUG, L"Ring: %p, LocalPort: %lu", *Ring, Channel->LocalPort);
+
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", Status);
+    RingChannelClose(Channel);
+    return Status;
+}
+
+static DWORD
+VchanChannelNotify(
+    IN  PVOID Context
+    )
+{
+    PXENCONTROL_VCHAN_CHANNEL Channel = Context;
+
+    return XcEvtchnNotify(Channel->Xc, Channel->LocalPort);
+}
+
+static DWORD
+VchanChannelWait(
+    IN  PVOID Context,
+    IN  DWORD Timeout
+    )
+{
+    PXENCONTROL_VCHAN_CHANNEL Channel = Context;
+
+    switch (WaitForSingleObject(Channel->Event, Timeout)) {
+    case WAIT_OBJECT_0:
+        return ERROR_SUCCESS;
+    case WAIT_TIMEOUT:
+        return ERROR_TIMEOUT;
+    default:
+        return GetLastError();
+    }
+}
+
+// Also undoes a partially set up channel: port 0 is never bound.
+static VOID
+VchanChannelClose(
+    IN  PVOID Context
+    )
+{
+    PXENCONTROL_VCHAN_CHANNEL Channel = Context;
+    PVOID Address[3];
+    ULONG Index;
+
+    Address[0] = Channel->LeftBuffer;
+    Address[1] = Channel->RightBuffer;
+    Address[2] = Channel->Interface;
+
+    for (Index = 0; Index < ARRAYSIZE(Address); Index++) {
+        if (Address[Index] == NULL)
+            continue;
+
+        if (Channel->Server)
+            XcGnttabRevokeForeignAccess(Channel->Xc, Address[Index]);
+        else
+            XcGnttabUnmapForeignPages(Channel->Xc, Address[Index]);
+    }
+
+    if (Channel->LocalPort != 0)
+        XcEvtchnClose(Channel->Xc, Channel->LocalPort);
+
+    if (Channel->Event != NULL)
+        CloseHandle(Channel->Event);
+
+    if (Channel->Path != NULL) {
+        XcStoreRemove(Channel->Xc, Channel->Path);
+        free(Channel->Path);
+    }
+
+    free(Channel);
+}
+
+static PXENCONTROL_VCHAN_CHANNEL
+VchanChannelCreate(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  BOOL Server
+    )
+{
+    PXENCONTROL_VCHAN_CHANNEL Channel;
+
+    Channel = malloc(sizeof(*Channel));
+    if (Channel == NULL) {
+        SetLastError(ERROR_OUTOFMEMORY);
+        return NULL;
+    }
+
+    ZeroMemory(Channel, sizeof(*Channel));
+    Channel->Xc = Xc;
+    Channel->Server = Server;
+
+    Channel->Event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (Channel->Event == NULL) {
+        free(Channel);
+        return NULL;
+    }
+
+    return Channel;
+}
+
+static DWORD
+VchanChannelOpen(
+    IN  PXENCONTROL_VCHAN_CHANNEL Channel,
+    IN  ULONG LeftOrder,
+    IN  ULONG RightOrder,
+    OUT PXC_VCHAN *Vchan
+    )
+{
+    XC_RING_TRANSPORT Transport;
+
+    Transport.Context = Channel;
+    Transport.Notify = VchanChannelNotify;
+    Transport.Wait = VchanChannelWait;
+    Transport.Close = VchanChannelClose;
+
+    return XcVchanOpen(Channel->Interface, Channel->Server, LeftOrder, RightOrder,
+                       Channel->LeftBuffer, Channel->RightBuffer, &Transport, Vchan);
+}
+
+// Smallest ring of at least Min bytes that isn't in the control page.
+static ULONG
+VchanPageOrder(
+    IN  ULONG Min
+    )
+{
+    ULONG Order = XC_VCHAN_PAGE_SHIFT;
+
+    while (Order <= XC_VCHAN_ORDER_MAX && (1UL << Order) < Min)
+        Order++;
+
+    return Order;
+}
+
+// Write Path/Name, readable by RemoteDomain only.
+static DWORD
+VchanStoreWrite(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  PCHAR Path,
+    IN  PCHAR Name,
+    IN  ULONG Value,
+    IN  USHORT LocalDomain,
+    IN  USHORT RemoteDomain
+    )
+{
+    XENIFACE_STORE_PERMISSION Permissions[2];
+    CHAR Buffer[16];
+    PCHAR Key;
+    size_t Size;
+    DWORD Status;
+
+    Size = strlen(Path) + 1 + strlen(Name) + 1;
+    Key = malloc(Size);
+    if (Key == NULL)
+        return ERROR_OUTOFMEMORY;
+
+    sprintf_s(Key, Size, "%s/%s", Path, Name);
+    sprintf_s(Buffer, sizeof(Buffer), "%lu", Value);
+
+    Status = XcStoreWrite(Xc, Key, Buffer);
+    if (Status != ERROR_SUCCESS)
+        goto fail;
+
+    // the first entry is the owner and the default for other domains
+    Permissions[0].Domain = LocalDomain;
+    Permissions[0].Mask = XENIFACE_STORE_PERM_NONE;
+    Permissions[1].Domain = RemoteDomain;
+    Permissions[1].Mask = XENIFACE_STORE_PERM_READ;
+
+    Status = XcStoreSetPermissions(Xc, Key, ARRAYSIZE(Permissions), Permissions);
+    if (Status != ERROR_SUCCESS)
+        goto fail;
+
+    free(Key);
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", Status);
+    free(Key);
+    return Status;
+}
+
+DWORD
+XcVchanServerInit(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  USHORT RemoteDomain,
+    IN  PCHAR Path,
+    IN  ULONG ReadMin,
+    IN  ULONG WriteMin,
+    OUT PXC_VCHAN *Vchan
+    )
+{
+    PXENCONTROL_VCHAN_CHANNEL Channel;
+    PXC_VCHAN Open = NULL;
+    ULONG LeftOrder, RightOrder;
+    ULONG LeftPages, RightPages;
+    ULONG Reference;
+    CHAR Value[16];
+    USHORT LocalDomain;
+    DWORD Status;
+
+    Log(XLL_DEBUG, L"RemoteDomain: %d, Path: '%S', ReadMin: %lu, WriteMin: %lu",
+        RemoteDomain, Path, ReadMin, WriteMin);
+
+    // same ring sizes as libxenvchan: the small rings go in the control page
+    // if they fit, the server reads the left ring
+    if (ReadMin <= (1UL << XC_VCHAN_SMALL_ORDER) && WriteMin <= (1UL << XC_VCHAN_LARGE_ORDER)) {
+        LeftOrder = XC_VCHAN_SMALL_ORDER;
+        RightOrder = XC_VCHAN_LARGE_ORDER;
+    } else if (ReadMin <= (1UL << XC_VCHAN_LARGE_ORDER) && WriteMin <= (1UL << XC_VCHAN_SMALL_ORDER)) {
+        LeftOrder = XC_VCHAN_LARGE_ORDER;
+        RightOrder = XC_VCHAN_SMALL_ORDER;
+    } else if (ReadMin <= (1UL << XC_VCHAN_LARGE_ORDER)) {
+        LeftOrder = XC_VCHAN_LARGE_ORDER;
+        RightOrder = VchanPageOrder(WriteMin);
+    } else if (WriteMin <= (1UL << XC_VCHAN_LARGE_ORDER)) {
+        LeftOrder = VchanPageOrder(ReadMin);
+        RightOrder = XC_VCHAN_LARGE_ORDER;
+    } else {
+        LeftOrder = VchanPageOrder(ReadMin);
+        RightOrder = VchanPageOrder(WriteMin);
+    }
+
+    if (LeftOrder > XC_VCHAN_ORDER_MAX || RightOrder > XC_VCHAN_ORDER_MAX)
+        return ERROR_INVALID_PARAMETER;
+
+    LeftPages = XC_VCHAN_PAGES(LeftOrder);
+    RightPages = XC_VCHAN_PAGES(RightOrder);
+
+    Status = XcStoreRead(Xc, "domid", sizeof(Value), Value);
+    if (Status != ERROR_SUCCESS)
+        return Status;
+
+    LocalDomain = (USHORT)atoi(Value);
+
+    Channel = VchanChannelCreate(Xc, TRUE);
+    if (Channel == NULL)
+        return GetLastError();
+
+    Channel->Path = _strdup(Path);
+    Status = ERROR_OUTOFMEMORY;
+    if (Channel->Path == NULL)
+        goto fail;
+
+    Status = XcEvtchnBindUnbound(Xc, RemoteDomain, Channel->Event, FALSE, &Channel->LocalPort);
+    if (Status != ERROR_SUCCESS)
+        goto fail;
+
+    // if we go away without closing, the client sees ServerLive drop
+    Status = XcGnttabPermitForeignAccess(Xc, RemoteDomain, 1,
+                                         FIELD_OFFSET(XC_VCHAN_INTERFACE, ServerLive),
+                                         Channel->LocalPort,
+                                         XENIFACE_GNTTAB_USE_HANDLE |
+                                         XENIFACE_GNTTAB_USE_NOTIFY_OFFSET |
+                                         XENIFACE_GNTTAB_USE_NOTIFY_PORT,
+                                         (PVOID *)&Channel->Interface, &Reference);
+    if (Status != ERROR_SUCCESS)
+        goto fail;
+
+    if (LeftPages != 0) {
+        Status = XcGnttabPermitForeignAccess(Xc, RemoteDomain, LeftPages, 0, 0,
+                                             XENIFACE_GNTTAB_USE_HANDLE,
+                                             &Channel->LeftBuffer,
+                                             &Channel->Interface->Grants[0]);
+        if (Status != ERROR_SUCCESS)
+            goto fail;
+    }
+
+    if (RightPages != 0) {
+        Status = XcGnttabPermitForeignAccess(Xc, RemoteDomain, RightPages, 0, 0,
+                                             XENIFACE_GNTTAB_USE_HANDLE,
+                                             &Channel->RightBuffer,
+                                             &Channel->Interface->Grants[LeftPages]);
+        if (Status != ERROR_SUCCESS)
+            goto fail;
+    }
+
+    // once open, the vchan owns the channel
+    Status = VchanChannelOpen(Channel, LeftOrder, RightOrder, &Open);
+    if (Status != ERROR_SUCCESS)
+        goto fail;
+
+    Status = VchanStoreWrite(Xc, Path, "ring-ref", Reference, LocalDomain, RemoteDomain);
+    if (Status != ERROR_SUCCESS)
+        goto fail;
+
+    Status = VchanStoreWrite(Xc, Path, "event-channel", Channel->LocalPort, LocalDomain, RemoteDomain);
+    if (Status != ERROR_SUCCESS)
+        goto fail;
+
+    Log(XLL_DEBUG, L"Vchan: %p, Reference: %lu, LocalPort: %lu, LeftOrder: %lu, RightOrder: %lu",
+        Open, Reference, Channel->LocalPort, LeftOrder, RightOrder);
+
+    *Vchan = Open;
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", Status);
+    if (Open != NULL)
+        XcVchanClose(Open);
+    else
+        VchanChannelClose(Channel);
+    return Status;
+}
+
+DWORD
+XcVchanClientInit(
+    IN  PXENCONTROL_CONTEXT Xc,
+    IN  USHORT RemoteDomain,
+    IN  PCHAR Path,
+    OUT PXC_VCHAN *Vchan
+    )
+{
+    PXENCONTROL_VCHAN_CHANNEL Channel;
+    ULONG LeftOrder, RightOrder;
+    ULONG LeftPages, RightPages;
+    ULONG Reference, RemotePort;
+    PULONG Grants = NULL;
+    PCHAR Key;
+    size_t Size;
+    CHAR Value[16];
+    DWORD Status;
+
+    Log(XLL_DEBUG, L"RemoteDomain: %d, Path: '%S'", RemoteDomain, Path);
+
+    Size = strlen(Path) + sizeof("/event-channel");
+    Key = malloc(Size);
+    if (Key == NULL)
+        return ERROR_OUTOFMEMORY;
+
+    sprintf_s(Key, Size, "%s/ring-ref", Path);
+    Status = XcStoreRead(Xc, Key, sizeof(Value), Value);
+    if (Status != ERROR_SUCCESS) {
+        free(Key);
+        return Status;
+    }
+    Reference = strtoul(Value, NULL, 10);
+
+    sprintf_s(Key, Size, "%s/event-channel", Path);
+    Status = XcStoreRead(Xc, Key, sizeof(Value), Value);
+    free(Key);
+    if (Status != ERROR_SUCCESS)
+        return Status;
+    RemotePort = strtoul(Value, NULL, 10);
+
+    Channel = VchanChannelCreate(Xc, FALSE);
+    if (Channel == NULL)
+        return GetLastError();
+
+    Status = XcEvtchnBindInterdomain(Xc, RemoteDomain, RemotePort, Channel->Event, FALSE, &Channel->LocalPort);
+    if (Status != ERROR_SUCCESS)
+        goto fail;
+
+    // if we go away without closing, the server sees ClientLive drop
+    Status = XcGnttabMapForeignPages(Xc, RemoteDomain, 1, &Reference,
+                                     FIELD_OFFSET(XC_VCHAN_INTERFACE, ClientLive),
+                                     Channel->LocalPort,
+                                     XENIFACE_GNTTAB_USE_HANDLE |
+                                     XENIFACE_GNTTAB_USE_NOTIFY_OFFSET |
+                                     XENIFACE_GNTTAB_USE_NOTIFY_PORT,
+                                     (PVOID *)&Channel->Interface);
+    if (Status != ERROR_SUCCESS)
+        goto fail;
+
+    // the server can change the page under us: read everything once and
+    // check it before use
+    LeftOrder = Channel->Interface->LeftOrder;
+    RightOrder = Channel->Interface->RightOrder;
+    MemoryBarrier();
+
+    Status = ERROR_INVALID_DATA;
+    if (LeftOrder > XC_VCHAN_ORDER_MAX || RightOrder > XC_VCHAN_ORDER_MAX)
+        goto fail;
+
+    LeftPages = XC_VCHAN_PAGES(LeftOrder);
+    RightPages = XC_VCHAN_PAGES(RightOrder);
+
+    if (FIELD_OFFSET(XC_VCHAN_INTERFACE, Grants[LeftPages + RightPages]) > (1UL << XC_VCHAN_PAGE_SHIFT))
+        goto fail;
+
+    Status = ERROR_OUTOFMEMORY;
+    Grants = malloc((LeftPages + RightPages + 1) * sizeof(ULONG));
+    if (Grants == NULL)
+        goto fail;
+
+    memcpy(Grants, Channel->Interface->Grants, (LeftPages + RightPages) * sizeof(ULONG));
+
+    if (LeftPages != 0) {
+        Status = XcGnttabMapForeignPages(Xc, RemoteDomain, LeftPages, &Grants[0], 0, 0,
+                                         XENIFACE_GNTTAB_USE_HANDLE,
+                                         &Channel->LeftBuffer);
+        if (Status != ERROR_SUCCESS)
+            goto fail;
+    }
+
+    if (RightPages != 0) {
+        Status = XcGnttabMapForeignPages(Xc, RemoteDomain, RightPages, &Grants[LeftPages], 0, 0,
+                                         XENIFACE_GNTTAB_USE_HANDLE,
+                                         &Channel->RightBuffer);
+        if (Status != ERROR_SUCCESS)
+            goto fail;
+    }
+
+    Status = VchanChannelOpen(Channel, LeftOrder, RightOrder, Vchan);
+    if (Status != ERROR_SUCCESS)
+        goto fail;
+
+    free(Grants);
+
+    Log(XLL_DEBUG, L"Vchan: %p, LocalPort: %lu, LeftOrder: %lu, RightOrder: %lu",
+        *Vchan, Channel->LocalPort, LeftOrder, RightOrder);
+
+    return ERROR_SUCCESS;
+
+fail:
+    Log(XLL_ERROR, L"Error: 0x%x", Status);
+    free(Grants);
+    VchanChannelClose(Channel);
+    return Status;
 }
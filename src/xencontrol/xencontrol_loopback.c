@@ -0,0 +1,147 @@
+/* In-process loopback transport, see xencontrol_loopback.h.
+ *
+ * Both ends live in this process: notifications are auto-reset events and
+ * the shared pages are ordinary memory. Only the C runtime (and pthreads
+ * off Windows, see xencontrol_portable.h) is needed.
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+#include <malloc.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#include "xencontrol_loopback.h"
+#include "xencontrol_portable.h"
+
+typedef struct _LOOPBACK LOOPBACK, *PLOOPBACK;
+
+typedef struct _LOOPBACK_END {
+    PLOOPBACK Loopback;
+    PORTABLE_EVENT Event;
+    struct _LOOPBACK_END *Peer;
+} LOOPBACK_END, *PLOOPBACK_END;
+
+struct _LOOPBACK {
+    volatile long References;
+    PVOID Shared;
+    LOOPBACK_END End[2];
+};
+
+static DWORD
+LoopbackNotify(
+    IN  PVOID Context
+    )
+{
+    PLOOPBACK_END End = Context;
+
+    return PortableEventSet(&End->Peer->Event);
+}
+
+static DWORD
+LoopbackWait(
+    IN  PVOID Context,
+    IN  DWORD Timeout
+    )
+{
+    PLOOPBACK_END End = Context;
+
+    return PortableEventWait(&End->Event, Timeout);
+}
+
+static VOID
+LoopbackRelease(
+    IN  PLOOPBACK Loopback
+    )
+{
+#ifdef _WIN32
+    if (InterlockedDecrement(&Loopback->References) != 0)
+        return;
+#else
+    if (__atomic_sub_fetch(&Loopback->References, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+#endif
+
+    PortableEventTeardown(&Loopback->End[1].Event);
+    PortableEventTeardown(&Loopback->End[0].Event);
+#ifdef _WIN32
+    _aligned_free(Loopback->Shared);
+#else
+    free(Loopback->Shared);
+#endif
+    free(Loopback);
+}
+
+static VOID
+LoopbackClose(
+    IN  PVOID Context
+    )
+{
+    PLOOPBACK_END End = Context;
+
+    LoopbackRelease(End->Loopback);
+}
+
+DWORD
+LoopbackCreate(
+    IN  ULONG Size,
+    OUT PVOID *Shared,
+    OUT XC_RING_TRANSPORT Transport[2]
+    )
+{
+    PLOOPBACK Loopback;
+    ULONG Index;
+    DWORD Error;
+
+    Error = ERROR_NOT_ENOUGH_MEMORY;
+    Loopback = calloc(1, sizeof(*Loopback));
+    if (Loopback == NULL)
+        goto fail1;
+
+#ifdef _WIN32
+    Loopback->Shared = _aligned_malloc(Size, XC_RING_PAGE_SIZE);
+#else
+    if (posix_memalign(&Loopback->Shared, XC_RING_PAGE_SIZE, Size) != 0)
+        Loopback->Shared = NULL;
+#endif
+    if (Loopback->Shared == NULL)
+        goto fail2;
+
+    memset(Loopback->Shared, 0, Size);
+
+    for (Index = 0; Index < 2; Index++) {
+        Loopback->End[Index].Loopback = Loopback;
+        Loopback->End[Index].Peer = &Loopback->End[1 - Index];
+
+        Error = PortableEventInitialize(&Loopback->End[Index].Event);
+        if (Error != ERROR_SUCCESS)
+            goto fail3;
+    }
+
+    for (Index = 0; Index < 2; Index++) {
+        Transport[Index].Context = &Loopback->End[Index];
+        Transport[Index].Notify = LoopbackNotify;
+        Transport[Index].Wait = LoopbackWait;
+        Transport[Index].Close = LoopbackClose;
+    }
+
+    Loopback->References = 2;
+
+    *Shared = Loopback->Shared;
+    return ERROR_SUCCESS;
+
+fail3:
+    while (Index-- != 0)
+        PortableEventTeardown(&Loopback->End[Index].Event);
+
+#ifdef _WIN32
+    _aligned_free(Loopback->Shared);
+#else
+    free(Loopback->Shared);
+#endif
+fail2:
+    free(Loopback);
+fail1:
+    return Error;
+}
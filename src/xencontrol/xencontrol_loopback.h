@@ -0,0 +1,17 @@
+#ifndef _XENCONTROL_LOOPBACK_H_
+#define _XENCONTROL_LOOPBACK_H_
+
+#include "xencontrol_ring.h"
+
+// In-process stand-in for grants and an event channel: Size bytes of
+// zeroed, page-aligned memory and a transport for each of its two ends.
+// Notifying one end wakes a Wait on the other. The memory is freed once
+// the Close callbacks of both transports have run.
+DWORD
+LoopbackCreate(
+    IN  ULONG Size,
+    OUT PVOID *Shared,
+    OUT XC_RING_TRANSPORT Transport[2]
+    );
+
+#endif // _XENCONTROL_LOOPBACK_H_
@@ -0,0 +1,182 @@
+#ifndef _XENCONTROL_PORTABLE_H_
+#define _XENCONTROL_PORTABLE_H_
+
+// Threads, a monotonic clock and auto-reset events on Windows and on any
+// host with pthreads. Shared by the in-process loopback transport and the
+// xencontrol-test harnesses, which also build off Windows against it.
+
+#ifdef _WIN32
+#include <windows.h>
+#define PORTABLE_INLINE static __inline
+#else
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "xencontrol_ring.h" // Windows types
+#define PORTABLE_INLINE static inline
+#endif
+
+#ifdef _WIN32
+typedef HANDLE PORTABLE_THREAD;
+#define PORTABLE_THREAD_PROC DWORD WINAPI
+#else
+typedef pthread_t PORTABLE_THREAD;
+#define PORTABLE_THREAD_PROC void *
+#endif
+
+typedef PORTABLE_THREAD_PROC PORTABLE_THREAD_ROUTINE(PVOID);
+
+PORTABLE_INLINE DWORD
+PortableThreadStart(
+    OUT PORTABLE_THREAD *Thread,
+    IN  PORTABLE_THREAD_ROUTINE *Routine,
+    IN  PVOID Context
+    )
+{
+#ifdef _WIN32
+    *Thread = CreateThread(NULL, 0, Routine, Context, 0, NULL);
+    return *Thread ? ERROR_SUCCESS : GetLastError();
+#else
+    return pthread_create(Thread, NULL, Routine, Context);
+#endif
+}
+
+PORTABLE_INLINE VOID
+PortableThreadJoin(
+    IN  PORTABLE_THREAD Thread
+    )
+{
+#ifdef _WIN32
+    WaitForSingleObject(Thread, INFINITE);
+    CloseHandle(Thread);
+#else
+    pthread_join(Thread, NULL);
+#endif
+}
+
+// Monotonic time in nanoseconds
+PORTABLE_INLINE ULONG64
+PortableNow(
+    VOID
+    )
+{
+#ifdef _WIN32
+    static LARGE_INTEGER Frequency;
+    LARGE_INTEGER Now;
+
+    if (Frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&Frequency);
+
+    QueryPerformanceCounter(&Now);
+    return (ULONG64)((double)Now.QuadPart * 1000000000.0 / Frequency.QuadPart);
+#else
+    struct timespec Now;
+
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (ULONG64)Now.tv_sec * 1000000000ULL + Now.tv_nsec;
+#endif
+}
+
+// Auto-reset event: a Wait consumes the Set that satisfied it.
+typedef struct _PORTABLE_EVENT {
+#ifdef _WIN32
+    HANDLE Handle;
+#else
+    pthread_mutex_t Lock;
+    pthread_cond_t Cond;
+    BOOL Signaled;
+#endif
+} PORTABLE_EVENT, *PPORTABLE_EVENT;
+
+PORTABLE_INLINE DWORD
+PortableEventInitialize(
+    IN  PPORTABLE_EVENT Event
+    )
+{
+#ifdef _WIN32
+    Event->Handle = CreateEvent(NULL, FALSE, FALSE, NULL);
+    return Event->Handle ? ERROR_SUCCESS : GetLastError();
+#else
+    Event->Signaled = FALSE;
+    pthread_mutex_init(&Event->Lock, NULL);
+    pthread_cond_init(&Event->Cond, NULL);
+    return ERROR_SUCCESS;
+#endif
+}
+
+PORTABLE_INLINE VOID
+PortableEventTeardown(
+    IN  PPORTABLE_EVENT Event
+    )
+{
+#ifdef _WIN32
+    if (Event->Handle != NULL)
+        CloseHandle(Event->Handle);
+    Event->Handle = NULL;
+#else
+    pthread_cond_destroy(&Event->Cond);
+    pthread_mutex_destroy(&Event->Lock);
+#endif
+}
+
+PORTABLE_INLINE DWORD
+PortableEventSet(
+    IN  PPORTABLE_EVENT Event
+    )
+{
+#ifdef _WIN32
+    return SetEvent(Event->Handle) ? ERROR_SUCCESS : GetLastError();
+#else
+    pthread_mutex_lock(&Event->Lock);
+    Event->Signaled = TRUE;
+    pthread_cond_signal(&Event->Cond);
+    pthread_mutex_unlock(&Event->Lock);
+    return ERROR_SUCCESS;
+#endif
+}
+
+// Returns ERROR_SUCCESS, ERROR_TIMEOUT or an error code.
+PORTABLE_INLINE DWORD
+PortableEventWait(
+    IN  PPORTABLE_EVENT Event,
+    IN  DWORD Timeout
+    )
+{
+#ifdef _WIN32
+    switch (WaitForSingleObject(Event->Handle, Timeout)) {
+    case WAIT_OBJECT_0:
+        return ERROR_SUCCESS;
+    case WAIT_TIMEOUT:
+        return ERROR_TIMEOUT;
+    default:
+        return GetLastError();
+    }
+#else
+    struct timespec Deadline;
+    DWORD Status = ERROR_SUCCESS;
+
+    clock_gettime(CLOCK_REALTIME, &Deadline);
+    Deadline.tv_sec += Timeout / 1000;
+    Deadline.tv_nsec += (long)(Timeout % 1000) * 1000000;
+    if (Deadline.tv_nsec >= 1000000000) {
+        Deadline.tv_sec++;
+        Deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&Event->Lock);
+    while (!Event->Signaled) {
+        int Error = Timeout == INFINITE ?
+                    pthread_cond_wait(&Event->Cond, &Event->Lock) :
+                    pthread_cond_timedwait(&Event->Cond, &Event->Lock, &Deadline);
+        if (Error == ETIMEDOUT) {
+            Status = ERROR_TIMEOUT;
+            break;
+        }
+    }
+    Event->Signaled = FALSE;
+    pthread_mutex_unlock(&Event->Lock);
+    return Status;
+#endif
+}
+
+#endif // _XENCONTROL_PORTABLE_H_
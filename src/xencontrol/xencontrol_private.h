@@ -3,6 +3,8 @@
 
 #include <windows.h>
 #include "xencontrol.h"
+#include "xencontrol_ring.h"
+#include "xencontrol_vchan.h"
 
 #define Log(level, format, ...) \
         _Log(Xc->Logger, level, Xc->LogLevel, __FUNCTION__, format, __VA_ARGS__)
@@ -34,7 +36,6 @@ typedef struct _XENCONTROL_CONTEXT {
     HANDLE XenIface;
     XENCONTROL_LOGGER *Logger;
     XENCONTROL_LOG_LEVEL LogLevel;
-    ULONG RequestId;
     LIST_ENTRY RequestList;
     CRITICAL_SECTION RequestListLock;
 } XENCONTROL_CONTEXT, *PXENCONTROL_CONTEXT;
@@ -46,4 +47,23 @@ typedef struct _XENCONTROL_GNTTAB_REQUEST {
     PVOID       Address;
 } XENCONTROL_GNTTAB_REQUEST, *PXENCONTROL_GNTTAB_REQUEST;
 
+typedef struct _XENCONTROL_RING_CHANNEL {
+    PXENCONTROL_CONTEXT Xc;
+    HANDLE              Event;
+    ULONG               LocalPort;
+    PVOID               Address;
+    BOOL                Granted;
+} XENCONTROL_RING_CHANNEL, *PXENCONTROL_RING_CHANNEL;
+
+typedef struct _XENCONTROL_VCHAN_CHANNEL {
+    PXENCONTROL_CONTEXT Xc;
+    HANDLE              Event;
+    ULONG               LocalPort;
+    PXC_VCHAN_INTERFACE Interface;
+    PVOID               LeftBuffer;
+    PVOID               RightBuffer;
+    BOOL                Server;
+    PCHAR               Path;
+} XENCONTROL_VCHAN_CHANNEL, *PXENCONTROL_VCHAN_CHANNEL;
+
 #endif // _XENCONTROL_PRIVATE_H_
@@ -0,0 +1,414 @@
+/* Single-producer, single-consumer message ring, see xencontrol_ring.h.
+ *
+ * This file only depends on the C runtime, so the ring and its loopback
+ * transport also build outside of xencontrol:
+ *
+ *     cc -O2 -pthread -I../../include -c xencontrol_ring.c xencontrol_loopback.c
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#include "xencontrol_ring.h"
+#include "xencontrol_loopback.h"
+
+#ifdef _WIN32
+#define XC_RING_MB()       MemoryBarrier()
+#if defined(_M_IX86) || defined(_M_X64)
+// stores aren't reordered with older stores nor loads with older loads
+#define XC_RING_ACQUIRE()  _ReadWriteBarrier()
+#define XC_RING_RELEASE()  _ReadWriteBarrier()
+#else
+#define XC_RING_ACQUIRE()  MemoryBarrier()
+#define XC_RING_RELEASE()  MemoryBarrier()
+#endif
+#else
+#define XC_RING_MB()       __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define XC_RING_ACQUIRE()  __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define XC_RING_RELEASE()  __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
+
+#define XC_RING_ALIGN(Length) \
+    (((Length) + sizeof(XC_RING_RECORD) - 1) & ~(ULONG)(sizeof(XC_RING_RECORD) - 1))
+
+struct _XC_RING {
+    PXC_RING_SHARED Shared;
+    PUCHAR Data;
+    ULONG Size;
+    ULONG ProdPvt;      // producer: end of the reserved records
+    ULONG ConsPvt;      // consumer: start of the next record
+    ULONG PeekNext;     // consumer: end of the record returned by XcRingPeek
+    BOOL Peeked;
+    ULONG64 Pending;    // producer: records reserved since the last commit
+    XC_RING_TRANSPORT Transport;
+    XC_RING_STATS Stats;
+};
+
+static DWORD
+RingNotify(
+    IN  PXC_RING Ring
+    )
+{
+    Ring->Stats.Notifies++;
+    return Ring->Transport.Notify(Ring->Transport.Context);
+}
+
+static DWORD
+RingWait(
+    IN  PXC_RING Ring,
+    IN  DWORD Timeout
+    )
+{
+    Ring->Stats.Waits++;
+    return Ring->Transport.Wait(Ring->Transport.Context, Timeout);
+}
+
+// Bytes of padding and of the record that a payload of Length bytes takes
+// at the current producer index.
+static ULONG
+RingSpace(
+    IN  PXC_RING Ring,
+    IN  ULONG Length,
+    OUT ULONG *Pad
+    )
+{
+    ULONG Need = XC_RING_ALIGN(sizeof(XC_RING_RECORD) + Length);
+    ULONG Offset = Ring->ProdPvt & (Ring->Size - 1);
+
+    *Pad = (Ring->Size - Offset < Need) ? Ring->Size - Offset : 0;
+    return Need;
+}
+
+DWORD
+XcRingOpen(
+    IN  PVOID Shared,
+    IN  ULONG Order,
+    IN  BOOL Initialize,
+    IN  const XC_RING_TRANSPORT *Transport,
+    OUT PXC_RING *Ring
+    )
+{
+    PXC_RING_SHARED Header = Shared;
+    PXC_RING New;
+
+    if (Shared == NULL ||
+        Order > XC_RING_ORDER_MAX ||
+        Transport == NULL ||
+        Transport->Notify == NULL ||
+        Transport->Wait == NULL ||
+        Ring == NULL)
+        return ERROR_INVALID_PARAMETER;
+
+    if (Initialize) {
+        memset(Header, 0, sizeof(*Header));
+        Header->ConsEvent = 1;
+        Header->ProdEvent = 1;
+        Header->Order = Order;
+        XC_RING_RELEASE();
+        Header->Magic = XC_RING_MAGIC;
+    } else {
+        if (Header->Magic != XC_RING_MAGIC || Header->Order != Order)
+            return ERROR_INVALID_DATA;
+        // records start aligned, so a record header never straddles the end
+        if ((Header->Prod | Header->Cons) & (sizeof(XC_RING_RECORD) - 1))
+            return ERROR_INVALID_DATA;
+        XC_RING_ACQUIRE();
+    }
+
+    New = calloc(1, sizeof(*New));
+    if (New == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    New->Shared = Header;
+    New->Data = (PUCHAR)Shared + XC_RING_PAGE_SIZE;
+    New->Size = XC_RING_PAGE_SIZE << Order;
+    New->ProdPvt = Header->Prod;
+    New->ConsPvt = Header->Cons;
+    New->Transport = *Transport;
+
+    *Ring = New;
+    return ERROR_SUCCESS;
+}
+
+VOID
+XcRingClose(
+    IN  PXC_RING Ring
+    )
+{
+    if (Ring == NULL)
+        return;
+
+    if (Ring->Transport.Close != NULL)
+        Ring->Transport.Close(Ring->Transport.Context);
+
+    free(Ring);
+}
+
+ULONG
+XcRingMaxLength(
+    IN  PXC_RING Ring
+    )
+{
+    return Ring->Size / 2 - sizeof(XC_RING_RECORD);
+}
+
+DWORD
+XcRingReserve(
+    IN  PXC_RING Ring,
+    IN  ULONG Length,
+    OUT PVOID *Buffer
+    )
+{
+    PXC_RING_RECORD Record;
+    ULONG Need;
+    ULONG Pad;
+    ULONG Cons;
+
+    if (Length > XcRingMaxLength(Ring))
+        return ERROR_INVALID_PARAMETER;
+
+    Need = RingSpace(Ring, Length, &Pad);
+
+    Cons = Ring->Shared->Cons;
+    XC_RING_ACQUIRE(); // don't write the data before the consumer is done with it
+
+    if (Ring->Size - (Ring->ProdPvt - Cons) < Pad + Need)
+        return ERROR_RETRY;
+
+    if (Pad != 0) {
+        Record = (PXC_RING_RECORD)(Ring->Data + (Ring->ProdPvt & (Ring->Size - 1)));
+        Record->Length = XC_RING_PADDING | Pad;
+        Ring->ProdPvt += Pad;
+    }
+
+    Record = (PXC_RING_RECORD)(Ring->Data + (Ring->ProdPvt & (Ring->Size - 1)));
+    Record->Length = Length;
+    Record->Reserved = 0;
+    Ring->ProdPvt += Need;
+    Ring->Pending++;
+
+    *Buffer = Record + 1;
+    return ERROR_SUCCESS;
+}
+
+DWORD
+XcRingCommit(
+    IN  PXC_RING Ring
+    )
+{
+    ULONG Old = Ring->Shared->Prod;
+    ULONG New = Ring->ProdPvt;
+
+    if (Old == New)
+        return ERROR_SUCCESS;
+
+    XC_RING_RELEASE(); // records before index
+    Ring->Shared->Prod = New;
+    Ring->Stats.Committed += Ring->Pending;
+    Ring->Pending = 0;
+    XC_RING_MB(); // index before event
+
+    if ((ULONG)(New - Ring->Shared->ProdEvent) < (ULONG)(New - Old))
+        return RingNotify(Ring);
+
+    return ERROR_SUCCESS;
+}
+
+DWORD
+XcRingPeek(
+    IN  PXC_RING Ring,
+    OUT PVOID *Buffer,
+    OUT ULONG *Length
+    )
+{
+    PXC_RING_RECORD Record;
+    ULONG Prod;
+    ULONG Avail;
+    ULONG Offset;
+    ULONG Value;
+    ULONG Need;
+
+    Prod = Ring->Shared->Prod;
+    XC_RING_ACQUIRE(); // index before records
+
+    // the other end may be hostile: read the index and the length once and
+    // don't let either reach past the data pages
+    Avail = Prod - Ring->ConsPvt;
+    if (Avail == 0)
+        return ERROR_NO_DATA;
+
+    if (Avail > Ring->Size)
+        return ERROR_INVALID_DATA;
+
+    Offset = Ring->ConsPvt & (Ring->Size - 1);
+    Record = (PXC_RING_RECORD)(Ring->Data + Offset);
+    Value = *(volatile ULONG *)&Record->Length;
+
+    if (Value & XC_RING_PADDING) {
+        if ((Value & ~XC_RING_PADDING) != Ring->Size - Offset ||
+            Ring->Size - Offset > Avail)
+            return ERROR_INVALID_DATA;
+
+        Ring->ConsPvt += Ring->Size - Offset;
+        Avail -= Ring->Size - Offset;
+        if (Avail == 0)
+            return ERROR_NO_DATA;
+
+        Offset = 0;
+        Record = (PXC_RING_RECORD)Ring->Data;
+        Value = *(volatile ULONG *)&Record->Length;
+    }
+
+    if (Value > XcRingMaxLength(Ring))
+        return ERROR_INVALID_DATA;
+
+    Need = XC_RING_ALIGN(sizeof(XC_RING_RECORD) + Value);
+    if (Need > Avail || Need > Ring->Size - Offset)
+        return ERROR_INVALID_DATA;
+
+    Ring->PeekNext = Ring->ConsPvt + Need;
+    Ring->Peeked = TRUE;
+
+    *Buffer = Record + 1;
+    *Length = Value;
+    return ERROR_SUCCESS;
+}
+
+DWORD
+XcRingRelease(
+    IN  PXC_RING Ring
+    )
+{
+    ULONG Old = Ring->Shared->Cons;
+    ULONG New;
+
+    if (!Ring->Peeked)
+        return ERROR_INVALID_FUNCTION;
+
+    New = Ring->PeekNext;
+    Ring->ConsPvt = New;
+    Ring->Peeked = FALSE;
+    Ring->Stats.Released++;
+
+    XC_RING_MB(); // finish with the record before handing it back
+    Ring->Shared->Cons = New;
+    XC_RING_MB(); // index before event
+
+    if ((ULONG)(New - Ring->Shared->ConsEvent) < (ULONG)(New - Old))
+        return RingNotify(Ring);
+
+    return ERROR_SUCCESS;
+}
+
+DWORD
+XcRingWaitReadable(
+    IN  PXC_RING Ring,
+    IN  DWORD Timeout
+    )
+{
+    DWORD Error;
+
+    for (;;) {
+        if (Ring->Shared->Prod != Ring->ConsPvt)
+            return ERROR_SUCCESS;
+
+        // ask for a notification, then check again in case it raced
+        Ring->Shared->ProdEvent = Ring->ConsPvt + 1;
+        XC_RING_MB();
+
+        if (Ring->Shared->Prod != Ring->ConsPvt)
+            return ERROR_SUCCESS;
+
+        Error = RingWait(Ring, Timeout);
+        if (Error != ERROR_SUCCESS)
+            return Error;
+    }
+}
+
+DWORD
+XcRingWaitWritable(
+    IN  PXC_RING Ring,
+    IN  ULONG Length,
+    IN  DWORD Timeout
+    )
+{
+    ULONG Need;
+    ULONG Pad;
+    DWORD Error;
+
+    if (Length > XcRingMaxLength(Ring))
+        return ERROR_INVALID_PARAMETER;
+
+    Error = XcRingCommit(Ring);
+    if (Error != ERROR_SUCCESS)
+        return Error;
+
+    Need = RingSpace(Ring, Length, &Pad);
+
+    for (;;) {
+        if (Ring->Size - (Ring->ProdPvt - Ring->Shared->Cons) >= Pad + Need)
+            return ERROR_SUCCESS;
+
+        Ring->Shared->ConsEvent = Ring->ProdPvt + Pad + Need - Ring->Size;
+        XC_RING_MB();
+
+        if (Ring->Size - (Ring->ProdPvt - Ring->Shared->Cons) >= Pad + Need)
+            return ERROR_SUCCESS;
+
+        Error = RingWait(Ring, Timeout);
+        if (Error != ERROR_SUCCESS)
+            return Error;
+    }
+}
+
+VOID
+XcRingQueryStats(
+    IN  PXC_RING Ring,
+    OUT PXC_RING_STATS Stats
+    )
+{
+    *Stats = Ring->Stats;
+}
+
+DWORD
+XcRingLoopbackCreate(
+    IN  ULONG Order,
+    OUT PXC_RING *Producer,
+    OUT PXC_RING *Consumer
+    )
+{
+    XC_RING_TRANSPORT Transport[2];
+    PVOID Shared;
+    DWORD Error;
+
+    if (Order > XC_RING_ORDER_MAX || Producer == NULL || Consumer == NULL)
+        return ERROR_INVALID_PARAMETER;
+
+    Error = LoopbackCreate(XC_RING_PAGES(Order) * XC_RING_PAGE_SIZE, &Shared, Transport);
+    if (Error != ERROR_SUCCESS)
+        return Error;
+
+    Error = XcRingOpen(Shared, Order, TRUE, &Transport[0], Producer);
+    if (Error != ERROR_SUCCESS)
+        goto fail1;
+
+    Error = XcRingOpen(Shared, Order, FALSE, &Transport[1], Consumer);
+    if (Error != ERROR_SUCCESS)
+        goto fail2;
+
+    return ERROR_SUCCESS;
+
+fail2:
+    XcRingClose(*Producer);
+    *Producer = NULL;
+    Transport[1].Close(Transport[1].Context);
+    return Error;
+
+fail1:
+    Transport[1].Close(Transport[1].Context);
+    Transport[0].Close(Transport[0].Context);
+    return Error;
+}
@@ -0,0 +1,545 @@
+/* libxenvchan-compatible byte stream, see xencontrol_vchan.h.
+ *
+ * This file only depends on the C runtime, so the protocol and its loopback
+ * transport also build outside of xencontrol:
+ *
+ *     cc -O2 -pthread -I../../include -c xencontrol_vchan.c xencontrol_loopback.c
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xencontrol_vchan.h"
+#include "xencontrol_loopback.h"
+
+#ifdef _WIN32
+#define XC_VCHAN_MB()                 MemoryBarrier()
+#define XC_VCHAN_FETCH_AND(Ptr, Mask) ((UCHAR)InterlockedAnd8((volatile char *)(Ptr), (char)(Mask)))
+#define XC_VCHAN_FETCH_OR(Ptr, Mask)  ((UCHAR)InterlockedOr8((volatile char *)(Ptr), (char)(Mask)))
+#else
+#define XC_VCHAN_MB()                 __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define XC_VCHAN_FETCH_AND(Ptr, Mask) __atomic_fetch_and((Ptr), (UCHAR)(Mask), __ATOMIC_SEQ_CST)
+#define XC_VCHAN_FETCH_OR(Ptr, Mask)  __atomic_fetch_or((Ptr), (UCHAR)(Mask), __ATOMIC_SEQ_CST)
+#endif
+
+#define XC_VCHAN_SMALL_OFFSET   1024
+#define XC_VCHAN_LARGE_OFFSET   2048
+
+typedef struct _XC_VCHAN_RING {
+    PXC_VCHAN_RING_SHARED Shared;
+    PUCHAR Buffer;
+    ULONG Size;
+} XC_VCHAN_RING, *PXC_VCHAN_RING;
+
+struct _XC_VCHAN {
+    PXC_VCHAN_INTERFACE Interface;
+    BOOL Server;
+    BOOL Blocking;
+    XC_VCHAN_RING Read;
+    XC_VCHAN_RING Write;
+    XC_RING_TRANSPORT Transport;
+};
+
+static BOOL
+VchanOrderValid(
+    IN  ULONG Order
+    )
+{
+    return Order == XC_VCHAN_SMALL_ORDER ||
+           Order == XC_VCHAN_LARGE_ORDER ||
+           (Order >= XC_VCHAN_PAGE_SHIFT && Order <= XC_VCHAN_ORDER_MAX);
+}
+
+static PUCHAR
+VchanBuffer(
+    IN  PXC_VCHAN_INTERFACE Interface,
+    IN  ULONG Order,
+    IN  PVOID Buffer
+    )
+{
+    switch (Order) {
+    case XC_VCHAN_SMALL_ORDER:
+        return (PUCHAR)Interface + XC_VCHAN_SMALL_OFFSET;
+    case XC_VCHAN_LARGE_ORDER:
+        return (PUCHAR)Interface + XC_VCHAN_LARGE_OFFSET;
+    default:
+        return Buffer;
+    }
+}
+
+// Bytes in the read ring. A count above the ring size can only come from a
+// broken peer; reporting nothing stalls the vchan instead of overrunning.
+static ULONG
+VchanRawDataReady(
+    IN  PXC_VCHAN Vchan
+    )
+{
+    ULONG Ready = Vchan->Read.Shared->Prod - Vchan->Read.Shared->Cons;
+
+    XC_VCHAN_MB(); // use the indices read above only once
+    return Ready > Vchan->Read.Size ? 0 : Ready;
+}
+
+static ULONG
+VchanRawBufferSpace(
+    IN  PXC_VCHAN Vchan
+    )
+{
+    ULONG Space = Vchan->Write.Size - (Vchan->Write.Shared->Prod - Vchan->Write.Shared->Cons);
+
+    XC_VCHAN_MB();
+    return Space > Vchan->Write.Size ? 0 : Space;
+}
+
+// Ask the other end for a notification on Bit, before the caller reads the
+// indices again.
+static VOID
+VchanRequestNotify(
+    IN  PXC_VCHAN Vchan,
+    IN  UCHAR Bit
+    )
+{
+    volatile UCHAR *Notify = Vchan->Server ?
+                             &Vchan->Interface->ClientNotify :
+                             &Vchan->Interface->ServerNotify;
+
+    XC_VCHAN_FETCH_OR(Notify, Bit);
+    XC_VCHAN_MB();
+}
+
+// Notify the other end on Bit if it asked for it, after the caller updated
+// the indices.
+static DWORD
+VchanSendNotify(
+    IN  PXC_VCHAN Vchan,
+    IN  UCHAR Bit
+    )
+{
+    volatile UCHAR *Notify = Vchan->Server ?
+                             &Vchan->Interface->ServerNotify :
+                             &Vchan->Interface->ClientNotify;
+
+    XC_VCHAN_MB();
+    if (XC_VCHAN_FETCH_AND(Notify, ~Bit) & Bit)
+        return Vchan->Transport.Notify(Vchan->Transport.Context);
+
+    return ERROR_SUCCESS;
+}
+
+static ULONG
+VchanFastDataReady(
+    IN  PXC_VCHAN Vchan,
+    IN  ULONG Request
+    )
+{
+    ULONG Ready = VchanRawDataReady(Vchan);
+
+    if (Ready >= Request)
+        return Ready;
+
+    // about to run dry: ask for a notification, then look again in case the
+    // writer moved on before it could see the request
+    VchanRequestNotify(Vchan, XC_VCHAN_NOTIFY_WRITE);
+    return VchanRawDataReady(Vchan);
+}
+
+static ULONG
+VchanFastBufferSpace(
+    IN  PXC_VCHAN Vchan,
+    IN  ULONG Request
+    )
+{
+    ULONG Space = VchanRawBufferSpace(Vchan);
+
+    if (Space >= Request)
+        return Space;
+
+    VchanRequestNotify(Vchan, XC_VCHAN_NOTIFY_READ);
+    return VchanRawBufferSpace(Vchan);
+}
+
+static DWORD
+VchanDoSend(
+    IN  PXC_VCHAN Vchan,
+    IN  const UCHAR *Data,
+    IN  ULONG Size
+    )
+{
+    ULONG Offset = Vchan->Write.Shared->Prod & (Vchan->Write.Size - 1);
+    ULONG Contiguous = Vchan->Write.Size - Offset;
+
+    if (Contiguous > Size)
+        Contiguous = Size;
+
+    XC_VCHAN_MB(); // read the indices, then write the data
+    memcpy(Vchan->Write.Buffer + Offset, Data, Contiguous);
+    if (Contiguous < Size)
+        memcpy(Vchan->Write.Buffer, Data + Contiguous, Size - Contiguous);
+    XC_VCHAN_MB(); // write the data, then publish it
+
+    Vchan->Write.Shared->Prod += Size;
+
+    return VchanSendNotify(Vchan, XC_VCHAN_NOTIFY_WRITE);
+}
+
+static DWORD
+VchanDoRecv(
+    IN  PXC_VCHAN Vchan,
+    OUT UCHAR *Data,
+    IN  ULONG Size
+    )
+{
+    ULONG Offset = Vchan->Read.Shared->Cons & (Vchan->Read.Size - 1);
+    ULONG Contiguous = Vchan->Read.Size - Offset;
+
+    if (Contiguous > Size)
+        Contiguous = Size;
+
+    XC_VCHAN_MB(); // read the indices, then the data
+    memcpy(Data, Vchan->Read.Buffer + Offset, Contiguous);
+    if (Contiguous < Size)
+        memcpy(Data + Contiguous, Vchan->Read.Buffer, Size - Contiguous);
+    XC_VCHAN_MB(); // read the data, then hand the space back
+
+    Vchan->Read.Shared->Cons += Size;
+
+    return VchanSendNotify(Vchan, XC_VCHAN_NOTIFY_READ);
+}
+
+DWORD
+XcVchanOpen(
+    IN  PXC_VCHAN_INTERFACE Interface,
+    IN  BOOL Server,
+    IN  ULONG LeftOrder,
+    IN  ULONG RightOrder,
+    IN  PVOID LeftBuffer OPTIONAL,
+    IN  PVOID RightBuffer OPTIONAL,
+    IN  const XC_RING_TRANSPORT *Transport,
+    OUT PXC_VCHAN *Vchan
+    )
+{
+    XC_VCHAN_RING Left, Right;
+    PXC_VCHAN New;
+
+    if (Interface == NULL ||
+        !VchanOrderValid(LeftOrder) ||
+        !VchanOrderValid(RightOrder) ||
+        (LeftOrder < XC_VCHAN_PAGE_SHIFT && LeftOrder == RightOrder) ||
+        Transport == NULL ||
+        Transport->Notify == NULL ||
+        Transport->Wait == NULL ||
+        Vchan == NULL)
+        return ERROR_INVALID_PARAMETER;
+
+    Left.Shared = &Interface->Left;
+    Left.Buffer = VchanBuffer(Interface, LeftOrder, LeftBuffer);
+    Left.Size = 1UL << LeftOrder;
+
+    Right.Shared = &Interface->Right;
+    Right.Buffer = VchanBuffer(Interface, RightOrder, RightBuffer);
+    Right.Size = 1UL << RightOrder;
+
+    if (Left.Buffer == NULL || Right.Buffer == NULL)
+        return ERROR_INVALID_PARAMETER;
+
+    if (!Server &&
+        (Interface->LeftOrder != LeftOrder || Interface->RightOrder != RightOrder))
+        return ERROR_INVALID_DATA;
+
+    New = calloc(1, sizeof(*New));
+    if (New == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    New->Interface = Interface;
+    New->Server = Server;
+    New->Blocking = TRUE;
+    New->Read = Server ? Left : Right;
+    New->Write = Server ? Right : Left;
+    New->Transport = *Transport;
+
+    if (Server) {
+        Interface->Left.Cons = Interface->Left.Prod = 0;
+        Interface->Right.Cons = Interface->Right.Prod = 0;
+        Interface->LeftOrder = (USHORT)LeftOrder;
+        Interface->RightOrder = (USHORT)RightOrder;
+        Interface->ClientLive = 2;
+        Interface->ServerLive = 1;
+        Interface->ClientNotify = XC_VCHAN_NOTIFY_WRITE;
+        Interface->ServerNotify = 0;
+        XC_VCHAN_MB();
+    } else {
+        Interface->ClientLive = 1;
+        Interface->ServerNotify = XC_VCHAN_NOTIFY_WRITE;
+        XC_VCHAN_MB();
+        // wake a server waiting for its client
+        New->Transport.Notify(New->Transport.Context);
+    }
+
+    *Vchan = New;
+    return ERROR_SUCCESS;
+}
+
+VOID
+XcVchanClose(
+    IN  PXC_VCHAN Vchan
+    )
+{
+    if (Vchan == NULL)
+        return;
+
+    if (Vchan->Server)
+        Vchan->Interface->ServerLive = 0;
+    else
+        Vchan->Interface->ClientLive = 0;
+
+    XC_VCHAN_MB();
+    Vchan->Transport.Notify(Vchan->Transport.Context);
+
+    if (Vchan->Transport.Close != NULL)
+        Vchan->Transport.Close(Vchan->Transport.Context);
+
+    free(Vchan);
+}
+
+VOID
+XcVchanSetBlocking(
+    IN  PXC_VCHAN Vchan,
+    IN  BOOL Blocking
+    )
+{
+    Vchan->Blocking = Blocking;
+}
+
+ULONG
+XcVchanIsOpen(
+    IN  PXC_VCHAN Vchan
+    )
+{
+    return Vchan->Server ? Vchan->Interface->ClientLive : Vchan->Interface->ServerLive;
+}
+
+ULONG
+XcVchanDataReady(
+    IN  PXC_VCHAN Vchan
+    )
+{
+    VchanRequestNotify(Vchan, XC_VCHAN_NOTIFY_WRITE);
+    return VchanRawDataReady(Vchan);
+}
+
+ULONG
+XcVchanBufferSpace(
+    IN  PXC_VCHAN Vchan
+    )
+{
+    VchanRequestNotify(Vchan, XC_VCHAN_NOTIFY_READ);
+    return VchanRawBufferSpace(Vchan);
+}
+
+DWORD
+XcVchanWait(
+    IN  PXC_VCHAN Vchan,
+    IN  DWORD Timeout
+    )
+{
+    return Vchan->Transport.Wait(Vchan->Transport.Context, Timeout);
+}
+
+DWORD
+XcVchanRead(
+    IN  PXC_VCHAN Vchan,
+    OUT PVOID Buffer,
+    IN  ULONG Size,
+    OUT ULONG *Read
+    )
+{
+    ULONG Ready;
+    DWORD Error;
+
+    *Read = 0;
+    if (Size == 0)
+        return ERROR_SUCCESS;
+
+    for (;;) {
+        Ready = VchanFastDataReady(Vchan, Size);
+        if (Ready != 0) {
+            if (Ready > Size)
+                Ready = Size;
+
+            *Read = Ready;
+            return VchanDoRecv(Vchan, Buffer, Ready);
+        }
+
+        if (!XcVchanIsOpen(Vchan))
+            return ERROR_BROKEN_PIPE;
+
+        if (!Vchan->Blocking)
+            return ERROR_SUCCESS;
+
+        Error = XcVchanWait(Vchan, INFINITE);
+        if (Error != ERROR_SUCCESS)
+            return Error;
+    }
+}
+
+DWORD
+XcVchanWrite(
+    IN  PXC_VCHAN Vchan,
+    IN  const VOID *Buffer,
+    IN  ULONG Size,
+    OUT ULONG *Written
+    )
+{
+    const UCHAR *Data = Buffer;
+    ULONG Space;
+    DWORD Error;
+
+    *Written = 0;
+    if (!XcVchanIsOpen(Vchan))
+        return ERROR_BROKEN_PIPE;
+
+    for (;;) {
+        Space = VchanFastBufferSpace(Vchan, Size - *Written);
+        if (Space > Size - *Written)
+            Space = Size - *Written;
+
+        if (Space != 0) {
+            Error = VchanDoSend(Vchan, Data + *Written, Space);
+            *Written += Space;
+            if (Error != ERROR_SUCCESS)
+                return Error;
+        }
+
+        if (*Written == Size || !Vchan->Blocking)
+            return ERROR_SUCCESS;
+
+        Error = XcVchanWait(Vchan, INFINITE);
+        if (Error != ERROR_SUCCESS)
+            return Error;
+
+        if (!XcVchanIsOpen(Vchan))
+            return ERROR_BROKEN_PIPE;
+    }
+}
+
+DWORD
+XcVchanRecv(
+    IN  PXC_VCHAN Vchan,
+    OUT PVOID Buffer,
+    IN  ULONG Size,
+    OUT ULONG *Read
+    )
+{
+    DWORD Error;
+
+    *Read = 0;
+    if (Size > Vchan->Read.Size)
+        return ERROR_INVALID_PARAMETER;
+
+    for (;;) {
+        if (VchanFastDataReady(Vchan, Size) >= Size) {
+            *Read = Size;
+            return VchanDoRecv(Vchan, Buffer, Size);
+        }
+
+        if (!XcVchanIsOpen(Vchan))
+            return ERROR_BROKEN_PIPE;
+
+        if (!Vchan->Blocking)
+            return ERROR_SUCCESS;
+
+        Error = XcVchanWait(Vchan, INFINITE);
+        if (Error != ERROR_SUCCESS)
+            return Error;
+    }
+}
+
+DWORD
+XcVchanSend(
+    IN  PXC_VCHAN Vchan,
+    IN  const VOID *Buffer,
+    IN  ULONG Size,
+    OUT ULONG *Written
+    )
+{
+    DWORD Error;
+
+    *Written = 0;
+    if (Size > Vchan->Write.Size)
+        return ERROR_INVALID_PARAMETER;
+
+    for (;;) {
+        if (VchanFastBufferSpace(Vchan, Size) >= Size) {
+            *Written = Size;
+            return VchanDoSend(Vchan, Buffer, Size);
+        }
+
+        if (!XcVchanIsOpen(Vchan))
+            return ERROR_BROKEN_PIPE;
+
+        if (!Vchan->Blocking)
+            return ERROR_SUCCESS;
+
+        Error = XcVchanWait(Vchan, INFINITE);
+        if (Error != ERROR_SUCCESS)
+            return Error;
+    }
+}
+
+DWORD
+XcVchanLoopbackCreate(
+    IN  ULONG LeftOrder,
+    IN  ULONG RightOrder,
+    OUT PXC_VCHAN *Server,
+    OUT PXC_VCHAN *Client
+    )
+{
+    XC_RING_TRANSPORT Transport[2];
+    PUCHAR Shared;
+    PUCHAR LeftBuffer, RightBuffer;
+    ULONG LeftPages, RightPages;
+    DWORD Error;
+
+    if (!VchanOrderValid(LeftOrder) || !VchanOrderValid(RightOrder) ||
+        Server == NULL || Client == NULL)
+        return ERROR_INVALID_PARAMETER;
+
+    // control page, then the left and the right ring pages, as granted
+    LeftPages = XC_VCHAN_PAGES(LeftOrder);
+    RightPages = XC_VCHAN_PAGES(RightOrder);
+
+    Error = LoopbackCreate((1 + LeftPages + RightPages) << XC_VCHAN_PAGE_SHIFT,
+                           (PVOID *)&Shared, Transport);
+    if (Error != ERROR_SUCCESS)
+        return Error;
+
+    LeftBuffer = LeftPages != 0 ? Shared + (1UL << XC_VCHAN_PAGE_SHIFT) : NULL;
+    RightBuffer = RightPages != 0 ? Shared + ((1UL + LeftPages) << XC_VCHAN_PAGE_SHIFT) : NULL;
+
+    Error = XcVchanOpen((PXC_VCHAN_INTERFACE)Shared, TRUE, LeftOrder, RightOrder,
+                        LeftBuffer, RightBuffer, &Transport[0], Server);
+    if (Error != ERROR_SUCCESS)
+        goto fail1;
+
+    Error = XcVchanOpen((PXC_VCHAN_INTERFACE)Shared, FALSE, LeftOrder, RightOrder,
+                        LeftBuffer, RightBuffer, &Transport[1], Client);
+    if (Error != ERROR_SUCCESS)
+        goto fail2;
+
+    return ERROR_SUCCESS;
+
+fail2:
+    XcVchanClose(*Server);
+    *Server = NULL;
+    Transport[1].Close(Transport[1].Context);
+    return Error;
+
+fail1:
+    Transport[1].Close(Transport[1].Context);
+    Transport[0].Close(Transport[0].Context);
+    return Error;
+}
@@ -0,0 +1,213 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+
+#include "driver.h"
+#include "fdo.h"
+#include "ioctls.h"
+#include "cache.h"
+#include "log.h"
+#include "assert.h"
+
+C_ASSERT(XENIFACE_CACHE_TYPES <= XENIFACE_CACHE_STATS_MAX);
+
+static const SIZE_T CacheObjectSize[XENIFACE_CACHE_TYPES] = {
+    sizeof (XENIFACE_EVTCHN_CONTEXT),   // XENIFACE_CACHE_EVTCHN
+    sizeof (XENIFACE_STORE_CONTEXT),    // XENIFACE_CACHE_STORE
+    sizeof (XENIFACE_SUSPEND_CONTEXT),  // XENIFACE_CACHE_SUSPEND
+    sizeof (XENIFACE_GRANT_CONTEXT),    // XENIFACE_CACHE_GRANT
+    sizeof (XENIFACE_MAP_CONTEXT),      // XENIFACE_CACHE_MAP
+};
+
+static const PCHAR CacheName[XENIFACE_CACHE_TYPES] = {
+    "evtchn",
+    "store",
+    "suspend",
+    "grant",
+    "map",
+};
+
+// Only called when the lookaside list is empty, so this counts misses.
+static
+PVOID
+CacheAllocate(
+    IN  POOL_TYPE           PoolType,
+    IN  SIZE_T              NumberOfBytes,
+    IN  ULONG               Tag,
+    IN  PLOOKASIDE_LIST_EX  Lookaside
+    )
+{
+    PXENIFACE_CACHE         Cache;
+
+    Cache = CONTAINING_RECORD(Lookaside, XENIFACE_CACHE, List);
+    InterlockedIncrement64(&Cache->Misses);
+
+    return ExAllocatePoolWithTag(PoolType, NumberOfBytes, Tag);
+}
+
+static
+VOID
+CacheFree(
+    IN  PVOID               Buffer,
+    IN  PLOOKASIDE_LIST_EX  Lookaside
+    )
+{
+    UNREFERENCED_PARAMETER(Lookaside);
+
+    ExFreePoolWithTag(Buffer, XENIFACE_POOL_TAG);
+}
+
+NTSTATUS
+CacheInitialize(
+    IN  PXENIFACE_FDO       Fdo
+    )
+{
+    PXENIFACE_CACHE         Cache;
+    ULONG                   Type;
+    NTSTATUS                status;
+
+    for (Type = 0; Type < XENIFACE_CACHE_TYPES; Type++) {
+        Cache = &Fdo->ContextCache[Type];
+
+        status = ExInitializeLookasideListEx(&Cache->List,
+                                             CacheAllocate,
+                                             CacheFree,
+                                             NonPagedPool,
+                                             0,
+                                             CacheObjectSize[Type],
+                                             XENIFACE_POOL_TAG,
+                                             0);
+        if (!NT_SUCCESS(status))
+            goto fail1;
+
+        Cache->Initialized = TRUE;
+    }
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    CacheTeardown(Fdo);
+
+    return status;
+}
+
+VOID
+CacheTeardown(
+    IN  PXENIFACE_FDO       Fdo
+    )
+{
+    PXENIFACE_CACHE         Cache;
+    ULONG                   Type;
+
+    for (Type = 0; Type < XENIFACE_CACHE_TYPES; Type++) {
+        Cache = &Fdo->ContextCache[Type];
+
+        if (!Cache->Initialized)
+            continue;
+
+        ASSERT3U(Cache->Allocations, ==, Cache->Frees);
+
+        Info("%s: %llu allocations, %llu misses\n",
+             CacheName[Type],
+             Cache->Allocations,
+             Cache->Misses);
+
+        ExDeleteLookasideListEx(&Cache->List);
+        RtlZeroMemory(Cache, sizeof (XENIFACE_CACHE));
+    }
+}
+
+PVOID
+CacheGet(
+    IN  PXENIFACE_FDO       Fdo,
+    IN  XENIFACE_CACHE_TYPE Type
+    )
+{
+    PXENIFACE_CACHE         Cache;
+    PVOID                   Object;
+
+    ASSERT3U(Type, <, XENIFACE_CACHE_TYPES);
+    Cache = &Fdo->ContextCache[Type];
+
+    Object = ExAllocateFromLookasideListEx(&Cache->List);
+    if (Object == NULL)
+        return NULL;
+
+    InterlockedIncrement64(&Cache->Allocations);
+
+    RtlZeroMemory(Object, CacheObjectSize[Type]);
+    return Object;
+}
+
+VOID
+CachePut(
+    IN  PXENIFACE_FDO       Fdo,
+    IN  XENIFACE_CACHE_TYPE Type,
+    IN  PVOID               Object
+    )
+{
+    PXENIFACE_CACHE         Cache;
+
+    ASSERT3U(Type, <, XENIFACE_CACHE_TYPES);
+    Cache = &Fdo->ContextCache[Type];
+
+    InterlockedIncrement64(&Cache->Frees);
+
+    ExFreeToLookasideListEx(&Cache->List, Object);
+}
+
+VOID
+CacheQueryStats(
+    IN  PXENIFACE_FDO               Fdo,
+    OUT PXENIFACE_CACHE_STATS_OUT   Stats
+    )
+{
+    PXENIFACE_CACHE                 Cache;
+    ULONG                           Type;
+
+    RtlZeroMemory(Stats, sizeof (XENIFACE_CACHE_STATS_OUT));
+    Stats->NumberCaches = XENIFACE_CACHE_TYPES;
+
+    for (Type = 0; Type < XENIFACE_CACHE_TYPES; Type++) {
+        Cache = &Fdo->ContextCache[Type];
+
+        (VOID) RtlStringCbCopyA(Stats->Caches[Type].Name,
+                                sizeof (Stats->Caches[Type].Name),
+                                CacheName[Type]);
+        Stats->Caches[Type].Allocations = Cache->Allocations;
+        Stats->Caches[Type].Misses = Cache->Misses;
+        Stats->Caches[Type].Frees = Cache->Frees;
+        Stats->Caches[Type].Depth = Cache->List.L.Depth;
+    }
+}
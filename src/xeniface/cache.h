@@ -0,0 +1,92 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, 
+ * with or without modification, are permitted provided 
+ * that the following conditions are met:
+ * 
+ * *   Redistributions of source code must retain the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above 
+ *     copyright notice, this list of conditions and the 
+ *     following disclaimer in the documentation and/or other 
+ *     materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND 
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, 
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF 
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR 
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, 
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR 
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, 
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING 
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE 
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+ * SUCH DAMAGE.
+ */
+
+#ifndef _XENIFACE_CACHE_H
+#define _XENIFACE_CACHE_H
+
+#include <ntddk.h>
+
+#include "xeniface_ioctls.h"
+
+// Types of per-request contexts that are recycled through lookaside lists.
+typedef enum _XENIFACE_CACHE_TYPE {
+    XENIFACE_CACHE_EVTCHN = 0,
+    XENIFACE_CACHE_STORE,
+    XENIFACE_CACHE_SUSPEND,
+    XENIFACE_CACHE_GRANT,
+    XENIFACE_CACHE_MAP,
+    XENIFACE_CACHE_TYPES
+} XENIFACE_CACHE_TYPE;
+
+// Lookaside list of one type of per-request context. Contexts are
+// allocated on every bind, watch and grant, so recycling them keeps
+// bind/close churn off the pool.
+typedef struct _XENIFACE_CACHE {
+    LOOKASIDE_LIST_EX       List;
+    BOOLEAN                 Initialized;
+    LONG64                  Allocations;
+    LONG64                  Misses; // allocations that went to the pool
+    LONG64                  Frees;
+} XENIFACE_CACHE, *PXENIFACE_CACHE;
+
+struct _XENIFACE_FDO;
+
+extern NTSTATUS
+CacheInitialize(
+    IN  struct _XENIFACE_FDO    *Fdo
+    );
+
+extern VOID
+CacheTeardown(
+    IN  struct _XENIFACE_FDO    *Fdo
+    );
+
+// Returns a zeroed context or NULL.
+extern PVOID
+CacheGet(
+    IN  struct _XENIFACE_FDO    *Fdo,
+    IN  XENIFACE_CACHE_TYPE     Type
+    );
+
+extern VOID
+CachePut(
+    IN  struct _XENIFACE_FDO    *Fdo,
+    IN  XENIFACE_CACHE_TYPE     Type,
+    IN  PVOID                   Object
+    );
+
+extern VOID
+CacheQueryStats(
+    IN  struct _XENIFACE_FDO        *Fdo,
+    OUT PXENIFACE_CACHE_STATS_OUT   Stats
+    );
+
+#endif  // _XENIFACE_CACHE_H
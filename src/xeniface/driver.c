@@ -35,6 +35,7 @@
 
 #include "fdo.h"
 #include "driver.h"
+#include "ioctls.h"
 
 #include "assert.h"
 #include "wmi.h"
@@ -45,6 +46,86 @@ DRIVER_UNLOAD       DriverUnload;
 
 XENIFACE_PARAMETERS DriverParameters;
 
+// FDOs told about exiting processes
+static LIST_ENTRY       DriverFdoList;
+static XENIFACE_MUTEX   DriverFdoMutex;
+
+// Driver memory mapped into user processes, through any FDO
+static LONG             DriverProcessMappings;
+
+VOID
+DriverAddFdo(
+    IN  PXENIFACE_FDO   Fdo
+    )
+{
+    AcquireMutex(&DriverFdoMutex);
+    InsertTailList(&DriverFdoList, &Fdo->DriverListEntry);
+    ReleaseMutex(&DriverFdoMutex);
+}
+
+VOID
+DriverRemoveFdo(
+    IN  PXENIFACE_FDO   Fdo
+    )
+{
+    AcquireMutex(&DriverFdoMutex);
+    RemoveEntryList(&Fdo->DriverListEntry);
+    ReleaseMutex(&DriverFdoMutex);
+}
+
+VOID
+DriverAddProcessMapping(
+    VOID
+    )
+{
+    InterlockedIncrement(&DriverProcessMappings);
+}
+
+VOID
+DriverRemoveProcessMapping(
+    VOID
+    )
+{
+    LONG    Mappings;
+
+    Mappings = InterlockedDecrement(&DriverProcessMappings);
+    ASSERT3S(Mappings, >=, 0);
+}
+
+// Runs in the context of the last thread of an exiting process, before its
+// address space is torn down. Driver memory still mapped into the process
+// must be unmapped now.
+static VOID
+DriverProcessNotify(
+    IN  HANDLE          ParentId,
+    IN  HANDLE          ProcessId,
+    IN  BOOLEAN         Create
+    )
+{
+    PXENIFACE_FDO       Fdo;
+    PLIST_ENTRY         Node;
+
+    UNREFERENCED_PARAMETER(ParentId);
+
+    if (Create)
+        return;
+
+    ASSERT3P(ProcessId, ==, PsGetCurrentProcessId());
+
+    // Mappings are only made by threads of the process they go into, so
+    // none of this process can appear once its last thread is exiting.
+    if (DriverProcessMappings == 0)
+        return;
+
+    AcquireMutex(&DriverFdoMutex);
+    for (Node = DriverFdoList.Flink; Node != &DriverFdoList; Node = Node->Flink) {
+        Fdo = CONTAINING_RECORD(Node, XENIFACE_FDO, DriverListEntry);
+
+        XenIfaceProcessExit(Fdo, PsGetCurrentProcess());
+    }
+    ReleaseMutex(&DriverFdoMutex);
+}
+
 VOID
 DriverUnload(
     IN  PDRIVER_OBJECT  _DriverObject
@@ -54,6 +135,9 @@ DriverUnload(
 
     Trace("====>\n");
 
+    (VOID) PsSetCreateProcessNotifyRoutine(DriverProcessNotify, TRUE);
+    ASSERT(IsListEmpty(&DriverFdoList));
+
     if (DriverParameters.RegistryPath.Buffer != NULL) {
         ExFreePool(DriverParameters.RegistryPath.Buffer);
     }
@@ -163,6 +247,12 @@ DriverEntry(
     }
     RtlCopyUnicodeString(&DriverParameters.RegistryPath, RegistryPath);
 
+    InitializeListHead(&DriverFdoList);
+    InitializeMutex(&DriverFdoMutex);
+
+    status = PsSetCreateProcessNotifyRoutine(DriverProcessNotify, FALSE);
+    if (!NT_SUCCESS(status))
+        goto fail2;
 
     DriverObject = _DriverObject;
     DriverObject->DriverUnload = DriverUnload;
@@ -178,6 +268,10 @@ DriverEntry(
     Trace("<====\n");
 
     return STATUS_SUCCESS;
+fail2:
+    Error("fail2\n");
+    ExFreePool(DriverParameters.RegistryPath.Buffer);
+    DriverParameters.RegistryPath.Buffer = NULL;
 fail1:
     Error("fail1 (%08x)\n", status);
     return status;
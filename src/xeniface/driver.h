@@ -77,5 +77,25 @@ typedef struct _XENIFACE_DX {
 
 } XENIFACE_DX, *PXENIFACE_DX;
 
+extern VOID
+DriverAddFdo(
+    IN  struct _XENIFACE_FDO    *Fdo
+    );
+
+extern VOID
+DriverRemoveFdo(
+    IN  struct _XENIFACE_FDO    *Fdo
+    );
+
+extern VOID
+DriverAddProcessMapping(
+    VOID
+    );
+
+extern VOID
+DriverRemoveProcessMapping(
+    VOID
+    );
+
 
 #endif  // _XENIFACE_DRIVER_H
@@ -2302,6 +2302,41 @@ FdoDispatchSystemControl(
     return STATUS_SUCCESS;
 }
 
+static DECLSPEC_NOINLINE NTSTATUS
+FdoDispatchCreate(
+    IN  PXENIFACE_FDO   Fdo,
+    IN  PIRP            Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+    NTSTATUS            status;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    status = XenIfaceCreate(Fdo, StackLocation->FileObject);
+
+    Irp->IoStatus.Information = 0;
+    Irp->IoStatus.Status = status;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+}
+
+static DECLSPEC_NOINLINE NTSTATUS
+FdoDispatchClose(
+    IN  PXENIFACE_FDO   Fdo,
+    IN  PIRP            Irp
+    )
+{
+    PIO_STACK_LOCATION  StackLocation;
+
+    StackLocation = IoGetCurrentIrpStackLocation(Irp);
+
+    XenIfaceClose(Fdo, StackLocation->FileObject);
+
+    return FdoDispatchComplete(Fdo, Irp);
+}
+
 static DECLSPEC_NOINLINE NTSTATUS
 FdoDispatchCleanup(
     IN  PXENIFACE_FDO   Fdo,
@@ -2353,9 +2388,18 @@ FdoDispatch(
         status = FdoDispatchCleanup(Fdo, Irp);
         break;
 
+    case IRP_MJ_READ:
+        status = XenIfaceRead(Fdo, Irp);
+        break;
+
     case IRP_MJ_CREATE:
+        status = FdoDispatchCreate(Fdo, Irp);
+        break;
+
     case IRP_MJ_CLOSE:
-    case IRP_MJ_READ:
+        status = FdoDispatchClose(Fdo, Irp);
+        break;
+
     case IRP_MJ_WRITE:
         status = FdoDispatchComplete(Fdo, Irp);
         break;
@@ -2464,6 +2508,7 @@ FdoCreate(
     PXENIFACE_FDO       Fdo;
     WCHAR               Name[MAXNAMELEN * sizeof (WCHAR)];
     ULONG               Size;
+    ULONG               Index;
     NTSTATUS            status;
 
 #pragma prefast(suppress:28197) // Possibly leaking memory 'FunctionDeviceObject'
@@ -2574,6 +2619,8 @@ FdoCreate(
         goto fail12;
 
     InitializeMutex(&Fdo->Mutex);
+    InitializeMutex(&Fdo->UnmapMutex);
+    InitializeMutex(&Fdo->FileMutex);
     InitializeListHead(&Dx->ListEntry);
     Fdo->References = 1;
 
@@ -2592,17 +2639,36 @@ FdoCreate(
     KeInitializeSpinLock(&Fdo->StoreWatchLock);
     InitializeListHead(&Fdo->StoreWatchList);
 
-    KeInitializeSpinLock(&Fdo->EvtchnLock);
+    Fdo->EvtchnLock = 0;
     InitializeListHead(&Fdo->EvtchnList);
 
+    for (Index = 0; Index < EVTCHN_PORT_TABLE_SIZE; Index++)
+        InitializeListHead(&Fdo->EvtchnPortTable[Index]);
+
+    InitializeListHead(&Fdo->EvtchnPendingList);
+
     KeInitializeSpinLock(&Fdo->SuspendLock);
     InitializeListHead(&Fdo->SuspendList);
 
     KeInitializeSpinLock(&Fdo->IrpQueueLock);
     InitializeListHead(&Fdo->IrpList);
 
+    for (Index = 0; Index < IRP_QUEUE_TABLE_SIZE; Index++)
+        InitializeListHead(&Fdo->IrpQueueTable[Index]);
+
     KeInitializeSpinLock(&Fdo->GnttabCacheLock);
 
+    KeInitializeSpinLock(&Fdo->GnttabPoolLock);
+
+    KeInitializeSpinLock(&Fdo->GnttabMapCacheLock);
+
+    KeInitializeSpinLock(&Fdo->GnttabHandleLock);
+    for (Index = 0; Index < GNTTAB_HANDLE_TABLE_SIZE; Index++)
+        InitializeListHead(&Fdo->GnttabHandleTable[Index]);
+
+    for (Index = 0; Index < FILE_TABLE_SIZE; Index++)
+        InitializeListHead(&Fdo->FileTable[Index]);
+
     status = IoCsqInitializeEx(&Fdo->IrpQueue,
                                CsqInsertIrpEx,
                                CsqRemoveIrp,
@@ -2613,6 +2679,10 @@ FdoCreate(
     if (!NT_SUCCESS(status))
         goto fail15;
 
+    status = CacheInitialize(Fdo);
+    if (!NT_SUCCESS(status))
+        goto fail16;
+
     Info("%p (%s)\n",
          FunctionDeviceObject,
          __FdoGetName(Fdo));
@@ -2620,12 +2690,37 @@ FdoCreate(
     Dx->Fdo = Fdo;
     FunctionDeviceObject->Flags &= ~DO_DEVICE_INITIALIZING;
 
+    DriverAddFdo(Fdo);
+
     return STATUS_SUCCESS;
 
+fail16:
+    Error("fail16\n");
+
+    RtlZeroMemory(&Fdo->IrpQueue, sizeof (IO_CSQ));
+
 fail15:
     Error("fail15\n");
 
+    for (Index = 0; Index < FILE_TABLE_SIZE; Index++)
+        ASSERT(IsListEmpty(&Fdo->FileTable[Index]));
+    RtlZeroMemory(&Fdo->FileTable, sizeof (Fdo->FileTable));
+
+    for (Index = 0; Index < GNTTAB_HANDLE_TABLE_SIZE; Index++)
+        ASSERT(IsListEmpty(&Fdo->GnttabHandleTable[Index]));
+    RtlZeroMemory(&Fdo->GnttabHandleTable, sizeof (Fdo->GnttabHandleTable));
+    RtlZeroMemory(&Fdo->GnttabHandleLock, sizeof (KSPIN_LOCK));
+
+    RtlZeroMemory(&Fdo->GnttabMapCacheLock, sizeof (KSPIN_LOCK));
+
+    ASSERT3U(Fdo->GnttabPoolPages, ==, 0);
+    RtlZeroMemory(&Fdo->GnttabPoolLock, sizeof (KSPIN_LOCK));
+
     RtlZeroMemory(&Fdo->GnttabCacheLock, sizeof (KSPIN_LOCK));
+    for (Index = 0; Index < IRP_QUEUE_TABLE_SIZE; Index++)
+        ASSERT(IsListEmpty(&Fdo->IrpQueueTable[Index]));
+    RtlZeroMemory(Fdo->IrpQueueTable, sizeof (Fdo->IrpQueueTable));
+
     ASSERT(IsListEmpty(&Fdo->IrpList));
     RtlZeroMemory(&Fdo->IrpList, sizeof (LIST_ENTRY));
     RtlZeroMemory(&Fdo->IrpQueueLock, sizeof (KSPIN_LOCK));
@@ -2634,9 +2729,16 @@ fail15:
     RtlZeroMemory(&Fdo->SuspendList, sizeof (LIST_ENTRY));
     RtlZeroMemory(&Fdo->SuspendLock, sizeof (KSPIN_LOCK));
 
+    ASSERT(IsListEmpty(&Fdo->EvtchnPendingList));
+    RtlZeroMemory(&Fdo->EvtchnPendingList, sizeof (LIST_ENTRY));
+
+    for (Index = 0; Index < EVTCHN_PORT_TABLE_SIZE; Index++)
+        ASSERT(IsListEmpty(&Fdo->EvtchnPortTable[Index]));
+    RtlZeroMemory(Fdo->EvtchnPortTable, sizeof (Fdo->EvtchnPortTable));
+
     ASSERT(IsListEmpty(&Fdo->EvtchnList));
     RtlZeroMemory(&Fdo->EvtchnList, sizeof (LIST_ENTRY));
-    RtlZeroMemory(&Fdo->EvtchnLock, sizeof (KSPIN_LOCK));
+    RtlZeroMemory(&Fdo->EvtchnLock, sizeof (EX_SPIN_LOCK));
 
     ASSERT(IsListEmpty(&Fdo->StoreWatchList));
     RtlZeroMemory(&Fdo->StoreWatchList, sizeof (LIST_ENTRY));
@@ -2737,6 +2839,7 @@ FdoDestroy(
 {
     PXENIFACE_DX          Dx = Fdo->Dx;
     PDEVICE_OBJECT        FunctionDeviceObject = Dx->DeviceObject;
+    ULONG                 Index;
 
     ASSERT(IsListEmpty(&Dx->ListEntry));
     ASSERT3U(Fdo->References, ==, 0);
@@ -2748,9 +2851,31 @@ FdoDestroy(
          FunctionDeviceObject,
          __FdoGetName(Fdo));
 
+    DriverRemoveFdo(Fdo);
+
     Dx->Fdo = NULL;
 
+    CacheTeardown(Fdo);
+
+    for (Index = 0; Index < FILE_TABLE_SIZE; Index++)
+        ASSERT(IsListEmpty(&Fdo->FileTable[Index]));
+    RtlZeroMemory(&Fdo->FileTable, sizeof (Fdo->FileTable));
+
+    for (Index = 0; Index < GNTTAB_HANDLE_TABLE_SIZE; Index++)
+        ASSERT(IsListEmpty(&Fdo->GnttabHandleTable[Index]));
+    RtlZeroMemory(&Fdo->GnttabHandleTable, sizeof (Fdo->GnttabHandleTable));
+    RtlZeroMemory(&Fdo->GnttabHandleLock, sizeof (KSPIN_LOCK));
+
+    RtlZeroMemory(&Fdo->GnttabMapCacheLock, sizeof (KSPIN_LOCK));
+
+    ASSERT3U(Fdo->GnttabPoolPages, ==, 0);
+    RtlZeroMemory(&Fdo->GnttabPoolLock, sizeof (KSPIN_LOCK));
+
     RtlZeroMemory(&Fdo->GnttabCacheLock, sizeof (KSPIN_LOCK));
+    for (Index = 0; Index < IRP_QUEUE_TABLE_SIZE; Index++)
+        ASSERT(IsListEmpty(&Fdo->IrpQueueTable[Index]));
+    RtlZeroMemory(Fdo->IrpQueueTable, sizeof (Fdo->IrpQueueTable));
+
     ASSERT(IsListEmpty(&Fdo->IrpList));
     RtlZeroMemory(&Fdo->IrpList, sizeof (LIST_ENTRY));
     RtlZeroMemory(&Fdo->IrpQueueLock, sizeof (KSPIN_LOCK));
@@ -2760,14 +2885,23 @@ FdoDestroy(
     RtlZeroMemory(&Fdo->SuspendList, sizeof (LIST_ENTRY));
     RtlZeroMemory(&Fdo->SuspendLock, sizeof (KSPIN_LOCK));
 
+    ASSERT(IsListEmpty(&Fdo->EvtchnPendingList));
+    RtlZeroMemory(&Fdo->EvtchnPendingList, sizeof (LIST_ENTRY));
+
+    for (Index = 0; Index < EVTCHN_PORT_TABLE_SIZE; Index++)
+        ASSERT(IsListEmpty(&Fdo->EvtchnPortTable[Index]));
+    RtlZeroMemory(Fdo->EvtchnPortTable, sizeof (Fdo->EvtchnPortTable));
+
     ASSERT(IsListEmpty(&Fdo->EvtchnList));
     RtlZeroMemory(&Fdo->EvtchnList, sizeof (LIST_ENTRY));
-    RtlZeroMemory(&Fdo->EvtchnLock, sizeof (KSPIN_LOCK));
+    RtlZeroMemory(&Fdo->EvtchnLock, sizeof (EX_SPIN_LOCK));
 
     ASSERT(IsListEmpty(&Fdo->StoreWatchList));
     RtlZeroMemory(&Fdo->StoreWatchList, sizeof (LIST_ENTRY));
     RtlZeroMemory(&Fdo->StoreWatchLock, sizeof (KSPIN_LOCK));
 
+    RtlZeroMemory(&Fdo->FileMutex, sizeof (XENIFACE_MUTEX));
+    RtlZeroMemory(&Fdo->UnmapMutex, sizeof (XENIFACE_MUTEX));
     RtlZeroMemory(&Fdo->Mutex, sizeof (XENIFACE_MUTEX));
 
     Fdo->InterfacesAcquired = FALSE;
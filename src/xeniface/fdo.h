@@ -44,6 +44,7 @@
 
 #include "thread.h"
 #include "mutex.h"
+#include "cache.h"
 
 typedef enum _FDO_RESOURCE_TYPE {
     MEMORY_RESOURCE = 0,
@@ -73,6 +74,20 @@ typedef struct _XENIFACE_FDO {
     XENIFACE_MUTEX                  Mutex;
     ULONG                           References;
 
+    // Link in the list of FDOs told about exiting processes
+    LIST_ENTRY                      DriverListEntry;
+
+    // Held while driver memory is unmapped from a user process, so the
+    // process can't finish exiting in the middle of it.
+    XENIFACE_MUTEX                  UnmapMutex;
+
+    // Open file objects, hashed by the process that opened them so an
+    // exiting process only looks at its own.
+    #define FILE_TABLE_SIZE             (64)
+
+    XENIFACE_MUTEX                  FileMutex;
+    LIST_ENTRY                      FileTable[FILE_TABLE_SIZE];
+
     FDO_RESOURCE                    Resource[RESOURCE_COUNT];
 
     XENBUS_STORE_INTERFACE          StoreInterface;
@@ -87,20 +102,61 @@ typedef struct _XENIFACE_FDO {
     KSPIN_LOCK                      StoreWatchLock;
     LIST_ENTRY                      StoreWatchList;
 
-    KSPIN_LOCK                      EvtchnLock;
+    // Lookups that only use a channel (notify, unmask, queries) take the lock
+    // shared, so they don't contend with each other. Binding, closing and
+    // the pending list take it exclusive.
+    EX_SPIN_LOCK                    EvtchnLock;
     LIST_ENTRY                      EvtchnList;
 
+    // Event channel contexts hashed by LocalPort. Xen allocates local ports
+    // densely from the bottom so each bucket normally holds a single entry.
+    #define EVTCHN_PORT_TABLE_SIZE  (4096)
+
+    LIST_ENTRY                      EvtchnPortTable[EVTCHN_PORT_TABLE_SIZE];
+
+    // Pending bit pages mapped by IOCTL_XENIFACE_EVTCHN_MAP_PENDING,
+    // one per file object.
+    LIST_ENTRY                      EvtchnPendingList;
+
     KSPIN_LOCK                      SuspendLock;
     LIST_ENTRY                      SuspendList;
 
     KSPIN_LOCK                      GnttabCacheLock;
 
+    // Memory of revoked XENIFACE_GNTTAB_PERSISTENT grants, still granted and
+    // waiting for reuse by the file object that owned it. Pooled grants are
+    // kept by each file object, the page count caps all of them.
+    #define GNTTAB_POOL_MAX_PAGES   (16384)
+
+    KSPIN_LOCK                      GnttabPoolLock;
+    ULONG                           GnttabPoolPages;
+
+    // Foreign mappings of unmapped XENIFACE_GNTTAB_CACHE_MAPPING requests,
+    // still mapped into system space. Lists, budget and stats are kept by
+    // each file object.
+    KSPIN_LOCK                      GnttabMapCacheLock;
+
+    // Grants and maps of XENIFACE_GNTTAB_USE_HANDLE requests, hashed by
+    // process and request ID like pending requests in IrpQueueTable.
+    #define GNTTAB_HANDLE_TABLE_SIZE    (4096)
+
+    KSPIN_LOCK                      GnttabHandleLock;
+    LIST_ENTRY                      GnttabHandleTable[GNTTAB_HANDLE_TABLE_SIZE];
+
     IO_CSQ                          IrpQueue;
     KSPIN_LOCK                      IrpQueueLock;
-    LIST_ENTRY                      IrpList;
+    LIST_ENTRY                      IrpList; // event channel waits
+
+    // Pending grant and map IRPs hashed by process and request ID.
+    #define IRP_QUEUE_TABLE_SIZE    (4096)
+
+    LIST_ENTRY                      IrpQueueTable[IRP_QUEUE_TABLE_SIZE];
 
     PXENBUS_GNTTAB_CACHE            GnttabCache;
 
+    // Lookaside lists of per-request contexts, indexed by XENIFACE_CACHE_TYPE.
+    XENIFACE_CACHE                  ContextCache[XENIFACE_CACHE_TYPES];
+
     #define MAX_SESSIONS    (65536)
 
     int                             WmiReady;
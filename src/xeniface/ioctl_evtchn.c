@@ -35,6 +35,98 @@
 #include "ioctls.h"
 #include "xeniface_ioctls.h"
 #include "log.h"
+#include "util.h"
+#include "irp_queue.h"
+
+_IRQL_requires_(DISPATCH_LEVEL)
+static
+VOID
+EvtchnQueueFired(
+    __in     PXENIFACE_FDO Fdo,
+    __inout  PXENIFACE_EVTCHN_CONTEXT Context
+    );
+
+static FORCEINLINE
+VOID
+__EvtchnUnmask(
+    __inout  PXENIFACE_EVTCHN_CONTEXT Context
+    )
+{
+    InterlockedIncrement64(&Context->Unmasks);
+
+    XENBUS_EVTCHN(Unmask,
+                  &Context->Fdo->EvtchnInterface,
+                  Context->Channel,
+                  FALSE);
+}
+
+// Add a latency sample between two performance counter values.
+static
+VOID
+EvtchnTraceLatency(
+    __inout  PXENIFACE_EVTCHN_CONTEXT       Context,
+    __in     XENIFACE_EVTCHN_LATENCY_STAGE  Stage,
+    __in     LONG64                         Start,
+    __in     LONG64                         End,
+    __in     LONG64                         Frequency
+    )
+{
+    ULONGLONG Nanoseconds;
+    CCHAR Bucket;
+
+    if (Start == 0 || End < Start)
+        return;
+
+    // anything over a second lands in the last bucket anyway
+    if (End - Start >= Frequency)
+        Nanoseconds = MAXULONGLONG;
+    else
+        Nanoseconds = (ULONGLONG)(End - Start) * 1000000000ull / Frequency;
+
+    Bucket = RtlFindMostSignificantBit(Nanoseconds);
+    if (Bucket < 0)
+        Bucket = 0;
+    else if (Bucket >= XENIFACE_EVTCHN_LATENCY_BUCKETS)
+        Bucket = XENIFACE_EVTCHN_LATENCY_BUCKETS - 1;
+
+    InterlockedIncrement(&Context->Latency[Stage][Bucket]);
+}
+
+// Hand a notification to user mode.
+_IRQL_requires_(DISPATCH_LEVEL)
+static
+VOID
+EvtchnDeliver(
+    __inout  PXENIFACE_EVTCHN_CONTEXT Context
+    )
+{
+    LARGE_INTEGER Now, Frequency;
+
+    Now = KeQueryPerformanceCounter(&Frequency);
+    EvtchnTraceLatency(Context, XENIFACE_EVTCHN_LATENCY_DPC_TO_SIGNAL,
+                       Context->TraceDpc, Now.QuadPart, Frequency.QuadPart);
+    Context->TraceSignalInterrupt = InterlockedExchange64(&Context->TraceInterrupt, 0);
+    InterlockedExchange64(&Context->TraceSignal, Now.QuadPart);
+
+    Context->LastDeliveryTime = KeQueryInterruptTime();
+    KeGetCurrentProcessorNumberEx(&Context->LastDelivery);
+    InterlockedIncrement64(&Context->Deliveries);
+    if (Context->LastDelivery.Group != Context->LastInterrupt.Group ||
+        Context->LastDelivery.Number != Context->LastInterrupt.Number)
+        InterlockedIncrement64(&Context->RemoteDeliveries);
+
+    // Set the pending bit first so that whoever is woken up sees it.
+    if (Context->PendingBits != NULL)
+        InterlockedBitTestAndSet(&Context->PendingBits[Context->LocalPort / 32],
+                                 Context->LocalPort % 32);
+
+    if (Context->Event != NULL) {
+        KeSetEvent(Context->Event, 0, FALSE);
+    } else {
+        EvtchnQueueFired(Context->Fdo, Context);
+        EvtchnCompleteWait(Context->Fdo, Context->FileObject);
+    }
+}
 
 _Function_class_(KDEFERRED_ROUTINE)
 _IRQL_requires_(DISPATCH_LEVEL)
@@ -48,6 +140,9 @@ EvtchnNotificationDpc(
     )
 {
     PXENIFACE_EVTCHN_CONTEXT Context = _Context;
+    ULONGLONG Now;
+    LARGE_INTEGER DueTime;
+    LARGE_INTEGER Counter, Frequency;
 
     UNREFERENCED_PARAMETER(Dpc);
     UNREFERENCED_PARAMETER(Argument1);
@@ -55,12 +150,96 @@ EvtchnNotificationDpc(
 
     ASSERT(Context != NULL);
 
-    KeSetEvent(Context->Event, 0, FALSE);
+    InterlockedIncrement64(&Context->Dpcs);
 
-    XENBUS_EVTCHN(Unmask,
-                  &Context->Fdo->EvtchnInterface,
-                  Context->Channel,
-                  FALSE);
+    Counter = KeQueryPerformanceCounter(&Frequency);
+    Context->TraceDpc = Counter.QuadPart;
+    EvtchnTraceLatency(Context, XENIFACE_EVTCHN_LATENCY_INTERRUPT_TO_DPC,
+                       Context->TraceInterrupt, Counter.QuadPart, Frequency.QuadPart);
+
+    // A thread spinning in IOCTL_XENIFACE_EVTCHN_SPIN_WAIT picks the
+    // notification up from SpinPending, or already has. That counts as a
+    // delivery for moderation.
+    if (Context->Spinners != 0 ||
+        InterlockedExchange(&Context->SpinPending, 0) == 0) {
+        // not signalled, so there is nothing to trace further
+        InterlockedExchange64(&Context->TraceInterrupt, 0);
+
+        switch (Context->ModerationMode) {
+        case XENIFACE_EVTCHN_MODERATION_INTERVAL:
+            Context->LastWake = KeQueryInterruptTime();
+            break;
+
+        case XENIFACE_EVTCHN_MODERATION_ACK:
+            // Stays masked until user mode acknowledges with IOCTL_XENIFACE_EVTCHN_UNMASK.
+            return;
+
+        default:
+            break;
+        }
+
+        goto unmask;
+    }
+
+    switch (Context->ModerationMode) {
+    case XENIFACE_EVTCHN_MODERATION_INTERVAL:
+        // interrupt time is in 100ns units
+        Now = KeQueryInterruptTime();
+        if (Now < Context->LastWake + Context->ModerationInterval * 10ull) {
+            // Too soon after the last wake. Leave the port masked and let
+            // EvtchnModerationDpc deliver everything that arrives meanwhile.
+            InterlockedIncrement64(&Context->Coalesced);
+
+            DueTime.QuadPart = -(LONGLONG)(Context->LastWake + Context->ModerationInterval * 10ull - Now);
+            KeSetTimer(&Context->ModerationTimer, DueTime, &Context->ModerationDpc);
+            return;
+        }
+
+        Context->LastWake = Now;
+        break;
+
+    case XENIFACE_EVTCHN_MODERATION_ACK:
+        // Stays masked until user mode acknowledges with IOCTL_XENIFACE_EVTCHN_UNMASK.
+        EvtchnDeliver(Context);
+        return;
+
+    default:
+        break;
+    }
+
+    EvtchnDeliver(Context);
+
+unmask:
+    __EvtchnUnmask(Context);
+}
+
+// Deliver notifications that were held back by interval moderation.
+_Function_class_(KDEFERRED_ROUTINE)
+_IRQL_requires_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+EvtchnModerationDpc(
+    __in      PKDPC Dpc,
+    __in_opt  PVOID _Context,
+    __in_opt  PVOID Argument1,
+    __in_opt  PVOID Argument2
+    )
+{
+    PXENIFACE_EVTCHN_CONTEXT Context = _Context;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    ASSERT(Context != NULL);
+
+    Context->LastWake = KeQueryInterruptTime();
+    Context->TraceDpc = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    EvtchnDeliver(Context);
+
+    __EvtchnUnmask(Context);
 }
 
 _Function_class_(KSERVICE_ROUTINE)
@@ -83,8 +262,30 @@ EvtchnInterruptHandler(
 
     KeGetCurrentProcessorNumberEx(&ProcNumber);
     ProcIndex = KeGetProcessorIndexFromNumber(&ProcNumber);
-
-    if (!KeInsertQueueDpc(&Context->Dpc, NULL, NULL)) {
+    Context->LastInterrupt = ProcNumber;
+    Context->LastInterruptTime = KeQueryInterruptTime();
+    InterlockedIncrement64(&Context->Interrupts);
+    // Only the first upcall before a delivery starts a trace.
+    InterlockedCompareExchange64(&Context->TraceInterrupt,
+                                 KeQueryPerformanceCounter(NULL).QuadPart,
+                                 0);
+
+    // Visible to spinners right away, without waiting for the DPC.
+    InterlockedExchange(&Context->SpinPending, 1);
+
+    if (Context->Retargeting) {
+        // IoctlEvtchnSetAffinity queues the DPC once it has been moved.
+        // The port stays masked until then.
+        InterlockedExchange(&Context->RetargetPending, 1);
+
+        // Unless it has finished meanwhile and may have missed the upcall,
+        // in which case whoever takes RetargetPending back queues the DPC.
+        if (!Context->Retargeting &&
+            InterlockedExchange(&Context->RetargetPending, 0) != 0)
+            (VOID) KeInsertQueueDpc(&Context->Dpc, NULL, NULL);
+    } else if (!KeInsertQueueDpc(&Context->Dpc, NULL, NULL)) {
+        // folded into the DPC that is already queued
+        InterlockedIncrement64(&Context->Coalesced);
         XenIfaceDebugPrint(TRACE, "NOT INSERTED: Context %p, Port %lu, FO %p, Cpu %lu\n",
                            Context, Context->LocalPort, Context->FileObject, ProcIndex);
     }
@@ -92,32 +293,98 @@ EvtchnInterruptHandler(
     return TRUE;
 }
 
+// Free a list of event channel contexts, linked through their Entry fields.
+// All channels are closed before the DPCs are flushed, so that tearing down
+// many channels costs at most two machine-wide flushes instead of one per
+// channel.
 _IRQL_requires_(PASSIVE_LEVEL) // needed for KeFlushQueuedDpcs
 VOID
-EvtchnFree(
+EvtchnFreeList(
     __in     PXENIFACE_FDO Fdo,
-    __inout  PXENIFACE_EVTCHN_CONTEXT Context
+    __inout  PLIST_ENTRY   List
     )
 {
+    PXENIFACE_EVTCHN_CONTEXT Context;
+    PLIST_ENTRY Node;
+    BOOLEAN ModerationUsed = FALSE;
+
     ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
 
-    XenIfaceDebugPrint(TRACE, "Context %p, LocalPort %d, FO %p\n",
-                       Context, Context->LocalPort, Context->FileObject);
+    if (IsListEmpty(List))
+        return;
 
-    XENBUS_EVTCHN(Close,
-                  &Fdo->EvtchnInterface,
-                  Context->Channel);
+    for (Node = List->Flink; Node != List; Node = Node->Flink) {
+        Context = CONTAINING_RECORD(Node, XENIFACE_EVTCHN_CONTEXT, Entry);
+
+        XenIfaceDebugPrint(TRACE, "Context %p, LocalPort %d, FO %p\n",
+                           Context, Context->LocalPort, Context->FileObject);
+
+        // Threads that use the channel without holding EvtchnLock hold rundown
+        // protection for a bounded time.
+        ExWaitForRundownProtectionRelease(&Context->Rundown);
+
+        XENBUS_EVTCHN(Close,
+                      &Fdo->EvtchnInterface,
+                      Context->Channel);
+
+        if (Context->ModerationUsed)
+            ModerationUsed = TRUE;
+    }
 
-    // There may still be a pending event at this time.
+    // There may still be pending events at this time.
     // Wait for our DPCs to complete.
     KeFlushQueuedDpcs();
 
-    ObDereferenceObject(Context->Event);
-    RtlZeroMemory(Context, sizeof(XENIFACE_EVTCHN_CONTEXT));
-    ExFreePoolWithTag(Context, XENIFACE_POOL_TAG);
+    // The notification DPCs may have armed moderation timers.
+    if (ModerationUsed) {
+        for (Node = List->Flink; Node != List; Node = Node->Flink) {
+            Context = CONTAINING_RECORD(Node, XENIFACE_EVTCHN_CONTEXT, Entry);
+
+            if (Context->ModerationUsed)
+                KeCancelTimer(&Context->ModerationTimer);
+        }
+
+        KeFlushQueuedDpcs();
+    }
+
+    while (!IsListEmpty(List)) {
+        Node = RemoveHeadList(List);
+        Context = CONTAINING_RECORD(Node, XENIFACE_EVTCHN_CONTEXT, Entry);
+
+        if (Context->Event != NULL)
+            ObDereferenceObject(Context->Event);
+
+        RtlZeroMemory(Context, sizeof(XENIFACE_EVTCHN_CONTEXT));
+        CachePut(Fdo, XENIFACE_CACHE_EVTCHN, Context);
+    }
 }
 
-_Requires_exclusive_lock_held_(Fdo->EvtchnLock)
+_IRQL_requires_(PASSIVE_LEVEL) // needed for KeFlushQueuedDpcs
+VOID
+EvtchnFree(
+    __in     PXENIFACE_FDO Fdo,
+    __inout  PXENIFACE_EVTCHN_CONTEXT Context
+    )
+{
+    LIST_ENTRY List;
+
+    InitializeListHead(&List);
+    InsertTailList(&List, &Context->Entry);
+
+    EvtchnFreeList(Fdo, &List);
+}
+
+static FORCEINLINE
+PLIST_ENTRY
+__EvtchnPortBucket(
+    __in  PXENIFACE_FDO Fdo,
+    __in  ULONG         LocalPort
+    )
+{
+    return &Fdo->EvtchnPortTable[LocalPort & (EVTCHN_PORT_TABLE_SIZE - 1)];
+}
+
+_Requires_lock_held_(Fdo->EvtchnLock) // shared is enough
 static
 PXENIFACE_EVTCHN_CONTEXT
 EvtchnFindChannel(
@@ -126,113 +393,1442 @@ EvtchnFindChannel(
     __in_opt  PFILE_OBJECT  FileObject
     )
 {
-    PXENIFACE_EVTCHN_CONTEXT Context, Found = NULL;
+    PXENIFACE_EVTCHN_CONTEXT Context;
+    PLIST_ENTRY Bucket, Node;
+
+    // Local ports are unique, so at most one context in the bucket can match.
+    Bucket = __EvtchnPortBucket(Fdo, LocalPort);
+    for (Node = Bucket->Flink; Node != Bucket; Node = Node->Flink) {
+        Context = CONTAINING_RECORD(Node, XENIFACE_EVTCHN_CONTEXT, PortEntry);
+
+        if (Context->LocalPort != LocalPort)
+            continue;
+
+        // Only the file object that bound the channel may use it.
+        if (FileObject != NULL &&
+            FileObject != Context->FileObject) {
+            return NULL;
+        }
+
+        return Context;
+    }
+
+    return NULL;
+}
+
+_Requires_exclusive_lock_held_(Fdo->EvtchnLock)
+static
+PXENIFACE_EVTCHN_PENDING_CONTEXT
+EvtchnFindPending(
+    __in  PXENIFACE_FDO Fdo,
+    __in  PFILE_OBJECT  FileObject
+    )
+{
+    PXENIFACE_EVTCHN_PENDING_CONTEXT Context;
+    PLIST_ENTRY Node;
+
+    for (Node = Fdo->EvtchnPendingList.Flink;
+         Node != &Fdo->EvtchnPendingList;
+         Node = Node->Flink) {
+        Context = CONTAINING_RECORD(Node, XENIFACE_EVTCHN_PENDING_CONTEXT, Entry);
+
+        if (Context->FileObject == FileObject)
+            return Context;
+    }
+
+    return NULL;
+}
+
+_Requires_lock_not_held_(Fdo->EvtchnLock)
+static
+VOID
+EvtchnInsertChannel(
+    __in     PXENIFACE_FDO Fdo,
+    __inout  PXENIFACE_EVTCHN_CONTEXT Context
+    )
+{
+    PXENIFACE_EVTCHN_PENDING_CONTEXT Pending;
+    KIRQL Irql;
+
+    Irql = ExAcquireSpinLockExclusive(&Fdo->EvtchnLock);
+    InsertTailList(&Fdo->EvtchnList, &Context->Entry);
+    InsertTailList(__EvtchnPortBucket(Fdo, Context->LocalPort), &Context->PortEntry);
+
+    Pending = EvtchnFindPending(Fdo, Context->FileObject);
+    if (Pending != NULL && Context->LocalPort < XENIFACE_EVTCHN_PENDING_PORTS)
+        Context->PendingBits = Pending->Bits;
+
+    ExReleaseSpinLockExclusive(&Fdo->EvtchnLock, Irql);
+}
+
+// Insert channels opened by the same file object under one lock acquisition.
+_Requires_lock_not_held_(Fdo->EvtchnLock)
+static
+VOID
+EvtchnInsertList(
+    __in     PXENIFACE_FDO Fdo,
+    __in     PFILE_OBJECT  FileObject,
+    __inout  PLIST_ENTRY   List
+    )
+{
+    PXENIFACE_EVTCHN_PENDING_CONTEXT Pending;
+    PXENIFACE_EVTCHN_CONTEXT Context;
+    PLIST_ENTRY Node;
+    KIRQL Irql;
+
+    Irql = ExAcquireSpinLockExclusive(&Fdo->EvtchnLock);
+
+    Pending = EvtchnFindPending(Fdo, FileObject);
+
+    while (!IsListEmpty(List)) {
+        Node = RemoveHeadList(List);
+        Context = CONTAINING_RECORD(Node, XENIFACE_EVTCHN_CONTEXT, Entry);
+
+        ASSERT3P(Context->FileObject, ==, FileObject);
+
+        InsertTailList(&Fdo->EvtchnList, &Context->Entry);
+        InsertTailList(__EvtchnPortBucket(Fdo, Context->LocalPort), &Context->PortEntry);
+
+        if (Pending != NULL && Context->LocalPort < XENIFACE_EVTCHN_PENDING_PORTS)
+            Context->PendingBits = Pending->Bits;
+    }
+
+    ExReleaseSpinLockExclusive(&Fdo->EvtchnLock, Irql);
+}
+
+_Requires_exclusive_lock_held_(Fdo->EvtchnLock)
+VOID
+EvtchnRemoveChannel(
+    __in     PXENIFACE_FDO Fdo,
+    __inout  PXENIFACE_EVTCHN_CONTEXT Context
+    )
+{
+    PXENIFACE_FILE_CONTEXT File;
+
+    UNREFERENCED_PARAMETER(Fdo);
+
+    RemoveEntryList(&Context->Entry);
+    RemoveEntryList(&Context->PortEntry);
+
+    File = __XenIfaceFileContext(Context->FileObject);
+    KeAcquireSpinLockAtDpcLevel(&File->EvtchnFiredLock);
+
+    if (Context->Fired) {
+        RemoveEntryList(&Context->FiredEntry);
+        Context->Fired = FALSE;
+    }
+
+    // A DPC may still run until EvtchnFreeList flushes it, don't let it
+    // queue the context again.
+    Context->Closed = TRUE;
+
+    KeReleaseSpinLockFromDpcLevel(&File->EvtchnFiredLock);
+}
+
+_IRQL_requires_(DISPATCH_LEVEL)
+static
+VOID
+EvtchnQueueFired(
+    __in     PXENIFACE_FDO Fdo,
+    __inout  PXENIFACE_EVTCHN_CONTEXT Context
+    )
+{
+    PXENIFACE_FILE_CONTEXT File;
+
+    UNREFERENCED_PARAMETER(Fdo);
+
+    File = __XenIfaceFileContext(Context->FileObject);
+    KeAcquireSpinLockAtDpcLevel(&File->EvtchnFiredLock);
+
+    if (!Context->Fired && !Context->Closed) {
+        Context->Fired = TRUE;
+        InsertTailList(&File->EvtchnFiredList, &Context->FiredEntry);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&File->EvtchnFiredLock);
+}
+
+// Move fired ports of a file object into a wait output buffer. Only the
+// list of that file object is locked, so waits on other handles don't
+// contend with it.
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static
+ULONG
+EvtchnDrainFired(
+    __in     PXENIFACE_FDO  Fdo,
+    __in     PFILE_OBJECT   FileObject,
+    __out    PULONG         LocalPorts,
+    __in     ULONG          MaxPorts
+    )
+{
+    PXENIFACE_FILE_CONTEXT File;
+    PXENIFACE_EVTCHN_CONTEXT Context;
     PLIST_ENTRY Node;
+    ULONG NumberPorts = 0;
+    KIRQL Irql;
+
+    UNREFERENCED_PARAMETER(Fdo);
+
+    File = __XenIfaceFileContext(FileObject);
+    KeAcquireSpinLock(&File->EvtchnFiredLock, &Irql);
+
+    while (!IsListEmpty(&File->EvtchnFiredList) && NumberPorts < MaxPorts) {
+        Node = RemoveHeadList(&File->EvtchnFiredList);
+        Context = CONTAINING_RECORD(Node, XENIFACE_EVTCHN_CONTEXT, FiredEntry);
+
+        ASSERT3P(Context->FileObject, ==, FileObject);
+        Context->Fired = FALSE;
+
+        LocalPorts[NumberPorts++] = Context->LocalPort;
+    }
+
+    KeReleaseSpinLock(&File->EvtchnFiredLock, Irql);
+
+    return NumberPorts;
+}
+
+static FORCEINLINE
+VOID
+__EvtchnInitializeWaitId(
+    __out  PXENIFACE_CONTEXT_ID Id,
+    __in   PFILE_OBJECT         FileObject
+    )
+{
+    RtlZeroMemory(Id, sizeof(XENIFACE_CONTEXT_ID));
+    Id->Type = XENIFACE_CONTEXT_EVTCHN_WAIT;
+    Id->FileObject = FileObject;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+EvtchnCompleteWaitIrp(
+    __inout  PIRP       Irp,
+    __in     NTSTATUS   Status,
+    __in     ULONG_PTR  Information
+    )
+{
+    PXENIFACE_CONTEXT_ID Id = Irp->Tail.Overlay.DriverContext[0];
+    PXENIFACE_EVTCHN_WAIT_CONTEXT Context;
+
+    ASSERT(Id->Type == XENIFACE_CONTEXT_EVTCHN_WAIT);
+    Context = CONTAINING_RECORD(Id, XENIFACE_EVTCHN_WAIT_CONTEXT, Id);
+
+    RtlZeroMemory(Context, sizeof(XENIFACE_EVTCHN_WAIT_CONTEXT));
+    ExFreePoolWithTag(Context, XENIFACE_POOL_TAG);
+
+    Irp->IoStatus.Status = Status;
+    Irp->IoStatus.Information = Information;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+// Wait requests are either IOCTL_XENIFACE_EVTCHN_WAIT, whose output starts
+// with a port count, or IRP_MJ_READ, which returns a bare array of ports
+// like the Linux evtchn device.
+static FORCEINLINE
+ULONG
+__EvtchnWaitBuffer(
+    __in   PIRP     Irp,
+    __out  PULONG   *LocalPorts
+    )
+{
+    PIO_STACK_LOCATION Stack = IoGetCurrentIrpStackLocation(Irp);
+    PXENIFACE_EVTCHN_WAIT_OUT Out;
+
+    if (Stack->MajorFunction == IRP_MJ_READ) {
+        *LocalPorts = Irp->AssociatedIrp.SystemBuffer;
+        return Stack->Parameters.Read.Length / sizeof(ULONG);
+    }
+
+    Out = Irp->AssociatedIrp.SystemBuffer;
+    *LocalPorts = Out->LocalPorts;
+    return (Stack->Parameters.DeviceIoControl.OutputBufferLength -
+            (ULONG)FIELD_OFFSET(XENIFACE_EVTCHN_WAIT_OUT, LocalPorts)) / sizeof(ULONG);
+}
+
+static FORCEINLINE
+ULONG_PTR
+__EvtchnWaitInformation(
+    __in  PIRP      Irp,
+    __in  ULONG     NumberPorts
+    )
+{
+    PXENIFACE_EVTCHN_WAIT_OUT Out;
+
+    if (IoGetCurrentIrpStackLocation(Irp)->MajorFunction == IRP_MJ_READ)
+        return NumberPorts * sizeof(ULONG);
+
+    Out = Irp->AssociatedIrp.SystemBuffer;
+    Out->NumberPorts = NumberPorts;
+    return FIELD_OFFSET(XENIFACE_EVTCHN_WAIT_OUT, LocalPorts[NumberPorts]);
+}
+
+// Complete a pending wait request of the file object, if there is one and
+// any of its channels fired.
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+EvtchnCompleteWait(
+    __in      PXENIFACE_FDO Fdo,
+    __in      PFILE_OBJECT  FileObject
+    )
+{
+    XENIFACE_CONTEXT_ID Id;
+    PULONG LocalPorts;
+    ULONG MaxPorts;
+    ULONG NumberPorts;
+    PIRP Irp;
+    NTSTATUS status;
+
+    __EvtchnInitializeWaitId(&Id, FileObject);
+
+    Irp = IoCsqRemoveNextIrp(&Fdo->IrpQueue, &Id);
+    if (Irp == NULL)
+        return;
+
+    MaxPorts = __EvtchnWaitBuffer(Irp, &LocalPorts);
+
+    NumberPorts = EvtchnDrainFired(Fdo, FileObject, LocalPorts, MaxPorts);
+    if (NumberPorts == 0) {
+        // Another waiter consumed the ports, keep this one pending.
+        status = IoCsqInsertIrpEx(&Fdo->IrpQueue, Irp, NULL, Irp->Tail.Overlay.DriverContext[0]);
+        if (NT_SUCCESS(status))
+            return;
+    }
+
+    XenIfaceDebugPrint(TRACE, "Irp %p, FO %p, NumberPorts %lu\n", Irp, FileObject, NumberPorts);
+
+    EvtchnCompleteWaitIrp(Irp,
+                          STATUS_SUCCESS,
+                          __EvtchnWaitInformation(Irp, NumberPorts));
+}
+
+// Cancel pending waits of a file object (or all of them if FileObject is NULL).
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+EvtchnCancelWaits(
+    __in      PXENIFACE_FDO Fdo,
+    __in_opt  PFILE_OBJECT  FileObject
+    )
+{
+    XENIFACE_CONTEXT_ID Id;
+    PIRP Irp;
+
+    __EvtchnInitializeWaitId(&Id, FileObject);
+
+    while ((Irp = IoCsqRemoveNextIrp(&Fdo->IrpQueue, &Id)) != NULL) {
+        XenIfaceDebugPrint(TRACE, "Irp %p, FO %p\n", Irp, FileObject);
+        EvtchnCompleteWaitIrp(Irp, STATUS_CANCELLED, 0);
+    }
+}
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnBindUnbound(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS status;
+    PXENIFACE_EVTCHN_BIND_UNBOUND_IN In = Buffer;
+    PXENIFACE_EVTCHN_BIND_UNBOUND_OUT Out = Buffer;
+    PXENIFACE_EVTCHN_CONTEXT Context;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != sizeof(XENIFACE_EVTCHN_BIND_UNBOUND_IN) ||
+        OutLen != sizeof(XENIFACE_EVTCHN_BIND_UNBOUND_OUT)) {
+        goto fail1;
+    }
+
+    status = STATUS_NO_MEMORY;
+    Context = CacheGet(Fdo, XENIFACE_CACHE_EVTCHN);
+    if (Context == NULL)
+        goto fail2;
+
+    Context->FileObject = FileObject;
+
+    XenIfaceDebugPrint(TRACE, "> RemoteDomain %d, Mask %d, FO %p\n",
+                       In->RemoteDomain, In->Mask, FileObject);
+
+    // Without an event object, notifications are delivered through
+    // IOCTL_XENIFACE_EVTCHN_WAIT.
+    if (In->Event != NULL) {
+        status = ObReferenceObjectByHandle(In->Event,
+                                           EVENT_MODIFY_STATE,
+                                           *ExEventObjectType,
+                                           UserMode,
+                                           &Context->Event,
+                                           NULL);
+        if (!NT_SUCCESS(status))
+            goto fail3;
+    }
+
+    KeInitializeDpc(&Context->Dpc, EvtchnNotificationDpc, Context);
+    KeInitializeDpc(&Context->ModerationDpc, EvtchnModerationDpc, Context);
+    KeInitializeTimer(&Context->ModerationTimer);
+    ExInitializeRundownProtection(&Context->Rundown);
+    Context->Fdo = Fdo;
+
+    status = STATUS_UNSUCCESSFUL;
+    Context->Channel = XENBUS_EVTCHN(Open,
+                                     &Fdo->EvtchnInterface,
+                                     XENBUS_EVTCHN_TYPE_UNBOUND,
+                                     EvtchnInterruptHandler,
+                                     Context,
+                                     In->RemoteDomain,
+                                     TRUE);
+    if (Context->Channel == NULL)
+        goto fail4;
+
+    Context->LocalPort = XENBUS_EVTCHN(GetPort,
+                                       &Fdo->EvtchnInterface,
+                                       Context->Channel);
+
+    EvtchnInsertChannel(Fdo, Context);
+
+    Out->LocalPort = Context->LocalPort;
+    *Info = sizeof(XENIFACE_EVTCHN_BIND_UNBOUND_OUT);
+
+    if (!In->Mask) {
+        __EvtchnUnmask(Context);
+    }
+
+    XenIfaceDebugPrint(TRACE, "< LocalPort %lu, Context %p\n", Context->LocalPort, Context);
+    return STATUS_SUCCESS;
+
+fail4:
+    XenIfaceDebugPrint(ERROR, "Fail4\n");
+    if (Context->Event != NULL)
+        ObDereferenceObject(Context->Event);
+
+fail3:
+    XenIfaceDebugPrint(ERROR, "Fail3\n");
+    RtlZeroMemory(Context, sizeof(XENIFACE_EVTCHN_CONTEXT));
+    CachePut(Fdo, XENIFACE_CACHE_EVTCHN, Context);
+
+fail2:
+    XenIfaceDebugPrint(ERROR, "Fail2\n");
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnBindUnboundBatch(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS status;
+    PXENIFACE_EVTCHN_BIND_UNBOUND_BATCH_IN In = Buffer;
+    PXENIFACE_EVTCHN_BIND_UNBOUND_BATCH_OUT Out = Buffer;
+    PXENIFACE_EVTCHN_CONTEXT Context;
+    LIST_ENTRY List;
+    USHORT RemoteDomain;
+    BOOLEAN Mask;
+    ULONG NumberChannels;
+    ULONG Index;
+    KIRQL Irql;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != sizeof(XENIFACE_EVTCHN_BIND_UNBOUND_BATCH_IN))
+        goto fail1;
+
+    // Out overlays In.
+    RemoteDomain = In->RemoteDomain;
+    Mask = In->Mask;
+    NumberChannels = In->NumberChannels;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (NumberChannels == 0 ||
+        NumberChannels > XENIFACE_EVTCHN_BIND_BATCH_MAX) {
+        goto fail2;
+    }
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (OutLen != (ULONG)FIELD_OFFSET(XENIFACE_EVTCHN_BIND_UNBOUND_BATCH_OUT, LocalPorts[NumberChannels]))
+        goto fail3;
+
+    XenIfaceDebugPrint(TRACE, "> RemoteDomain %d, Mask %d, NumberChannels %lu, FO %p\n",
+                       RemoteDomain, Mask, NumberChannels, FileObject);
+
+    InitializeListHead(&List);
+
+    for (Index = 0; Index < NumberChannels; Index++) {
+        status = STATUS_NO_MEMORY;
+        Context = CacheGet(Fdo, XENIFACE_CACHE_EVTCHN);
+        if (Context == NULL)
+            goto fail4;
+
+        Context->FileObject = FileObject;
+
+        KeInitializeDpc(&Context->Dpc, EvtchnNotificationDpc, Context);
+        KeInitializeDpc(&Context->ModerationDpc, EvtchnModerationDpc, Context);
+        KeInitializeTimer(&Context->ModerationTimer);
+        ExInitializeRundownProtection(&Context->Rundown);
+        Context->Fdo = Fdo;
+
+        // Channels are opened masked, so nothing fires before they are inserted.
+        status = STATUS_UNSUCCESSFUL;
+        Context->Channel = XENBUS_EVTCHN(Open,
+                                         &Fdo->EvtchnInterface,
+                                         XENBUS_EVTCHN_TYPE_UNBOUND,
+                                         EvtchnInterruptHandler,
+                                         Context,
+                                         RemoteDomain,
+                                         TRUE);
+        if (Context->Channel == NULL) {
+            RtlZeroMemory(Context, sizeof(XENIFACE_EVTCHN_CONTEXT));
+            CachePut(Fdo, XENIFACE_CACHE_EVTCHN, Context);
+            goto fail4;
+        }
+
+        Context->LocalPort = XENBUS_EVTCHN(GetPort,
+                                           &Fdo->EvtchnInterface,
+                                           Context->Channel);
+
+        InsertTailList(&List, &Context->Entry);
+        Out->LocalPorts[Index] = Context->LocalPort;
+    }
+
+    EvtchnInsertList(Fdo, FileObject, &List);
+
+    if (!Mask) {
+        // Once inserted the channels may be closed by another thread, so look
+        // them up again like IOCTL_XENIFACE_EVTCHN_UNMASK does.
+        Irql = ExAcquireSpinLockShared(&Fdo->EvtchnLock);
+
+        for (Index = 0; Index < NumberChannels; Index++) {
+            Context = EvtchnFindChannel(Fdo, Out->LocalPorts[Index], FileObject);
+            if (Context != NULL)
+                __EvtchnUnmask(Context);
+        }
+
+        ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
+    }
+
+    Out->NumberChannels = NumberChannels;
+    *Info = (ULONG_PTR)FIELD_OFFSET(XENIFACE_EVTCHN_BIND_UNBOUND_BATCH_OUT, LocalPorts[NumberChannels]);
+
+    XenIfaceDebugPrint(TRACE, "< NumberChannels %lu\n", NumberChannels);
+    return STATUS_SUCCESS;
+
+fail4:
+    XenIfaceDebugPrint(ERROR, "Fail4 (%lu opened)\n", Index);
+    EvtchnFreeList(Fdo, &List);
+
+fail3:
+    XenIfaceDebugPrint(ERROR, "Fail3\n");
+
+fail2:
+    XenIfaceDebugPrint(ERROR, "Fail2\n");
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnBindInterdomain(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS status;
+    PXENIFACE_EVTCHN_BIND_INTERDOMAIN_IN In = Buffer;
+    PXENIFACE_EVTCHN_BIND_INTERDOMAIN_OUT Out = Buffer;
+    PXENIFACE_EVTCHN_CONTEXT Context;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != sizeof(XENIFACE_EVTCHN_BIND_INTERDOMAIN_IN) ||
+        OutLen != sizeof(XENIFACE_EVTCHN_BIND_INTERDOMAIN_OUT)) {
+        goto fail1;
+    }
+
+    status = STATUS_NO_MEMORY;
+    Context = CacheGet(Fdo, XENIFACE_CACHE_EVTCHN);
+    if (Context == NULL)
+        goto fail2;
+
+    Context->FileObject = FileObject;
+
+    XenIfaceDebugPrint(TRACE, "> RemoteDomain %d, RemotePort %lu, Mask %d, FO %p\n",
+                       In->RemoteDomain, In->RemotePort, In->Mask, FileObject);
+
+    // Without an event object, notifications are delivered through
+    // IOCTL_XENIFACE_EVTCHN_WAIT.
+    if (In->Event != NULL) {
+        status = ObReferenceObjectByHandle(In->Event,
+                                           EVENT_MODIFY_STATE,
+                                           *ExEventObjectType,
+                                           UserMode,
+                                           &Context->Event,
+                                           NULL);
+        if (!NT_SUCCESS(status))
+            goto fail3;
+    }
+
+    KeInitializeDpc(&Context->Dpc, EvtchnNotificationDpc, Context);
+    KeInitializeDpc(&Context->ModerationDpc, EvtchnModerationDpc, Context);
+    KeInitializeTimer(&Context->ModerationTimer);
+    ExInitializeRundownProtection(&Context->Rundown);
+    Context->Fdo = Fdo;
+
+    status = STATUS_UNSUCCESSFUL;
+    Context->Channel = XENBUS_EVTCHN(Open,
+                                     &Fdo->EvtchnInterface,
+                                     XENBUS_EVTCHN_TYPE_INTER_DOMAIN,
+                                     EvtchnInterruptHandler,
+                                     Context,
+                                     In->RemoteDomain,
+                                     In->RemotePort,
+                                     TRUE);
+    if (Context->Channel == NULL)
+        goto fail4;
+
+    Context->LocalPort = XENBUS_EVTCHN(GetPort,
+                                       &Fdo->EvtchnInterface,
+                                       Context->Channel);
+
+    EvtchnInsertChannel(Fdo, Context);
+
+    Out->LocalPort = Context->LocalPort;
+    *Info = sizeof(XENIFACE_EVTCHN_BIND_INTERDOMAIN_OUT);
+
+    if (!In->Mask) {
+        __EvtchnUnmask(Context);
+    }
+
+    XenIfaceDebugPrint(TRACE, "< LocalPort %lu, Context %p\n", Context->LocalPort, Context);
+
+    return STATUS_SUCCESS;
+
+fail4:
+    XenIfaceDebugPrint(ERROR, "Fail4\n");
+    if (Context->Event != NULL)
+        ObDereferenceObject(Context->Event);
+
+fail3:
+    XenIfaceDebugPrint(ERROR, "Fail3\n");
+    RtlZeroMemory(Context, sizeof(XENIFACE_EVTCHN_CONTEXT));
+    CachePut(Fdo, XENIFACE_CACHE_EVTCHN, Context);
+
+fail2:
+    XenIfaceDebugPrint(ERROR, "Fail2\n");
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnClose(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject
+    )
+{
+    NTSTATUS status;
+    PXENIFACE_EVTCHN_CLOSE_IN In = Buffer;
+    PXENIFACE_EVTCHN_CONTEXT Context;
+    KIRQL Irql;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != sizeof(XENIFACE_EVTCHN_CLOSE_IN) ||
+        OutLen != 0) {
+        goto fail1;
+    }
+
+    XenIfaceDebugPrint(TRACE, "> LocalPort %lu, FO %p\n", In->LocalPort, FileObject);
+
+    Irql = ExAcquireSpinLockExclusive(&Fdo->EvtchnLock);
+    status = STATUS_NOT_FOUND;
+    Context = EvtchnFindChannel(Fdo, In->LocalPort, FileObject);
+    if (Context == NULL)
+        goto fail2;
+
+    EvtchnRemoveChannel(Fdo, Context);
+    ExReleaseSpinLockExclusive(&Fdo->EvtchnLock, Irql);
+    EvtchnFree(Fdo, Context);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    XenIfaceDebugPrint(ERROR, "Fail2\n");
+    ExReleaseSpinLockExclusive(&Fdo->EvtchnLock, Irql);
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+_Requires_lock_not_held_(Fdo->EvtchnLock)
+DECLSPEC_NOINLINE
+NTSTATUS
+EvtchnNotify(
+    __in      PXENIFACE_FDO Fdo,
+    __in      ULONG         LocalPort,
+    __in_opt  PFILE_OBJECT  FileObject
+    )
+{
+    NTSTATUS status;
+    PXENIFACE_EVTCHN_CONTEXT Context;
+    KIRQL Irql;
+
+    Irql = ExAcquireSpinLockShared(&Fdo->EvtchnLock);
+
+    Context = EvtchnFindChannel(Fdo, LocalPort, FileObject);
+
+    status = STATUS_NOT_FOUND;
+    if (Context == NULL)
+        goto fail1;
+
+    XENBUS_EVTCHN(Send,
+                  &Fdo->EvtchnInterface,
+                  Context->Channel);
+    InterlockedIncrement64(&Context->Sends);
+
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
+    return status;
+}
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnNotify(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject
+    )
+{
+    NTSTATUS status;
+    PXENIFACE_EVTCHN_NOTIFY_IN In = Buffer;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != sizeof(XENIFACE_EVTCHN_NOTIFY_IN) ||
+        OutLen != 0) {
+        goto fail1;
+    }
+
+#if DBG
+    XenIfaceDebugPrint(INFO, "> LocalPort %d, FO %p\n", In->LocalPort, FileObject);
+#endif
+
+    return EvtchnNotify(Fdo, In->LocalPort, FileObject);
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnNotifyBatch(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS status;
+    PXENIFACE_EVTCHN_NOTIFY_BATCH_IN In = Buffer;
+    PXENIFACE_EVTCHN_NOTIFY_BATCH_OUT Out = Buffer;
+    PXENIFACE_EVTCHN_CONTEXT Context;
+    ULONG NumberPorts;
+    ULONG LocalPort;
+    ULONG Index;
+    KIRQL Irql;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen < (ULONG)FIELD_OFFSET(XENIFACE_EVTCHN_NOTIFY_BATCH_IN, LocalPorts))
+        goto fail1;
+
+    NumberPorts = In->NumberPorts;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (NumberPorts == 0 ||
+        NumberPorts > XENIFACE_EVTCHN_NOTIFY_BATCH_MAX) {
+        goto fail2;
+    }
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != (ULONG)FIELD_OFFSET(XENIFACE_EVTCHN_NOTIFY_BATCH_IN, LocalPorts[NumberPorts]) ||
+        OutLen != (ULONG)FIELD_OFFSET(XENIFACE_EVTCHN_NOTIFY_BATCH_OUT, Status[NumberPorts])) {
+        goto fail3;
+    }
+
+    XenIfaceDebugPrint(TRACE, "> NumberPorts %lu, FO %p\n", NumberPorts, FileObject);
+
+    // In and Out share the system buffer and have the same layout, so each
+    // Status entry overwrites the LocalPorts entry that was just consumed.
+    Irql = ExAcquireSpinLockShared(&Fdo->EvtchnLock);
+
+    for (Index = 0; Index < NumberPorts; Index++) {
+        LocalPort = In->LocalPorts[Index];
+
+        Context = EvtchnFindChannel(Fdo, LocalPort, FileObject);
+        if (Context == NULL) {
+            Out->Status[Index] = STATUS_NOT_FOUND;
+            continue;
+        }
+
+        XENBUS_EVTCHN(Send,
+                      &Fdo->EvtchnInterface,
+                      Context->Channel);
+        InterlockedIncrement64(&Context->Sends);
+
+        Out->Status[Index] = STATUS_SUCCESS;
+    }
+
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
+
+    Out->NumberPorts = NumberPorts;
+    *Info = OutLen;
+
+    return STATUS_SUCCESS;
+
+fail3:
+    XenIfaceDebugPrint(ERROR, "Fail3\n");
+
+fail2:
+    XenIfaceDebugPrint(ERROR, "Fail2\n");
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnUnmask(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject
+    )
+{
+    NTSTATUS status;
+    PXENIFACE_EVTCHN_UNMASK_IN In = Buffer;
+    PXENIFACE_EVTCHN_CONTEXT Context;
+    KIRQL Irql;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != sizeof(XENIFACE_EVTCHN_UNMASK_IN) ||
+        OutLen != 0) {
+        goto fail1;
+    }
+
+    XenIfaceDebugPrint(TRACE, "> LocalPort %d, FO %p\n", In->LocalPort, FileObject);
+
+    Irql = ExAcquireSpinLockShared(&Fdo->EvtchnLock);
+
+    Context = EvtchnFindChannel(Fdo, In->LocalPort, FileObject);
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Context == NULL)
+        goto fail2;
+
+    __EvtchnUnmask(Context);
+
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    XenIfaceDebugPrint(ERROR, "Fail2\n");
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+// Return fired ports right away or queue the request until one fires.
+static
+NTSTATUS
+EvtchnWait(
+    __in     PXENIFACE_FDO     Fdo,
+    __inout  PIRP              Irp,
+    __out    PULONG_PTR        Info
+    )
+{
+    NTSTATUS status;
+    PFILE_OBJECT FileObject = IoGetCurrentIrpStackLocation(Irp)->FileObject;
+    PXENIFACE_EVTCHN_WAIT_CONTEXT Context;
+    PULONG LocalPorts;
+    ULONG MaxPorts;
+    ULONG NumberPorts;
+
+    MaxPorts = __EvtchnWaitBuffer(Irp, &LocalPorts);
+
+    // Complete immediately if something already fired.
+    NumberPorts = EvtchnDrainFired(Fdo, FileObject, LocalPorts, MaxPorts);
+    if (NumberPorts != 0) {
+        *Info = __EvtchnWaitInformation(Irp, NumberPorts);
+        return STATUS_SUCCESS;
+    }
+
+    status = STATUS_NO_MEMORY;
+    Context = ExAllocatePoolWithTag(NonPagedPool, sizeof(XENIFACE_EVTCHN_WAIT_CONTEXT), XENIFACE_POOL_TAG);
+    if (Context == NULL)
+        goto fail1;
+
+    RtlZeroMemory(Context, sizeof(XENIFACE_EVTCHN_WAIT_CONTEXT));
+    __EvtchnInitializeWaitId(&Context->Id, FileObject);
+    Context->Id.Process = PsGetCurrentProcess();
+
+    XenIfaceDebugPrint(TRACE, "> Irp %p, FO %p, MaxPorts %lu\n", Irp, FileObject, MaxPorts);
+
+    Irp->Tail.Overlay.DriverContext[0] = &Context->Id;
+    status = IoCsqInsertIrpEx(&Fdo->IrpQueue, Irp, NULL, &Context->Id);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    // A channel may have fired between draining and queueing the IRP.
+    // The IRP must not be touched after this point.
+    EvtchnCompleteWait(Fdo, FileObject);
+
+    return STATUS_PENDING;
+
+fail2:
+    XenIfaceDebugPrint(ERROR, "Fail2\n");
+    RtlZeroMemory(Context, sizeof(XENIFACE_EVTCHN_WAIT_CONTEXT));
+    ExFreePoolWithTag(Context, XENIFACE_POOL_TAG);
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnWait(
+    __in     PXENIFACE_FDO     Fdo,
+    __in     PVOID             Buffer,
+    __in     ULONG             InLen,
+    __in     ULONG             OutLen,
+    __inout  PIRP              Irp,
+    __out    PULONG_PTR        Info
+    )
+{
+    NTSTATUS status;
+
+    UNREFERENCED_PARAMETER(Buffer);
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != 0 ||
+        OutLen < (ULONG)FIELD_OFFSET(XENIFACE_EVTCHN_WAIT_OUT, LocalPorts[1])) {
+        goto fail1;
+    }
+
+    return EvtchnWait(Fdo, Irp, Info);
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+// ReadFile on the device: a bare array of fired ports, one batch per read.
+DECLSPEC_NOINLINE
+NTSTATUS
+EvtchnRead(
+    __in     PXENIFACE_FDO     Fdo,
+    __inout  PIRP              Irp,
+    __out    PULONG_PTR        Info
+    )
+{
+    NTSTATUS status;
+    PIO_STACK_LOCATION Stack = IoGetCurrentIrpStackLocation(Irp);
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (Stack->Parameters.Read.Length < sizeof(ULONG))
+        goto fail1;
+
+    return EvtchnWait(Fdo, Irp, Info);
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnMapPending(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS status;
+    PXENIFACE_EVTCHN_MAP_PENDING_OUT Out = Buffer;
+    PXENIFACE_EVTCHN_PENDING_CONTEXT Context;
+    PXENIFACE_EVTCHN_CONTEXT EvtchnContext;
+    PLIST_ENTRY Node;
+    KIRQL Irql;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != 0 ||
+        OutLen != sizeof(XENIFACE_EVTCHN_MAP_PENDING_OUT)) {
+        goto fail1;
+    }
+
+    // The page is unmapped when its process exits, a handle inherited
+    // or duplicated into another process can't map it there.
+    status = STATUS_ACCESS_DENIED;
+    if (PsGetCurrentProcess() != __XenIfaceFileContext(FileObject)->Process)
+        goto fail2;
+
+    status = STATUS_NO_MEMORY;
+    Context = ExAllocatePoolWithTag(NonPagedPool, sizeof(XENIFACE_EVTCHN_PENDING_CONTEXT), XENIFACE_POOL_TAG);
+    if (Context == NULL)
+        goto fail3;
+
+    RtlZeroMemory(Context, sizeof(XENIFACE_EVTCHN_PENDING_CONTEXT));
+    Context->FileObject = FileObject;
+    Context->Process = PsGetCurrentProcess();
+
+    XenIfaceDebugPrint(TRACE, "> FO %p, Process %p\n", FileObject, Context->Process);
+
+    // zeroed page, mapped into system space
+    status = STATUS_NO_MEMORY;
+    Context->Mdl = __AllocatePage();
+    if (Context->Mdl == NULL)
+        goto fail4;
+
+    Context->Bits = Context->Mdl->MappedSystemVa;
+
+    // map into user mode
+#pragma prefast(suppress: 6320) // we want to catch all exceptions
+    __try {
+        Context->UserVa = MmMapLockedPagesSpecifyCache(Context->Mdl,
+                                                       UserMode,
+                                                       MmCached,
+                                                       NULL,
+                                                       FALSE,
+                                                       NormalPagePriority);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+        goto fail5;
+    }
+
+    status = STATUS_UNSUCCESSFUL;
+    if (Context->UserVa == NULL)
+        goto fail6;
+
+    Irql = ExAcquireSpinLockExclusive(&Fdo->EvtchnLock);
+
+    status = STATUS_ALREADY_REGISTERED;
+    if (EvtchnFindPending(Fdo, FileObject) != NULL)
+        goto fail7;
+
+    InsertTailList(&Fdo->EvtchnPendingList, &Context->Entry);
+
+    // channels that were opened before the page was mapped
+    for (Node = Fdo->EvtchnList.Flink; Node != &Fdo->EvtchnList; Node = Node->Flink) {
+        EvtchnContext = CONTAINING_RECORD(Node, XENIFACE_EVTCHN_CONTEXT, Entry);
+
+        if (EvtchnContext->FileObject == FileObject &&
+            EvtchnContext->LocalPort < XENIFACE_EVTCHN_PENDING_PORTS)
+            EvtchnContext->PendingBits = Context->Bits;
+    }
+
+    ExReleaseSpinLockExclusive(&Fdo->EvtchnLock, Irql);
+
+    // keep the process alive until the page is unmapped from it
+    ObReferenceObject(Context->Process);
+    XenIfaceAddProcessMapping(FileObject);
+
+    Out->Address = Context->UserVa;
+    Out->NumberPorts = XENIFACE_EVTCHN_PENDING_PORTS;
+    *Info = sizeof(XENIFACE_EVTCHN_MAP_PENDING_OUT);
+
+    XenIfaceDebugPrint(TRACE, "< Context %p, UserVa %p\n", Context, Context->UserVa);
+    return STATUS_SUCCESS;
+
+fail7:
+    XenIfaceDebugPrint(ERROR, "Fail7\n");
+    ExReleaseSpinLockExclusive(&Fdo->EvtchnLock, Irql);
+    MmUnmapLockedPages(Context->UserVa, Context->Mdl);
+
+fail6:
+    XenIfaceDebugPrint(ERROR, "Fail6\n");
+
+fail5:
+    XenIfaceDebugPrint(ERROR, "Fail5\n");
+    __FreePage(Context->Mdl);
+    ExFreePool(Context->Mdl);
+
+fail4:
+    XenIfaceDebugPrint(ERROR, "Fail4\n");
+    RtlZeroMemory(Context, sizeof(XENIFACE_EVTCHN_PENDING_CONTEXT));
+    ExFreePoolWithTag(Context, XENIFACE_POOL_TAG);
+
+fail3:
+    XenIfaceDebugPrint(ERROR, "Fail3\n");
+
+fail2:
+    XenIfaceDebugPrint(ERROR, "Fail2\n");
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+// Unmap pending pages of a file object (or all of them if FileObject is NULL).
+// All channels of the file object must already be freed.
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+EvtchnFreePending(
+    __in      PXENIFACE_FDO Fdo,
+    __in_opt  PFILE_OBJECT  FileObject
+    )
+{
+    PXENIFACE_EVTCHN_PENDING_CONTEXT Context;
+    PLIST_ENTRY Node;
+    LIST_ENTRY ToFree;
+    KAPC_STATE ApcState;
+    BOOLEAN ChangeProcess;
+    KIRQL Irql;
+
+    ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+    InitializeListHead(&ToFree);
+    Irql = ExAcquireSpinLockExclusive(&Fdo->EvtchnLock);
+    Node = Fdo->EvtchnPendingList.Flink;
+    while (Node != &Fdo->EvtchnPendingList) {
+        Context = CONTAINING_RECORD(Node, XENIFACE_EVTCHN_PENDING_CONTEXT, Entry);
+
+        Node = Node->Flink;
+        if (FileObject != NULL &&
+            Context->FileObject != FileObject)
+            continue;
+
+        RemoveEntryList(&Context->Entry);
+        InsertTailList(&ToFree, &Context->Entry);
+    }
+    ExReleaseSpinLockExclusive(&Fdo->EvtchnLock, Irql);
+
+    // EvtchnProcessExit can't unmap a page while it is attached here
+    AcquireMutex(&Fdo->UnmapMutex);
+
+    while (!IsListEmpty(&ToFree)) {
+        Node = RemoveHeadList(&ToFree);
+        Context = CONTAINING_RECORD(Node, XENIFACE_EVTCHN_PENDING_CONTEXT, Entry);
+
+        XenIfaceDebugPrint(TRACE, "Context %p, FO %p, Process %p, UserVa %p\n",
+                           Context, Context->FileObject, Context->Process, Context->UserVa);
+
+        // already unmapped if the process exited
+        if (Context->Process != NULL) {
+            // user mappings can only be removed in the context of their process
+            ChangeProcess = PsGetCurrentProcess() != Context->Process;
+            if (ChangeProcess)
+                KeStackAttachProcess(Context->Process, &ApcState);
+
+            MmUnmapLockedPages(Context->UserVa, Context->Mdl);
+
+            if (ChangeProcess)
+                KeUnstackDetachProcess(&ApcState);
+
+            ObDereferenceObject(Context->Process);
+            XenIfaceRemoveProcessMapping(Context->FileObject);
+        }
+
+        __FreePage(Context->Mdl);
+        ExFreePool(Context->Mdl);
+
+        RtlZeroMemory(Context, sizeof(XENIFACE_EVTCHN_PENDING_CONTEXT));
+        ExFreePoolWithTag(Context, XENIFACE_POOL_TAG);
+    }
+
+    ReleaseMutex(&Fdo->UnmapMutex);
+}
+
+// Unmap the pending page of a file object from its process, which is exiting,
+// called in its context. The page itself stays allocated: channels of the
+// file object may set bits in it until EvtchnFreePending runs at cleanup.
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+EvtchnProcessExit(
+    __in      PXENIFACE_FDO Fdo,
+    __in      PFILE_OBJECT  FileObject
+    )
+{
+    PXENIFACE_EVTCHN_PENDING_CONTEXT Context;
+    KIRQL Irql;
+
+    ASSERT3P(Fdo->UnmapMutex.Owner, ==, KeGetCurrentThread());
+
+    // Contexts are only freed under UnmapMutex, the one found stays valid
+    // once the lock is dropped to unmap it.
+    Irql = ExAcquireSpinLockExclusive(&Fdo->EvtchnLock);
+    Context = EvtchnFindPending(Fdo, FileObject);
+    ExReleaseSpinLockExclusive(&Fdo->EvtchnLock, Irql);
+
+    // not mapped, or already unmapped
+    if (Context == NULL || Context->Process == NULL)
+        return;
+
+    ASSERT3P(PsGetCurrentProcess(), ==, Context->Process);
+
+    XenIfaceDebugPrint(TRACE, "Context %p, FO %p, Process %p, UserVa %p\n",
+                       Context, Context->FileObject, Context->Process, Context->UserVa);
+
+    MmUnmapLockedPages(Context->UserVa, Context->Mdl);
+    Context->UserVa = NULL;
+
+    ObDereferenceObject(Context->Process);
+    Context->Process = NULL;
+
+    XenIfaceRemoveProcessMapping(FileObject);
+}
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnSetSpin(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject
+    )
+{
+    NTSTATUS status;
+    PXENIFACE_EVTCHN_SET_SPIN_IN In = Buffer;
+    PXENIFACE_EVTCHN_CONTEXT Context;
+    KIRQL Irql;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != sizeof(XENIFACE_EVTCHN_SET_SPIN_IN) ||
+        OutLen != 0) {
+        goto fail1;
+    }
+
+    status = STATUS_INVALID_PARAMETER;
+    if (In->SpinMicroseconds > XENIFACE_EVTCHN_SPIN_MAX)
+        goto fail2;
+
+    XenIfaceDebugPrint(TRACE, "> LocalPort %lu, SpinMicroseconds %lu, FO %p\n",
+                       In->LocalPort, In->SpinMicroseconds, FileObject);
+
+    Irql = ExAcquireSpinLockExclusive(&Fdo->EvtchnLock);
+
+    status = STATUS_NOT_FOUND;
+    Context = EvtchnFindChannel(Fdo, In->LocalPort, FileObject);
+    if (Context == NULL)
+        goto fail3;
+
+    Context->SpinMicroseconds = In->SpinMicroseconds;
+
+    ExReleaseSpinLockExclusive(&Fdo->EvtchnLock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail3:
+    XenIfaceDebugPrint(ERROR, "Fail3\n");
+    ExReleaseSpinLockExclusive(&Fdo->EvtchnLock, Irql);
+
+fail2:
+    XenIfaceDebugPrint(ERROR, "Fail2\n");
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+// Spin on SpinPending for at most the channel's spin budget.
+static
+BOOLEAN
+EvtchnSpin(
+    __inout  PXENIFACE_EVTCHN_CONTEXT Context
+    )
+{
+    LARGE_INTEGER Frequency;
+    LARGE_INTEGER Now;
+    LONGLONG Deadline;
+    BOOLEAN Fired = FALSE;
+
+    Now = KeQueryPerformanceCounter(&Frequency);
+    Deadline = Now.QuadPart +
+               (Frequency.QuadPart * Context->SpinMicroseconds) / 1000000;
+
+    InterlockedIncrement(&Context->Spinners);
+
+    do {
+        if (Context->SpinPending != 0 &&
+            InterlockedExchange(&Context->SpinPending, 0) != 0) {
+            Fired = TRUE;
+            break;
+        }
+
+        YieldProcessor();
+        Now = KeQueryPerformanceCounter(NULL);
+    } while (Now.QuadPart < Deadline);
+
+    InterlockedDecrement(&Context->Spinners);
+
+    // The DPC skips notifications while Spinners is non-zero, so check
+    // once more after leaving.
+    if (!Fired &&
+        InterlockedExchange(&Context->SpinPending, 0) != 0)
+        Fired = TRUE;
+
+    return Fired;
+}
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnSpinWait(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS status;
+    PXENIFACE_EVTCHN_SPIN_WAIT_IN In = Buffer;
+    PXENIFACE_EVTCHN_SPIN_WAIT_OUT Out = Buffer;
+    PXENIFACE_EVTCHN_CONTEXT Context;
+    BOOLEAN Fired;
+    KIRQL Irql;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != sizeof(XENIFACE_EVTCHN_SPIN_WAIT_IN) ||
+        OutLen != sizeof(XENIFACE_EVTCHN_SPIN_WAIT_OUT)) {
+        goto fail1;
+    }
+
+    Irql = ExAcquireSpinLockShared(&Fdo->EvtchnLock);
+
+    status = STATUS_NOT_FOUND;
+    Context = EvtchnFindChannel(Fdo, In->LocalPort, FileObject);
+    if (Context == NULL)
+        goto fail2;
+
+    // Keeps the context alive without holding the lock while spinning.
+    if (!ExAcquireRundownProtection(&Context->Rundown))
+        goto fail3;
 
-    Node = Fdo->EvtchnList.Flink;
-    while (Node->Flink != Fdo->EvtchnList.Flink) {
-        Context = CONTAINING_RECORD(Node, XENIFACE_EVTCHN_CONTEXT, Entry);
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
 
-        Node = Node->Flink;
-        if (Context->LocalPort != LocalPort)
-            continue;
+    Fired = EvtchnSpin(Context);
+    if (Fired)
+        InterlockedIncrement(&Context->SpinWakeups);
+    else
+        InterlockedIncrement(&Context->SpinMisses);
 
-        if (FileObject != NULL &&
-            FileObject != Context->FileObject) {
-            continue;
-        }
+    Out->Fired = Fired;
+    Out->SpinWakeups = Context->SpinWakeups;
+    Out->SpinMisses = Context->SpinMisses;
 
-        Found = Context;
-        break;
-    }
+    ExReleaseRundownProtection(&Context->Rundown);
+
+    *Info = sizeof(XENIFACE_EVTCHN_SPIN_WAIT_OUT);
+    return STATUS_SUCCESS;
+
+fail3:
+    XenIfaceDebugPrint(ERROR, "Fail3\n");
+
+fail2:
+    XenIfaceDebugPrint(ERROR, "Fail2\n");
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
 
-    return Found;
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
 }
 
 DECLSPEC_NOINLINE
 NTSTATUS
-IoctlEvtchnBindUnbound(
+IoctlEvtchnSetModeration(
     __in  PXENIFACE_FDO     Fdo,
     __in  PVOID             Buffer,
     __in  ULONG             InLen,
     __in  ULONG             OutLen,
-    __in  PFILE_OBJECT      FileObject,
-    __out PULONG_PTR        Info
+    __in  PFILE_OBJECT      FileObject
     )
 {
     NTSTATUS status;
-    PXENIFACE_EVTCHN_BIND_UNBOUND_IN In = Buffer;
-    PXENIFACE_EVTCHN_BIND_UNBOUND_OUT Out = Buffer;
+    PXENIFACE_EVTCHN_SET_MODERATION_IN In = Buffer;
     PXENIFACE_EVTCHN_CONTEXT Context;
+    KIRQL Irql;
 
     status = STATUS_INVALID_BUFFER_SIZE;
-    if (InLen != sizeof(XENIFACE_EVTCHN_BIND_UNBOUND_IN) ||
-        OutLen != sizeof(XENIFACE_EVTCHN_BIND_UNBOUND_OUT)) {
+    if (InLen != sizeof(XENIFACE_EVTCHN_SET_MODERATION_IN) ||
+        OutLen != 0) {
         goto fail1;
     }
 
-    status = STATUS_NO_MEMORY;
-    Context = ExAllocatePoolWithTag(NonPagedPool, sizeof(XENIFACE_EVTCHN_CONTEXT), XENIFACE_POOL_TAG);
-    if (Context == NULL)
-        goto fail2;
-
-    RtlZeroMemory(Context, sizeof(XENIFACE_EVTCHN_CONTEXT));
-    Context->FileObject = FileObject;
-
-    XenIfaceDebugPrint(TRACE, "> RemoteDomain %d, Mask %d, FO %p\n",
-                       In->RemoteDomain, In->Mask, FileObject);
-
-    status = ObReferenceObjectByHandle(In->Event,
-                                       EVENT_MODIFY_STATE,
-                                       *ExEventObjectType,
-                                       UserMode,
-                                       &Context->Event,
-                                       NULL);
-    if (!NT_SUCCESS(status))
-        goto fail3;
+    status = STATUS_INVALID_PARAMETER;
+    switch (In->Mode) {
+    case XENIFACE_EVTCHN_MODERATION_NONE:
+    case XENIFACE_EVTCHN_MODERATION_ACK:
+        break;
 
-    KeInitializeDpc(&Context->Dpc, EvtchnNotificationDpc, Context);
+    case XENIFACE_EVTCHN_MODERATION_INTERVAL:
+        if (In->IntervalMicroseconds == 0 ||
+            In->IntervalMicroseconds > XENIFACE_EVTCHN_MODERATION_INTERVAL_MAX)
+            goto fail2;
+        break;
 
-    status = STATUS_UNSUCCESSFUL;
-    Context->Channel = XENBUS_EVTCHN(Open,
-                                     &Fdo->EvtchnInterface,
-                                     XENBUS_EVTCHN_TYPE_UNBOUND,
-                                     EvtchnInterruptHandler,
-                                     Context,
-                                     In->RemoteDomain,
-                                     TRUE);
-    if (Context->Channel == NULL)
-        goto fail4;
+    default:
+        goto fail2;
+    }
 
-    Context->LocalPort = XENBUS_EVTCHN(GetPort,
-                                       &Fdo->EvtchnInterface,
-                                       Context->Channel);
+    XenIfaceDebugPrint(TRACE, "> LocalPort %lu, Mode %d, IntervalMicroseconds %lu, FO %p\n",
+                       In->LocalPort, In->Mode, In->IntervalMicroseconds, FileObject);
 
-    Context->Fdo = Fdo;
+    Irql = ExAcquireSpinLockExclusive(&Fdo->EvtchnLock);
 
-    ExInterlockedInsertTailList(&Fdo->EvtchnList, &Context->Entry, &Fdo->EvtchnLock);
+    status = STATUS_NOT_FOUND;
+    Context = EvtchnFindChannel(Fdo, In->LocalPort, FileObject);
+    if (Context == NULL)
+        goto fail3;
 
-    Out->LocalPort = Context->LocalPort;
-    *Info = sizeof(XENIFACE_EVTCHN_BIND_UNBOUND_OUT);
+    Context->ModerationInterval = In->IntervalMicroseconds;
+    Context->ModerationMode = In->Mode;
+    if (In->Mode == XENIFACE_EVTCHN_MODERATION_INTERVAL)
+        Context->ModerationUsed = TRUE;
 
-    if (!In->Mask) {
-        XENBUS_EVTCHN(Unmask,
-                      &Fdo->EvtchnInterface,
-                      Context->Channel,
-                      FALSE);
-    }
+    ExReleaseSpinLockExclusive(&Fdo->EvtchnLock, Irql);
 
-    XenIfaceDebugPrint(TRACE, "< LocalPort %lu, Context %p\n", Context->LocalPort, Context);
     return STATUS_SUCCESS;
 
-fail4:
-    XenIfaceDebugPrint(ERROR, "Fail4\n");
-    ObDereferenceObject(Context->Event);
-
 fail3:
     XenIfaceDebugPrint(ERROR, "Fail3\n");
-    RtlZeroMemory(Context, sizeof(XENIFACE_EVTCHN_CONTEXT));
-    ExFreePoolWithTag(Context, XENIFACE_POOL_TAG);
+    ExReleaseSpinLockExclusive(&Fdo->EvtchnLock, Irql);
 
 fail2:
     XenIfaceDebugPrint(ERROR, "Fail2\n");
@@ -244,7 +1840,7 @@ fail1:
 
 DECLSPEC_NOINLINE
 NTSTATUS
-IoctlEvtchnBindInterdomain(
+IoctlEvtchnSetAffinity(
     __in  PXENIFACE_FDO     Fdo,
     __in  PVOID             Buffer,
     __in  ULONG             InLen,
@@ -254,80 +1850,115 @@ IoctlEvtchnBindInterdomain(
     )
 {
     NTSTATUS status;
-    PXENIFACE_EVTCHN_BIND_INTERDOMAIN_IN In = Buffer;
-    PXENIFACE_EVTCHN_BIND_INTERDOMAIN_OUT Out = Buffer;
+    PXENIFACE_EVTCHN_SET_AFFINITY_IN In = Buffer;
+    PXENIFACE_EVTCHN_SET_AFFINITY_OUT Out = Buffer;
     PXENIFACE_EVTCHN_CONTEXT Context;
+    PROCESSOR_NUMBER ProcNumber;
+    BOOLEAN Pending;
+    BOOLEAN ModerationPending;
+    KIRQL Irql;
 
     status = STATUS_INVALID_BUFFER_SIZE;
-    if (InLen != sizeof(XENIFACE_EVTCHN_BIND_INTERDOMAIN_IN) ||
-        OutLen != sizeof(XENIFACE_EVTCHN_BIND_INTERDOMAIN_OUT)) {
+    if (InLen != sizeof(XENIFACE_EVTCHN_SET_AFFINITY_IN) ||
+        OutLen != sizeof(XENIFACE_EVTCHN_SET_AFFINITY_OUT)) {
         goto fail1;
     }
 
-    status = STATUS_NO_MEMORY;
-    Context = ExAllocatePoolWithTag(NonPagedPool, sizeof(XENIFACE_EVTCHN_CONTEXT), XENIFACE_POOL_TAG);
-    if (Context == NULL)
+    RtlZeroMemory(&ProcNumber, sizeof(PROCESSOR_NUMBER));
+    ProcNumber.Group = In->Group;
+    ProcNumber.Number = In->Number;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (KeGetProcessorIndexFromNumber(&ProcNumber) == INVALID_PROCESSOR_INDEX)
         goto fail2;
 
-    RtlZeroMemory(Context, sizeof(XENIFACE_EVTCHN_CONTEXT));
-    Context->FileObject = FileObject;
+    XenIfaceDebugPrint(TRACE, "> LocalPort %lu, Group %u, Number %u, FO %p\n",
+                       In->LocalPort, In->Group, In->Number, FileObject);
 
-    XenIfaceDebugPrint(TRACE, "> RemoteDomain %d, RemotePort %lu, Mask %d, FO %p\n",
-                       In->RemoteDomain, In->RemotePort, In->Mask, FileObject);
+    Irql = ExAcquireSpinLockShared(&Fdo->EvtchnLock);
 
-    status = ObReferenceObjectByHandle(In->Event,
-                                       EVENT_MODIFY_STATE,
-                                       *ExEventObjectType,
-                                       UserMode,
-                                       &Context->Event,
-                                       NULL);
-    if (!NT_SUCCESS(status))
+    status = STATUS_NOT_FOUND;
+    Context = EvtchnFindChannel(Fdo, In->LocalPort, FileObject);
+    if (Context == NULL)
         goto fail3;
 
-    KeInitializeDpc(&Context->Dpc, EvtchnNotificationDpc, Context);
-
-    status = STATUS_UNSUCCESSFUL;
-    Context->Channel = XENBUS_EVTCHN(Open,
-                                     &Fdo->EvtchnInterface,
-                                     XENBUS_EVTCHN_TYPE_INTER_DOMAIN,
-                                     EvtchnInterruptHandler,
-                                     Context,
-                                     In->RemoteDomain,
-                                     In->RemotePort,
-                                     TRUE);
-    if (Context->Channel == NULL)
+    if (!ExAcquireRundownProtection(&Context->Rundown))
         goto fail4;
 
-    Context->LocalPort = XENBUS_EVTCHN(GetPort,
-                                       &Fdo->EvtchnInterface,
-                                       Context->Channel);
+    status = STATUS_DEVICE_BUSY;
+    if (InterlockedCompareExchange(&Context->Retargeting, 1, 0) != 0)
+        goto fail5;
 
-    Context->Fdo = Fdo;
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
 
-    ExInterlockedInsertTailList(&Fdo->EvtchnList, &Context->Entry, &Fdo->EvtchnLock);
+    // A DPC can only be retargeted while it is not queued. Keep the ISR
+    // from queueing the DPCs, which leaves the port masked after an upcall,
+    // and let the DPCs queued before, by ISRs that were already past the
+    // check, run out. Anything they queued on the way out is dequeued below.
+    KeFlushQueuedDpcs();
 
-    Out->LocalPort = Context->LocalPort;
-    *Info = sizeof(XENIFACE_EVTCHN_BIND_INTERDOMAIN_OUT);
+    Pending = KeRemoveQueueDpc(&Context->Dpc);
 
-    if (!In->Mask) {
-        XENBUS_EVTCHN(Unmask,
-                      &Fdo->EvtchnInterface,
-                      Context->Channel,
-                      FALSE);
+    // A notification DPC may have armed the moderation timer.
+    ModerationPending = FALSE;
+    if (Context->ModerationUsed) {
+        if (KeCancelTimer(&Context->ModerationTimer))
+            ModerationPending = TRUE;
+        if (KeRemoveQueueDpc(&Context->ModerationDpc))
+            ModerationPending = TRUE;
     }
 
-    XenIfaceDebugPrint(TRACE, "< LocalPort %lu, Context %p\n", Context->LocalPort, Context);
+    // Have the upcall taken on the target vCPU, so the DPC is queued there
+    // without an IPI. Xen may refuse, e.g. with the 2-level ABI.
+    status = XENBUS_EVTCHN(Bind,
+                           &Fdo->EvtchnInterface,
+                           Context->Channel,
+                           In->Group,
+                           In->Number);
+    if (!NT_SUCCESS(status))
+        XenIfaceDebugPrint(WARNING, "LocalPort %lu: Bind failed (%08x)\n",
+                           Context->LocalPort, status);
 
+    Out->BindStatus = status;
+
+    // Either way run the DPCs there.
+    (VOID) KeSetTargetProcessorDpcEx(&Context->Dpc, &ProcNumber);
+    (VOID) KeSetTargetProcessorDpcEx(&Context->ModerationDpc, &ProcNumber);
+    KeSetImportanceDpc(&Context->Dpc, MediumHighImportance);
+    KeSetImportanceDpc(&Context->ModerationDpc, MediumHighImportance);
+
+    Context->Target = ProcNumber;
+    Context->Targeted = TRUE;
+
+    // Let the ISR queue the DPCs again, then queue what was held back. An
+    // ISR that saw Retargeting still set either left RetargetPending for us
+    // or takes it back and queues the DPC itself.
+    InterlockedExchange(&Context->Retargeting, 0);
+    if (InterlockedExchange(&Context->RetargetPending, 0) != 0)
+        Pending = TRUE;
+
+    // The moderation DPC delivers right away instead of at the end of the
+    // interval, which is harmless.
+    if (ModerationPending)
+        (VOID) KeInsertQueueDpc(&Context->ModerationDpc, NULL, NULL);
+    if (Pending)
+        (VOID) KeInsertQueueDpc(&Context->Dpc, NULL, NULL);
+
+    ExReleaseRundownProtection(&Context->Rundown);
+
+    *Info = sizeof(XENIFACE_EVTCHN_SET_AFFINITY_OUT);
     return STATUS_SUCCESS;
 
+fail5:
+    XenIfaceDebugPrint(ERROR, "Fail5\n");
+    ExReleaseRundownProtection(&Context->Rundown);
+
 fail4:
     XenIfaceDebugPrint(ERROR, "Fail4\n");
-    ObDereferenceObject(Context->Event);
 
 fail3:
     XenIfaceDebugPrint(ERROR, "Fail3\n");
-    RtlZeroMemory(Context, sizeof(XENIFACE_EVTCHN_CONTEXT));
-    ExFreePoolWithTag(Context, XENIFACE_POOL_TAG);
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
 
 fail2:
     XenIfaceDebugPrint(ERROR, "Fail2\n");
@@ -339,86 +1970,210 @@ fail1:
 
 DECLSPEC_NOINLINE
 NTSTATUS
-IoctlEvtchnClose(
+IoctlEvtchnQueryAffinity(
     __in  PXENIFACE_FDO     Fdo,
     __in  PVOID             Buffer,
     __in  ULONG             InLen,
     __in  ULONG             OutLen,
-    __in  PFILE_OBJECT      FileObject
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
     )
 {
     NTSTATUS status;
-    PXENIFACE_EVTCHN_CLOSE_IN In = Buffer;
+    PXENIFACE_EVTCHN_QUERY_AFFINITY_IN In = Buffer;
+    PXENIFACE_EVTCHN_QUERY_AFFINITY_OUT Out = Buffer;
     PXENIFACE_EVTCHN_CONTEXT Context;
     KIRQL Irql;
 
     status = STATUS_INVALID_BUFFER_SIZE;
-    if (InLen != sizeof(XENIFACE_EVTCHN_CLOSE_IN) ||
-        OutLen != 0) {
+    if (InLen != sizeof(XENIFACE_EVTCHN_QUERY_AFFINITY_IN) ||
+        OutLen != sizeof(XENIFACE_EVTCHN_QUERY_AFFINITY_OUT)) {
         goto fail1;
     }
 
-    XenIfaceDebugPrint(TRACE, "> LocalPort %lu, FO %p\n", In->LocalPort, FileObject);
+    Irql = ExAcquireSpinLockShared(&Fdo->EvtchnLock);
 
-    KeAcquireSpinLock(&Fdo->EvtchnLock, &Irql);
     status = STATUS_NOT_FOUND;
     Context = EvtchnFindChannel(Fdo, In->LocalPort, FileObject);
     if (Context == NULL)
         goto fail2;
 
-    RemoveEntryList(&Context->Entry);
-    KeReleaseSpinLock(&Fdo->EvtchnLock, Irql);
-    EvtchnFree(Fdo, Context);
+    RtlZeroMemory(Out, sizeof(XENIFACE_EVTCHN_QUERY_AFFINITY_OUT));
+    Out->Targeted = Context->Targeted;
+    Out->Target = Context->Target;
+    Out->LastInterrupt = Context->LastInterrupt;
+    Out->LastDelivery = Context->LastDelivery;
+    Out->Deliveries = Context->Deliveries;
+    Out->RemoteDeliveries = Context->RemoteDeliveries;
+
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
 
+    *Info = sizeof(XENIFACE_EVTCHN_QUERY_AFFINITY_OUT);
     return STATUS_SUCCESS;
 
 fail2:
     XenIfaceDebugPrint(ERROR, "Fail2\n");
-    KeReleaseSpinLock(&Fdo->EvtchnLock, Irql);
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
 
 fail1:
     XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
     return status;
 }
 
+_Requires_lock_held_(Fdo->EvtchnLock) // shared is enough
+static
+VOID
+EvtchnAddStats(
+    __in     PXENIFACE_EVTCHN_CONTEXT          Context,
+    __inout  PXENIFACE_EVTCHN_QUERY_STATS_OUT  Stats
+    )
+{
+    Stats->Interrupts += Context->Interrupts;
+    Stats->Dpcs += Context->Dpcs;
+    Stats->Coalesced += Context->Coalesced;
+    Stats->Deliveries += Context->Deliveries;
+    Stats->Sends += Context->Sends;
+    Stats->Unmasks += Context->Unmasks;
+
+    if (Context->LastInterruptTime > Stats->LastInterruptTime)
+        Stats->LastInterruptTime = Context->LastInterruptTime;
+    if (Context->LastDeliveryTime > Stats->LastDeliveryTime)
+        Stats->LastDeliveryTime = Context->LastDeliveryTime;
+}
+
+// Statistics of a single channel. FileObject is NULL for WMI queries,
+// which may look at any channel.
 _Requires_lock_not_held_(Fdo->EvtchnLock)
-DECLSPEC_NOINLINE
 NTSTATUS
-EvtchnNotify(
-    __in      PXENIFACE_FDO Fdo,
-    __in      ULONG         LocalPort,
-    __in_opt  PFILE_OBJECT  FileObject
+EvtchnQueryStats(
+    __in      PXENIFACE_FDO                       Fdo,
+    __in      ULONG                               LocalPort,
+    __in_opt  PFILE_OBJECT                        FileObject,
+    __out     PXENIFACE_EVTCHN_QUERY_STATS_OUT    Stats
     )
 {
-    NTSTATUS status;
     PXENIFACE_EVTCHN_CONTEXT Context;
     KIRQL Irql;
 
-    KeAcquireSpinLock(&Fdo->EvtchnLock, &Irql);
+    RtlZeroMemory(Stats, sizeof(XENIFACE_EVTCHN_QUERY_STATS_OUT));
+
+    Irql = ExAcquireSpinLockShared(&Fdo->EvtchnLock);
 
     Context = EvtchnFindChannel(Fdo, LocalPort, FileObject);
+    if (Context == NULL) {
+        ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
+        return STATUS_NOT_FOUND;
+    }
 
-    status = STATUS_NOT_FOUND;
-    if (Context == NULL)
+    EvtchnAddStats(Context, Stats);
+
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
+
+    Stats->CurrentTime = KeQueryInterruptTime();
+    return STATUS_SUCCESS;
+}
+
+// Statistics summed over all open channels, returns the number of channels.
+_Requires_lock_not_held_(Fdo->EvtchnLock)
+ULONG
+EvtchnQueryTotals(
+    __in      PXENIFACE_FDO                       Fdo,
+    __out     PXENIFACE_EVTCHN_QUERY_STATS_OUT    Totals
+    )
+{
+    PXENIFACE_EVTCHN_CONTEXT Context;
+    PLIST_ENTRY Node;
+    ULONG NumberChannels = 0;
+    KIRQL Irql;
+
+    RtlZeroMemory(Totals, sizeof(XENIFACE_EVTCHN_QUERY_STATS_OUT));
+
+    Irql = ExAcquireSpinLockShared(&Fdo->EvtchnLock);
+
+    for (Node = Fdo->EvtchnList.Flink; Node != &Fdo->EvtchnList; Node = Node->Flink) {
+        Context = CONTAINING_RECORD(Node, XENIFACE_EVTCHN_CONTEXT, Entry);
+
+        EvtchnAddStats(Context, Totals);
+        NumberChannels++;
+    }
+
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
+
+    Totals->CurrentTime = KeQueryInterruptTime();
+    return NumberChannels;
+}
+
+// Local ports of all open channels. Returns the number of open channels,
+// which may be more than MaxPorts.
+_Requires_lock_not_held_(Fdo->EvtchnLock)
+ULONG
+EvtchnQueryPorts(
+    __in      PXENIFACE_FDO Fdo,
+    __out_ecount_opt(MaxPorts) PULONG LocalPorts,
+    __in      ULONG         MaxPorts
+    )
+{
+    PXENIFACE_EVTCHN_CONTEXT Context;
+    PLIST_ENTRY Node;
+    ULONG NumberPorts = 0;
+    KIRQL Irql;
+
+    Irql = ExAcquireSpinLockShared(&Fdo->EvtchnLock);
+
+    for (Node = Fdo->EvtchnList.Flink; Node != &Fdo->EvtchnList; Node = Node->Flink) {
+        Context = CONTAINING_RECORD(Node, XENIFACE_EVTCHN_CONTEXT, Entry);
+
+        if (LocalPorts != NULL && NumberPorts < MaxPorts)
+            LocalPorts[NumberPorts] = Context->LocalPort;
+        NumberPorts++;
+    }
+
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
+
+    return NumberPorts;
+}
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnQueryStats(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS status;
+    PXENIFACE_EVTCHN_QUERY_STATS_IN In = Buffer;
+    XENIFACE_EVTCHN_QUERY_STATS_OUT Stats;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != sizeof(XENIFACE_EVTCHN_QUERY_STATS_IN) ||
+        OutLen != sizeof(XENIFACE_EVTCHN_QUERY_STATS_OUT)) {
         goto fail1;
+    }
 
-    XENBUS_EVTCHN(Send,
-                  &Fdo->EvtchnInterface,
-                  Context->Channel);
+    status = EvtchnQueryStats(Fdo, In->LocalPort, FileObject, &Stats);
+    if (!NT_SUCCESS(status))
+        goto fail2;
 
-    KeReleaseSpinLock(&Fdo->EvtchnLock, Irql);
+    RtlCopyMemory(Buffer, &Stats, sizeof(XENIFACE_EVTCHN_QUERY_STATS_OUT));
+    *Info = sizeof(XENIFACE_EVTCHN_QUERY_STATS_OUT);
 
     return STATUS_SUCCESS;
 
+fail2:
+    XenIfaceDebugPrint(ERROR, "Fail2\n");
+
 fail1:
     XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
-    KeReleaseSpinLock(&Fdo->EvtchnLock, Irql);
     return status;
 }
 
 DECLSPEC_NOINLINE
 NTSTATUS
-IoctlEvtchnNotify(
+IoctlEvtchnReportWake(
     __in  PXENIFACE_FDO     Fdo,
     __in  PVOID             Buffer,
     __in  ULONG             InLen,
@@ -427,19 +2182,40 @@ IoctlEvtchnNotify(
     )
 {
     NTSTATUS status;
-    PXENIFACE_EVTCHN_NOTIFY_IN In = Buffer;
+    PXENIFACE_EVTCHN_REPORT_WAKE_IN In = Buffer;
+    PXENIFACE_EVTCHN_CONTEXT Context;
+    LARGE_INTEGER Frequency;
+    LONG64 Signal;
+    KIRQL Irql;
 
     status = STATUS_INVALID_BUFFER_SIZE;
-    if (InLen != sizeof(XENIFACE_EVTCHN_NOTIFY_IN) ||
-        OutLen != 0) {
+    if (InLen != sizeof(XENIFACE_EVTCHN_REPORT_WAKE_IN) || OutLen != 0)
         goto fail1;
+
+    Irql = ExAcquireSpinLockShared(&Fdo->EvtchnLock);
+
+    status = STATUS_NOT_FOUND;
+    Context = EvtchnFindChannel(Fdo, In->LocalPort, FileObject);
+    if (Context == NULL)
+        goto fail2;
+
+    KeQueryPerformanceCounter(&Frequency);
+
+    Signal = InterlockedExchange64(&Context->TraceSignal, 0);
+    if (Signal != 0) {
+        EvtchnTraceLatency(Context, XENIFACE_EVTCHN_LATENCY_SIGNAL_TO_WAKE,
+                           Signal, In->WakeTime, Frequency.QuadPart);
+        EvtchnTraceLatency(Context, XENIFACE_EVTCHN_LATENCY_INTERRUPT_TO_WAKE,
+                           Context->TraceSignalInterrupt, In->WakeTime, Frequency.QuadPart);
     }
 
-#if DBG
-    XenIfaceDebugPrint(INFO, "> LocalPort %d, FO %p\n", In->LocalPort, FileObject);
-#endif
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
 
-    return EvtchnNotify(Fdo, In->LocalPort, FileObject);
+    return STATUS_SUCCESS;
+
+fail2:
+    XenIfaceDebugPrint(ERROR, "Fail2\n");
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
 
 fail1:
     XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
@@ -448,47 +2224,57 @@ fail1:
 
 DECLSPEC_NOINLINE
 NTSTATUS
-IoctlEvtchnUnmask(
+IoctlEvtchnQueryLatency(
     __in  PXENIFACE_FDO     Fdo,
     __in  PVOID             Buffer,
     __in  ULONG             InLen,
     __in  ULONG             OutLen,
-    __in  PFILE_OBJECT      FileObject
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
     )
 {
     NTSTATUS status;
-    PXENIFACE_EVTCHN_UNMASK_IN In = Buffer;
+    PXENIFACE_EVTCHN_QUERY_LATENCY_IN In = Buffer;
+    PXENIFACE_EVTCHN_QUERY_LATENCY_OUT Out = Buffer;
     PXENIFACE_EVTCHN_CONTEXT Context;
+    BOOLEAN Reset;
+    ULONG Stage, Bucket;
     KIRQL Irql;
 
     status = STATUS_INVALID_BUFFER_SIZE;
-    if (InLen != sizeof(XENIFACE_EVTCHN_UNMASK_IN) ||
-        OutLen != 0) {
+    if (InLen != sizeof(XENIFACE_EVTCHN_QUERY_LATENCY_IN) ||
+        OutLen != sizeof(XENIFACE_EVTCHN_QUERY_LATENCY_OUT)) {
         goto fail1;
     }
 
-    XenIfaceDebugPrint(TRACE, "> LocalPort %d, FO %p\n", In->LocalPort, FileObject);
-
-    KeAcquireSpinLock(&Fdo->EvtchnLock, &Irql);
+    Irql = ExAcquireSpinLockShared(&Fdo->EvtchnLock);
 
+    status = STATUS_NOT_FOUND;
     Context = EvtchnFindChannel(Fdo, In->LocalPort, FileObject);
-
-    status = STATUS_INVALID_PARAMETER;
     if (Context == NULL)
         goto fail2;
 
-    XENBUS_EVTCHN(Unmask,
-                  &Fdo->EvtchnInterface,
-                  Context->Channel,
-                  FALSE);
+    // Out overlays In.
+    Reset = In->Reset;
+
+    for (Stage = 0; Stage < XENIFACE_EVTCHN_LATENCY_STAGES; Stage++) {
+        for (Bucket = 0; Bucket < XENIFACE_EVTCHN_LATENCY_BUCKETS; Bucket++) {
+            if (Reset)
+                Out->Histogram[Stage][Bucket] =
+                    InterlockedExchange(&Context->Latency[Stage][Bucket], 0);
+            else
+                Out->Histogram[Stage][Bucket] = Context->Latency[Stage][Bucket];
+        }
+    }
 
-    KeReleaseSpinLock(&Fdo->EvtchnLock, Irql);
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
 
+    *Info = sizeof(XENIFACE_EVTCHN_QUERY_LATENCY_OUT);
     return STATUS_SUCCESS;
 
 fail2:
     XenIfaceDebugPrint(ERROR, "Fail2\n");
-    KeReleaseSpinLock(&Fdo->EvtchnLock, Irql);
+    ExReleaseSpinLockShared(&Fdo->EvtchnLock, Irql);
 
 fail1:
     XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
@@ -35,6 +35,9 @@
 #include "log.h"
 #include "irp_queue.h"
 
+// A grant or map is described by a single MDL, whose byte count is a ULONG.
+#define GNTTAB_MAX_PAGES    (MAXULONG / PAGE_SIZE)
+
 // Complete a canceled gnttab IRP, cleanup associated grant/map.
 _Function_class_(IO_WORKITEM_ROUTINE)
 VOID
@@ -69,11 +72,12 @@ CompleteGnttabIrp(
     switch (Id->Type) {
 
     case XENIFACE_CONTEXT_GRANT:
-        GnttabFreeGrant(Fdo, CONTAINING_RECORD(Id, XENIFACE_GRANT_CONTEXT, Id));
+        // the owner is going away, don't keep anything granted on its behalf
+        GnttabFreeGrant(Fdo, CONTAINING_RECORD(Id, XENIFACE_GRANT_CONTEXT, Id), FALSE);
         break;
 
     case XENIFACE_CONTEXT_MAP:
-        GnttabFreeMap(Fdo, CONTAINING_RECORD(Id, XENIFACE_MAP_CONTEXT, Id));
+        GnttabFreeMap(Fdo, CONTAINING_RECORD(Id, XENIFACE_MAP_CONTEXT, Id), FALSE);
         break;
 
     default:
@@ -118,6 +122,25 @@ GnttabReleaseLock(
     KeReleaseSpinLockFromDpcLevel(&Fdo->GnttabCacheLock);
 }
 
+static FORCEINLINE
+MEMORY_CACHING_TYPE
+__GnttabCachingType(
+    __in  XENIFACE_GNTTAB_CACHE_TYPE CacheType
+    )
+{
+    switch (CacheType) {
+    case XENIFACE_GNTTAB_WRITE_COMBINED:
+        return MmWriteCombined;
+
+    case XENIFACE_GNTTAB_UNCACHED:
+        return MmNonCached;
+
+    default:
+        ASSERT(CacheType == XENIFACE_GNTTAB_CACHED);
+        return MmCached;
+    }
+}
+
 _Requires_lock_not_held_(Fdo->IrpQueueLock)
 static
 PIRP
@@ -135,6 +158,667 @@ FindGnttabIrp(
     return Irp;
 }
 
+static FORCEINLINE
+PLIST_ENTRY
+__GnttabHandleBucket(
+    __in  PXENIFACE_FDO         Fdo,
+    __in  PXENIFACE_CONTEXT_ID  Id
+    )
+{
+    ULONG Hash = Id->RequestId ^ (ULONG)((ULONG_PTR)Id->Process >> 6);
+
+    return &Fdo->GnttabHandleTable[Hash & (GNTTAB_HANDLE_TABLE_SIZE - 1)];
+}
+
+// Request IDs are unique per process, for pending requests and file object
+// owned ones alike, whatever their type and file object.
+_Requires_lock_held_(Fdo->GnttabHandleLock)
+static
+BOOLEAN
+__GnttabHandleInUse(
+    __in  PXENIFACE_FDO         Fdo,
+    __in  PXENIFACE_CONTEXT_ID  Id
+    )
+{
+    PLIST_ENTRY Bucket = __GnttabHandleBucket(Fdo, Id);
+    PXENIFACE_GNTTAB_HANDLE Handle;
+    PLIST_ENTRY Node;
+
+    for (Node = Bucket->Flink; Node != Bucket; Node = Node->Flink) {
+        Handle = CONTAINING_RECORD(Node, XENIFACE_GNTTAB_HANDLE, Entry);
+
+        if (Handle->Id->RequestId == Id->RequestId &&
+            Handle->Id->Process == Id->Process)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+_Requires_lock_held_(Fdo->GnttabHandleLock)
+static
+PXENIFACE_GNTTAB_HANDLE
+__GnttabHandleLookup(
+    __in  PXENIFACE_FDO         Fdo,
+    __in  PXENIFACE_CONTEXT_ID  Id
+    )
+{
+    PLIST_ENTRY Bucket = __GnttabHandleBucket(Fdo, Id);
+    PXENIFACE_GNTTAB_HANDLE Handle;
+    PLIST_ENTRY Node;
+
+    for (Node = Bucket->Flink; Node != Bucket; Node = Node->Flink) {
+        Handle = CONTAINING_RECORD(Node, XENIFACE_GNTTAB_HANDLE, Entry);
+
+        if (Handle->Id->Type == Id->Type &&
+            Handle->Id->RequestId == Id->RequestId &&
+            Handle->Id->Process == Id->Process &&
+            Handle->Id->FileObject == Id->FileObject)
+            return Handle;
+    }
+
+    return NULL;
+}
+
+// Check whether a file object owns a grant or map with the request ID of a
+// request about to be queued. Lock order is IrpQueueLock, GnttabHandleLock.
+_Requires_lock_held_(Fdo->IrpQueueLock)
+_IRQL_requires_(DISPATCH_LEVEL)
+BOOLEAN
+GnttabHandleExists(
+    __in  PXENIFACE_FDO         Fdo,
+    __in  PXENIFACE_CONTEXT_ID  Id
+    )
+{
+    BOOLEAN Exists;
+
+    KeAcquireSpinLockAtDpcLevel(&Fdo->GnttabHandleLock);
+    Exists = __GnttabHandleInUse(Fdo, Id);
+    KeReleaseSpinLockFromDpcLevel(&Fdo->GnttabHandleLock);
+
+    return Exists;
+}
+
+// Hand a grant or map to its file object. Fails if the request ID is in use,
+// by a pending request or by another grant or map of the process.
+_IRQL_requires_max_(APC_LEVEL)
+static
+NTSTATUS
+GnttabHandleInsert(
+    __in     PXENIFACE_FDO            Fdo,
+    __inout  PXENIFACE_GNTTAB_HANDLE  Handle
+    )
+{
+    NTSTATUS status;
+    KIRQL Irql;
+
+    status = STATUS_INVALID_PARAMETER;
+
+    CsqAcquireLock(&Fdo->IrpQueue, &Irql);
+    KeAcquireSpinLockAtDpcLevel(&Fdo->GnttabHandleLock);
+    if (CsqPeekNextIrp(&Fdo->IrpQueue, NULL, Handle->Id) == NULL &&
+        !__GnttabHandleInUse(Fdo, Handle->Id)) {
+        InsertTailList(__GnttabHandleBucket(Fdo, Handle->Id), &Handle->Entry);
+        InsertTailList(&__XenIfaceFileContext(Handle->Id->FileObject)->GnttabHandleList,
+                       &Handle->FileEntry);
+        status = STATUS_SUCCESS;
+    }
+    KeReleaseSpinLockFromDpcLevel(&Fdo->GnttabHandleLock);
+    CsqReleaseLock(&Fdo->IrpQueue, Irql);
+
+    if (NT_SUCCESS(status))
+        XenIfaceAddProcessMapping(Handle->Id->FileObject);
+
+    return status;
+}
+
+// Take the grant or map identified by Id away from its file object.
+_IRQL_requires_max_(APC_LEVEL)
+static
+PXENIFACE_CONTEXT_ID
+GnttabHandleRemove(
+    __in  PXENIFACE_FDO         Fdo,
+    __in  PXENIFACE_CONTEXT_ID  Id
+    )
+{
+    PXENIFACE_GNTTAB_HANDLE Handle;
+    KIRQL Irql;
+
+    KeAcquireSpinLock(&Fdo->GnttabHandleLock, &Irql);
+    Handle = __GnttabHandleLookup(Fdo, Id);
+    if (Handle != NULL) {
+        RemoveEntryList(&Handle->Entry);
+        RemoveEntryList(&Handle->FileEntry);
+    }
+    KeReleaseSpinLock(&Fdo->GnttabHandleLock, Irql);
+
+    return (Handle != NULL) ? Handle->Id : NULL;
+}
+
+// Free a grant or map removed from the handle table.
+_IRQL_requires_max_(APC_LEVEL)
+static
+VOID
+GnttabHandleFree(
+    __in  PXENIFACE_FDO         Fdo,
+    __in  PXENIFACE_CONTEXT_ID  Id,
+    __in  BOOLEAN               Reuse
+    )
+{
+    PEPROCESS Process = Id->Process;
+    PFILE_OBJECT FileObject = Id->FileObject; // Id is freed with its context
+    KAPC_STATE ApcState;
+    BOOLEAN ChangeProcess;
+
+    // The handle may have been duplicated into another process, but user
+    // mappings can only be removed in the context of their own. That one
+    // hasn't exited yet, GnttabProcessExit would have freed them.
+    ChangeProcess = PsGetCurrentProcess() != Process;
+    if (ChangeProcess)
+        KeStackAttachProcess(Process, &ApcState);
+
+    switch (Id->Type) {
+
+    case XENIFACE_CONTEXT_GRANT:
+        GnttabFreeGrant(Fdo, CONTAINING_RECORD(Id, XENIFACE_GRANT_CONTEXT, Id), Reuse);
+        break;
+
+    case XENIFACE_CONTEXT_MAP:
+        GnttabFreeMap(Fdo, CONTAINING_RECORD(Id, XENIFACE_MAP_CONTEXT, Id), Reuse);
+        break;
+
+    default:
+        ASSERT(FALSE);
+    }
+
+    if (ChangeProcess)
+        KeUnstackDetachProcess(&ApcState);
+
+    ObDereferenceObject(Process);
+    XenIfaceRemoveProcessMapping(FileObject);
+}
+
+// Move the grants and maps owned by a file object out of the handle table.
+_Requires_lock_held_(Fdo->GnttabHandleLock)
+static
+VOID
+__GnttabHandleTakeFile(
+    __in     PXENIFACE_FDO  Fdo,
+    __in     PFILE_OBJECT   FileObject,
+    __inout  PLIST_ENTRY    ToFree
+    )
+{
+    PLIST_ENTRY List = &__XenIfaceFileContext(FileObject)->GnttabHandleList;
+    PXENIFACE_GNTTAB_HANDLE Handle;
+
+    UNREFERENCED_PARAMETER(Fdo);
+
+    while (!IsListEmpty(List)) {
+        Handle = CONTAINING_RECORD(RemoveHeadList(List), XENIFACE_GNTTAB_HANDLE, FileEntry);
+
+        RemoveEntryList(&Handle->Entry);
+        InsertTailList(ToFree, &Handle->Entry);
+    }
+}
+
+// Free grants and maps owned by a file object (all of them if FileObject is NULL).
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+GnttabHandleFlush(
+    __in      PXENIFACE_FDO Fdo,
+    __in_opt  PFILE_OBJECT  FileObject
+    )
+{
+    PXENIFACE_GNTTAB_HANDLE Handle;
+    PLIST_ENTRY Node;
+    LIST_ENTRY ToFree;
+    ULONG Index;
+    KIRQL Irql;
+
+    InitializeListHead(&ToFree);
+
+    // GnttabProcessExit can't free them while GnttabHandleFree is attached
+    // to their process
+    AcquireMutex(&Fdo->UnmapMutex);
+
+    KeAcquireSpinLock(&Fdo->GnttabHandleLock, &Irql);
+    if (FileObject != NULL) {
+        __GnttabHandleTakeFile(Fdo, FileObject, &ToFree);
+    } else {
+        for (Index = 0; Index < GNTTAB_HANDLE_TABLE_SIZE; Index++) {
+            while (!IsListEmpty(&Fdo->GnttabHandleTable[Index])) {
+                Node = RemoveHeadList(&Fdo->GnttabHandleTable[Index]);
+                Handle = CONTAINING_RECORD(Node, XENIFACE_GNTTAB_HANDLE, Entry);
+
+                RemoveEntryList(&Handle->FileEntry);
+                InsertTailList(&ToFree, &Handle->Entry);
+            }
+        }
+    }
+    KeReleaseSpinLock(&Fdo->GnttabHandleLock, Irql);
+
+    while (!IsListEmpty(&ToFree)) {
+        Handle = CONTAINING_RECORD(RemoveHeadList(&ToFree), XENIFACE_GNTTAB_HANDLE, Entry);
+
+        XenIfaceDebugPrint(TRACE, "Process %p, Id %lu, Type %d\n",
+                           Handle->Id->Process, Handle->Id->RequestId, Handle->Id->Type);
+        GnttabHandleFree(Fdo, Handle->Id, FALSE);
+    }
+
+    ReleaseMutex(&Fdo->UnmapMutex);
+}
+
+// Free grants and maps of a file object, mapped into its process which is
+// exiting, called in its context. The file object may outlive the process if
+// the handle was inherited or duplicated.
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+GnttabProcessExit(
+    __in  PXENIFACE_FDO Fdo,
+    __in  PFILE_OBJECT  FileObject
+    )
+{
+    PXENIFACE_GNTTAB_HANDLE Handle;
+    LIST_ENTRY ToFree;
+    KIRQL Irql;
+
+    ASSERT3P(Fdo->UnmapMutex.Owner, ==, KeGetCurrentThread());
+
+    InitializeListHead(&ToFree);
+
+    KeAcquireSpinLock(&Fdo->GnttabHandleLock, &Irql);
+    __GnttabHandleTakeFile(Fdo, FileObject, &ToFree);
+    KeReleaseSpinLock(&Fdo->GnttabHandleLock, Irql);
+
+    while (!IsListEmpty(&ToFree)) {
+        Handle = CONTAINING_RECORD(RemoveHeadList(&ToFree), XENIFACE_GNTTAB_HANDLE, Entry);
+
+        ASSERT3P(Handle->Id->Process, ==, PsGetCurrentProcess());
+
+        XenIfaceDebugPrint(TRACE, "FO %p, Id %lu, Type %d\n",
+                           Handle->Id->FileObject, Handle->Id->RequestId, Handle->Id->Type);
+        GnttabHandleFree(Fdo, Handle->Id, FALSE);
+    }
+}
+
+// Allocate and grant the memory described by Context.
+_IRQL_requires_max_(APC_LEVEL)
+static
+NTSTATUS
+GnttabShare(
+    __in     PXENIFACE_FDO            Fdo,
+    __inout  PXENIFACE_GRANT_CONTEXT  Context
+    )
+{
+    NTSTATUS status;
+    PHYSICAL_ADDRESS Low, High, Skip;
+    ULONG Page;
+
+    status = STATUS_NO_MEMORY;
+    Context->Grants = ExAllocatePoolWithTag(NonPagedPool, Context->NumberPages * sizeof(PXENBUS_GNTTAB_ENTRY), XENIFACE_POOL_TAG);
+    if (Context->Grants == NULL)
+        goto fail1;
+
+    RtlZeroMemory(Context->Grants, Context->NumberPages * sizeof(PXENBUS_GNTTAB_ENTRY));
+
+    // Allocate memory to share page by page, straight into the MDL, so large
+    // grants need neither contiguous pool nor a separate zeroing pass.
+    Low.QuadPart = 0;
+    High.QuadPart = -1;
+    Skip.QuadPart = 0;
+    Context->Mdl = MmAllocatePagesForMdlEx(Low,
+                                           High,
+                                           Skip,
+                                           (SIZE_T)Context->NumberPages * PAGE_SIZE,
+                                           __GnttabCachingType(Context->CacheType),
+                                           0);
+    if (Context->Mdl == NULL)
+        goto fail2;
+
+    // the memory manager may return fewer pages than asked for
+    if ((ULONGLONG)MmGetMdlByteCount(Context->Mdl) != (ULONGLONG)Context->NumberPages * PAGE_SIZE)
+        goto fail3;
+
+    // the system space view must use the same attribute as the user one
+    Context->KernelVa = MmMapLockedPagesSpecifyCache(Context->Mdl,
+                                                     KernelMode,
+                                                     __GnttabCachingType(Context->CacheType),
+                                                     NULL,
+                                                     FALSE,
+                                                     NormalPagePriority);
+    if (Context->KernelVa == NULL)
+        goto fail4;
+
+    // perform sharing
+    for (Page = 0; Page < Context->NumberPages; Page++) {
+        status = XENBUS_GNTTAB(PermitForeignAccess,
+                               &Fdo->GnttabInterface,
+                               Fdo->GnttabCache,
+                               FALSE,
+                               Context->RemoteDomain,
+                               MmGetMdlPfnArray(Context->Mdl)[Page],
+                               (Context->Flags & XENIFACE_GNTTAB_READONLY) != 0,
+                               &(Context->Grants[Page]));
+
+// prefast somehow thinks that this call can modify Page...
+#pragma prefast(suppress:6385)
+        XenIfaceDebugPrint(INFO, "Grants[%lu] = %p\n", Page, Context->Grants[Page]);
+        if (!NT_SUCCESS(status))
+            goto fail5;
+    }
+
+    return STATUS_SUCCESS;
+
+fail5:
+    XenIfaceDebugPrint(ERROR, "Fail5: Page = %lu\n", Page);
+
+    while (Page > 0) {
+        NTSTATUS RevokeStatus;
+
+        --Page;
+        RevokeStatus = XENBUS_GNTTAB(RevokeForeignAccess,
+                                     &Fdo->GnttabInterface,
+                                     Fdo->GnttabCache,
+                                     FALSE,
+                                     Context->Grants[Page]);
+        ASSERT(NT_SUCCESS(RevokeStatus));
+    }
+    MmUnmapLockedPages(Context->KernelVa, Context->Mdl);
+    Context->KernelVa = NULL;
+
+fail4:
+    XenIfaceDebugPrint(ERROR, "Fail4\n");
+
+fail3:
+    XenIfaceDebugPrint(ERROR, "Fail3\n");
+    MmFreePagesFromMdl(Context->Mdl);
+    ExFreePool(Context->Mdl);
+    Context->Mdl = NULL;
+
+fail2:
+    XenIfaceDebugPrint(ERROR, "Fail2\n");
+    ExFreePoolWithTag(Context->Grants, XENIFACE_POOL_TAG);
+    Context->Grants = NULL;
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+_IRQL_requires_max_(APC_LEVEL)
+static
+VOID
+GnttabFreePages(
+    __in  PVOID KernelVa,
+    __in  PMDL  Mdl
+    )
+{
+    MmUnmapLockedPages(KernelVa, Mdl);
+    MmFreePagesFromMdl(Mdl);
+    ExFreePool(Mdl);
+}
+
+// Scrub and free the pages of a revoked XENIFACE_GNTTAB_DEFER_SCRUB grant.
+_Function_class_(IO_WORKITEM_ROUTINE)
+static
+VOID
+GnttabScrubPages(
+    __in      PDEVICE_OBJECT DeviceObject,
+    __in_opt  PVOID          Context
+    )
+{
+    PXENIFACE_GNTTAB_SCRUB Scrub = Context;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+    ASSERT(Scrub != NULL);
+
+    XenIfaceDebugPrint(TRACE, "KernelVa %p, NumberPages %lu\n", Scrub->KernelVa, Scrub->NumberPages);
+
+    RtlZeroMemory(Scrub->KernelVa, (SIZE_T)Scrub->NumberPages * PAGE_SIZE);
+    GnttabFreePages(Scrub->KernelVa, Scrub->Mdl);
+
+    IoFreeWorkItem(Scrub->WorkItem);
+    ExFreePoolWithTag(Scrub, XENIFACE_POOL_TAG);
+}
+
+// Hand the pages of Context to a worker that scrubs and frees them.
+// Returns FALSE if that isn't possible right now.
+_IRQL_requires_max_(APC_LEVEL)
+static
+BOOLEAN
+GnttabQueueScrub(
+    __in  PXENIFACE_FDO            Fdo,
+    __in  PXENIFACE_GRANT_CONTEXT  Context
+    )
+{
+    PXENIFACE_GNTTAB_SCRUB Scrub;
+
+    Scrub = ExAllocatePoolWithTag(NonPagedPool, sizeof(XENIFACE_GNTTAB_SCRUB), XENIFACE_POOL_TAG);
+    if (Scrub == NULL)
+        return FALSE;
+
+    Scrub->WorkItem = IoAllocateWorkItem(Fdo->Dx->DeviceObject);
+    if (Scrub->WorkItem == NULL) {
+        ExFreePoolWithTag(Scrub, XENIFACE_POOL_TAG);
+        return FALSE;
+    }
+
+    Scrub->KernelVa = Context->KernelVa;
+    Scrub->Mdl = Context->Mdl;
+    Scrub->NumberPages = Context->NumberPages;
+    IoQueueWorkItem(Scrub->WorkItem, GnttabScrubPages, DelayedWorkQueue, Scrub);
+    return TRUE;
+}
+
+// Revoke and free the memory described by Context, scrubbing it as its flags ask.
+_IRQL_requires_max_(APC_LEVEL)
+static
+VOID
+GnttabUnshare(
+    __in     PXENIFACE_FDO            Fdo,
+    __inout  PXENIFACE_GRANT_CONTEXT  Context
+    )
+{
+    NTSTATUS status;
+    ULONG Page;
+
+    // stop sharing
+    for (Page = 0; Page < Context->NumberPages; Page++) {
+        status = XENBUS_GNTTAB(RevokeForeignAccess,
+                               &Fdo->GnttabInterface,
+                               Fdo->GnttabCache,
+                               FALSE,
+                               Context->Grants[Page]);
+
+        ASSERT(NT_SUCCESS(status)); // failure here is fatal, something must've gone catastrophically wrong
+    }
+
+    RtlZeroMemory(Context->Grants, Context->NumberPages * sizeof(PXENBUS_GNTTAB_ENTRY));
+    ExFreePoolWithTag(Context->Grants, XENIFACE_POOL_TAG);
+    Context->Grants = NULL;
+
+    // The pages are no longer shared, so scrubbing them later on a worker
+    // exposes them to nobody.
+    if (Context->Flags & XENIFACE_GNTTAB_NO_SCRUB) {
+        GnttabFreePages(Context->KernelVa, Context->Mdl);
+    } else if ((Context->Flags & XENIFACE_GNTTAB_DEFER_SCRUB) == 0 ||
+               !GnttabQueueScrub(Fdo, Context)) {
+        RtlZeroMemory(Context->KernelVa, (SIZE_T)Context->NumberPages * PAGE_SIZE);
+        GnttabFreePages(Context->KernelVa, Context->Mdl);
+    }
+
+    Context->KernelVa = NULL;
+    Context->Mdl = NULL;
+}
+
+static FORCEINLINE
+PLIST_ENTRY
+__GnttabPoolBucket(
+    __in  PXENIFACE_GRANT_CONTEXT  Context
+    )
+{
+    ULONG Hash = Context->RemoteDomain ^ Context->NumberPages;
+
+    return &__XenIfaceFileContext(Context->FileObject)->GnttabPoolTable[Hash % GNTTAB_POOL_TABLE_SIZE];
+}
+
+// Park the memory of a revoked persistent grant in the pool, still granted.
+// Returns FALSE if the pool is full.
+_IRQL_requires_max_(APC_LEVEL)
+static
+BOOLEAN
+GnttabPoolPut(
+    __in     PXENIFACE_FDO            Fdo,
+    __inout  PXENIFACE_GRANT_CONTEXT  Context
+    )
+{
+    KIRQL Irql;
+    BOOLEAN Pooled;
+
+    // The remote domain keeps access but nothing written by the previous user
+    // survives, unless the caller opted out of scrubbing.
+    if ((Context->Flags & XENIFACE_GNTTAB_NO_SCRUB) == 0)
+        RtlZeroMemory(Context->KernelVa, (SIZE_T)Context->NumberPages * PAGE_SIZE);
+
+    RtlZeroMemory(&Context->Id, sizeof(XENIFACE_CONTEXT_ID));
+    Context->UserVa = NULL;
+
+    KeAcquireSpinLock(&Fdo->GnttabPoolLock, &Irql);
+    Pooled = Fdo->GnttabPoolPages + Context->NumberPages <= GNTTAB_POOL_MAX_PAGES;
+    if (Pooled) {
+        Fdo->GnttabPoolPages += Context->NumberPages;
+        InsertHeadList(__GnttabPoolBucket(Context), &Context->Entry);
+    }
+    KeReleaseSpinLock(&Fdo->GnttabPoolLock, Irql);
+
+    return Pooled;
+}
+
+// Pooled memory is only handed to grants that agree on these flags: access
+// mode, and whether the memory is known to be zeroed.
+#define GNTTAB_POOL_FLAGS   (XENIFACE_GNTTAB_READONLY | XENIFACE_GNTTAB_NO_SCRUB)
+
+// Move pooled memory of the same file object, granted to the same domain with
+// the same size and flags, into Context. Returns FALSE if there is none.
+_IRQL_requires_max_(APC_LEVEL)
+static
+BOOLEAN
+GnttabPoolGet(
+    __in     PXENIFACE_FDO            Fdo,
+    __inout  PXENIFACE_GRANT_CONTEXT  Context
+    )
+{
+    PLIST_ENTRY Bucket = __GnttabPoolBucket(Context);
+    PXENIFACE_GRANT_CONTEXT Pooled = NULL;
+    PXENIFACE_GRANT_CONTEXT Candidate;
+    PLIST_ENTRY Node;
+    KIRQL Irql;
+
+    KeAcquireSpinLock(&Fdo->GnttabPoolLock, &Irql);
+    for (Node = Bucket->Flink; Node != Bucket; Node = Node->Flink) {
+        Candidate = CONTAINING_RECORD(Node, XENIFACE_GRANT_CONTEXT, Entry);
+
+        if (Candidate->RemoteDomain == Context->RemoteDomain &&
+            Candidate->NumberPages == Context->NumberPages &&
+            Candidate->CacheType == Context->CacheType &&
+            (Candidate->Flags & GNTTAB_POOL_FLAGS) == (Context->Flags & GNTTAB_POOL_FLAGS)) {
+            RemoveEntryList(&Candidate->Entry);
+            Fdo->GnttabPoolPages -= Candidate->NumberPages;
+            Pooled = Candidate;
+            break;
+        }
+    }
+    KeReleaseSpinLock(&Fdo->GnttabPoolLock, Irql);
+
+    if (Pooled == NULL)
+        return FALSE;
+
+    XenIfaceDebugPrint(TRACE, "Context %p reuses %p\n", Context, Pooled);
+
+    Context->Grants = Pooled->Grants;
+    Context->KernelVa = Pooled->KernelVa;
+    Context->Mdl = Pooled->Mdl;
+
+    RtlZeroMemory(Pooled, sizeof(XENIFACE_GRANT_CONTEXT));
+    CachePut(Fdo, XENIFACE_CACHE_GRANT, Pooled);
+    return TRUE;
+}
+
+// Move every pooled grant of a file object to List.
+_Requires_lock_held_(Fdo->GnttabPoolLock)
+static
+VOID
+__GnttabPoolTakeFile(
+    __in     PXENIFACE_FDO  Fdo,
+    __in     PFILE_OBJECT   FileObject,
+    __inout  PLIST_ENTRY    List
+    )
+{
+    PXENIFACE_FILE_CONTEXT File = __XenIfaceFileContext(FileObject);
+    PXENIFACE_GRANT_CONTEXT Context;
+    ULONG Index;
+
+    for (Index = 0; Index < GNTTAB_POOL_TABLE_SIZE; Index++) {
+        while (!IsListEmpty(&File->GnttabPoolTable[Index])) {
+            Context = CONTAINING_RECORD(RemoveHeadList(&File->GnttabPoolTable[Index]),
+                                        XENIFACE_GRANT_CONTEXT,
+                                        Entry);
+
+            Fdo->GnttabPoolPages -= Context->NumberPages;
+            InsertTailList(List, &Context->Entry);
+        }
+    }
+}
+
+// Revoke pooled grants of a file object (all of them if FileObject is NULL).
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+GnttabPoolFlush(
+    __in      PXENIFACE_FDO Fdo,
+    __in_opt  PFILE_OBJECT  FileObject
+    )
+{
+    PXENIFACE_GRANT_CONTEXT Context;
+    PXENIFACE_FILE_CONTEXT File;
+    PLIST_ENTRY Node;
+    LIST_ENTRY ToFree;
+    ULONG Index;
+    KIRQL Irql;
+
+    InitializeListHead(&ToFree);
+
+    if (FileObject != NULL) {
+        KeAcquireSpinLock(&Fdo->GnttabPoolLock, &Irql);
+        __GnttabPoolTakeFile(Fdo, FileObject, &ToFree);
+        KeReleaseSpinLock(&Fdo->GnttabPoolLock, Irql);
+    } else {
+        // the file objects can't be closed while their pools are emptied
+        AcquireMutex(&Fdo->FileMutex);
+        KeAcquireSpinLock(&Fdo->GnttabPoolLock, &Irql);
+        for (Index = 0; Index < FILE_TABLE_SIZE; Index++) {
+            for (Node = Fdo->FileTable[Index].Flink;
+                 Node != &Fdo->FileTable[Index];
+                 Node = Node->Flink) {
+                File = CONTAINING_RECORD(Node, XENIFACE_FILE_CONTEXT, Entry);
+
+                __GnttabPoolTakeFile(Fdo, File->FileObject, &ToFree);
+            }
+        }
+        KeReleaseSpinLock(&Fdo->GnttabPoolLock, Irql);
+        ReleaseMutex(&Fdo->FileMutex);
+    }
+
+    while (!IsListEmpty(&ToFree)) {
+        Context = CONTAINING_RECORD(RemoveHeadList(&ToFree), XENIFACE_GRANT_CONTEXT, Entry);
+
+        XenIfaceDebugPrint(TRACE, "Context %p\n", Context);
+        GnttabUnshare(Fdo, Context);
+
+        RtlZeroMemory(Context, sizeof(XENIFACE_GRANT_CONTEXT));
+        CachePut(Fdo, XENIFACE_CACHE_GRANT, Context);
+    }
+}
+
 DECLSPEC_NOINLINE
 NTSTATUS
 IoctlGnttabPermitForeignAccess(
@@ -162,83 +846,62 @@ IoctlGnttabPermitForeignAccess(
 
     status = STATUS_INVALID_PARAMETER;
     if (In->NumberPages == 0 ||
-        In->NumberPages > 1024 * 1024) {
+        In->NumberPages > GNTTAB_MAX_PAGES ||
+        (ULONG)In->CacheType >= XENIFACE_GNTTAB_CACHE_TYPES) {
         goto fail3;
     }
 
     if ((In->Flags & XENIFACE_GNTTAB_USE_NOTIFY_OFFSET) &&
-        (In->NotifyOffset >= In->NumberPages * PAGE_SIZE)) {
+        ((ULONGLONG)In->NotifyOffset >= (ULONGLONG)In->NumberPages * PAGE_SIZE)) {
         goto fail4;
     }
 
+    // Owned pages are unmapped when the process that opened the handle
+    // exits, no other process can map them through it.
+    status = STATUS_ACCESS_DENIED;
+    if ((In->Flags & XENIFACE_GNTTAB_USE_HANDLE) &&
+        PsGetCurrentProcess() != __XenIfaceFileContext(IoGetCurrentIrpStackLocation(Irp)->FileObject)->Process) {
+        goto fail5;
+    }
+
     status = STATUS_INVALID_BUFFER_SIZE;
     if (OutLen != (ULONG)FIELD_OFFSET(XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS_OUT, References[In->NumberPages]))
-        goto fail5;
+        goto fail6;
 
     status = STATUS_NO_MEMORY;
-    Context = ExAllocatePoolWithTag(NonPagedPool, sizeof(XENIFACE_GRANT_CONTEXT), XENIFACE_POOL_TAG);
+    Context = CacheGet(Fdo, XENIFACE_CACHE_GRANT);
     if (Context == NULL)
-        goto fail6;
+        goto fail7;
 
-    RtlZeroMemory(Context, sizeof(XENIFACE_GRANT_CONTEXT));
     Context->Id.Type = XENIFACE_CONTEXT_GRANT;
     Context->Id.Process = PsGetCurrentProcess();
-    Context->Id.RequestId = In->RequestId;
-    Context->RemoteDomain = In->RemoteDomain;
-    Context->NumberPages = In->NumberPages;
-    Context->Flags = In->Flags;
-    Context->NotifyOffset = In->NotifyOffset;
-    Context->NotifyPort = In->NotifyPort;
-
-    XenIfaceDebugPrint(TRACE, "> RemoteDomain %d, NumberPages %lu, Flags 0x%x, Offset 0x%x, Port %d, Process %p, Id %lu\n",
-                       Context->RemoteDomain, Context->NumberPages, Context->Flags, Context->NotifyOffset, Context->NotifyPort,
-                       Context->Id.Process, Context->Id.RequestId);
-
-    // Check if the request ID is unique for this process.
-    // This doesn't protect us from simultaneous requests with the same ID arriving here
-    // but another check for duplicate ID is performed when the context/IRP is queued at the end.
-    // Ideally we would lock the whole section but that's not really an option since we touch user memory.
-    status = STATUS_INVALID_PARAMETER;
-    if (FindGnttabIrp(Fdo, &Context->Id) != NULL)
-        goto fail7;
-
-    status = STATUS_NO_MEMORY;
-    Context->Grants = ExAllocatePoolWithTag(NonPagedPool, Context->NumberPages * sizeof(PXENBUS_GNTTAB_ENTRY), XENIFACE_POOL_TAG);
-    if (Context->Grants == NULL)
-        goto fail8;
-
-    RtlZeroMemory(Context->Grants, Context->NumberPages * sizeof(PXENBUS_GNTTAB_ENTRY));
-
-    // allocate memory to share
-    status = STATUS_NO_MEMORY;
-    Context->KernelVa = ExAllocatePoolWithTag(NonPagedPool, Context->NumberPages * PAGE_SIZE, XENIFACE_POOL_TAG);
-    if (Context->KernelVa == NULL)
-        goto fail9;
-
-    RtlZeroMemory(Context->KernelVa, Context->NumberPages * PAGE_SIZE);
-    Context->Mdl = IoAllocateMdl(Context->KernelVa, Context->NumberPages * PAGE_SIZE, FALSE, FALSE, NULL);
-    if (Context->Mdl == NULL)
-        goto fail10;
+    Context->Id.RequestId = In->RequestId;
+    Context->RemoteDomain = In->RemoteDomain;
+    Context->NumberPages = In->NumberPages;
+    Context->Flags = In->Flags;
+    Context->CacheType = In->CacheType;
+    Context->NotifyOffset = In->NotifyOffset;
+    Context->NotifyPort = In->NotifyPort;
+    Context->FileObject = IoGetCurrentIrpStackLocation(Irp)->FileObject;
 
-    MmBuildMdlForNonPagedPool(Context->Mdl);
-    ASSERT(MmGetMdlByteCount(Context->Mdl) == Context->NumberPages * PAGE_SIZE);
+    XenIfaceDebugPrint(TRACE, "> RemoteDomain %d, NumberPages %lu, Flags 0x%x, CacheType %d, Offset 0x%x, Port %d, Process %p, Id %lu\n",
+                       Context->RemoteDomain, Context->NumberPages, Context->Flags, Context->CacheType, Context->NotifyOffset, Context->NotifyPort,
+                       Context->Id.Process, Context->Id.RequestId);
 
-    // perform sharing
-    for (Page = 0; Page < Context->NumberPages; Page++) {
-        status = XENBUS_GNTTAB(PermitForeignAccess,
-                               &Fdo->GnttabInterface,
-                               Fdo->GnttabCache,
-                               FALSE,
-                               Context->RemoteDomain,
-                               MmGetMdlPfnArray(Context->Mdl)[Page],
-                               (Context->Flags & XENIFACE_GNTTAB_READONLY) != 0,
-                               &(Context->Grants[Page]));
+    // Check if the request ID is unique for this process.
+    // This doesn't protect us from simultaneous requests with the same ID arriving here
+    // but another check for duplicate ID is performed when the context/IRP is queued at the end.
+    // Ideally we would lock the whole section but that's not really an option since we touch user memory.
+    status = STATUS_INVALID_PARAMETER;
+    if (FindGnttabIrp(Fdo, &Context->Id) != NULL)
+        goto fail8;
 
-// prefast somehow thinks that this call can modify Page...
-#pragma prefast(suppress:6385)
-        XenIfaceDebugPrint(INFO, "Grants[%lu] = %p\n", Page, Context->Grants[Page]);
+    // Reuse memory this handle released earlier if the caller allows it.
+    if ((Context->Flags & XENIFACE_GNTTAB_PERSISTENT) == 0 ||
+        !GnttabPoolGet(Fdo, Context)) {
+        status = GnttabShare(Fdo, Context);
         if (!NT_SUCCESS(status))
-            goto fail11;
+            goto fail9;
     }
 
     // map into user mode
@@ -246,19 +909,19 @@ IoctlGnttabPermitForeignAccess(
     __try {
         Context->UserVa = MmMapLockedPagesSpecifyCache(Context->Mdl,
                                                        UserMode,
-                                                       MmCached,
+                                                       __GnttabCachingType(Context->CacheType),
                                                        NULL,
                                                        FALSE,
                                                        NormalPagePriority);
     }
     __except (EXCEPTION_EXECUTE_HANDLER) {
         status = GetExceptionCode();
-        goto fail12;
+        goto fail10;
     }
 
     status = STATUS_UNSUCCESSFUL;
     if (Context->UserVa == NULL)
-        goto fail13;
+        goto fail11;
 
     XenIfaceDebugPrint(TRACE, "< Context %p, Irp %p, KernelVa %p, UserVa %p\n",
                        Context, Irp, Context->KernelVa, Context->UserVa);
@@ -276,7 +939,25 @@ IoctlGnttabPermitForeignAccess(
     } except(EXCEPTION_EXECUTE_HANDLER) {
         status = GetExceptionCode();
         XenIfaceDebugPrint(ERROR, "Exception 0x%lx while probing/writing output buffer at %p, size 0x%lx\n", status, Out, OutLen);
-        goto fail14;
+        goto fail12;
+    }
+
+    // Hand the context to the file object and complete the request right
+    // away. The process stays referenced until the pages are unmapped from it.
+    if (Context->Flags & XENIFACE_GNTTAB_USE_HANDLE) {
+        Context->Id.FileObject = Context->FileObject;
+        Context->Handle.Id = &Context->Id;
+
+        ObReferenceObject(Context->Id.Process);
+        status = GnttabHandleInsert(Fdo, &Context->Handle);
+        if (!NT_SUCCESS(status)) {
+            ObDereferenceObject(Context->Id.Process);
+            goto fail13;
+        }
+
+        __FreeCapturedBuffer(In);
+
+        return STATUS_SUCCESS;
     }
 
     // Insert the IRP/context into the pending queue.
@@ -284,54 +965,36 @@ IoctlGnttabPermitForeignAccess(
     Irp->Tail.Overlay.DriverContext[0] = &Context->Id;
     status = IoCsqInsertIrpEx(&Fdo->IrpQueue, Irp, NULL, &Context->Id);
     if (!NT_SUCCESS(status))
-        goto fail15;
+        goto fail13;
 
     __FreeCapturedBuffer(In);
 
     return STATUS_PENDING;
 
-fail15:
-    XenIfaceDebugPrint(ERROR, "Fail15\n");
-
-fail14:
-    XenIfaceDebugPrint(ERROR, "Fail14\n");
-    MmUnmapLockedPages(Context->UserVa, Context->Mdl);
-
 fail13:
     XenIfaceDebugPrint(ERROR, "Fail13\n");
 
 fail12:
     XenIfaceDebugPrint(ERROR, "Fail12\n");
+    MmUnmapLockedPages(Context->UserVa, Context->Mdl);
 
 fail11:
-    XenIfaceDebugPrint(ERROR, "Fail11: Page = %lu\n", Page);
-
-    while (Page > 0) {
-        ASSERT(NT_SUCCESS(XENBUS_GNTTAB(RevokeForeignAccess,
-                                        &Fdo->GnttabInterface,
-                                        Fdo->GnttabCache,
-                                        FALSE,
-                                        Context->Grants[Page - 1])));
-
-        --Page;
-    }
-    IoFreeMdl(Context->Mdl);
+    XenIfaceDebugPrint(ERROR, "Fail11\n");
 
 fail10:
     XenIfaceDebugPrint(ERROR, "Fail10\n");
-    ExFreePoolWithTag(Context->KernelVa, XENIFACE_POOL_TAG);
+    GnttabUnshare(Fdo, Context);
 
 fail9:
     XenIfaceDebugPrint(ERROR, "Fail9\n");
-    ExFreePoolWithTag(Context->Grants, XENIFACE_POOL_TAG);
 
 fail8:
     XenIfaceDebugPrint(ERROR, "Fail8\n");
+    RtlZeroMemory(Context, sizeof(XENIFACE_GRANT_CONTEXT));
+    CachePut(Fdo, XENIFACE_CACHE_GRANT, Context);
 
 fail7:
     XenIfaceDebugPrint(ERROR, "Fail7\n");
-    RtlZeroMemory(Context, sizeof(XENIFACE_GRANT_CONTEXT));
-    ExFreePoolWithTag(Context, XENIFACE_POOL_TAG);
 
 fail6:
     XenIfaceDebugPrint(ERROR, "Fail6\n");
@@ -358,15 +1021,15 @@ _IRQL_requires_max_(APC_LEVEL)
 VOID
 GnttabFreeGrant(
     __in     PXENIFACE_FDO            Fdo,
-    __inout  PXENIFACE_GRANT_CONTEXT  Context
+    __inout  PXENIFACE_GRANT_CONTEXT  Context,
+    __in     BOOLEAN                  Reuse
 )
 {
     NTSTATUS status;
-    ULONG Page;
 
     ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
 
-    XenIfaceDebugPrint(TRACE, "Context %p\n", Context);
+    XenIfaceDebugPrint(TRACE, "Context %p, Reuse %d\n", Context, Reuse);
 
     if (Context->Flags & XENIFACE_GNTTAB_USE_NOTIFY_OFFSET) {
         ((PCHAR)Context->KernelVa)[Context->NotifyOffset] = 0;
@@ -382,27 +1045,16 @@ GnttabFreeGrant(
     // unmap from user address space
     MmUnmapLockedPages(Context->UserVa, Context->Mdl);
 
-    // stop sharing
-    for (Page = 0; Page < Context->NumberPages; Page++) {
-        status = XENBUS_GNTTAB(RevokeForeignAccess,
-                               &Fdo->GnttabInterface,
-                               Fdo->GnttabCache,
-                               FALSE,
-                               Context->Grants[Page]);
-
-        ASSERT(NT_SUCCESS(status)); // failure here is fatal, something must've gone catastrophically wrong
-    }
-
-    IoFreeMdl(Context->Mdl);
-
-    RtlZeroMemory(Context->KernelVa, Context->NumberPages * PAGE_SIZE);
-    ExFreePoolWithTag(Context->KernelVa, XENIFACE_POOL_TAG);
+    // keep persistent grants for the next request of this handle
+    if (Reuse &&
+        (Context->Flags & XENIFACE_GNTTAB_PERSISTENT) &&
+        GnttabPoolPut(Fdo, Context))
+        return;
 
-    RtlZeroMemory(Context->Grants, Context->NumberPages * sizeof(PXENBUS_GNTTAB_ENTRY));
-    ExFreePoolWithTag(Context->Grants, XENIFACE_POOL_TAG);
+    GnttabUnshare(Fdo, Context);
 
     RtlZeroMemory(Context, sizeof(XENIFACE_GRANT_CONTEXT));
-    ExFreePoolWithTag(Context, XENIFACE_POOL_TAG);
+    CachePut(Fdo, XENIFACE_CACHE_GRANT, Context);
 }
 
 DECLSPEC_NOINLINE
@@ -411,7 +1063,8 @@ IoctlGnttabRevokeForeignAccess(
     __in  PXENIFACE_FDO     Fdo,
     __in  PVOID             Buffer,
     __in  ULONG             InLen,
-    __in  ULONG             OutLen
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject
     )
 {
     NTSTATUS status;
@@ -428,17 +1081,25 @@ IoctlGnttabRevokeForeignAccess(
     Id.Type = XENIFACE_CONTEXT_GRANT;
     Id.Process = PsGetCurrentProcess();
     Id.RequestId = In->RequestId;
+    Id.FileObject = FileObject;
 
     XenIfaceDebugPrint(TRACE, "> Process %p, Id %lu\n", Id.Process, Id.RequestId);
 
-    status = STATUS_NOT_FOUND;
     PendingIrp = IoCsqRemoveNextIrp(&Fdo->IrpQueue, &Id);
-    if (PendingIrp == NULL)
-        goto fail2;
+    if (PendingIrp == NULL) {
+        // not pending, may be owned by the file object
+        status = STATUS_NOT_FOUND;
+        ContextId = GnttabHandleRemove(Fdo, &Id);
+        if (ContextId == NULL)
+            goto fail2;
+
+        GnttabHandleFree(Fdo, ContextId, TRUE);
+        return STATUS_SUCCESS;
+    }
 
     ContextId = PendingIrp->Tail.Overlay.DriverContext[0];
     Context = CONTAINING_RECORD(ContextId, XENIFACE_GRANT_CONTEXT, Id);
-    GnttabFreeGrant(Fdo, Context);
+    GnttabFreeGrant(Fdo, Context, TRUE);
 
     PendingIrp->IoStatus.Status = STATUS_SUCCESS;
     PendingIrp->IoStatus.Information = 0;
@@ -454,6 +1115,372 @@ fail1:
     return status;
 }
 
+// Map the foreign pages described by Context into system space.
+_IRQL_requires_max_(APC_LEVEL)
+static
+NTSTATUS
+GnttabMapKernel(
+    __in     PXENIFACE_FDO          Fdo,
+    __inout  PXENIFACE_MAP_CONTEXT  Context,
+    __in     PULONG                 References
+    )
+{
+    NTSTATUS status;
+
+    // cached mappings are looked up by their references later
+    if (Context->Flags & XENIFACE_GNTTAB_CACHE_MAPPING) {
+        status = STATUS_NO_MEMORY;
+        Context->References = ExAllocatePoolWithTag(NonPagedPool, Context->NumberPages * sizeof(ULONG), XENIFACE_POOL_TAG);
+        if (Context->References == NULL)
+            goto fail1;
+
+        RtlCopyMemory(Context->References, References, Context->NumberPages * sizeof(ULONG));
+    }
+
+    status = XENBUS_GNTTAB(MapForeignPages,
+                           &Fdo->GnttabInterface,
+                           Context->RemoteDomain,
+                           Context->NumberPages,
+                           References,
+                           Context->Flags & XENIFACE_GNTTAB_READONLY,
+                           &Context->Address);
+
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = STATUS_NO_MEMORY;
+    Context->KernelVa = MmMapIoSpace(Context->Address, Context->NumberPages * PAGE_SIZE, __GnttabCachingType(Context->CacheType));
+    if (Context->KernelVa == NULL)
+        goto fail3;
+
+    status = STATUS_NO_MEMORY;
+    Context->Mdl = IoAllocateMdl(Context->KernelVa, Context->NumberPages * PAGE_SIZE, FALSE, FALSE, NULL);
+    if (Context->Mdl == NULL)
+        goto fail4;
+
+    MmBuildMdlForNonPagedPool(Context->Mdl);
+
+    return STATUS_SUCCESS;
+
+fail4:
+    XenIfaceDebugPrint(ERROR, "Fail4\n");
+    MmUnmapIoSpace(Context->KernelVa, Context->NumberPages * PAGE_SIZE);
+    Context->KernelVa = NULL;
+
+fail3:
+    XenIfaceDebugPrint(ERROR, "Fail3\n");
+    ASSERT(NT_SUCCESS(XENBUS_GNTTAB(UnmapForeignPages,
+                                    &Fdo->GnttabInterface,
+                                    Context->Address
+                                    )));
+
+fail2:
+    XenIfaceDebugPrint(ERROR, "Fail2\n");
+    if (Context->References != NULL) {
+        ExFreePoolWithTag(Context->References, XENIFACE_POOL_TAG);
+        Context->References = NULL;
+    }
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+// Undo GnttabMapKernel.
+_IRQL_requires_max_(APC_LEVEL)
+static
+VOID
+GnttabUnmapKernel(
+    __in     PXENIFACE_FDO          Fdo,
+    __inout  PXENIFACE_MAP_CONTEXT  Context
+    )
+{
+    NTSTATUS status;
+
+    IoFreeMdl(Context->Mdl);
+    Context->Mdl = NULL;
+
+    // unmap from system space
+    MmUnmapIoSpace(Context->KernelVa, Context->NumberPages * PAGE_SIZE);
+    Context->KernelVa = NULL;
+
+    // undo mapping
+    status = XENBUS_GNTTAB(UnmapForeignPages,
+                           &Fdo->GnttabInterface,
+                           Context->Address);
+
+    ASSERT(NT_SUCCESS(status));
+
+    if (Context->References != NULL) {
+        ExFreePoolWithTag(Context->References, XENIFACE_POOL_TAG);
+        Context->References = NULL;
+    }
+}
+
+// Tell the remote end the mapping is going away, as requested by the last map
+// of it.
+_IRQL_requires_max_(APC_LEVEL)
+static
+VOID
+GnttabMapNotify(
+    __in  PXENIFACE_FDO          Fdo,
+    __in  PXENIFACE_MAP_CONTEXT  Context
+    )
+{
+    NTSTATUS status;
+
+    if (Context->Flags & XENIFACE_GNTTAB_USE_NOTIFY_OFFSET) {
+        ((PCHAR)Context->KernelVa)[Context->NotifyOffset] = 0;
+    }
+
+    if (Context->Flags & XENIFACE_GNTTAB_USE_NOTIFY_PORT) {
+        status = EvtchnNotify(Fdo, Context->NotifyPort, NULL);
+
+        if (!NT_SUCCESS(status)) // non-fatal, we must free memory
+            XenIfaceDebugPrint(ERROR, "failed to notify port %lu: 0x%x\n", Context->NotifyPort, status);
+    }
+}
+
+// Unmap cached mappings removed from the cache.
+_IRQL_requires_max_(APC_LEVEL)
+static
+VOID
+GnttabMapCacheFree(
+    __in     PXENIFACE_FDO  Fdo,
+    __inout  PLIST_ENTRY    List
+    )
+{
+    PXENIFACE_MAP_CONTEXT Context;
+
+    while (!IsListEmpty(List)) {
+        Context = CONTAINING_RECORD(RemoveHeadList(List), XENIFACE_MAP_CONTEXT, Entry);
+
+        XenIfaceDebugPrint(TRACE, "Context %p\n", Context);
+        GnttabMapNotify(Fdo, Context);
+        GnttabUnmapKernel(Fdo, Context);
+
+        RtlZeroMemory(Context, sizeof(XENIFACE_MAP_CONTEXT));
+        CachePut(Fdo, XENIFACE_CACHE_MAP, Context);
+    }
+}
+
+static FORCEINLINE
+PLIST_ENTRY
+__GnttabMapCacheBucket(
+    __in  PXENIFACE_FILE_CONTEXT  File,
+    __in  PXENIFACE_MAP_CONTEXT   Context,
+    __in  PULONG                  References
+    )
+{
+    ULONG Hash = References[0] ^
+                 ((ULONG)Context->RemoteDomain << 16) ^
+                 (Context->NumberPages << 8) ^
+                 (ULONG)Context->CacheType;
+
+    return &File->GnttabMapCacheTable[Hash % GNTTAB_MAP_CACHE_TABLE_SIZE];
+}
+
+// Take a mapping out of the cache of its file object.
+_Requires_lock_held_(Fdo->GnttabMapCacheLock)
+static FORCEINLINE
+VOID
+__GnttabMapCacheRemove(
+    __in     PXENIFACE_FDO          Fdo,
+    __inout  PXENIFACE_MAP_CONTEXT  Context
+    )
+{
+    PXENIFACE_GNTTAB_MAP_CACHE_STATS Stats = &__XenIfaceFileContext(Context->FileObject)->GnttabMapCacheStats;
+
+    UNREFERENCED_PARAMETER(Fdo);
+
+    RemoveEntryList(&Context->Entry);
+    RemoveEntryList(&Context->CacheEntry);
+    Stats->Bytes -= (ULONG64)Context->NumberPages * PAGE_SIZE;
+    Stats->Entries--;
+}
+
+// Move least recently used mappings of a file object to List until its
+// cached mappings fit its budget.
+_Requires_lock_held_(Fdo->GnttabMapCacheLock)
+static
+VOID
+GnttabMapCacheTrim(
+    __in     PXENIFACE_FDO  Fdo,
+    __in     PFILE_OBJECT   FileObject,
+    __inout  PLIST_ENTRY    List
+    )
+{
+    PXENIFACE_FILE_CONTEXT File = __XenIfaceFileContext(FileObject);
+    PXENIFACE_MAP_CONTEXT Context;
+
+    while (File->GnttabMapCacheStats.Bytes > File->GnttabMapCacheStats.Budget) {
+        ASSERT(!IsListEmpty(&File->GnttabMapCacheList));
+
+        Context = CONTAINING_RECORD(File->GnttabMapCacheList.Blink, XENIFACE_MAP_CONTEXT, Entry);
+
+        __GnttabMapCacheRemove(Fdo, Context);
+        File->GnttabMapCacheStats.Evictions++;
+        InsertTailList(List, &Context->Entry);
+    }
+}
+
+// Keep the system space mapping of an unmapped XENIFACE_GNTTAB_CACHE_MAPPING
+// request. Returns FALSE if it doesn't fit in the budget.
+_IRQL_requires_max_(APC_LEVEL)
+static
+BOOLEAN
+GnttabMapCachePut(
+    __in     PXENIFACE_FDO          Fdo,
+    __inout  PXENIFACE_MAP_CONTEXT  Context
+    )
+{
+    PXENIFACE_FILE_CONTEXT File = __XenIfaceFileContext(Context->FileObject);
+    ULONG64 Bytes = (ULONG64)Context->NumberPages * PAGE_SIZE;
+    LIST_ENTRY ToFree;
+    KIRQL Irql;
+    BOOLEAN Cached;
+
+    ASSERT(Context->References != NULL);
+
+    RtlZeroMemory(&Context->Id, sizeof(XENIFACE_CONTEXT_ID));
+    Context->UserVa = NULL;
+
+    InitializeListHead(&ToFree);
+
+    KeAcquireSpinLock(&Fdo->GnttabMapCacheLock, &Irql);
+    Cached = Bytes <= File->GnttabMapCacheStats.Budget;
+    if (Cached) {
+        InsertHeadList(&File->GnttabMapCacheList, &Context->Entry);
+        InsertHeadList(__GnttabMapCacheBucket(File, Context, Context->References),
+                       &Context->CacheEntry);
+        File->GnttabMapCacheStats.Bytes += Bytes;
+        File->GnttabMapCacheStats.Entries++;
+
+        GnttabMapCacheTrim(Fdo, Context->FileObject, &ToFree);
+    }
+    KeReleaseSpinLock(&Fdo->GnttabMapCacheLock, Irql);
+
+    GnttabMapCacheFree(Fdo, &ToFree);
+
+    return Cached;
+}
+
+// Move a cached mapping of the same file object, domain, references and access
+// mode into Context. Returns FALSE if there is none.
+_IRQL_requires_max_(APC_LEVEL)
+static
+BOOLEAN
+GnttabMapCacheGet(
+    __in     PXENIFACE_FDO          Fdo,
+    __inout  PXENIFACE_MAP_CONTEXT  Context,
+    __in     PULONG                 References
+    )
+{
+    PXENIFACE_FILE_CONTEXT File = __XenIfaceFileContext(Context->FileObject);
+    PXENIFACE_MAP_CONTEXT Cached = NULL;
+    PXENIFACE_MAP_CONTEXT Candidate;
+    PLIST_ENTRY Bucket;
+    PLIST_ENTRY Node;
+    KIRQL Irql;
+
+    KeAcquireSpinLock(&Fdo->GnttabMapCacheLock, &Irql);
+    Bucket = __GnttabMapCacheBucket(File, Context, References);
+    for (Node = Bucket->Flink; Node != Bucket; Node = Node->Flink) {
+        Candidate = CONTAINING_RECORD(Node, XENIFACE_MAP_CONTEXT, CacheEntry);
+
+        if (Candidate->RemoteDomain == Context->RemoteDomain &&
+            Candidate->NumberPages == Context->NumberPages &&
+            Candidate->CacheType == Context->CacheType &&
+            (Candidate->Flags & XENIFACE_GNTTAB_READONLY) == (Context->Flags & XENIFACE_GNTTAB_READONLY) &&
+            RtlEqualMemory(Candidate->References, References, Context->NumberPages * sizeof(ULONG))) {
+            __GnttabMapCacheRemove(Fdo, Candidate);
+            Cached = Candidate;
+            break;
+        }
+    }
+
+    if (Cached != NULL)
+        File->GnttabMapCacheStats.Hits++;
+    else
+        File->GnttabMapCacheStats.Misses++;
+    KeReleaseSpinLock(&Fdo->GnttabMapCacheLock, Irql);
+
+    if (Cached == NULL)
+        return FALSE;
+
+    XenIfaceDebugPrint(TRACE, "Context %p reuses %p\n", Context, Cached);
+
+    Context->References = Cached->References;
+    Context->Address = Cached->Address;
+    Context->KernelVa = Cached->KernelVa;
+    Context->Mdl = Cached->Mdl;
+
+    RtlZeroMemory(Cached, sizeof(XENIFACE_MAP_CONTEXT));
+    CachePut(Fdo, XENIFACE_CACHE_MAP, Cached);
+    return TRUE;
+}
+
+// Move every cached mapping of a file object to List.
+_Requires_lock_held_(Fdo->GnttabMapCacheLock)
+static
+VOID
+__GnttabMapCacheTakeFile(
+    __in     PXENIFACE_FDO  Fdo,
+    __in     PFILE_OBJECT   FileObject,
+    __inout  PLIST_ENTRY    List
+    )
+{
+    PXENIFACE_FILE_CONTEXT File = __XenIfaceFileContext(FileObject);
+    PXENIFACE_MAP_CONTEXT Context;
+
+    while (!IsListEmpty(&File->GnttabMapCacheList)) {
+        Context = CONTAINING_RECORD(File->GnttabMapCacheList.Flink, XENIFACE_MAP_CONTEXT, Entry);
+
+        __GnttabMapCacheRemove(Fdo, Context);
+        InsertTailList(List, &Context->Entry);
+    }
+}
+
+// Unmap cached mappings of a file object (all of them if FileObject is NULL).
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+GnttabMapCacheFlush(
+    __in      PXENIFACE_FDO Fdo,
+    __in_opt  PFILE_OBJECT  FileObject
+    )
+{
+    PXENIFACE_FILE_CONTEXT File;
+    PLIST_ENTRY Node;
+    LIST_ENTRY ToFree;
+    ULONG Index;
+    KIRQL Irql;
+
+    InitializeListHead(&ToFree);
+
+    if (FileObject != NULL) {
+        KeAcquireSpinLock(&Fdo->GnttabMapCacheLock, &Irql);
+        __GnttabMapCacheTakeFile(Fdo, FileObject, &ToFree);
+        KeReleaseSpinLock(&Fdo->GnttabMapCacheLock, Irql);
+    } else {
+        // the file objects can't be closed while their caches are emptied
+        AcquireMutex(&Fdo->FileMutex);
+        KeAcquireSpinLock(&Fdo->GnttabMapCacheLock, &Irql);
+        for (Index = 0; Index < FILE_TABLE_SIZE; Index++) {
+            for (Node = Fdo->FileTable[Index].Flink;
+                 Node != &Fdo->FileTable[Index];
+                 Node = Node->Flink) {
+                File = CONTAINING_RECORD(Node, XENIFACE_FILE_CONTEXT, Entry);
+
+                __GnttabMapCacheTakeFile(Fdo, File->FileObject, &ToFree);
+            }
+        }
+        KeReleaseSpinLock(&Fdo->GnttabMapCacheLock, Irql);
+        ReleaseMutex(&Fdo->FileMutex);
+    }
+
+    GnttabMapCacheFree(Fdo, &ToFree);
+}
+
 DECLSPEC_NOINLINE
 NTSTATUS
 IoctlGnttabMapForeignPages(
@@ -488,37 +1515,47 @@ IoctlGnttabMapForeignPages(
 
     status = STATUS_INVALID_PARAMETER;
     if (In->NumberPages == 0 ||
-        In->NumberPages > 1024 * 1024 ||
-        In->NumberPages != NumberPages) {
+        In->NumberPages > GNTTAB_MAX_PAGES ||
+        In->NumberPages != NumberPages ||
+        (ULONG)In->CacheType >= XENIFACE_GNTTAB_CACHE_TYPES) {
         goto fail3;
     }
 
     if ((In->Flags & XENIFACE_GNTTAB_USE_NOTIFY_OFFSET) &&
-        (In->NotifyOffset >= In->NumberPages * PAGE_SIZE)) {
+        ((ULONGLONG)In->NotifyOffset >= (ULONGLONG)In->NumberPages * PAGE_SIZE)) {
         goto fail4;
     }
 
+    // Owned pages are unmapped when the process that opened the handle
+    // exits, no other process can map them through it.
+    status = STATUS_ACCESS_DENIED;
+    if ((In->Flags & XENIFACE_GNTTAB_USE_HANDLE) &&
+        PsGetCurrentProcess() != __XenIfaceFileContext(IoGetCurrentIrpStackLocation(Irp)->FileObject)->Process) {
+        goto fail5;
+    }
+
     status = STATUS_INVALID_BUFFER_SIZE;
     if (InLen != (ULONG)FIELD_OFFSET(XENIFACE_GNTTAB_MAP_FOREIGN_PAGES_IN, References[In->NumberPages]))
-        goto fail5;
+        goto fail6;
 
     status = STATUS_NO_MEMORY;
-    Context = ExAllocatePoolWithTag(NonPagedPool, sizeof(XENIFACE_MAP_CONTEXT), XENIFACE_POOL_TAG);
+    Context = CacheGet(Fdo, XENIFACE_CACHE_MAP);
     if (Context == NULL)
-        goto fail6;
+        goto fail7;
 
-    RtlZeroMemory(Context, sizeof(XENIFACE_MAP_CONTEXT));
     Context->Id.Type = XENIFACE_CONTEXT_MAP;
     Context->Id.Process = PsGetCurrentProcess();
     Context->Id.RequestId = In->RequestId;
     Context->RemoteDomain = In->RemoteDomain;
     Context->NumberPages = In->NumberPages;
     Context->Flags = In->Flags;
+    Context->CacheType = In->CacheType;
     Context->NotifyOffset = In->NotifyOffset;
     Context->NotifyPort = In->NotifyPort;
+    Context->FileObject = IoGetCurrentIrpStackLocation(Irp)->FileObject;
 
-    XenIfaceDebugPrint(TRACE, "> RemoteDomain %d, NumberPages %lu, Flags 0x%x, Offset 0x%x, Port %d, Process %p, Id %lu\n",
-                       Context->RemoteDomain, Context->NumberPages, Context->Flags, Context->NotifyOffset, Context->NotifyPort,
+    XenIfaceDebugPrint(TRACE, "> RemoteDomain %d, NumberPages %lu, Flags 0x%x, CacheType %d, Offset 0x%x, Port %d, Process %p, Id %lu\n",
+                       Context->RemoteDomain, Context->NumberPages, Context->Flags, Context->CacheType, Context->NotifyOffset, Context->NotifyPort,
                        Context->Id.Process, Context->Id.RequestId);
 
     for (PageIndex = 0; PageIndex < In->NumberPages; PageIndex++)
@@ -526,49 +1563,33 @@ IoctlGnttabMapForeignPages(
 
     status = STATUS_INVALID_PARAMETER;
     if (FindGnttabIrp(Fdo, &Context->Id) != NULL)
-        goto fail7;
-
-    status = XENBUS_GNTTAB(MapForeignPages,
-                           &Fdo->GnttabInterface,
-                           Context->RemoteDomain,
-                           Context->NumberPages,
-                           In->References,
-                           Context->Flags & XENIFACE_GNTTAB_READONLY,
-                           &Context->Address);
-
-    if (!NT_SUCCESS(status))
         goto fail8;
 
-    status = STATUS_NO_MEMORY;
-    Context->KernelVa = MmMapIoSpace(Context->Address, Context->NumberPages * PAGE_SIZE, MmCached);
-    if (Context->KernelVa == NULL)
-        goto fail9;
-
-    status = STATUS_NO_MEMORY;
-    Context->Mdl = IoAllocateMdl(Context->KernelVa, Context->NumberPages * PAGE_SIZE, FALSE, FALSE, NULL);
-    if (Context->Mdl == NULL)
-        goto fail10;
-
-    MmBuildMdlForNonPagedPool(Context->Mdl);
+    if ((Context->Flags & XENIFACE_GNTTAB_CACHE_MAPPING) == 0 ||
+        !GnttabMapCacheGet(Fdo, Context, In->References)) {
+        status = GnttabMapKernel(Fdo, Context, In->References);
+        if (!NT_SUCCESS(status))
+            goto fail9;
+    }
 
     // map into user mode
 #pragma prefast(suppress: 6320) // we want to catch all exceptions
     __try {
         Context->UserVa = MmMapLockedPagesSpecifyCache(Context->Mdl,
                                                        UserMode,
-                                                       MmCached,
+                                                       __GnttabCachingType(Context->CacheType),
                                                        NULL,
                                                        FALSE,
                                                        NormalPagePriority);
     }
     __except (EXCEPTION_EXECUTE_HANDLER) {
         status = GetExceptionCode();
-        goto fail11;
+        goto fail10;
     }
 
     status = STATUS_UNSUCCESSFUL;
     if (Context->UserVa == NULL)
-        goto fail12;
+        goto fail11;
 
     XenIfaceDebugPrint(TRACE, "< Context %p, Irp %p, Address %p, KernelVa %p, UserVa %p\n",
                        Context, Irp, Context->Address, Context->KernelVa, Context->UserVa);
@@ -581,7 +1602,25 @@ IoctlGnttabMapForeignPages(
     } except(EXCEPTION_EXECUTE_HANDLER) {
         status = GetExceptionCode();
         XenIfaceDebugPrint(ERROR, "Exception 0x%lx while probing/writing output buffer at %p, size 0x%lx\n", status, Out, OutLen);
-        goto fail13;
+        goto fail12;
+    }
+
+    // Hand the context to the file object and complete the request right
+    // away. The process stays referenced until the pages are unmapped from it.
+    if (Context->Flags & XENIFACE_GNTTAB_USE_HANDLE) {
+        Context->Id.FileObject = Context->FileObject;
+        Context->Handle.Id = &Context->Id;
+
+        ObReferenceObject(Context->Id.Process);
+        status = GnttabHandleInsert(Fdo, &Context->Handle);
+        if (!NT_SUCCESS(status)) {
+            ObDereferenceObject(Context->Id.Process);
+            goto fail13;
+        }
+
+        __FreeCapturedBuffer(In);
+
+        return STATUS_SUCCESS;
     }
 
     // Insert the IRP/context into the pending queue.
@@ -589,44 +1628,36 @@ IoctlGnttabMapForeignPages(
     Irp->Tail.Overlay.DriverContext[0] = &Context->Id;
     status = IoCsqInsertIrpEx(&Fdo->IrpQueue, Irp, NULL, &Context->Id);
     if (!NT_SUCCESS(status))
-        goto fail14;
+        goto fail13;
 
     __FreeCapturedBuffer(In);
 
     return STATUS_PENDING;
 
-fail14:
-    XenIfaceDebugPrint(ERROR, "Fail14\n");
-
 fail13:
     XenIfaceDebugPrint(ERROR, "Fail13\n");
-    MmUnmapLockedPages(Context->UserVa, Context->Mdl);
 
 fail12:
     XenIfaceDebugPrint(ERROR, "Fail12\n");
+    MmUnmapLockedPages(Context->UserVa, Context->Mdl);
 
 fail11:
     XenIfaceDebugPrint(ERROR, "Fail11\n");
-    IoFreeMdl(Context->Mdl);
 
 fail10:
     XenIfaceDebugPrint(ERROR, "Fail10\n");
-    MmUnmapIoSpace(Context->KernelVa, Context->NumberPages * PAGE_SIZE);
+    GnttabUnmapKernel(Fdo, Context);
 
 fail9:
     XenIfaceDebugPrint(ERROR, "Fail9\n");
-    ASSERT(NT_SUCCESS(XENBUS_GNTTAB(UnmapForeignPages,
-                                    &Fdo->GnttabInterface,
-                                    Context->Address
-                                    )));
 
 fail8:
     XenIfaceDebugPrint(ERROR, "Fail8\n");
+    RtlZeroMemory(Context, sizeof(XENIFACE_MAP_CONTEXT));
+    CachePut(Fdo, XENIFACE_CACHE_MAP, Context);
 
 fail7:
     XenIfaceDebugPrint(ERROR, "Fail7\n");
-    RtlZeroMemory(Context, sizeof(XENIFACE_MAP_CONTEXT));
-    ExFreePoolWithTag(Context, XENIFACE_POOL_TAG);
 
 fail6:
     XenIfaceDebugPrint(ERROR, "Fail6\n");
@@ -654,43 +1685,29 @@ DECLSPEC_NOINLINE
 VOID
 GnttabFreeMap(
     __in     PXENIFACE_FDO            Fdo,
-    __inout  PXENIFACE_MAP_CONTEXT    Context
+    __inout  PXENIFACE_MAP_CONTEXT    Context,
+    __in     BOOLEAN                  Reuse
     )
 {
-    NTSTATUS status;
-
     ASSERT(KeGetCurrentIrql() <= APC_LEVEL);
 
-    XenIfaceDebugPrint(TRACE, "Context %p\n", Context);
-
-    if (Context->Flags & XENIFACE_GNTTAB_USE_NOTIFY_OFFSET) {
-        ((PCHAR)Context->KernelVa)[Context->NotifyOffset] = 0;
-    }
-
-    if (Context->Flags & XENIFACE_GNTTAB_USE_NOTIFY_PORT) {
-        status = EvtchnNotify(Fdo, Context->NotifyPort, NULL);
-
-        if (!NT_SUCCESS(status)) // non-fatal, we must free memory
-            XenIfaceDebugPrint(ERROR, "failed to notify port %lu: 0x%x\n", Context->NotifyPort, status);
-    }
+    XenIfaceDebugPrint(TRACE, "Context %p, Reuse %d\n", Context, Reuse);
 
     // unmap from user address space
     MmUnmapLockedPages(Context->UserVa, Context->Mdl);
 
-    IoFreeMdl(Context->Mdl);
-
-    // unmap from system space
-    MmUnmapIoSpace(Context->KernelVa, Context->NumberPages * PAGE_SIZE);
-
-    // undo mapping
-    status = XENBUS_GNTTAB(UnmapForeignPages,
-                           &Fdo->GnttabInterface,
-                           Context->Address);
+    // keep the mapping for the next map of the same references by this
+    // handle, the remote end is notified when it is evicted
+    if (Reuse &&
+        (Context->Flags & XENIFACE_GNTTAB_CACHE_MAPPING) &&
+        GnttabMapCachePut(Fdo, Context))
+        return;
 
-    ASSERT(NT_SUCCESS(status));
+    GnttabMapNotify(Fdo, Context);
+    GnttabUnmapKernel(Fdo, Context);
 
     RtlZeroMemory(Context, sizeof(XENIFACE_MAP_CONTEXT));
-    ExFreePoolWithTag(Context, XENIFACE_POOL_TAG);
+    CachePut(Fdo, XENIFACE_CACHE_MAP, Context);
 }
 
 DECLSPEC_NOINLINE
@@ -699,7 +1716,8 @@ IoctlGnttabUnmapForeignPages(
     __in  PXENIFACE_FDO     Fdo,
     __in  PVOID             Buffer,
     __in  ULONG             InLen,
-    __in  ULONG             OutLen
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject
     )
 {
     NTSTATUS status;
@@ -718,17 +1736,25 @@ IoctlGnttabUnmapForeignPages(
     Id.Type = XENIFACE_CONTEXT_MAP;
     Id.Process = PsGetCurrentProcess();
     Id.RequestId = In->RequestId;
+    Id.FileObject = FileObject;
 
     XenIfaceDebugPrint(TRACE, "> Process %p, Id %lu\n", Id.Process, Id.RequestId);
 
-    status = STATUS_NOT_FOUND;
     PendingIrp = IoCsqRemoveNextIrp(&Fdo->IrpQueue, &Id);
-    if (PendingIrp == NULL)
-        goto fail2;
+    if (PendingIrp == NULL) {
+        // not pending, may be owned by the file object
+        status = STATUS_NOT_FOUND;
+        ContextId = GnttabHandleRemove(Fdo, &Id);
+        if (ContextId == NULL)
+            goto fail2;
+
+        GnttabHandleFree(Fdo, ContextId, TRUE);
+        return STATUS_SUCCESS;
+    }
 
     ContextId = PendingIrp->Tail.Overlay.DriverContext[0];
     Context = CONTAINING_RECORD(ContextId, XENIFACE_MAP_CONTEXT, Id);
-    GnttabFreeMap(Fdo, Context);
+    GnttabFreeMap(Fdo, Context, TRUE);
 
     PendingIrp->IoStatus.Status = STATUS_SUCCESS;
     PendingIrp->IoStatus.Information = 0;
@@ -743,3 +1769,308 @@ fail1:
     XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
     return status;
 }
+
+// Lock the local buffer of a copy segment and map it into system space.
+_IRQL_requires_max_(APC_LEVEL)
+static
+NTSTATUS
+GnttabCopyLock(
+    __inout  PXENIFACE_GNTTAB_COPY_OP Op
+    )
+{
+    NTSTATUS status;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Op->Segment.Length == 0 ||
+        Op->Segment.Offset >= PAGE_SIZE ||
+        Op->Segment.Length > PAGE_SIZE - Op->Segment.Offset ||
+        (Op->Segment.Direction != XENIFACE_GNTTAB_COPY_TO_REMOTE &&
+         Op->Segment.Direction != XENIFACE_GNTTAB_COPY_FROM_REMOTE)) {
+        goto fail1;
+    }
+
+    status = STATUS_NO_MEMORY;
+    Op->Mdl = IoAllocateMdl(Op->Segment.Buffer, Op->Segment.Length, FALSE, FALSE, NULL);
+    if (Op->Mdl == NULL)
+        goto fail2;
+
+#pragma prefast(suppress: 6320) // we want to catch all exceptions
+    try {
+        MmProbeAndLockPages(Op->Mdl,
+                            UserMode,
+                            (Op->Segment.Direction == XENIFACE_GNTTAB_COPY_FROM_REMOTE) ? IoWriteAccess : IoReadAccess);
+    } except(EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+        goto fail3;
+    }
+
+    status = STATUS_NO_MEMORY;
+    Op->SystemVa = MmGetSystemAddressForMdlSafe(Op->Mdl, NormalPagePriority);
+    if (Op->SystemVa == NULL)
+        goto fail4;
+
+    return STATUS_SUCCESS;
+
+fail4:
+    XenIfaceDebugPrint(ERROR, "Fail4\n");
+    MmUnlockPages(Op->Mdl);
+
+fail3:
+    XenIfaceDebugPrint(ERROR, "Fail3\n");
+    IoFreeMdl(Op->Mdl);
+    Op->Mdl = NULL;
+
+fail2:
+    XenIfaceDebugPrint(ERROR, "Fail2\n");
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+// Foreign pages mapped at once by IOCTL_XENIFACE_GNTTAB_COPY.
+#define GNTTAB_COPY_RUN_MAX 64
+
+// Map the foreign pages of Count consecutive copy segments with one grant
+// operation and copy each of them.
+_IRQL_requires_max_(APC_LEVEL)
+static
+NTSTATUS
+GnttabCopyRun(
+    __in     PXENIFACE_FDO            Fdo,
+    __inout  PXENIFACE_GNTTAB_COPY_OP Ops,
+    __in     ULONG                    Count
+    )
+{
+    NTSTATUS status;
+    ULONG References[GNTTAB_COPY_RUN_MAX];
+    PHYSICAL_ADDRESS Address;
+    PUCHAR ForeignVa;
+    PUCHAR Remote;
+    ULONG Index;
+
+    ASSERT(Count != 0 && Count <= GNTTAB_COPY_RUN_MAX);
+
+    for (Index = 0; Index < Count; Index++)
+        References[Index] = Ops[Index].Segment.Reference;
+
+    status = XENBUS_GNTTAB(MapForeignPages,
+                           &Fdo->GnttabInterface,
+                           Ops[0].Segment.RemoteDomain,
+                           Count,
+                           References,
+                           Ops[0].Segment.Direction == XENIFACE_GNTTAB_COPY_FROM_REMOTE,
+                           &Address);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = STATUS_NO_MEMORY;
+    ForeignVa = MmMapIoSpace(Address, Count * PAGE_SIZE, MmCached);
+    if (ForeignVa == NULL)
+        goto fail2;
+
+    for (Index = 0; Index < Count; Index++) {
+        Remote = ForeignVa + Index * PAGE_SIZE + Ops[Index].Segment.Offset;
+
+        if (Ops[Index].Segment.Direction == XENIFACE_GNTTAB_COPY_FROM_REMOTE)
+            RtlCopyMemory(Ops[Index].SystemVa, Remote, Ops[Index].Segment.Length);
+        else
+            RtlCopyMemory(Remote, Ops[Index].SystemVa, Ops[Index].Segment.Length);
+    }
+
+    MmUnmapIoSpace(ForeignVa, Count * PAGE_SIZE);
+
+    status = XENBUS_GNTTAB(UnmapForeignPages,
+                           &Fdo->GnttabInterface,
+                           Address);
+    ASSERT(NT_SUCCESS(status));
+
+    return STATUS_SUCCESS;
+
+fail2:
+    XenIfaceDebugPrint(ERROR, "Fail2\n");
+    (VOID) XENBUS_GNTTAB(UnmapForeignPages,
+                         &Fdo->GnttabInterface,
+                         Address);
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlGnttabCopy(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS status;
+    PXENIFACE_GNTTAB_COPY_IN In = Buffer;
+    PXENIFACE_GNTTAB_COPY_OUT Out = Buffer;
+    PXENIFACE_GNTTAB_COPY_OP Ops;
+    ULONG NumberSegments;
+    ULONG Index;
+    ULONG Count;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen < (ULONG)FIELD_OFFSET(XENIFACE_GNTTAB_COPY_IN, Segments))
+        goto fail1;
+
+    NumberSegments = In->NumberSegments;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (NumberSegments == 0 ||
+        NumberSegments > XENIFACE_GNTTAB_COPY_MAX) {
+        goto fail2;
+    }
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != (ULONG)FIELD_OFFSET(XENIFACE_GNTTAB_COPY_IN, Segments[NumberSegments]) ||
+        OutLen != (ULONG)FIELD_OFFSET(XENIFACE_GNTTAB_COPY_OUT, Status[NumberSegments])) {
+        goto fail3;
+    }
+
+    status = STATUS_NO_MEMORY;
+    Ops = ExAllocatePoolWithTag(NonPagedPool, NumberSegments * sizeof(XENIFACE_GNTTAB_COPY_OP), XENIFACE_POOL_TAG);
+    if (Ops == NULL)
+        goto fail4;
+
+    RtlZeroMemory(Ops, NumberSegments * sizeof(XENIFACE_GNTTAB_COPY_OP));
+
+    XenIfaceDebugPrint(TRACE, "> NumberSegments %lu\n", NumberSegments);
+
+    // Capture the segments (the output overwrites them) and lock every local
+    // buffer before touching any foreign page.
+    for (Index = 0; Index < NumberSegments; Index++) {
+        Ops[Index].Segment = In->Segments[Index];
+        Ops[Index].Status = GnttabCopyLock(&Ops[Index]);
+    }
+
+    // Copy runs of locked segments that share a domain and direction.
+    Index = 0;
+    while (Index < NumberSegments) {
+        if (!NT_SUCCESS(Ops[Index].Status)) {
+            Index++;
+            continue;
+        }
+
+        Count = 1;
+        while (Index + Count < NumberSegments &&
+               Count < GNTTAB_COPY_RUN_MAX &&
+               NT_SUCCESS(Ops[Index + Count].Status) &&
+               Ops[Index + Count].Segment.RemoteDomain == Ops[Index].Segment.RemoteDomain &&
+               Ops[Index + Count].Segment.Direction == Ops[Index].Segment.Direction)
+            Count++;
+
+        status = GnttabCopyRun(Fdo, &Ops[Index], Count);
+        if (!NT_SUCCESS(status)) {
+            ULONG Failed;
+
+            for (Failed = Index; Failed < Index + Count; Failed++)
+                Ops[Failed].Status = status;
+        }
+
+        Index += Count;
+    }
+
+    Out->NumberSegments = NumberSegments;
+    for (Index = 0; Index < NumberSegments; Index++) {
+        if (Ops[Index].Mdl != NULL) {
+            MmUnlockPages(Ops[Index].Mdl);
+            IoFreeMdl(Ops[Index].Mdl);
+        }
+
+        Out->Status[Index] = Ops[Index].Status;
+    }
+
+    ExFreePoolWithTag(Ops, XENIFACE_POOL_TAG);
+
+    *Info = OutLen;
+    return STATUS_SUCCESS;
+
+fail4:
+    XenIfaceDebugPrint(ERROR, "Fail4\n");
+
+fail3:
+    XenIfaceDebugPrint(ERROR, "Fail3\n");
+
+fail2:
+    XenIfaceDebugPrint(ERROR, "Fail2\n");
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlGnttabSetMapCacheBudget(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject
+    )
+{
+    NTSTATUS status;
+    PXENIFACE_GNTTAB_SET_MAP_CACHE_BUDGET_IN In = Buffer;
+    LIST_ENTRY ToFree;
+    KIRQL Irql;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != sizeof(XENIFACE_GNTTAB_SET_MAP_CACHE_BUDGET_IN) ||
+        OutLen != 0) {
+        goto fail1;
+    }
+
+    XenIfaceDebugPrint(TRACE, "> Budget %llu\n", In->Budget);
+
+    InitializeListHead(&ToFree);
+
+    KeAcquireSpinLock(&Fdo->GnttabMapCacheLock, &Irql);
+    __XenIfaceFileContext(FileObject)->GnttabMapCacheStats.Budget = In->Budget;
+    GnttabMapCacheTrim(Fdo, FileObject, &ToFree);
+    KeReleaseSpinLock(&Fdo->GnttabMapCacheLock, Irql);
+
+    GnttabMapCacheFree(Fdo, &ToFree);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlGnttabQueryMapCache(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS status;
+    KIRQL Irql;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != 0 || OutLen != sizeof(XENIFACE_GNTTAB_MAP_CACHE_STATS))
+        goto fail1;
+
+    KeAcquireSpinLock(&Fdo->GnttabMapCacheLock, &Irql);
+    RtlCopyMemory(Buffer, &__XenIfaceFileContext(FileObject)->GnttabMapCacheStats, sizeof(XENIFACE_GNTTAB_MAP_CACHE_STATS));
+    KeReleaseSpinLock(&Fdo->GnttabMapCacheLock, Irql);
+
+    *Info = sizeof(XENIFACE_GNTTAB_MAP_CACHE_STATS);
+    return STATUS_SUCCESS;
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
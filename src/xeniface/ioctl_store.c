@@ -464,12 +464,10 @@ IoctlStoreAddWatch(
     Path[In->PathLength - 1] = 0;
 
     status = STATUS_NO_MEMORY;
-    Context = ExAllocatePoolWithTag(NonPagedPool, sizeof(XENIFACE_STORE_CONTEXT), XENIFACE_POOL_TAG);
+    Context = CacheGet(Fdo, XENIFACE_CACHE_STORE);
     if (Context == NULL)
         goto fail4;
 
-    RtlZeroMemory(Context, sizeof(XENIFACE_STORE_CONTEXT));
-
     Context->FileObject = FileObject;
 
     status = ObReferenceObjectByHandle(In->Event,
@@ -511,7 +509,7 @@ fail6:
 fail5:
     XenIfaceDebugPrint(ERROR, "Fail5\n");
     RtlZeroMemory(Context, sizeof(XENIFACE_STORE_CONTEXT));
-    ExFreePoolWithTag(Context, XENIFACE_POOL_TAG);
+    CachePut(Fdo, XENIFACE_CACHE_STORE, Context);
 
 fail4:
     XenIfaceDebugPrint(ERROR, "Fail4\n");
@@ -548,7 +546,7 @@ StoreFreeWatch(
 
     ObDereferenceObject(Context->Event);
     RtlZeroMemory(Context, sizeof(XENIFACE_STORE_CONTEXT));
-    ExFreePoolWithTag(Context, XENIFACE_POOL_TAG);
+    CachePut(Fdo, XENIFACE_CACHE_STORE, Context);
 }
 
 DECLSPEC_NOINLINE
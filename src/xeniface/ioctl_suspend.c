@@ -91,12 +91,10 @@ IoctlSuspendRegister(
     }
 
     status = STATUS_NO_MEMORY;
-    Context = ExAllocatePoolWithTag(NonPagedPool, sizeof(XENIFACE_SUSPEND_CONTEXT), XENIFACE_POOL_TAG);
+    Context = CacheGet(Fdo, XENIFACE_CACHE_SUSPEND);
     if (Context == NULL)
         goto fail2;
 
-    RtlZeroMemory(Context, sizeof(XENIFACE_SUSPEND_CONTEXT));
-
     Context->FileObject = FileObject;
 
     status = ObReferenceObjectByHandle(In->Event,
@@ -119,7 +117,7 @@ IoctlSuspendRegister(
 fail3:
     XenIfaceDebugPrint(ERROR, "Fail3\n");
     RtlZeroMemory(Context, sizeof(XENIFACE_SUSPEND_CONTEXT));
-    ExFreePoolWithTag(Context, XENIFACE_POOL_TAG);
+    CachePut(Fdo, XENIFACE_CACHE_SUSPEND, Context);
 
 fail2:
     XenIfaceDebugPrint(ERROR, "Fail2\n");
@@ -141,7 +139,7 @@ SuspendFreeEvent(
 
     ObDereferenceObject(Context->Event);
     RtlZeroMemory(Context, sizeof(XENIFACE_SUSPEND_CONTEXT));
-    ExFreePoolWithTag(Context, XENIFACE_POOL_TAG);
+    CachePut(Fdo, XENIFACE_CACHE_SUSPEND, Context);
 }
 
 DECLSPEC_NOINLINE
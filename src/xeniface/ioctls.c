@@ -141,8 +141,187 @@ fail1:
     return status;
 }
 
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlQueryCacheStats(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __out PULONG_PTR        Info
+    )
+{
+    NTSTATUS    status;
+
+    status = STATUS_INVALID_BUFFER_SIZE;
+    if (InLen != 0 || OutLen != sizeof(XENIFACE_CACHE_STATS_OUT))
+        goto fail1;
+
+    CacheQueryStats(Fdo, Buffer);
+
+    *Info = sizeof(XENIFACE_CACHE_STATS_OUT);
+    return STATUS_SUCCESS;
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+static FORCEINLINE
+PLIST_ENTRY
+__XenIfaceFileBucket(
+    __in  PXENIFACE_FDO Fdo,
+    __in  PEPROCESS     Process
+    )
+{
+    return &Fdo->FileTable[((ULONG_PTR)Process >> 6) & (FILE_TABLE_SIZE - 1)];
+}
+
+// Per file object state, freed by XenIfaceClose once no IRP can use it.
+NTSTATUS
+XenIfaceCreate(
+    __in     PXENIFACE_FDO     Fdo,
+    __inout  PFILE_OBJECT      FileObject
+    )
+{
+    PXENIFACE_FILE_CONTEXT Context;
+    NTSTATUS status;
+    ULONG Index;
+
+    status = STATUS_NO_MEMORY;
+    Context = ExAllocatePoolWithTag(NonPagedPool, sizeof(XENIFACE_FILE_CONTEXT), XENIFACE_POOL_TAG);
+    if (Context == NULL)
+        goto fail1;
+
+    RtlZeroMemory(Context, sizeof(XENIFACE_FILE_CONTEXT));
+
+    KeInitializeSpinLock(&Context->EvtchnFiredLock);
+    InitializeListHead(&Context->EvtchnFiredList);
+
+    InitializeListHead(&Context->GnttabHandleList);
+
+    InitializeListHead(&Context->GnttabMapCacheList);
+    for (Index = 0; Index < GNTTAB_MAP_CACHE_TABLE_SIZE; Index++)
+        InitializeListHead(&Context->GnttabMapCacheTable[Index]);
+
+    Context->GnttabMapCacheStats.Budget = GNTTAB_MAP_CACHE_DEFAULT_BUDGET;
+
+    for (Index = 0; Index < GNTTAB_POOL_TABLE_SIZE; Index++)
+        InitializeListHead(&Context->GnttabPoolTable[Index]);
+
+    // only compared, the reference keeps the address from being reused
+    Context->Process = PsGetCurrentProcess();
+    ObReferenceObject(Context->Process);
+
+    Context->FileObject = FileObject;
+    FileObject->FsContext = Context;
+
+    AcquireMutex(&Fdo->FileMutex);
+    InsertTailList(__XenIfaceFileBucket(Fdo, Context->Process), &Context->Entry);
+    ReleaseMutex(&Fdo->FileMutex);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    XenIfaceDebugPrint(ERROR, "Fail1 (%08x)\n", status);
+    return status;
+}
+
+VOID
+XenIfaceClose(
+    __in     PXENIFACE_FDO     Fdo,
+    __inout  PFILE_OBJECT      FileObject
+    )
+{
+    PXENIFACE_FILE_CONTEXT Context;
+    ULONG Index;
+
+    Context = __XenIfaceFileContext(FileObject);
+    if (Context == NULL)
+        return;
+
+    AcquireMutex(&Fdo->FileMutex);
+    RemoveEntryList(&Context->Entry);
+    ReleaseMutex(&Fdo->FileMutex);
+
+    // XenIfaceCleanup closed every channel and flushed every cached
+    // mapping of the file object
+    ASSERT(IsListEmpty(&Context->EvtchnFiredList));
+    ASSERT(IsListEmpty(&Context->GnttabMapCacheList));
+    ASSERT3U(Context->GnttabMapCacheStats.Entries, ==, 0);
+    for (Index = 0; Index < GNTTAB_POOL_TABLE_SIZE; Index++)
+        ASSERT(IsListEmpty(&Context->GnttabPoolTable[Index]));
+    ASSERT(IsListEmpty(&Context->GnttabHandleList));
+    ASSERT3S(Context->ProcessMappings, ==, 0);
+
+    ObDereferenceObject(Context->Process);
+
+    FileObject->FsContext = NULL;
+    ExFreePoolWithTag(Context, XENIFACE_POOL_TAG);
+}
+
+// Unmap driver memory from a process that is exiting, called in its context.
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+XenIfaceProcessExit(
+    __in     PXENIFACE_FDO     Fdo,
+    __in     PEPROCESS         Process
+    )
+{
+    PLIST_ENTRY Bucket = __XenIfaceFileBucket(Fdo, Process);
+    PXENIFACE_FILE_CONTEXT Context;
+    PLIST_ENTRY Node;
+
+    // Only file objects opened by the process can have memory mapped into
+    // it, a file object is not closed while its mappings are freed here.
+    AcquireMutex(&Fdo->FileMutex);
+    for (Node = Bucket->Flink; Node != Bucket; Node = Node->Flink) {
+        Context = CONTAINING_RECORD(Node, XENIFACE_FILE_CONTEXT, Entry);
+
+        if (Context->Process != Process ||
+            Context->ProcessMappings == 0)
+            continue;
+
+        AcquireMutex(&Fdo->UnmapMutex);
+
+        // pending bit page
+        EvtchnProcessExit(Fdo, Context->FileObject);
+
+        // grants and maps owned by the file object
+        GnttabProcessExit(Fdo, Context->FileObject);
+
+        ReleaseMutex(&Fdo->UnmapMutex);
+
+        ASSERT3S(Context->ProcessMappings, ==, 0);
+    }
+    ReleaseMutex(&Fdo->FileMutex);
+}
+
+// Count memory of a file object mapped into its process.
+VOID
+XenIfaceAddProcessMapping(
+    __in     PFILE_OBJECT      FileObject
+    )
+{
+    InterlockedIncrement(&__XenIfaceFileContext(FileObject)->ProcessMappings);
+    DriverAddProcessMapping();
+}
+
+VOID
+XenIfaceRemoveProcessMapping(
+    __in     PFILE_OBJECT      FileObject
+    )
+{
+    LONG Mappings;
+
+    Mappings = InterlockedDecrement(&__XenIfaceFileContext(FileObject)->ProcessMappings);
+    ASSERT3S(Mappings, >=, 0);
+
+    DriverRemoveProcessMapping();
+}
+
 // Cleanup store watches and event channels, called on file object close.
-_IRQL_requires_(PASSIVE_LEVEL) // EvtchnFree calls KeFlushQueuedDpcs
+_IRQL_requires_(PASSIVE_LEVEL) // EvtchnFreeList calls KeFlushQueuedDpcs
 VOID
 XenIfaceCleanup(
     __in  PXENIFACE_FDO Fdo,
@@ -156,6 +335,18 @@ XenIfaceCleanup(
     KIRQL Irql;
     LIST_ENTRY ToFree;
 
+    // Grants and maps go first, unmapping them may notify one of the event
+    // channels closed below.
+
+    // grants and maps owned by the file object
+    GnttabHandleFlush(Fdo, FileObject);
+
+    // pooled persistent grants
+    GnttabPoolFlush(Fdo, FileObject);
+
+    // cached foreign mappings
+    GnttabMapCacheFlush(Fdo, FileObject);
+
     // store watches
     KeAcquireSpinLock(&Fdo->StoreWatchLock, &Irql);
     Node = Fdo->StoreWatchList.Flink;
@@ -175,7 +366,7 @@ XenIfaceCleanup(
 
     // event channels
     InitializeListHead(&ToFree);
-    KeAcquireSpinLock(&Fdo->EvtchnLock, &Irql);
+    Irql = ExAcquireSpinLockExclusive(&Fdo->EvtchnLock);
     Node = Fdo->EvtchnList.Flink;
     while (Node->Flink != Fdo->EvtchnList.Flink) {
         EvtchnContext = CONTAINING_RECORD(Node, XENIFACE_EVTCHN_CONTEXT, Entry);
@@ -186,20 +377,20 @@ XenIfaceCleanup(
             continue;
 
         XenIfaceDebugPrint(TRACE, "Evtchn context %p\n", EvtchnContext);
-        RemoveEntryList(&EvtchnContext->Entry);
-        // EvtchnFree requires PASSIVE_LEVEL and we're inside a lock
+        EvtchnRemoveChannel(Fdo, EvtchnContext);
+        // EvtchnFreeList requires PASSIVE_LEVEL and we're inside a lock
         InsertTailList(&ToFree, &EvtchnContext->Entry);
     }
-    KeReleaseSpinLock(&Fdo->EvtchnLock, Irql);
+    ExReleaseSpinLockExclusive(&Fdo->EvtchnLock, Irql);
 
-    Node = ToFree.Flink;
-    while (Node->Flink != ToFree.Flink) {
-        EvtchnContext = CONTAINING_RECORD(Node, XENIFACE_EVTCHN_CONTEXT, Entry);
-        Node = Node->Flink;
+    // nothing can fire for this file object any more
+    EvtchnCancelWaits(Fdo, FileObject);
 
-        RemoveEntryList(&EvtchnContext->Entry);
-        EvtchnFree(Fdo, EvtchnContext);
-    }
+    // close them all before flushing DPCs once
+    EvtchnFreeList(Fdo, &ToFree);
+
+    // no channel of this file object can set pending bits any more
+    EvtchnFreePending(Fdo, FileObject);
      
     // suspend events
     KeAcquireSpinLock(&Fdo->SuspendLock, &Irql);
@@ -282,17 +473,65 @@ XenIfaceIoctl(
         status = IoctlEvtchnNotify(Fdo, Buffer, InLen, OutLen, Stack->FileObject);
         break;
 
+    case IOCTL_XENIFACE_EVTCHN_NOTIFY_BATCH:
+        status = IoctlEvtchnNotifyBatch(Fdo, Buffer, InLen, OutLen, Stack->FileObject, &Irp->IoStatus.Information);
+        break;
+
     case IOCTL_XENIFACE_EVTCHN_UNMASK:
         status = IoctlEvtchnUnmask(Fdo, Buffer, InLen, OutLen, Stack->FileObject);
         break;
 
+    case IOCTL_XENIFACE_EVTCHN_WAIT:
+        status = IoctlEvtchnWait(Fdo, Buffer, InLen, OutLen, Irp, &Irp->IoStatus.Information);
+        break;
+
+    case IOCTL_XENIFACE_EVTCHN_SET_SPIN:
+        status = IoctlEvtchnSetSpin(Fdo, Buffer, InLen, OutLen, Stack->FileObject);
+        break;
+
+    case IOCTL_XENIFACE_EVTCHN_SPIN_WAIT:
+        status = IoctlEvtchnSpinWait(Fdo, Buffer, InLen, OutLen, Stack->FileObject, &Irp->IoStatus.Information);
+        break;
+
+    case IOCTL_XENIFACE_EVTCHN_SET_MODERATION:
+        status = IoctlEvtchnSetModeration(Fdo, Buffer, InLen, OutLen, Stack->FileObject);
+        break;
+
+    case IOCTL_XENIFACE_EVTCHN_SET_AFFINITY:
+        status = IoctlEvtchnSetAffinity(Fdo, Buffer, InLen, OutLen, Stack->FileObject, &Irp->IoStatus.Information);
+        break;
+
+    case IOCTL_XENIFACE_EVTCHN_QUERY_AFFINITY:
+        status = IoctlEvtchnQueryAffinity(Fdo, Buffer, InLen, OutLen, Stack->FileObject, &Irp->IoStatus.Information);
+        break;
+
+    case IOCTL_XENIFACE_EVTCHN_QUERY_STATS:
+        status = IoctlEvtchnQueryStats(Fdo, Buffer, InLen, OutLen, Stack->FileObject, &Irp->IoStatus.Information);
+        break;
+
+    case IOCTL_XENIFACE_EVTCHN_REPORT_WAKE:
+        status = IoctlEvtchnReportWake(Fdo, Buffer, InLen, OutLen, Stack->FileObject);
+        break;
+
+    case IOCTL_XENIFACE_EVTCHN_QUERY_LATENCY:
+        status = IoctlEvtchnQueryLatency(Fdo, Buffer, InLen, OutLen, Stack->FileObject, &Irp->IoStatus.Information);
+        break;
+
+    case IOCTL_XENIFACE_EVTCHN_BIND_UNBOUND_BATCH:
+        status = IoctlEvtchnBindUnboundBatch(Fdo, Buffer, InLen, OutLen, Stack->FileObject, &Irp->IoStatus.Information);
+        break;
+
+    case IOCTL_XENIFACE_EVTCHN_MAP_PENDING:
+        status = IoctlEvtchnMapPending(Fdo, Buffer, InLen, OutLen, Stack->FileObject, &Irp->IoStatus.Information);
+        break;
+
         // gnttab
     case IOCTL_XENIFACE_GNTTAB_PERMIT_FOREIGN_ACCESS: // this is a METHOD_NEITHER IOCTL
         status = IoctlGnttabPermitForeignAccess(Fdo, Stack->Parameters.DeviceIoControl.Type3InputBuffer, InLen, OutLen, Irp);
         break;
 
     case IOCTL_XENIFACE_GNTTAB_REVOKE_FOREIGN_ACCESS:
-        status = IoctlGnttabRevokeForeignAccess(Fdo, Buffer, InLen, OutLen);
+        status = IoctlGnttabRevokeForeignAccess(Fdo, Buffer, InLen, OutLen, Stack->FileObject);
         break;
 
     case IOCTL_XENIFACE_GNTTAB_MAP_FOREIGN_PAGES: // this is a METHOD_NEITHER IOCTL
@@ -300,7 +539,19 @@ XenIfaceIoctl(
         break;
 
     case IOCTL_XENIFACE_GNTTAB_UNMAP_FOREIGN_PAGES:
-        status = IoctlGnttabUnmapForeignPages(Fdo, Buffer, InLen, OutLen);
+        status = IoctlGnttabUnmapForeignPages(Fdo, Buffer, InLen, OutLen, Stack->FileObject);
+        break;
+
+    case IOCTL_XENIFACE_GNTTAB_COPY:
+        status = IoctlGnttabCopy(Fdo, Buffer, InLen, OutLen, &Irp->IoStatus.Information);
+        break;
+
+    case IOCTL_XENIFACE_GNTTAB_SET_MAP_CACHE_BUDGET:
+        status = IoctlGnttabSetMapCacheBudget(Fdo, Buffer, InLen, OutLen, Stack->FileObject);
+        break;
+
+    case IOCTL_XENIFACE_GNTTAB_QUERY_MAP_CACHE:
+        status = IoctlGnttabQueryMapCache(Fdo, Buffer, InLen, OutLen, Stack->FileObject, &Irp->IoStatus.Information);
         break;
 
         // suspend
@@ -326,6 +577,10 @@ XenIfaceIoctl(
         status = IoctlLog(Fdo, Buffer, InLen, OutLen);
         break;
 
+    case IOCTL_XENIFACE_QUERY_CACHE_STATS:
+        status = IoctlQueryCacheStats(Fdo, Buffer, InLen, OutLen, &Irp->IoStatus.Information);
+        break;
+
     default:
         status = STATUS_INVALID_DEVICE_REQUEST;
         break;
@@ -333,10 +588,39 @@ XenIfaceIoctl(
 
 done:
 
-    Irp->IoStatus.Status = status;
+    // A pending IRP may already have been completed by someone else.
+    if (status != STATUS_PENDING) {
+        Irp->IoStatus.Status = status;
+        IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
 
-    if (status != STATUS_PENDING)
+    return status;
+}
+
+// Reading the device returns fired event channel ports, see EvtchnRead.
+NTSTATUS
+XenIfaceRead(
+    __in     PXENIFACE_FDO     Fdo,
+    __inout  PIRP              Irp
+    )
+{
+    NTSTATUS            status;
+
+    Irp->IoStatus.Information = 0;
+
+    status = STATUS_DEVICE_NOT_READY;
+    if (Fdo->InterfacesAcquired == FALSE)
+        goto done;
+
+    status = EvtchnRead(Fdo, Irp, &Irp->IoStatus.Information);
+
+done:
+
+    // A pending IRP may already have been completed by someone else.
+    if (status != STATUS_PENDING) {
+        Irp->IoStatus.Status = status;
         IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    }
 
     return status;
 }
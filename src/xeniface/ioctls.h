@@ -37,15 +37,66 @@
 
 typedef enum _XENIFACE_CONTEXT_TYPE {
     XENIFACE_CONTEXT_GRANT = 1,
-    XENIFACE_CONTEXT_MAP
+    XENIFACE_CONTEXT_MAP,
+    XENIFACE_CONTEXT_EVTCHN_WAIT
 } XENIFACE_CONTEXT_TYPE;
 
 typedef struct _XENIFACE_CONTEXT_ID {
     XENIFACE_CONTEXT_TYPE  Type;
     ULONG                  RequestId;
     PEPROCESS              Process;
+    PVOID                  FileObject; // only used by XENIFACE_CONTEXT_EVTCHN_WAIT and XENIFACE_GNTTAB_USE_HANDLE
 } XENIFACE_CONTEXT_ID, *PXENIFACE_CONTEXT_ID;
 
+// Per file object state, FileObject->FsContext from IRP_MJ_CREATE to IRP_MJ_CLOSE.
+typedef struct _XENIFACE_FILE_CONTEXT {
+    // Link in Fdo->FileTable, under Fdo->FileMutex
+    LIST_ENTRY             Entry;
+    PFILE_OBJECT           FileObject;
+
+    // Process that opened the file object, the only one that may map
+    // driver memory through it.
+    PEPROCESS              Process;
+
+    // Pending page, grants and maps of the file object currently mapped
+    // into Process. XenIfaceProcessExit skips the file object when zero.
+    LONG                   ProcessMappings;
+
+    // Grants and maps owned by the file object, also in
+    // Fdo->GnttabHandleTable, under Fdo->GnttabHandleLock.
+    LIST_ENTRY             GnttabHandleList;
+
+    // Channels without an event object that fired since the last
+    // IOCTL_XENIFACE_EVTCHN_WAIT of the file object.
+    KSPIN_LOCK             EvtchnFiredLock;
+    LIST_ENTRY             EvtchnFiredList;
+
+    // Cached mappings of the file object, most recently used first, also
+    // hashed by domain, first reference, page count and cache type. Under
+    // Fdo->GnttabMapCacheLock.
+    #define GNTTAB_MAP_CACHE_DEFAULT_BUDGET (64 * 1024 * 1024)
+    #define GNTTAB_MAP_CACHE_TABLE_SIZE     (64)
+
+    LIST_ENTRY             GnttabMapCacheList;
+    LIST_ENTRY             GnttabMapCacheTable[GNTTAB_MAP_CACHE_TABLE_SIZE];
+    XENIFACE_GNTTAB_MAP_CACHE_STATS GnttabMapCacheStats;
+
+    // Pooled persistent grants of the file object, hashed by domain and page
+    // count. Under Fdo->GnttabPoolLock.
+    #define GNTTAB_POOL_TABLE_SIZE          (16)
+
+    LIST_ENTRY             GnttabPoolTable[GNTTAB_POOL_TABLE_SIZE];
+} XENIFACE_FILE_CONTEXT, *PXENIFACE_FILE_CONTEXT;
+
+static FORCEINLINE
+PXENIFACE_FILE_CONTEXT
+__XenIfaceFileContext(
+    __in  PFILE_OBJECT  FileObject
+    )
+{
+    return (PXENIFACE_FILE_CONTEXT)FileObject->FsContext;
+}
+
 typedef struct _XENIFACE_STORE_CONTEXT {
     LIST_ENTRY             Entry;
     PXENBUS_STORE_WATCH    Watch;
@@ -55,27 +106,88 @@ typedef struct _XENIFACE_STORE_CONTEXT {
 
 typedef struct _XENIFACE_EVTCHN_CONTEXT {
     LIST_ENTRY             Entry;
+    LIST_ENTRY             PortEntry;
+    LIST_ENTRY             FiredEntry; // only used if Event is NULL, under EvtchnFiredLock of the file object
+    BOOLEAN                Fired;
+    BOOLEAN                Closed;
     PXENBUS_EVTCHN_CHANNEL Channel;
     ULONG                  LocalPort;
     PKEVENT                Event;
     PXENIFACE_FDO          Fdo;
     KDPC                   Dpc;
     PVOID                  FileObject;
+    volatile LONG          *PendingBits; // pending page of the file object, if mapped
+    ULONG                  SpinMicroseconds;
+    LONG                   SpinPending; // set by the ISR, consumed by a spinner or the DPC
+    LONG                   Spinners;
+    LONG                   SpinWakeups;
+    LONG                   SpinMisses;
+    EX_RUNDOWN_REF         Rundown;
+    XENIFACE_EVTCHN_MODERATION ModerationMode;
+    ULONG                  ModerationInterval; // microseconds
+    BOOLEAN                ModerationUsed; // ModerationTimer may have been set
+    ULONGLONG              LastWake; // interrupt time
+    LONG64                 Coalesced;
+    KTIMER                 ModerationTimer;
+    KDPC                   ModerationDpc;
+    BOOLEAN                Targeted; // DPCs target a specific processor
+    volatile LONG          Retargeting; // the DPCs are being moved, the ISR doesn't queue them
+    LONG                   RetargetPending; // upcall held back while Retargeting
+    PROCESSOR_NUMBER       Target;
+    PROCESSOR_NUMBER       LastInterrupt;
+    PROCESSOR_NUMBER       LastDelivery;
+    LONG64                 Deliveries;
+    LONG64                 RemoteDeliveries; // delivered on a different processor than the upcall
+    LONG64                 Interrupts;
+    LONG64                 Dpcs;
+    LONG64                 Sends;
+    LONG64                 Unmasks;
+    ULONGLONG              LastInterruptTime; // interrupt time
+    ULONGLONG              LastDeliveryTime;
+    // Latency tracing, performance counter values (0 if nothing is in flight)
+    LONG64                 TraceInterrupt; // first upcall not yet delivered
+    LONG64                 TraceDpc;
+    LONG64                 TraceSignal; // last delivery not yet reported by user mode
+    LONG64                 TraceSignalInterrupt; // upcall of that delivery
+    LONG                   Latency[XENIFACE_EVTCHN_LATENCY_STAGES][XENIFACE_EVTCHN_LATENCY_BUCKETS];
 } XENIFACE_EVTCHN_CONTEXT, *PXENIFACE_EVTCHN_CONTEXT;
 
+typedef struct _XENIFACE_EVTCHN_PENDING_CONTEXT {
+    LIST_ENTRY             Entry;
+    PVOID                  FileObject;
+    PEPROCESS              Process; // NULL once unmapped from it
+    PMDL                   Mdl;
+    volatile LONG          *Bits;
+    PVOID                  UserVa;
+} XENIFACE_EVTCHN_PENDING_CONTEXT, *PXENIFACE_EVTCHN_PENDING_CONTEXT;
+
+typedef struct _XENIFACE_EVTCHN_WAIT_CONTEXT {
+    XENIFACE_CONTEXT_ID    Id;
+} XENIFACE_EVTCHN_WAIT_CONTEXT, *PXENIFACE_EVTCHN_WAIT_CONTEXT;
+
 typedef struct _XENIFACE_SUSPEND_CONTEXT {
     LIST_ENTRY              Entry;
     PKEVENT                 Event;
     PVOID                   FileObject;
 } XENIFACE_SUSPEND_CONTEXT, *PXENIFACE_SUSPEND_CONTEXT;
 
+// Link of a grant or map owned by its file object (XENIFACE_GNTTAB_USE_HANDLE).
+typedef struct _XENIFACE_GNTTAB_HANDLE {
+    LIST_ENTRY                 Entry;
+    LIST_ENTRY                 FileEntry;   // in the file object's GnttabHandleList
+    PXENIFACE_CONTEXT_ID       Id;
+} XENIFACE_GNTTAB_HANDLE, *PXENIFACE_GNTTAB_HANDLE;
+
 typedef struct _XENIFACE_GRANT_CONTEXT {
     XENIFACE_CONTEXT_ID        Id;
     LIST_ENTRY                 Entry;
+    XENIFACE_GNTTAB_HANDLE     Handle;
     PXENBUS_GNTTAB_ENTRY       *Grants;
+    PVOID                      FileObject;
     USHORT                     RemoteDomain;
     ULONG                      NumberPages;
     XENIFACE_GNTTAB_PAGE_FLAGS Flags;
+    XENIFACE_GNTTAB_CACHE_TYPE CacheType;
     ULONG                      NotifyOffset;
     ULONG                      NotifyPort;
     PVOID                      KernelVa;
@@ -83,12 +195,33 @@ typedef struct _XENIFACE_GRANT_CONTEXT {
     PMDL                       Mdl;
 } XENIFACE_GRANT_CONTEXT, *PXENIFACE_GRANT_CONTEXT;
 
+// Pages of a revoked XENIFACE_GNTTAB_DEFER_SCRUB grant waiting for a worker.
+typedef struct _XENIFACE_GNTTAB_SCRUB {
+    PIO_WORKITEM               WorkItem;
+    PVOID                      KernelVa;
+    PMDL                       Mdl;
+    ULONG                      NumberPages;
+} XENIFACE_GNTTAB_SCRUB, *PXENIFACE_GNTTAB_SCRUB;
+
+// One segment of IOCTL_XENIFACE_GNTTAB_COPY with its locked local buffer.
+typedef struct _XENIFACE_GNTTAB_COPY_OP {
+    XENIFACE_GNTTAB_COPY_SEGMENT Segment;
+    PMDL                         Mdl;
+    PVOID                        SystemVa;
+    NTSTATUS                     Status;
+} XENIFACE_GNTTAB_COPY_OP, *PXENIFACE_GNTTAB_COPY_OP;
+
 typedef struct _XENIFACE_MAP_CONTEXT {
     XENIFACE_CONTEXT_ID        Id;
     LIST_ENTRY                 Entry;
+    LIST_ENTRY                 CacheEntry; // in GnttabMapCacheTable while cached
+    XENIFACE_GNTTAB_HANDLE     Handle;
+    PVOID                      FileObject;
+    PULONG                     References; // only kept for XENIFACE_GNTTAB_CACHE_MAPPING
     USHORT                     RemoteDomain;
     ULONG                      NumberPages;
     XENIFACE_GNTTAB_PAGE_FLAGS Flags;
+    XENIFACE_GNTTAB_CACHE_TYPE CacheType;
     ULONG                      NotifyOffset;
     ULONG                      NotifyPort;
     PHYSICAL_ADDRESS           Address;
@@ -109,12 +242,47 @@ __FreeCapturedBuffer(
     __in  PVOID CapturedBuffer
     );
 
+NTSTATUS
+XenIfaceCreate(
+    __in     PXENIFACE_FDO     Fdo,
+    __inout  PFILE_OBJECT      FileObject
+    );
+
+VOID
+XenIfaceClose(
+    __in     PXENIFACE_FDO     Fdo,
+    __inout  PFILE_OBJECT      FileObject
+    );
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+XenIfaceProcessExit(
+    __in     PXENIFACE_FDO     Fdo,
+    __in     PEPROCESS         Process
+    );
+
+VOID
+XenIfaceAddProcessMapping(
+    __in     PFILE_OBJECT      FileObject
+    );
+
+VOID
+XenIfaceRemoveProcessMapping(
+    __in     PFILE_OBJECT      FileObject
+    );
+
 NTSTATUS
 XenIfaceIoctl(
     __in     PXENIFACE_FDO     Fdo,
     __inout  PIRP              Irp
     );
 
+NTSTATUS
+XenIfaceRead(
+    __in     PXENIFACE_FDO     Fdo,
+    __inout  PIRP              Irp
+    );
+
 _IRQL_requires_(PASSIVE_LEVEL)
 VOID
 XenIfaceCleanup(
@@ -239,6 +407,17 @@ IoctlEvtchnNotify(
     __in  PFILE_OBJECT      FileObject
     );
 
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnNotifyBatch(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
+    );
+
 DECLSPEC_NOINLINE
 NTSTATUS
 IoctlEvtchnUnmask(
@@ -249,6 +428,192 @@ IoctlEvtchnUnmask(
     __in  PFILE_OBJECT      FileObject
     );
 
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnWait(
+    __in     PXENIFACE_FDO     Fdo,
+    __in     PVOID             Buffer,
+    __in     ULONG             InLen,
+    __in     ULONG             OutLen,
+    __inout  PIRP              Irp,
+    __out    PULONG_PTR        Info
+    );
+
+DECLSPEC_NOINLINE
+NTSTATUS
+EvtchnRead(
+    __in     PXENIFACE_FDO     Fdo,
+    __inout  PIRP              Irp,
+    __out    PULONG_PTR        Info
+    );
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnSetSpin(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject
+    );
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnSpinWait(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
+    );
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnSetModeration(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject
+    );
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnSetAffinity(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
+    );
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnQueryAffinity(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
+    );
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnQueryStats(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
+    );
+
+_Requires_lock_not_held_(Fdo->EvtchnLock)
+NTSTATUS
+EvtchnQueryStats(
+    __in      PXENIFACE_FDO                       Fdo,
+    __in      ULONG                               LocalPort,
+    __in_opt  PFILE_OBJECT                        FileObject,
+    __out     PXENIFACE_EVTCHN_QUERY_STATS_OUT    Stats
+    );
+
+_Requires_lock_not_held_(Fdo->EvtchnLock)
+ULONG
+EvtchnQueryTotals(
+    __in      PXENIFACE_FDO                       Fdo,
+    __out     PXENIFACE_EVTCHN_QUERY_STATS_OUT    Totals
+    );
+
+_Requires_lock_not_held_(Fdo->EvtchnLock)
+ULONG
+EvtchnQueryPorts(
+    __in      PXENIFACE_FDO Fdo,
+    __out_ecount_opt(MaxPorts) PULONG LocalPorts,
+    __in      ULONG         MaxPorts
+    );
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnReportWake(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject
+    );
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnQueryLatency(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
+    );
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnBindUnboundBatch(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
+    );
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlEvtchnMapPending(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
+    );
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+EvtchnFreePending(
+    __in      PXENIFACE_FDO Fdo,
+    __in_opt  PFILE_OBJECT  FileObject
+    );
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+EvtchnProcessExit(
+    __in      PXENIFACE_FDO Fdo,
+    __in      PFILE_OBJECT  FileObject
+    );
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+EvtchnCompleteWait(
+    __in      PXENIFACE_FDO Fdo,
+    __in      PFILE_OBJECT  FileObject
+    );
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+EvtchnCancelWaits(
+    __in      PXENIFACE_FDO Fdo,
+    __in_opt  PFILE_OBJECT  FileObject
+    );
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+EvtchnCompleteWaitIrp(
+    __inout  PIRP       Irp,
+    __in     NTSTATUS   Status,
+    __in     ULONG_PTR  Information
+    );
+
 _Requires_lock_not_held_(Fdo->EvtchnLock)
 DECLSPEC_NOINLINE
 NTSTATUS
@@ -276,6 +641,20 @@ EvtchnFree(
     __inout  PXENIFACE_EVTCHN_CONTEXT Context
     );
 
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+EvtchnFreeList(
+    __in     PXENIFACE_FDO Fdo,
+    __inout  PLIST_ENTRY   List
+    );
+
+_Requires_exclusive_lock_held_(Fdo->EvtchnLock)
+VOID
+EvtchnRemoveChannel(
+    __in     PXENIFACE_FDO Fdo,
+    __inout  PXENIFACE_EVTCHN_CONTEXT Context
+    );
+
 DECLSPEC_NOINLINE
 NTSTATUS
 IoctlGnttabPermitForeignAccess(
@@ -302,7 +681,8 @@ IoctlGnttabRevokeForeignAccess(
     __in  PXENIFACE_FDO     Fdo,
     __in  PVOID             Buffer,
     __in  ULONG             InLen,
-    __in  ULONG             OutLen
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject
     );
 
 DECLSPEC_NOINLINE
@@ -331,7 +711,37 @@ IoctlGnttabUnmapForeignPages(
     __in  PXENIFACE_FDO     Fdo,
     __in  PVOID             Buffer,
     __in  ULONG             InLen,
-    __in  ULONG             OutLen
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject
+    );
+
+DECLSPEC_NOINLINE
+NTSTATUS
+IoctlGnttabCopy(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __out PULONG_PTR        Info
+    );
+
+NTSTATUS
+IoctlGnttabSetMapCacheBudget(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject
+    );
+
+NTSTATUS
+IoctlGnttabQueryMapCache(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject,
+    __out PULONG_PTR        Info
     );
 
 _Acquires_exclusive_lock_(((PXENIFACE_FDO)Argument)->GnttabCacheLock)
@@ -359,14 +769,52 @@ _IRQL_requires_max_(APC_LEVEL)
 VOID
 GnttabFreeGrant(
     __in     PXENIFACE_FDO Fdo,
-    __inout  PXENIFACE_GRANT_CONTEXT Context
+    __inout  PXENIFACE_GRANT_CONTEXT Context,
+    __in     BOOLEAN Reuse
     );
 
 _IRQL_requires_max_(APC_LEVEL)
 VOID
 GnttabFreeMap(
     __in     PXENIFACE_FDO Fdo,
-    __inout  PXENIFACE_MAP_CONTEXT Context
+    __inout  PXENIFACE_MAP_CONTEXT Context,
+    __in     BOOLEAN Reuse
+    );
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+GnttabPoolFlush(
+    __in      PXENIFACE_FDO Fdo,
+    __in_opt  PFILE_OBJECT  FileObject
+    );
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+GnttabMapCacheFlush(
+    __in      PXENIFACE_FDO Fdo,
+    __in_opt  PFILE_OBJECT  FileObject
+    );
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+GnttabHandleFlush(
+    __in      PXENIFACE_FDO Fdo,
+    __in_opt  PFILE_OBJECT  FileObject
+    );
+
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+GnttabProcessExit(
+    __in      PXENIFACE_FDO Fdo,
+    __in      PFILE_OBJECT  FileObject
+    );
+
+_Requires_lock_held_(Fdo->IrpQueueLock)
+_IRQL_requires_(DISPATCH_LEVEL)
+BOOLEAN
+GnttabHandleExists(
+    __in      PXENIFACE_FDO         Fdo,
+    __in      PXENIFACE_CONTEXT_ID  Id
     );
 
 NTSTATUS
@@ -426,6 +874,15 @@ IoctlLog(
     __in  ULONG             OutLen
     );
 
+NTSTATUS
+IoctlQueryCacheStats(
+    __in  PXENIFACE_FDO     Fdo,
+    __in  PVOID             Buffer,
+    __in  ULONG             InLen,
+    __in  ULONG             OutLen,
+    __out PULONG_PTR        Info
+    );
+
 VOID
 __FreeCapturedBuffer(
     __in  PVOID CapturedBuffer
@@ -624,7 +1081,8 @@ IoctlGnttabRevokeForeignAccess(
     __in  PXENIFACE_FDO     Fdo,
     __in  PVOID             Buffer,
     __in  ULONG             InLen,
-    __in  ULONG             OutLen
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject
     );
 
 DECLSPEC_NOINLINE
@@ -653,7 +1111,8 @@ IoctlGnttabUnmapForeignPages(
     __in  PXENIFACE_FDO     Fdo,
     __in  PVOID             Buffer,
     __in  ULONG             InLen,
-    __in  ULONG             OutLen
+    __in  ULONG             OutLen,
+    __in  PFILE_OBJECT      FileObject
     );
 
 _Acquires_exclusive_lock_(((PXENIFACE_FDO)Argument)->GnttabCacheLock)
@@ -681,14 +1140,16 @@ _IRQL_requires_max_(APC_LEVEL)
 VOID
 GnttabFreeGrant(
     __in     PXENIFACE_FDO Fdo,
-    __inout  PXENIFACE_GRANT_CONTEXT Context
+    __inout  PXENIFACE_GRANT_CONTEXT Context,
+    __in     BOOLEAN Reuse
     );
 
 _IRQL_requires_max_(APC_LEVEL)
 VOID
 GnttabFreeMap(
     __in     PXENIFACE_FDO Fdo,
-    __inout  PXENIFACE_MAP_CONTEXT Context
+    __inout  PXENIFACE_MAP_CONTEXT Context,
+    __in     BOOLEAN Reuse
     );
 
 #endif // _IOCTLS_H_
@@ -36,6 +36,39 @@
 
 // Cancel-safe IRP queue implementation
 
+// Event channel waits are looked up by file object (any file object if the
+// target doesn't specify one), everything else by process and request ID.
+static FORCEINLINE
+BOOLEAN
+__CsqMatchId(
+    _In_  PXENIFACE_CONTEXT_ID Id,
+    _In_  PXENIFACE_CONTEXT_ID TargetId
+    )
+{
+    if (TargetId->Type == XENIFACE_CONTEXT_EVTCHN_WAIT)
+        return Id->Type == XENIFACE_CONTEXT_EVTCHN_WAIT &&
+               (TargetId->FileObject == NULL || Id->FileObject == TargetId->FileObject);
+
+    return Id->Type != XENIFACE_CONTEXT_EVTCHN_WAIT &&
+           Id->RequestId == TargetId->RequestId &&
+           Id->Process == TargetId->Process;
+}
+
+// Grant and map IRPs live in IrpQueueTable, in the bucket of their process
+// and request ID, so looking one up doesn't walk every pending request.
+// Event channel waits are matched by file object and stay on IrpList.
+static FORCEINLINE
+PLIST_ENTRY
+__CsqBucket(
+    _In_  PXENIFACE_FDO        Fdo,
+    _In_  PXENIFACE_CONTEXT_ID Id
+    )
+{
+    ULONG Hash = Id->RequestId ^ (ULONG)((ULONG_PTR)Id->Process >> 6);
+
+    return &Fdo->IrpQueueTable[Hash & (IRP_QUEUE_TABLE_SIZE - 1)];
+}
+
 NTSTATUS
 CsqInsertIrpEx(
     _In_  PIO_CSQ Csq,
@@ -44,14 +77,23 @@ CsqInsertIrpEx(
     )
 {
     PXENIFACE_FDO Fdo;
+    PXENIFACE_CONTEXT_ID Id = InsertContext;
 
     Fdo = CONTAINING_RECORD(Csq, XENIFACE_FDO, IrpQueue);
 
-    // Fail if a request with the same ID already exists.
-    if (CsqPeekNextIrp(Csq, NULL, InsertContext) != NULL)
+    // A file object may have any number of event channel waits pending.
+    if (Id->Type == XENIFACE_CONTEXT_EVTCHN_WAIT) {
+        InsertTailList(&Fdo->IrpList, &Irp->Tail.Overlay.ListEntry);
+        return STATUS_SUCCESS;
+    }
+
+    // Fail if a request with the same ID already exists, pending or owned
+    // by a file object.
+    if (CsqPeekNextIrp(Csq, NULL, InsertContext) != NULL ||
+        GnttabHandleExists(Fdo, Id))
         return STATUS_INVALID_PARAMETER;
 
-    InsertTailList(&Fdo->IrpList, &Irp->Tail.Overlay.ListEntry);
+    InsertTailList(__CsqBucket(Fdo, Id), &Irp->Tail.Overlay.ListEntry);
     return STATUS_SUCCESS;
 }
 
@@ -80,11 +122,18 @@ CsqPeekNextIrp(
 
     Fdo = CONTAINING_RECORD(Csq, XENIFACE_FDO, IrpQueue);
     TargetId = PeekContext;
-    Head = &Fdo->IrpList;
+
+    // Grant and map IDs only ever match within their own bucket.
+    // Without a context only event channel waits are visited.
+    if (TargetId != NULL && TargetId->Type != XENIFACE_CONTEXT_EVTCHN_WAIT)
+        Head = __CsqBucket(Fdo, TargetId);
+    else
+        Head = &Fdo->IrpList;
 
     // If the IRP is NULL, we will start peeking from the list head,
-    // else we will start from that IRP onwards. This is done under the
-    // assumption that new IRPs are always inserted at the tail.
+    // else we will start from that IRP onwards (it is on the same list).
+    // This is done under the assumption that new IRPs are always inserted
+    // at the tail.
 
     if (Irp == NULL) {
         NextEntry = Head->Flink;
@@ -97,7 +146,7 @@ CsqPeekNextIrp(
 
         if (PeekContext) {
             Id = NextIrp->Tail.Overlay.DriverContext[0];
-            if (Id->RequestId == TargetId->RequestId && Id->Process == TargetId->Process)
+            if (__CsqMatchId(Id, TargetId))
                 break;
         } else {
             break;
@@ -148,11 +197,18 @@ CsqCompleteCanceledIrp(
     )
 {
     PXENIFACE_FDO Fdo = CONTAINING_RECORD(Csq, XENIFACE_FDO, IrpQueue);
+    PXENIFACE_CONTEXT_ID Id = Irp->Tail.Overlay.DriverContext[0];
     PIO_WORKITEM WorkItem;
 
     XenIfaceDebugPrint(TRACE, "Irp %p, IRQL %d\n",
                        Irp, KeGetCurrentIrql());
 
+    // Event channel waits own no memory in the caller's address space.
+    if (Id->Type == XENIFACE_CONTEXT_EVTCHN_WAIT) {
+        EvtchnCompleteWaitIrp(Irp, STATUS_CANCELLED, 0);
+        return;
+    }
+
     // This is not guaranteed to run at PASSIVE_LEVEL, so queue a work item
     // to perform actual cleanup/IRP completion.
 
@@ -44,6 +44,7 @@
 #include "..\..\include\suspend_interface.h"
 #include "log.h"
 #include "xeniface_ioctls.h"
+#include "ioctls.h"
 #include <version.h>
 
 __drv_raisesIRQL(APC_LEVEL)
@@ -2380,6 +2381,94 @@ BaseExecuteAddSession(UCHAR *InBuffer,
 }
 
 
+NTSTATUS
+BaseExecuteGetEvtchnPorts(UCHAR *InBuffer,
+                        ULONG InBufferSize,
+                        UCHAR *OutBuffer,
+                        ULONG OutBufferSize,
+                        XENIFACE_FDO* fdoData,
+                        OUT ULONG_PTR *byteswritten) {
+    ULONG RequiredSize;
+    ULONG *count;
+    UCHAR *ports;
+    ULONG noofports;
+
+    UNREFERENCED_PARAMETER(InBuffer);
+    UNREFERENCED_PARAMETER(InBufferSize);
+
+    *byteswritten = 0;
+    noofports = EvtchnQueryPorts(fdoData, NULL, 0);
+    if (!AccessWmiBuffer(OutBuffer, FALSE, &RequiredSize, OutBufferSize,
+                            WMI_UINT32, &count,
+                            WMI_BUFFER, noofports * sizeof(ULONG), &ports,
+                            WMI_DONE)) {
+        *byteswritten = RequiredSize;
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    // channels opened since the size was taken don't fit and are left out
+    *count = min(noofports, EvtchnQueryPorts(fdoData, (ULONG *)ports, noofports));
+    RequiredSize = (ULONG)(ports - OutBuffer) + *count * sizeof(ULONG);
+
+    *byteswritten = RequiredSize;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+BaseExecuteGetEvtchnStats(UCHAR *InBuffer,
+                        ULONG InBufferSize,
+                        UCHAR *OutBuffer,
+                        ULONG OutBufferSize,
+                        XENIFACE_FDO* fdoData,
+                        OUT ULONG_PTR *byteswritten) {
+    ULONG RequiredSize;
+    ULONG *localport;
+    ULONGLONG *interrupts, *dpcs, *coalesced, *deliveries, *sends, *unmasks;
+    ULONGLONG *lastinterrupt, *lastdelivery, *now;
+    XENIFACE_EVTCHN_QUERY_STATS_OUT stats;
+    NTSTATUS status;
+
+    *byteswritten = 0;
+    if (!AccessWmiBuffer(InBuffer, TRUE, &RequiredSize, InBufferSize,
+                            WMI_UINT32, &localport,
+                            WMI_DONE)){
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+    if (!AccessWmiBuffer(OutBuffer, FALSE, &RequiredSize, OutBufferSize,
+                            WMI_UINT64, &interrupts,
+                            WMI_UINT64, &dpcs,
+                            WMI_UINT64, &coalesced,
+                            WMI_UINT64, &deliveries,
+                            WMI_UINT64, &sends,
+                            WMI_UINT64, &unmasks,
+                            WMI_UINT64, &lastinterrupt,
+                            WMI_UINT64, &lastdelivery,
+                            WMI_UINT64, &now,
+                            WMI_DONE)) {
+        *byteswritten = RequiredSize;
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    // WMI callers are privileged, so any open channel can be looked at
+    status = EvtchnQueryStats(fdoData, *localport, NULL, &stats);
+    if (!NT_SUCCESS(status))
+        return status;
+
+    *interrupts = stats.Interrupts;
+    *dpcs = stats.Dpcs;
+    *coalesced = stats.Coalesced;
+    *deliveries = stats.Deliveries;
+    *sends = stats.Sends;
+    *unmasks = stats.Unmasks;
+    *lastinterrupt = stats.LastInterruptTime;
+    *lastdelivery = stats.LastDeliveryTime;
+    *now = stats.CurrentTime;
+
+    *byteswritten = RequiredSize;
+    return STATUS_SUCCESS;
+}
+
+
 NTSTATUS
 SessionExecuteMethod(UCHAR *Buffer,
                     ULONG BufferSize,
@@ -2566,6 +2655,28 @@ BaseExecuteMethod(UCHAR *Buffer,
             Method->WnodeHeader.BufferSize = (ULONG)*byteswritten;
             return status;
 
+        case GetEvtchnPorts:
+            status = BaseExecuteGetEvtchnPorts(InBuffer, Method->SizeDataBlock,
+                                             Buffer+Method->DataBlockOffset,
+                                             BufferSize-Method->DataBlockOffset,
+                                             fdoData,
+                                             byteswritten);
+            Method->SizeDataBlock = (ULONG)*byteswritten;
+            *byteswritten+=Method->DataBlockOffset;
+            Method->WnodeHeader.BufferSize = (ULONG)*byteswritten;
+            return status;
+
+        case GetEvtchnStats:
+            status = BaseExecuteGetEvtchnStats(InBuffer, Method->SizeDataBlock,
+                                             Buffer+Method->DataBlockOffset,
+                                             BufferSize-Method->DataBlockOffset,
+                                             fdoData,
+                                             byteswritten);
+            Method->SizeDataBlock = (ULONG)*byteswritten;
+            *byteswritten+=Method->DataBlockOffset;
+            Method->WnodeHeader.BufferSize = (ULONG)*byteswritten;
+            return status;
+
         default:
             return STATUS_WMI_ITEMID_NOT_FOUND;
     }
@@ -2713,6 +2824,24 @@ GenerateSessionBlock(UCHAR *Buffer,
 
 }
 
+static VOID
+WriteBaseEvtchnStats(XENIFACE_FDO *fdoData,
+                    ULONG *channels,
+                    ULONGLONG *interrupts,
+                    ULONGLONG *dpcs,
+                    ULONGLONG *coalesced,
+                    ULONGLONG *sends,
+                    ULONGLONG *unmasks) {
+    XENIFACE_EVTCHN_QUERY_STATS_OUT totals;
+
+    *channels = EvtchnQueryTotals(fdoData, &totals);
+    *interrupts = totals.Interrupts;
+    *dpcs = totals.Dpcs;
+    *coalesced = totals.Coalesced;
+    *sends = totals.Sends;
+    *unmasks = totals.Unmasks;
+}
+
 NTSTATUS
 GenerateBaseBlock(  XENIFACE_FDO *fdoData,
                     UCHAR *Buffer,
@@ -2721,9 +2850,17 @@ GenerateBaseBlock(  XENIFACE_FDO *fdoData,
     WNODE_ALL_DATA *node;
     ULONG RequiredSize;
     ULONGLONG *time;
+    ULONG *channels;
+    ULONGLONG *interrupts, *dpcs, *coalesced, *sends, *unmasks;
     if (!AccessWmiBuffer(Buffer, FALSE, &RequiredSize, BufferSize,
                             WMI_BUFFER, sizeof(WNODE_ALL_DATA), &node,
                             WMI_UINT64, &time,
+                            WMI_UINT32, &channels,
+                            WMI_UINT64, &interrupts,
+                            WMI_UINT64, &dpcs,
+                            WMI_UINT64, &coalesced,
+                            WMI_UINT64, &sends,
+                            WMI_UINT64, &unmasks,
                             WMI_DONE))
     {
         return NodeTooSmall(Buffer, BufferSize, RequiredSize, byteswritten);
@@ -2741,8 +2878,10 @@ GenerateBaseBlock(  XENIFACE_FDO *fdoData,
     else {
         *time = 0;
     }
+    WriteBaseEvtchnStats(fdoData, channels, interrupts, dpcs, coalesced,
+                         sends, unmasks);
     node->InstanceCount = 1;
-    node->FixedInstanceSize = sizeof(ULONGLONG);
+    node->FixedInstanceSize = RequiredSize - node->DataBlockOffset;
     *byteswritten = RequiredSize;
     return STATUS_SUCCESS;
 }
@@ -2755,6 +2894,8 @@ GenerateBaseInstance(
     WNODE_SINGLE_INSTANCE *node;
     ULONG RequiredSize;
     ULONGLONG *time;
+    ULONG *channels;
+    ULONGLONG *interrupts, *dpcs, *coalesced, *sends, *unmasks;
     UCHAR * dbo;
     if (!AccessWmiBuffer(Buffer, FALSE, &RequiredSize, BufferSize,
                             WMI_BUFFER, sizeof(WNODE_SINGLE_INSTANCE), &node,
@@ -2771,6 +2912,12 @@ GenerateBaseInstance(
     }
     if (!AccessWmiBuffer(dbo, FALSE, &RequiredSize, BufferSize-node->DataBlockOffset,
                             WMI_UINT64, &time,
+                            WMI_UINT32, &channels,
+                            WMI_UINT64, &interrupts,
+                            WMI_UINT64, &dpcs,
+                            WMI_UINT64, &coalesced,
+                            WMI_UINT64, &sends,
+                            WMI_UINT64, &unmasks,
                             WMI_DONE)){
         return NodeTooSmall(Buffer, BufferSize, RequiredSize+node->DataBlockOffset,
                             byteswritten);
@@ -2785,6 +2932,8 @@ GenerateBaseInstance(
     else {
         *time = 0;
     }
+    WriteBaseEvtchnStats(fdoData, channels, interrupts, dpcs, coalesced,
+                         sends, unmasks);
 
 
     node->WnodeHeader.BufferSize = node->DataBlockOffset+RequiredSize;